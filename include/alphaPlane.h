@@ -0,0 +1,23 @@
+#ifndef ALPHAPLANE_H
+
+#define ALPHAPLANE_H
+
+#include "ppmIO.h"
+
+// An 8-bit blend mask.  Masks are stored as pgm files with one alpha sample
+// per pixel; colour masks whose channels differ keep all three.
+typedef struct {
+  int rows, cols;
+  int channels;                 // 1 for a grey plane, 3 for an RGB mask
+  const unsigned char *alpha;   // rows * cols * channels samples
+  unsigned char *owned;         // heap copy of the samples, or NULL
+  const void *mapped;           // mapping from mapPPM/mapPGM, or NULL
+} AlphaPlane;
+
+AlphaPlane *newAlphaPlane(int rows, int cols);
+AlphaPlane *readAlphaPlane(char *filename);
+void writeAlphaPlane(AlphaPlane *plane, char *filename);
+void freeAlphaPlane(AlphaPlane *plane);
+
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef BLEND_H
+
+#define BLEND_H
+
+#include "ppmIO.h"
+
+void alphaBlend(Pixel *output, const Pixel *foreground, const Pixel *background,
+                const unsigned char *alpha, int channels, long n);
+const char *blendKernel(void);
+int useBlendKernel(const char *name);
+
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef CHROMAKEY_H
+
+#define CHROMAKEY_H
+
+#include "ppmIO.h"
+
+void chromaKeyMask(const Pixel *image, unsigned char *mask, long n, char keyColor,
+                   int channels);
+void chromaKeyComposite(const Pixel *foreground, const Pixel *background, Pixel *output,
+                        long n, char keyColor);
+const char *chromaKeyKernel(void);
+int useChromaKeyKernel(const char *name);
+
+
+#endif
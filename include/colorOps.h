@@ -0,0 +1,39 @@
+#ifndef COLOROPS_H
+
+#define COLOROPS_H
+
+#include "ppmIO.h"
+
+// operations on one channel
+#define COLOR_OP_ADD 0          // add amount, clamped to 0..255
+#define COLOR_OP_SCALE 1        // multiply by amount, truncated and clamped
+#define COLOR_OP_SET 2          // replace with amount
+
+// channels, in the order of a Pixel's samples
+#define COLOR_RED 0
+#define COLOR_GREEN 1
+#define COLOR_BLUE 2
+
+// An operation on one channel of every pixel, applied only where the
+// channel's value lies strictly between low and high; -1 and 256 take in
+// every value.
+typedef struct {
+  int type;
+  int channel;
+  int low, high;
+  double amount;
+} ColorOp;
+
+// a chain of ColorOps compiled to one table per channel
+typedef struct {
+  unsigned char table[3][256];
+} ColorLUT;
+
+void compileColorOps(ColorLUT *lut, const ColorOp *ops, int count);
+void applyColorLUT(const ColorLUT *lut, Pixel *output, const Pixel *input, long n);
+void isolateRed(Pixel *output, const Pixel *input, long n, int threshold);
+const char *colorOpsKernel(void);
+int useColorOpsKernel(const char *name);
+
+
+#endif
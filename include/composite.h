@@ -0,0 +1,29 @@
+#ifndef COMPOSITE_H
+
+#define COMPOSITE_H
+
+#include "maskSpans.h"
+#include "ppmIO.h"
+#include "threadPool.h"
+
+// share of the L2 cache one tile's images should fit in
+#define COMPOSITE_L2_SHARE 2
+
+// L2 size assumed when the system cannot say
+#define COMPOSITE_DEFAULT_L2 (256L << 10)
+
+void compositeTileSize(int cols, int channels, int *tileRows, int *tileCols);
+void compositeOffset(ThreadPool *pool, Pixel *output, const Pixel *background,
+                     int bgRows, int bgCols, const Pixel *foreground,
+                     const unsigned char *alpha, int channels, int fgRows, int fgCols,
+                     int dx, int dy, const MaskSpans *spans);
+int scaledSize(int rows, int cols, float scaleFactor, int *newRows, int *newCols);
+int compositeScaled(ThreadPool *pool, Pixel *output, const Pixel *background,
+                    int bgRows, int bgCols, const Pixel *foreground,
+                    const unsigned char *alpha, int channels, int fgRows, int fgCols,
+                    float scaleFactor, int dx, int dy, const MaskSpans *spans);
+int scaleNearest(ThreadPool *pool, unsigned char *output, const unsigned char *input,
+                 int rows, int cols, int channels, float scaleFactor);
+
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef FEATHER_H
+
+#define FEATHER_H
+
+// most threads featherMask will use
+#define MAX_FEATHER_THREADS 64
+
+// box passes used to approximate a gaussian
+#define FEATHER_PASSES 3
+
+int featherMask(const unsigned char *mask, unsigned char *output, int rows, int cols,
+                int channels, double sigma, int nthreads);
+
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef IMAGEARENA_H
+
+#define IMAGEARENA_H
+
+#include "ppmIO.h"
+
+// alignment of every arena allocation, one cache line
+#define ARENA_ALIGN 64
+
+// smallest block the arena maps at a time
+#define ARENA_BLOCK (4L << 20)
+
+// createArena flags
+#define ARENA_HUGE_PAGES 1      // back blocks with huge pages when possible
+
+typedef struct ImageArena ImageArena;
+
+ImageArena *createArena(long capacity, int flags);
+void *arenaAlloc(ImageArena *arena, long bytes);
+Pixel *arenaPixels(ImageArena *arena, int rows, int cols);
+long arenaMark(ImageArena *arena);
+void arenaReset(ImageArena *arena, long mark);
+long arenaInUse(ImageArena *arena);
+long arenaPeak(ImageArena *arena);
+void destroyArena(ImageArena *arena);
+
+
+#endif
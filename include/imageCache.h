@@ -0,0 +1,30 @@
+#ifndef IMAGECACHE_H
+
+#define IMAGECACHE_H
+
+#include "alphaPlane.h"
+#include "ppmIO.h"
+
+// bytes of decoded images a cache created with capacity 0 holds
+#define IMAGE_CACHE_DEFAULT (256L << 20)
+
+typedef struct ImageCache ImageCache;
+
+typedef struct {
+  long hits, misses;
+  long reloads;                 // misses because the file changed on disk
+  long evictions;
+  long bytes;                   // decoded bytes held
+  int entries;
+} CacheStats;
+
+ImageCache *createImageCache(long capacity);
+const Pixel *cacheImage(ImageCache *cache, char *filename, int *rows, int *cols,
+                        int *colors);
+const AlphaPlane *cacheMask(ImageCache *cache, char *filename);
+void releaseCached(ImageCache *cache, const void *image);
+void imageCacheStats(ImageCache *cache, CacheStats *stats);
+void destroyImageCache(ImageCache *cache);
+
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef KERNELCHOICE_H
+
+#define KERNELCHOICE_H
+
+#include <stddef.h>
+
+// The part of a module's kernel table entry the choice is made on: the name
+// its use*Kernel function takes and the processor features the kernel needs,
+// separated by spaces as __builtin_cpu_supports names them (NULL for none).
+// Each entry of a table starts with one of these; the entries run from best
+// to worst, the last needing no features, and a NULL name ends the table.
+typedef struct {
+  const char *name;
+  const char *features;
+} KernelChoice;
+
+int bestKernel(const void *table, size_t entrySize);
+int findKernel(const void *table, size_t entrySize, const char *name);
+
+
+#endif
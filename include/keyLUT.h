@@ -0,0 +1,50 @@
+#ifndef KEYLUT_H
+
+#define KEYLUT_H
+
+#include "ppmIO.h"
+
+// key rule types
+#define KEY_RULE_RATIO 0        // key channel above ratio * both others and a minimum
+#define KEY_RULE_DIFF 1         // key channel more than threshold above both others
+#define KEY_RULE_DIST 2         // within radius of a colour
+
+// colour spaces for distance rules
+#define KEY_SPACE_RGB 0         // euclidean distance in RGB
+#define KEY_SPACE_YCC 1         // distance in Cb/Cr only, ignoring brightness
+
+// bits of each channel the table is indexed by; 8 is exact and takes 2 MB
+#define KEYLUT_BITS 8
+
+// the longest rule spec
+#define KEYLUT_SPEC 128
+
+typedef struct {
+  int type;
+  int key, other;               // channel of the key colour and the other non-red one
+  double ratio, minimum;        // ratio rules
+  double threshold;             // difference rules
+  int space;                    // distance rules
+  double target[3];
+  double radius;
+} KeyRule;
+
+typedef struct {
+  KeyRule rule;
+  char spec[KEYLUT_SPEC];       // the rule, written out in full
+  int bits;
+  int cached;                   // 1 if the table came from the disk cache
+  long entries;
+  unsigned char *table;         // one bit per entry, set where the colour is keyed
+} KeyLUT;
+
+int parseKeyRule(const char *spec, KeyRule *rule);
+KeyLUT *createKeyLUT(const char *spec, int bits);
+void keyLUTMask(const KeyLUT *lut, const Pixel *image, unsigned char *mask, long n,
+                int channels);
+void keyLUTComposite(const KeyLUT *lut, const Pixel *foreground, const Pixel *background,
+                     Pixel *output, long n);
+void freeKeyLUT(KeyLUT *lut);
+
+
+#endif
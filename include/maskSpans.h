@@ -0,0 +1,33 @@
+#ifndef MASKSPANS_H
+
+#define MASKSPANS_H
+
+#include "ppmIO.h"
+
+// span types; pixels between spans are clear (alpha 0 in every channel)
+#define SPAN_SOLID 1            // alpha 255 in every channel, all foreground
+#define SPAN_EDGE 2             // anything between, blended
+
+typedef struct {
+  int start, length;
+  int type;
+} MaskSpan;
+
+// the runs of a mask that are not clear, row by row, and their bounding box
+typedef struct {
+  int rows, cols, channels;
+  long *rowStart;               // first span of each row, and one past the last row's
+  MaskSpan *spans;
+  long count;
+  int left, top, right, bottom; // right and bottom exclusive; empty when left == right
+  long solid, edge;             // pixels of each type
+} MaskSpans;
+
+MaskSpans *buildMaskSpans(const unsigned char *alpha, int rows, int cols, int channels);
+void blendSpanRow(const MaskSpans *spans, int y, int x0, int x1, Pixel *output,
+                  const Pixel *foreground, const Pixel *background,
+                  const unsigned char *alpha);
+void freeMaskSpans(MaskSpans *spans);
+
+
+#endif
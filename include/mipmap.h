@@ -0,0 +1,28 @@
+#ifndef MIPMAP_H
+
+#define MIPMAP_H
+
+// most halvings a pyramid holds
+#define MAX_MIPMAP_LEVELS 24
+
+// appended to an image's name to name its pyramid
+#define MIPMAP_EXTENSION ".mip"
+
+// The half resolution levels of an image, each the 2 x 2 average of the one
+// above.  Level 0 is the image itself and is not held here.
+typedef struct {
+  int levels;                   // levels below the image
+  int channels;                 // 1 for a grey image, 3 for RGB
+  int rows[MAX_MIPMAP_LEVELS + 1], cols[MAX_MIPMAP_LEVELS + 1];
+  const unsigned char *samples[MAX_MIPMAP_LEVELS + 1];  // NULL for level 0
+  void *base;                   // mapping of the pyramid file
+  long length;
+} Mipmap;
+
+int buildMipmaps(char *filename);
+Mipmap *openMipmaps(char *filename, int rows, int cols);
+int mipmapLevelFor(const Mipmap *mipmap, int rows, int cols);
+void closeMipmaps(Mipmap *mipmap);
+
+
+#endif
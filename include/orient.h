@@ -0,0 +1,34 @@
+#ifndef ORIENT_H
+
+#define ORIENT_H
+
+#include "imageArena.h"
+#include "threadPool.h"
+
+// the eight orientations, numbered as EXIF numbers them
+#define ORIENT_NORMAL 1
+#define ORIENT_FLIP_HORIZONTAL 2
+#define ORIENT_ROTATE_180 3
+#define ORIENT_FLIP_VERTICAL 4
+#define ORIENT_TRANSPOSE 5
+#define ORIENT_ROTATE_90 6      // clockwise
+#define ORIENT_TRANSVERSE 7
+#define ORIENT_ROTATE_270 8
+
+// side of the square of output pixels each step of a transposing pass
+// covers, small enough that its input and output stay in the L1 cache
+#define ORIENT_TILE 64
+
+int orientationFor(const char *text);
+const char *orientationName(int orientation);
+void orientedSize(int rows, int cols, int orientation, int *newRows, int *newCols);
+int orientImage(ThreadPool *pool, unsigned char *output, const unsigned char *input,
+                int rows, int cols, int channels, int orientation);
+unsigned char *orientedCopy(ImageArena *arena, ThreadPool *pool, const unsigned char *input,
+                            int rows, int cols, int channels, int orientation,
+                            int *newRows, int *newCols);
+const char *orientKernel(void);
+int useOrientKernel(const char *name);
+
+
+#endif
@@ -8,11 +8,57 @@ typedef struct {
   unsigned char b;
 } Pixel;
 
+// state of a QOI encoder or decoder between calls
+typedef struct {
+  unsigned char index[64][4];
+  unsigned char prev[4];
+  int run;
+} QOIState;
+
+#define QOI_HEADER_BYTES 14
+// most bytes qoiEncode writes for n pixels: four a pixel, plus the run left
+// open by the call before
+#define QOI_ENCODED_BYTES(n) (4L * (n) + 1)
+// most bytes qoiEncodeEnd writes: a closing run and the 8-byte end marker
+#define QOI_END_BYTES 9
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xC0
+#define QOI_OP_RGB 0xFE
+#define QOI_OP_RGBA 0xFF
+#define QOI_HASH(r, g, b, a) (((r) * 3 + (g) * 5 + (b) * 7 + (a) * 11) % 64)
+
 Pixel *readPPM(int *rows, int *cols, int * colors, char *filename);
 void writePPM(Pixel *image, int rows, int cols, int colors, char *filename);
 
 unsigned char *readPGM(int *rows, int *cols, int *intensities, char *filename);
 void writePGM(unsigned char *image, long rows, long cols, int intensities, char *filename);
+long writeNetpbm(const unsigned char *image, int channels, long rows, long cols, int maxval,
+                 char *filename);
+
+long parseNetpbmHeader(const unsigned char *buf, long len, char *magic, int num[3]);
+long parseASCIISamples(const unsigned char *buf, long len, unsigned short *out, long count);
+unsigned char *decodeNetpbm(const unsigned char *buf, long len, int *rows, int *cols,
+                            int *colors, int *channels);
+
+int openReplacement(char *filename, int flags, char **temp);
+int finishReplacement(char *filename, char *temp, int ok);
+
+int isQOIFile(char *filename);
+void qoiInit(QOIState *state);
+void qoiHeader(unsigned char *out, int rows, int cols);
+long qoiEncode(QOIState *state, const Pixel *pixels, long n, unsigned char *out);
+long qoiEncodeEnd(QOIState *state, unsigned char *out);
+long qoiDecode(QOIState *state, const unsigned char *in, long len, Pixel *pixels, long n,
+               long *decoded);
+
+const Pixel *mapPPM(int *rows, int *cols, int *colors, char *filename);
+Pixel *mapPPMPrivate(int *rows, int *cols, int *colors, char *filename);
+void unmapPPM(const Pixel *image);
+
+const unsigned char *mapPGM(int *rows, int *cols, int *intensities, char *filename);
+void unmapPGM(const unsigned char *image);
 
 
 #endif
@@ -0,0 +1,28 @@
+#ifndef PPMSTREAM_H
+
+#define PPMSTREAM_H
+
+#include "ppmIO.h"
+
+// number of bands each stream keeps in flight
+#define STREAM_BANDS 3
+
+// default number of rows in a band
+#define STREAM_BAND_ROWS 64
+
+typedef struct PPMReader PPMReader;
+typedef struct PPMWriter PPMWriter;
+
+PPMReader *openPPMReader(int *rows, int *cols, int *colors, char *filename, int bandRows);
+PPMReader *openImageReader(int *rows, int *cols, int *colors, int *channels, char *filename,
+                           int bandRows);
+int readPPMRows(PPMReader *reader, Pixel *image, int nrows);
+int readImageRows(PPMReader *reader, unsigned char *image, int nrows);
+void closePPMReader(PPMReader *reader);
+
+PPMWriter *openPPMWriter(int rows, int cols, int colors, char *filename, int bandRows);
+int writePPMRows(PPMWriter *writer, const Pixel *image, int nrows);
+int closePPMWriter(PPMWriter *writer);
+
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef PPMWRITE_H
+
+#define PPMWRITE_H
+
+#include "ppmIO.h"
+
+// what a write moved and how long it took
+typedef struct {
+  long bytes;
+  double seconds;
+} WriteStats;
+
+typedef struct AsyncWriter AsyncWriter;
+
+// a raw ppm opened to rewrite rows in place
+typedef struct {
+  int fd;
+  int rows, cols, colors;
+  long offset;                  // file offset of the first pixel
+} PPMUpdate;
+
+int writePPMParallel(const Pixel *image, int rows, int cols, int colors, char *filename,
+                     int nthreads, WriteStats *stats);
+int writePGMParallel(const unsigned char *image, int rows, int cols, int intensities,
+                     char *filename, int nthreads, WriteStats *stats);
+
+AsyncWriter *beginPPMWrite(const Pixel *image, int rows, int cols, int colors, char *filename);
+AsyncWriter *beginPGMWrite(const unsigned char *image, int rows, int cols, int intensities,
+                           char *filename);
+void commitRows(AsyncWriter *writer, int rows);
+int endWrite(AsyncWriter *writer, WriteStats *stats);
+
+PPMUpdate *openPPMUpdate(char *filename);
+int readPPMRowsAt(PPMUpdate *file, Pixel *image, int first, int nrows);
+int writePPMRowsAt(PPMUpdate *file, const Pixel *image, int first, int nrows);
+int closePPMUpdate(PPMUpdate *file);
+
+double writeBandwidth(const WriteStats *stats);
+
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef RESAMPLE_H
+
+#define RESAMPLE_H
+
+#include "threadPool.h"
+
+// resampling filters
+#define RESAMPLE_NEAREST 0
+#define RESAMPLE_BOX 1
+#define RESAMPLE_BILINEAR 2
+#define RESAMPLE_LANCZOS3 3
+
+// fraction bits of the fixed point filter weights
+#define RESAMPLE_BITS 14
+
+// rows of a pass each task works through
+#define RESAMPLE_BAND 16
+
+int resampleFilter(const char *name);
+const char *resampleFilterName(int filter);
+int resampleImage(ThreadPool *pool, unsigned char *output, int newRows, int newCols,
+                  const unsigned char *input, int rows, int cols, int channels, int filter);
+const char *resampleKernel(void);
+int useResampleKernel(const char *name);
+
+
+#endif
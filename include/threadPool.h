@@ -0,0 +1,19 @@
+#ifndef THREADPOOL_H
+
+#define THREADPOOL_H
+
+// most threads a pool will start
+#define MAX_POOL_THREADS 256
+
+typedef struct ThreadPool ThreadPool;
+
+// one piece of a parallel loop
+typedef void (*PoolTask)(void *arg, long index);
+
+ThreadPool *createThreadPool(int nthreads);
+void poolFor(ThreadPool *pool, long count, PoolTask task, void *arg);
+int poolThreads(ThreadPool *pool);
+void destroyThreadPool(ThreadPool *pool);
+
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef TILEIO_H
+
+#define TILEIO_H
+
+#include "ppmIO.h"
+
+// file name extension of tiled images
+#define TILED_EXTENSION ".tpm"
+
+// default edge length of a tile in pixels
+#define TILE_SIZE 64
+
+typedef struct {
+  int fd;
+  int rows, cols;
+  int tileSize;
+  int tilesAcross, tilesDown;
+  long *offsets;                // file offset of each tile, row by row
+} TiledImage;
+
+int isTiledFile(char *filename);
+
+TiledImage *createTiled(char *filename, int rows, int cols, int tileSize);
+TiledImage *openTiled(char *filename, int writable);
+TiledImage *openTiledCopy(char *source, char *filename);
+int readTiledRect(TiledImage *image, int x, int y, int width, int height, Pixel *pixels);
+int writeTiledRect(TiledImage *image, int x, int y, int width, int height, const Pixel *pixels);
+int closeTiled(TiledImage *image);
+
+int ppmToTiled(char *ppmFile, char *tiledFile, int tileSize);
+int tiledToPPM(char *tiledFile, char *ppmFile);
+
+
+#endif
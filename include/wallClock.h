@@ -0,0 +1,8 @@
+#ifndef WALLCLOCK_H
+
+#define WALLCLOCK_H
+
+double wallSeconds(void);
+
+
+#endif
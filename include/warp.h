@@ -0,0 +1,22 @@
+#ifndef WARP_H
+
+#define WARP_H
+
+#include "ppmIO.h"
+#include "threadPool.h"
+
+// fractional bits of the source positions stepped along each output row
+#define WARP_BITS 16
+
+// least scale compositeAffine takes, so that a step of the source position
+// along a row, 1 / scale pixels, stays well inside that fixed point
+#define WARP_MIN_SCALE (1.0 / 32768)
+
+void affineSize(int rows, int cols, float scaleFactor, float angle, int *newRows, int *newCols);
+int compositeAffine(ThreadPool *pool, Pixel *output, const Pixel *background,
+                    int bgRows, int bgCols, const Pixel *foreground,
+                    const unsigned char *alpha, int channels, int fgRows, int fgCols,
+                    float scaleFactor, float angle, int dx, int dy, int filter);
+
+
+#endif
@@ -0,0 +1,133 @@
+// Alpha planes: blend masks with one 8-bit sample per pixel.  Grey masks,
+// whether stored as pgm or as a ppm with three equal channels, are read as a
+// single plane so blending needs one alpha per pixel instead of three.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "alphaPlane.h"
+
+
+// make an empty plane of rows x cols samples
+AlphaPlane *newAlphaPlane(int rows, int cols) {
+  AlphaPlane *plane = (AlphaPlane *)calloc(1, sizeof(AlphaPlane));
+
+  if(!plane)
+    return(NULL);
+
+  plane->owned = (unsigned char *)malloc((long)rows * cols);
+  if(!plane->owned) {
+    free(plane);
+    return(NULL);
+  }
+
+  plane->rows = rows;
+  plane->cols = cols;
+  plane->channels = 1;
+  plane->alpha = plane->owned;
+
+  return(plane);
+} // end newAlphaPlane
+
+
+// true if the file starts with a pgm magic number
+static int isPGMFile(char *filename) {
+  char magic[2] = {0, 0};
+  FILE *fp = fopen(filename, "r");
+
+  if(!fp)
+    return(0);
+  if(fread(magic, 1, 2, fp) != 2)
+    magic[0] = 0;
+  fclose(fp);
+
+  return(magic[0] == 'P' && (magic[1] == '5' || magic[1] == '2'));
+} // end isPGMFile
+
+
+// Read a mask.  Pgm files are mapped as they are; ppm (or QOI) masks are
+// collapsed to one plane when every pixel is grey and kept as RGB otherwise.
+// Reads stdin when filename is NULL or empty.
+AlphaPlane *readAlphaPlane(char *filename) {
+  AlphaPlane *plane;
+  const Pixel *pixels;
+  int colors;
+  long n, i;
+
+  plane = (AlphaPlane *)calloc(1, sizeof(AlphaPlane));
+  if(!plane)
+    return(NULL);
+
+  if(filename != NULL && strlen(filename) && isPGMFile(filename)) {
+    plane->alpha = mapPGM(&plane->rows, &plane->cols, &colors, filename);
+    plane->mapped = plane->alpha;
+    plane->channels = 1;
+    if(!plane->alpha) {
+      free(plane);
+      return(NULL);
+    }
+    return(plane);
+  }
+
+  if(filename != NULL && strlen(filename))
+    pixels = mapPPM(&plane->rows, &plane->cols, &colors, filename);
+  else
+    pixels = readPPM(&plane->rows, &plane->cols, &colors, filename);
+  if(!pixels) {
+    free(plane);
+    return(NULL);
+  }
+
+  n = (long)plane->rows * plane->cols;
+  for(i = 0; i < n && pixels[i].r == pixels[i].g && pixels[i].g == pixels[i].b; i++)
+    /* look for a pixel that is not grey */;
+
+  // a grey mask is copied out to one plane
+  if(i == n)
+    plane->owned = (unsigned char *)malloc(n * sizeof(unsigned char));
+
+  if(!plane->owned) {
+    // a colour mask, blended channel by channel
+    plane->channels = 3;
+    plane->alpha = (const unsigned char *)pixels;
+    if(filename != NULL && strlen(filename))
+      plane->mapped = pixels;
+    else
+      plane->owned = (unsigned char *)pixels;
+    return(plane);
+  }
+
+  for(i = 0; i < n; i++)
+    plane->owned[i] = pixels[i].g;
+  plane->alpha = plane->owned;
+  plane->channels = 1;
+
+  if(filename != NULL && strlen(filename))
+    unmapPPM(pixels);
+  else
+    free((Pixel *)pixels);
+
+  return(plane);
+} // end readAlphaPlane
+
+
+// write a grey plane as pgm (or QOI for a .qoi name) and an RGB mask as ppm
+void writeAlphaPlane(AlphaPlane *plane, char *filename) {
+  if(plane->channels == 1)
+    writePGM((unsigned char *)plane->alpha, plane->rows, plane->cols, 255, filename);
+  else
+    writePPM((Pixel *)plane->alpha, plane->rows, plane->cols, 255, filename);
+} // end writeAlphaPlane
+
+
+void freeAlphaPlane(AlphaPlane *plane) {
+  if(!plane)
+    return;
+
+  if(plane->mapped && plane->channels == 1)
+    unmapPGM((const unsigned char *)plane->mapped);
+  else if(plane->mapped)
+    unmapPPM((const Pixel *)plane->mapped);
+  free(plane->owned);
+  free(plane);
+} // end freeAlphaPlane
@@ -0,0 +1,384 @@
+// Alpha blending in 8.8 fixed point.  Each output sample is
+//   (a * f + (255 - a) * b + 127) / 255
+// for foreground f, background b and alpha a, the exact blend rounded to
+// nearest.  The division is done as (x + 1 + (x >> 8)) >> 8, which is exact
+// for every x a blend can produce, so all kernels give identical results.
+// Besides the scalar kernel there are AVX-512, AVX2 and SSSE3 ones for x86
+// and a NEON one for ARM; alphaBlend runs the widest the processor has.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "blend.h"
+#include "kernelChoice.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLEND_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// blend n pixels; alpha has one (grey) or three (RGB) samples per pixel
+typedef void (*BlendKernel)(unsigned char *output, const unsigned char *foreground,
+                            const unsigned char *background, const unsigned char *alpha,
+                            int channels, long n);
+
+typedef struct {
+  KernelChoice choice;
+  BlendKernel kernel;
+} BlendKernelInfo;
+
+static pthread_once_t chooseOnce = PTHREAD_ONCE_INIT;
+static const BlendKernelInfo *current;
+
+
+static inline unsigned char blendSample(int f, int b, int a) {
+  int x = a * f + (255 - a) * b + 127;
+
+  return((unsigned char)((x + 1 + (x >> 8)) >> 8));
+} // end blendSample
+
+
+// blend samples that each have their own alpha
+static void blendBytes(unsigned char *output, const unsigned char *foreground,
+                       const unsigned char *background, const unsigned char *alpha,
+                       long samples) {
+  long i;
+
+  for(i = 0; i < samples; i++)
+    output[i] = blendSample(foreground[i], background[i], alpha[i]);
+} // end blendBytes
+
+
+static void blendScalar(unsigned char *output, const unsigned char *foreground,
+                        const unsigned char *background, const unsigned char *alpha,
+                        int channels, long n) {
+  long i;
+
+  if(channels == 1) {
+    for(i = 0; i < n; i++, output += 3, foreground += 3, background += 3) {
+      output[0] = blendSample(foreground[0], background[0], alpha[i]);
+      output[1] = blendSample(foreground[1], background[1], alpha[i]);
+      output[2] = blendSample(foreground[2], background[2], alpha[i]);
+    }
+    return;
+  }
+
+  // an RGB mask has an alpha for every sample
+  blendBytes(output, foreground, background, alpha, 3 * n);
+} // end blendScalar
+
+
+#ifdef BLEND_X86
+// pshufb controls that spread 16 alpha bytes out to three bytes per pixel
+static unsigned char spread[3][16];
+
+static void buildSpread(void) {
+  int j, t;
+
+  for(j = 0; j < 3; j++)
+    for(t = 0; t < 16; t++)
+      spread[j][t] = (16 * j + t) / 3;
+} // end buildSpread
+
+
+// blend 16 samples, in 16-bit lanes
+__attribute__((target("ssse3")))
+static inline __m128i blend128(__m128i f, __m128i b, __m128i a) {
+  __m128i zero = _mm_setzero_si128(), max = _mm_set1_epi16(255), half = _mm_set1_epi16(127);
+  __m128i one = _mm_set1_epi16(1);
+  __m128i alo = _mm_unpacklo_epi8(a, zero), ahi = _mm_unpackhi_epi8(a, zero);
+  __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(f, zero), alo),
+                                           _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero),
+                                                           _mm_sub_epi16(max, alo))), half);
+  __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(f, zero), ahi),
+                                           _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero),
+                                                           _mm_sub_epi16(max, ahi))), half);
+
+  lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(lo, one), _mm_srli_epi16(lo, 8)), 8);
+  hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(hi, one), _mm_srli_epi16(hi, 8)), 8);
+
+  return(_mm_packus_epi16(lo, hi));
+} // end blend128
+
+
+__attribute__((target("ssse3")))
+static void blendSSSE3(unsigned char *output, const unsigned char *foreground,
+                       const unsigned char *background, const unsigned char *alpha,
+                       int channels, long n) {
+  const __m128i *s = (const __m128i *)spread;
+  long i, j;
+
+  if(channels == 3) {
+    for(i = 0; i + 16 <= 3 * n; i += 16)
+      _mm_storeu_si128((__m128i *)(output + i),
+                       blend128(_mm_loadu_si128((const __m128i *)(foreground + i)),
+                                _mm_loadu_si128((const __m128i *)(background + i)),
+                                _mm_loadu_si128((const __m128i *)(alpha + i))));
+    blendBytes(output + i, foreground + i, background + i, alpha + i, 3 * n - i);
+    return;
+  }
+
+  for(i = 0; i + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(alpha + i));
+
+    for(j = 0; j < 3; j++) {
+      long offset = 3 * i + 16 * j;
+
+      _mm_storeu_si128((__m128i *)(output + offset),
+                       blend128(_mm_loadu_si128((const __m128i *)(foreground + offset)),
+                                _mm_loadu_si128((const __m128i *)(background + offset)),
+                                _mm_shuffle_epi8(a, _mm_loadu_si128(s + j))));
+    }
+  }
+
+  blendScalar(output + 3 * i, foreground + 3 * i, background + 3 * i, alpha + i, 1, n - i);
+} // end blendSSSE3
+
+
+// the AVX2 grey kernel runs the SSSE3 steps on 16 pixels in each 128-bit
+// lane, so lane 1 of each register holds the bytes 48 past those in lane 0
+__attribute__((target("avx2")))
+static inline __m256i load256(const unsigned char *p) {
+  return(_mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)),
+                                 _mm_loadu_si128((const __m128i *)(p + 48)), 1));
+} // end load256
+
+
+__attribute__((target("avx2")))
+static inline void store256(unsigned char *p, __m256i v) {
+  _mm_storeu_si128((__m128i *)p, _mm256_castsi256_si128(v));
+  _mm_storeu_si128((__m128i *)(p + 48), _mm256_extracti128_si256(v, 1));
+} // end store256
+
+
+__attribute__((target("avx2")))
+static inline __m256i blend256(__m256i f, __m256i b, __m256i a) {
+  __m256i zero = _mm256_setzero_si256(), max = _mm256_set1_epi16(255);
+  __m256i half = _mm256_set1_epi16(127), one = _mm256_set1_epi16(1);
+  __m256i alo = _mm256_unpacklo_epi8(a, zero), ahi = _mm256_unpackhi_epi8(a, zero);
+  __m256i lo = _mm256_add_epi16(
+    _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(f, zero), alo),
+                     _mm256_mullo_epi16(_mm256_unpacklo_epi8(b, zero), _mm256_sub_epi16(max, alo))),
+    half);
+  __m256i hi = _mm256_add_epi16(
+    _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(f, zero), ahi),
+                     _mm256_mullo_epi16(_mm256_unpackhi_epi8(b, zero), _mm256_sub_epi16(max, ahi))),
+    half);
+
+  lo = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(lo, one), _mm256_srli_epi16(lo, 8)), 8);
+  hi = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(hi, one), _mm256_srli_epi16(hi, 8)), 8);
+
+  return(_mm256_packus_epi16(lo, hi));
+} // end blend256
+
+
+__attribute__((target("avx2")))
+static void blendAVX2(unsigned char *output, const unsigned char *foreground,
+                      const unsigned char *background, const unsigned char *alpha,
+                      int channels, long n) {
+  long i, j;
+
+  if(channels == 3) {
+    for(i = 0; i + 32 <= 3 * n; i += 32)
+      _mm256_storeu_si256((__m256i *)(output + i),
+                          blend256(_mm256_loadu_si256((const __m256i *)(foreground + i)),
+                                   _mm256_loadu_si256((const __m256i *)(background + i)),
+                                   _mm256_loadu_si256((const __m256i *)(alpha + i))));
+    blendBytes(output + i, foreground + i, background + i, alpha + i, 3 * n - i);
+    return;
+  }
+
+  for(i = 0; i + 32 <= n; i += 32) {
+    // lane 0 has the alphas of pixels 0-15 and lane 1 those of 16-31
+    __m256i a = _mm256_loadu_si256((const __m256i *)(alpha + i));
+
+    for(j = 0; j < 3; j++) {
+      long offset = 3 * i + 16 * j;
+      __m256i s = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)spread[j]));
+
+      store256(output + offset, blend256(load256(foreground + offset), load256(background + offset),
+                                         _mm256_shuffle_epi8(a, s)));
+    }
+  }
+
+  blendSSSE3(output + 3 * i, foreground + 3 * i, background + 3 * i, alpha + i, 1, n - i);
+} // end blendAVX2
+
+
+// and the AVX-512 one runs them on four lanes, 64 pixels at a time
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i load512(const unsigned char *p) {
+  __m512i v = _mm512_castsi128_si512(_mm_loadu_si128((const __m128i *)p));
+
+  v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i *)(p + 48)), 1);
+  v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i *)(p + 96)), 2);
+  return(_mm512_inserti32x4(v, _mm_loadu_si128((const __m128i *)(p + 144)), 3));
+} // end load512
+
+
+__attribute__((target("avx512f,avx512bw")))
+static inline void store512(unsigned char *p, __m512i v) {
+  _mm_storeu_si128((__m128i *)p, _mm512_castsi512_si128(v));
+  _mm_storeu_si128((__m128i *)(p + 48), _mm512_extracti32x4_epi32(v, 1));
+  _mm_storeu_si128((__m128i *)(p + 96), _mm512_extracti32x4_epi32(v, 2));
+  _mm_storeu_si128((__m128i *)(p + 144), _mm512_extracti32x4_epi32(v, 3));
+} // end store512
+
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i blend512(__m512i f, __m512i b, __m512i a) {
+  __m512i zero = _mm512_setzero_si512(), max = _mm512_set1_epi16(255);
+  __m512i half = _mm512_set1_epi16(127), one = _mm512_set1_epi16(1);
+  __m512i alo = _mm512_unpacklo_epi8(a, zero), ahi = _mm512_unpackhi_epi8(a, zero);
+  __m512i lo = _mm512_add_epi16(
+    _mm512_add_epi16(_mm512_mullo_epi16(_mm512_unpacklo_epi8(f, zero), alo),
+                     _mm512_mullo_epi16(_mm512_unpacklo_epi8(b, zero), _mm512_sub_epi16(max, alo))),
+    half);
+  __m512i hi = _mm512_add_epi16(
+    _mm512_add_epi16(_mm512_mullo_epi16(_mm512_unpackhi_epi8(f, zero), ahi),
+                     _mm512_mullo_epi16(_mm512_unpackhi_epi8(b, zero), _mm512_sub_epi16(max, ahi))),
+    half);
+
+  lo = _mm512_srli_epi16(_mm512_add_epi16(_mm512_add_epi16(lo, one), _mm512_srli_epi16(lo, 8)), 8);
+  hi = _mm512_srli_epi16(_mm512_add_epi16(_mm512_add_epi16(hi, one), _mm512_srli_epi16(hi, 8)), 8);
+
+  return(_mm512_packus_epi16(lo, hi));
+} // end blend512
+
+
+__attribute__((target("avx512f,avx512bw")))
+static void blendAVX512(unsigned char *output, const unsigned char *foreground,
+                        const unsigned char *background, const unsigned char *alpha,
+                        int channels, long n) {
+  long i, j;
+
+  if(channels == 3) {
+    for(i = 0; i + 64 <= 3 * n; i += 64)
+      _mm512_storeu_si512(output + i, blend512(_mm512_loadu_si512(foreground + i),
+                                               _mm512_loadu_si512(background + i),
+                                               _mm512_loadu_si512(alpha + i)));
+    blendBytes(output + i, foreground + i, background + i, alpha + i, 3 * n - i);
+    return;
+  }
+
+  for(i = 0; i + 64 <= n; i += 64) {
+    __m512i a = _mm512_loadu_si512(alpha + i);
+
+    for(j = 0; j < 3; j++) {
+      long offset = 3 * i + 16 * j;
+      __m512i s = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)spread[j]));
+
+      store512(output + offset, blend512(load512(foreground + offset), load512(background + offset),
+                                         _mm512_shuffle_epi8(a, s)));
+    }
+  }
+
+  blendAVX2(output + 3 * i, foreground + 3 * i, background + 3 * i, alpha + i, 1, n - i);
+} // end blendAVX512
+#endif
+
+
+#if defined(__aarch64__)
+static inline uint8x16_t blendNEON16(uint8x16_t f, uint8x16_t b, uint8x16_t a) {
+  uint8x16_t inverse = vmvnq_u8(a);
+  uint16x8_t half = vdupq_n_u16(127);
+  uint16x8_t lo = vaddq_u16(vmlal_u8(vmull_u8(vget_low_u8(f), vget_low_u8(a)),
+                                     vget_low_u8(b), vget_low_u8(inverse)), half);
+  uint16x8_t hi = vaddq_u16(vmlal_u8(vmull_u8(vget_high_u8(f), vget_high_u8(a)),
+                                     vget_high_u8(b), vget_high_u8(inverse)), half);
+
+  // (x + (x >> 8) + 1) >> 8
+  lo = vsraq_n_u16(lo, lo, 8);
+  hi = vsraq_n_u16(hi, hi, 8);
+  return(vcombine_u8(vaddhn_u16(lo, vdupq_n_u16(1)), vaddhn_u16(hi, vdupq_n_u16(1))));
+} // end blendNEON16
+
+
+static void blendNEON(unsigned char *output, const unsigned char *foreground,
+                      const unsigned char *background, const unsigned char *alpha,
+                      int channels, long n) {
+  long i;
+  int c;
+
+  if(channels == 3) {
+    for(i = 0; i + 16 <= 3 * n; i += 16)
+      vst1q_u8(output + i, blendNEON16(vld1q_u8(foreground + i), vld1q_u8(background + i),
+                                       vld1q_u8(alpha + i)));
+    blendBytes(output + i, foreground + i, background + i, alpha + i, 3 * n - i);
+    return;
+  }
+
+  for(i = 0; i + 16 <= n; i += 16) {
+    uint8x16x3_t f = vld3q_u8(foreground + 3 * i), b = vld3q_u8(background + 3 * i);
+    uint8x16_t a = vld1q_u8(alpha + i);
+
+    for(c = 0; c < 3; c++)
+      f.val[c] = blendNEON16(f.val[c], b.val[c], a);
+    vst3q_u8(output + 3 * i, f);
+  }
+
+  blendScalar(output + 3 * i, foreground + 3 * i, background + 3 * i, alpha + i, 1, n - i);
+} // end blendNEON
+#endif
+
+
+// every kernel built into the library, best first
+static const BlendKernelInfo kernels[] = {
+#ifdef BLEND_X86
+  {{"avx512", "avx512f avx512bw"}, blendAVX512},
+  {{"avx2", "avx2"}, blendAVX2},
+  {{"ssse3", "ssse3"}, blendSSSE3},
+#endif
+#if defined(__aarch64__)
+  {{"neon", NULL}, blendNEON},
+#endif
+  {{"scalar", NULL}, blendScalar},
+  {{NULL, NULL}, NULL}
+};
+
+
+static void chooseKernel(void) {
+#ifdef BLEND_X86
+  buildSpread();
+#endif
+  current = &kernels[bestKernel(kernels, sizeof(kernels[0]))];
+} // end chooseKernel
+
+
+// Blend n pixels of the foreground over the background through a mask with
+// one (grey) or three (RGB) alpha samples per pixel, 255 being all
+// foreground.  output may be the same as either image.
+void alphaBlend(Pixel *output, const Pixel *foreground, const Pixel *background,
+                const unsigned char *alpha, int channels, long n) {
+  pthread_once(&chooseOnce, chooseKernel);
+
+  current->kernel((unsigned char *)output, (const unsigned char *)foreground,
+                  (const unsigned char *)background, alpha, channels, n);
+} // end alphaBlend
+
+
+// name of the kernel alphaBlend uses
+const char *blendKernel(void) {
+  pthread_once(&chooseOnce, chooseKernel);
+
+  return(current->choice.name);
+} // end blendKernel
+
+
+// Switch to the named kernel, for benchmarks and testing.  Returns -1 if it
+// is not built in or the processor cannot run it.
+int useBlendKernel(const char *name) {
+  int i;
+
+  pthread_once(&chooseOnce, chooseKernel);
+
+  i = findKernel(kernels, sizeof(kernels[0]), name);
+  if(i < 0)
+    return(-1);
+  current = &kernels[i];
+
+  return(0);
+} // end useBlendKernel
@@ -0,0 +1,528 @@
+// Chroma keying.  A pixel is background when its key channel (blue or green)
+// is above 50 and more than 4/3 of both other channels.  The ratio test is
+// done in integers as 3 * key > 4 * other, which gives the same answer as the
+// floating point test for every pair of 8-bit samples.  The kernels either
+// write the mask or, fused, composite the image over a background without
+// any mask existing at all.  The test is compiled as AVX-512, AVX2, SSSE3
+// and NEON kernels, each handing the pixels left over at the end of a run to
+// a narrower one, and the widest the processor can run is used.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "chromaKey.h"
+#include "kernelChoice.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KEY_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// what a kernel is asked to do
+typedef struct {
+  int key, other;               // channel of the key colour and the other non-red one
+  int channels;                 // mask samples per pixel, 1 or 3
+  int composite;                // write the image over background instead of a mask
+  const unsigned char *background; // composite background, NULL for black
+} KeyOp;
+
+typedef void (*KeyKernel)(const unsigned char *image, unsigned char *out, long n,
+                          const KeyOp *op);
+
+typedef struct {
+  KernelChoice choice;
+  KeyKernel kernel;
+} KeyKernelInfo;
+
+static pthread_once_t chooseOnce = PTHREAD_ONCE_INIT;
+static const KeyKernelInfo *current;
+
+
+static void keyScalar(const unsigned char *image, unsigned char *out, long n, const KeyOp *op) {
+  const unsigned char *background = op->background;
+  int key = op->key, other = op->other, channels = op->channels;
+  long i;
+
+  for(i = 0; i < n; i++, image += 3) {
+    int k = 3 * image[key];
+    int keyed = k > 4 * image[other] && k > 4 * image[0] && image[key] > 50;
+
+    if(op->composite) {
+      // the image where it is not keyed, otherwise the background
+      out[0] = keyed ? (background ? background[0] : 0) : image[0];
+      out[1] = keyed ? (background ? background[1] : 0) : image[1];
+      out[2] = keyed ? (background ? background[2] : 0) : image[2];
+      out += 3;
+      if(background)
+        background += 3;
+    }
+    else {
+      out[0] = out[channels / 2] = out[channels - 1] = keyed ? 0 : 255;
+      out += channels;
+    }
+  }
+} // end keyScalar
+
+
+// the part of a kernel's work from pixel i on, for the next kernel down
+static void keyRest(KeyKernel kernel, const unsigned char *image, unsigned char *out, long n,
+                    long i, const KeyOp *op) {
+  KeyOp rest = *op;
+
+  if(rest.background)
+    rest.background += 3 * i;
+  kernel(image + 3 * i, out + (op->composite ? 3 : op->channels) * i, n - i, &rest);
+} // end keyRest
+
+
+#ifdef KEY_X86
+// pshufb controls that gather one channel of 16 pixels from each of the
+// three 16-byte pieces they span, and that spread 16 mask bytes back out
+// to three bytes per pixel
+static unsigned char gather[3][3][16];
+static unsigned char spread[3][16];
+
+static void buildShuffles(void) {
+  int c, j, t;
+
+  for(c = 0; c < 3; c++)
+    for(j = 0; j < 3; j++)
+      for(t = 0; t < 16; t++) {
+        int byte = 3 * t + c - 16 * j;
+
+        gather[c][j][t] = byte >= 0 && byte < 16 ? byte : 0x80;
+      }
+
+  for(j = 0; j < 3; j++)
+    for(t = 0; t < 16; t++)
+      spread[j][t] = (16 * j + t) / 3;
+} // end buildShuffles
+
+
+__attribute__((target("ssse3")))
+static inline __m128i gather128(__m128i a, __m128i b, __m128i c, int channel) {
+  const __m128i *g = (const __m128i *)gather[channel];
+
+  return(_mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, _mm_loadu_si128(g)),
+                                   _mm_shuffle_epi8(b, _mm_loadu_si128(g + 1))),
+                      _mm_shuffle_epi8(c, _mm_loadu_si128(g + 2))));
+} // end gather128
+
+
+// 0xFF in the lanes where 3k > 4x, for 8-bit k and x
+__attribute__((target("ssse3")))
+static inline __m128i ratio128(__m128i k, __m128i x) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i klo = _mm_unpacklo_epi8(k, zero), khi = _mm_unpackhi_epi8(k, zero);
+  __m128i lo = _mm_cmpgt_epi16(_mm_add_epi16(klo, _mm_add_epi16(klo, klo)),
+                               _mm_slli_epi16(_mm_unpacklo_epi8(x, zero), 2));
+  __m128i hi = _mm_cmpgt_epi16(_mm_add_epi16(khi, _mm_add_epi16(khi, khi)),
+                               _mm_slli_epi16(_mm_unpackhi_epi8(x, zero), 2));
+
+  return(_mm_packs_epi16(lo, hi));
+} // end ratio128
+
+
+// image bytes where m is set, background bytes (or black) elsewhere
+__attribute__((target("ssse3")))
+static inline __m128i select128(__m128i m, __m128i image, const unsigned char *background) {
+  image = _mm_and_si128(m, image);
+  if(background)
+    image = _mm_or_si128(image, _mm_andnot_si128(m, _mm_loadu_si128((const __m128i *)background)));
+
+  return(image);
+} // end select128
+
+
+__attribute__((target("ssse3")))
+static void keySSSE3(const unsigned char *image, unsigned char *out, long n, const KeyOp *op) {
+  const __m128i *s = (const __m128i *)spread;
+  const unsigned char *background = op->background;
+  __m128i ones = _mm_set1_epi8(-1), limit = _mm_set1_epi8(51);
+  long i;
+
+  for(i = 0; i + 16 <= n; i += 16) {
+    const unsigned char *p = image + 3 * i;
+    __m128i a = _mm_loadu_si128((const __m128i *)p);
+    __m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+    __m128i c = _mm_loadu_si128((const __m128i *)(p + 32));
+    __m128i k = gather128(a, b, c, op->key);
+    __m128i bg = _mm_and_si128(ratio128(k, gather128(a, b, c, op->other)),
+                               ratio128(k, gather128(a, b, c, 0)));
+    __m128i fg, m0, m1, m2;
+
+    // k > 50 is max(k, 51) == k
+    bg = _mm_and_si128(bg, _mm_cmpeq_epi8(_mm_max_epu8(k, limit), k));
+    fg = _mm_xor_si128(bg, ones);
+    if(!op->composite && op->channels == 1) {
+      _mm_storeu_si128((__m128i *)(out + i), fg);
+      continue;
+    }
+
+    m0 = _mm_shuffle_epi8(fg, _mm_loadu_si128(s));
+    m1 = _mm_shuffle_epi8(fg, _mm_loadu_si128(s + 1));
+    m2 = _mm_shuffle_epi8(fg, _mm_loadu_si128(s + 2));
+    if(op->composite) {
+      const unsigned char *q = background ? background + 3 * i : NULL;
+
+      m0 = select128(m0, a, q);
+      m1 = select128(m1, b, q ? q + 16 : NULL);
+      m2 = select128(m2, c, q ? q + 32 : NULL);
+    }
+    _mm_storeu_si128((__m128i *)(out + 3 * i), m0);
+    _mm_storeu_si128((__m128i *)(out + 3 * i + 16), m1);
+    _mm_storeu_si128((__m128i *)(out + 3 * i + 32), m2);
+  }
+
+  keyRest(keyScalar, image, out, n, i, op);
+} // end keySSSE3
+
+
+// the AVX2 kernel runs the SSSE3 steps on 16 pixels in each 128-bit lane,
+// so lane 1 of each register holds the bytes 48 past those in lane 0
+__attribute__((target("avx2")))
+static inline __m256i load256(const unsigned char *p) {
+  return(_mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)),
+                                 _mm_loadu_si128((const __m128i *)(p + 48)), 1));
+} // end load256
+
+
+__attribute__((target("avx2")))
+static inline void store256(unsigned char *p, __m256i v) {
+  _mm_storeu_si128((__m128i *)p, _mm256_castsi256_si128(v));
+  _mm_storeu_si128((__m128i *)(p + 48), _mm256_extracti128_si256(v, 1));
+} // end store256
+
+
+__attribute__((target("avx2")))
+static inline __m256i gather256(__m256i a, __m256i b, __m256i c, int channel) {
+  const __m128i *g = (const __m128i *)gather[channel];
+
+  return(_mm256_or_si256(
+           _mm256_or_si256(_mm256_shuffle_epi8(a, _mm256_broadcastsi128_si256(_mm_loadu_si128(g))),
+                           _mm256_shuffle_epi8(b, _mm256_broadcastsi128_si256(_mm_loadu_si128(g + 1)))),
+           _mm256_shuffle_epi8(c, _mm256_broadcastsi128_si256(_mm_loadu_si128(g + 2)))));
+} // end gather256
+
+
+__attribute__((target("avx2")))
+static inline __m256i ratio256(__m256i k, __m256i x) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i klo = _mm256_unpacklo_epi8(k, zero), khi = _mm256_unpackhi_epi8(k, zero);
+  __m256i lo = _mm256_cmpgt_epi16(_mm256_add_epi16(klo, _mm256_add_epi16(klo, klo)),
+                                  _mm256_slli_epi16(_mm256_unpacklo_epi8(x, zero), 2));
+  __m256i hi = _mm256_cmpgt_epi16(_mm256_add_epi16(khi, _mm256_add_epi16(khi, khi)),
+                                  _mm256_slli_epi16(_mm256_unpackhi_epi8(x, zero), 2));
+
+  return(_mm256_packs_epi16(lo, hi));
+} // end ratio256
+
+
+__attribute__((target("avx2")))
+static inline __m256i select256(__m256i m, __m256i image, const unsigned char *background) {
+  image = _mm256_and_si256(m, image);
+  if(background)
+    image = _mm256_or_si256(image, _mm256_andnot_si256(m, load256(background)));
+
+  return(image);
+} // end select256
+
+
+__attribute__((target("avx2")))
+static void keyAVX2(const unsigned char *image, unsigned char *out, long n, const KeyOp *op) {
+  const unsigned char *background = op->background;
+  __m256i ones = _mm256_set1_epi8(-1), limit = _mm256_set1_epi8(51);
+  __m256i s0 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)spread[0]));
+  __m256i s1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)spread[1]));
+  __m256i s2 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)spread[2]));
+  long i;
+
+  for(i = 0; i + 32 <= n; i += 32) {
+    const unsigned char *p = image + 3 * i;
+    unsigned char *o = out + 3 * i;
+    __m256i a = load256(p);
+    __m256i b = load256(p + 16);
+    __m256i c = load256(p + 32);
+    __m256i k = gather256(a, b, c, op->key);
+    __m256i bg = _mm256_and_si256(ratio256(k, gather256(a, b, c, op->other)),
+                                  ratio256(k, gather256(a, b, c, 0)));
+    __m256i fg, m0, m1, m2;
+
+    bg = _mm256_and_si256(bg, _mm256_cmpeq_epi8(_mm256_max_epu8(k, limit), k));
+    fg = _mm256_xor_si256(bg, ones);
+
+    // each lane holds 16 consecutive pixels, so a grey mask is stored as is
+    if(!op->composite && op->channels == 1) {
+      _mm256_storeu_si256((__m256i *)(out + i), fg);
+      continue;
+    }
+
+    m0 = _mm256_shuffle_epi8(fg, s0);
+    m1 = _mm256_shuffle_epi8(fg, s1);
+    m2 = _mm256_shuffle_epi8(fg, s2);
+    if(op->composite) {
+      const unsigned char *q = background ? background + 3 * i : NULL;
+
+      m0 = select256(m0, a, q);
+      m1 = select256(m1, b, q ? q + 16 : NULL);
+      m2 = select256(m2, c, q ? q + 32 : NULL);
+    }
+    store256(o, m0);
+    store256(o + 16, m1);
+    store256(o + 32, m2);
+  }
+
+  keyRest(keySSSE3, image, out, n, i, op);
+} // end keyAVX2
+
+
+// and the AVX-512 kernel runs them on four lanes, 64 pixels at a time
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i load512(const unsigned char *p) {
+  __m512i v = _mm512_castsi128_si512(_mm_loadu_si128((const __m128i *)p));
+
+  v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i *)(p + 48)), 1);
+  v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i *)(p + 96)), 2);
+  return(_mm512_inserti32x4(v, _mm_loadu_si128((const __m128i *)(p + 144)), 3));
+} // end load512
+
+
+__attribute__((target("avx512f,avx512bw")))
+static inline void store512(unsigned char *p, __m512i v) {
+  _mm_storeu_si128((__m128i *)p, _mm512_castsi512_si128(v));
+  _mm_storeu_si128((__m128i *)(p + 48), _mm512_extracti32x4_epi32(v, 1));
+  _mm_storeu_si128((__m128i *)(p + 96), _mm512_extracti32x4_epi32(v, 2));
+  _mm_storeu_si128((__m128i *)(p + 144), _mm512_extracti32x4_epi32(v, 3));
+} // end store512
+
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i gather512(__m512i a, __m512i b, __m512i c, int channel) {
+  const __m128i *g = (const __m128i *)gather[channel];
+
+  return(_mm512_or_si512(
+           _mm512_or_si512(_mm512_shuffle_epi8(a, _mm512_broadcast_i32x4(_mm_loadu_si128(g))),
+                           _mm512_shuffle_epi8(b, _mm512_broadcast_i32x4(_mm_loadu_si128(g + 1)))),
+           _mm512_shuffle_epi8(c, _mm512_broadcast_i32x4(_mm_loadu_si128(g + 2)))));
+} // end gather512
+
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i ratio512(__m512i k, __m512i x) {
+  __m512i zero = _mm512_setzero_si512();
+  __m512i klo = _mm512_unpacklo_epi8(k, zero), khi = _mm512_unpackhi_epi8(k, zero);
+  __mmask32 lo = _mm512_cmpgt_epi16_mask(_mm512_add_epi16(klo, _mm512_add_epi16(klo, klo)),
+                                         _mm512_slli_epi16(_mm512_unpacklo_epi8(x, zero), 2));
+  __mmask32 hi = _mm512_cmpgt_epi16_mask(_mm512_add_epi16(khi, _mm512_add_epi16(khi, khi)),
+                                         _mm512_slli_epi16(_mm512_unpackhi_epi8(x, zero), 2));
+
+  return(_mm512_packs_epi16(_mm512_movm_epi16(lo), _mm512_movm_epi16(hi)));
+} // end ratio512
+
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i select512(__m512i m, __m512i image, const unsigned char *background) {
+  // ternary logic 0xCA is m ? image : background
+  if(background)
+    return(_mm512_ternarylogic_epi32(m, image, load512(background), 0xCA));
+
+  return(_mm512_and_si512(m, image));
+} // end select512
+
+
+__attribute__((target("avx512f,avx512bw")))
+static void keyAVX512(const unsigned char *image, unsigned char *out, long n, const KeyOp *op) {
+  const unsigned char *background = op->background;
+  __m512i s0 = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)spread[0]));
+  __m512i s1 = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)spread[1]));
+  __m512i s2 = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)spread[2]));
+  __m512i limit = _mm512_set1_epi8(50);
+  long i;
+
+  for(i = 0; i + 64 <= n; i += 64) {
+    const unsigned char *p = image + 3 * i;
+    unsigned char *o = out + 3 * i;
+    __m512i a = load512(p);
+    __m512i b = load512(p + 16);
+    __m512i c = load512(p + 32);
+    __m512i k = gather512(a, b, c, op->key);
+    __m512i bg = _mm512_and_si512(ratio512(k, gather512(a, b, c, op->other)),
+                                  ratio512(k, gather512(a, b, c, 0)));
+    __m512i fg, m0, m1, m2;
+
+    bg = _mm512_and_si512(bg, _mm512_movm_epi8(_mm512_cmpgt_epu8_mask(k, limit)));
+    fg = _mm512_ternarylogic_epi32(bg, bg, bg, 0x55);
+    if(!op->composite && op->channels == 1) {
+      _mm512_storeu_si512(out + i, fg);
+      continue;
+    }
+
+    m0 = _mm512_shuffle_epi8(fg, s0);
+    m1 = _mm512_shuffle_epi8(fg, s1);
+    m2 = _mm512_shuffle_epi8(fg, s2);
+    if(op->composite) {
+      const unsigned char *q = background ? background + 3 * i : NULL;
+
+      m0 = select512(m0, a, q);
+      m1 = select512(m1, b, q ? q + 16 : NULL);
+      m2 = select512(m2, c, q ? q + 32 : NULL);
+    }
+    store512(o, m0);
+    store512(o + 16, m1);
+    store512(o + 32, m2);
+  }
+
+  keyRest(keyAVX2, image, out, n, i, op);
+} // end keyAVX512
+#endif
+
+
+#if defined(__aarch64__)
+// 0xFF in the lanes where 3k > 4x
+static inline uint8x16_t ratioNEON(uint8x16_t k, uint8x16_t x) {
+  uint16x8_t lo = vcgtq_u16(vmull_u8(vget_low_u8(k), vdup_n_u8(3)), vshll_n_u8(vget_low_u8(x), 2));
+  uint16x8_t hi = vcgtq_u16(vmull_u8(vget_high_u8(k), vdup_n_u8(3)), vshll_n_u8(vget_high_u8(x), 2));
+
+  return(vcombine_u8(vmovn_u16(lo), vmovn_u16(hi)));
+} // end ratioNEON
+
+
+static void keyNEON(const unsigned char *image, unsigned char *out, long n, const KeyOp *op) {
+  long i;
+  int c;
+
+  for(i = 0; i + 16 <= n; i += 16) {
+    uint8x16x3_t p = vld3q_u8(image + 3 * i);
+    uint8x16x3_t result;
+    uint8x16_t k = p.val[op->key];
+    uint8x16_t fg = vmvnq_u8(vandq_u8(vandq_u8(ratioNEON(k, p.val[op->other]),
+                                                ratioNEON(k, p.val[0])),
+                                       vcgtq_u8(k, vdupq_n_u8(50))));
+
+    if(op->composite) {
+      uint8x16x3_t q;
+
+      if(op->background)
+        q = vld3q_u8(op->background + 3 * i);
+      else
+        q.val[0] = q.val[1] = q.val[2] = vdupq_n_u8(0);
+      for(c = 0; c < 3; c++)
+        result.val[c] = vbslq_u8(fg, p.val[c], q.val[c]);
+      vst3q_u8(out + 3 * i, result);
+    }
+    else if(op->channels == 1)
+      vst1q_u8(out + i, fg);
+    else {
+      result.val[0] = result.val[1] = result.val[2] = fg;
+      vst3q_u8(out + 3 * i, result);
+    }
+  }
+
+  keyRest(keyScalar, image, out, n, i, op);
+} // end keyNEON
+#endif
+
+
+// every kernel built into the library, best first
+static const KeyKernelInfo kernels[] = {
+#ifdef KEY_X86
+  {{"avx512", "avx512f avx512bw"}, keyAVX512},
+  {{"avx2", "avx2"}, keyAVX2},
+  {{"ssse3", "ssse3"}, keySSSE3},
+#endif
+#if defined(__aarch64__)
+  {{"neon", NULL}, keyNEON},
+#endif
+  {{"scalar", NULL}, keyScalar},
+  {{NULL, NULL}, NULL}
+};
+
+
+static void chooseKernel(void) {
+#ifdef KEY_X86
+  buildShuffles();
+#endif
+  current = &kernels[bestKernel(kernels, sizeof(kernels[0]))];
+} // end chooseKernel
+
+
+// fill in the channels for a key colour; returns 0 if it is not 'b' or 'g'
+static int keyChannels(KeyOp *op, char keyColor) {
+  memset(op, 0, sizeof(KeyOp));
+  if(keyColor != 'b' && keyColor != 'g')
+    return(0);
+
+  op->key = keyColor == 'b' ? 2 : 1;
+  op->other = keyColor == 'b' ? 1 : 2;
+
+  return(1);
+} // end keyChannels
+
+
+// Build a mask that is black where the image shows the key colour ('b' or
+// 'g') and white elsewhere, as an alpha plane (channels 1) or an RGB image
+// (channels 3).  Any other key colour gives an all white mask.
+void chromaKeyMask(const Pixel *image, unsigned char *mask, long n, char keyColor,
+                   int channels) {
+  KeyOp op;
+
+  pthread_once(&chooseOnce, chooseKernel);
+
+  if(!keyChannels(&op, keyColor)) {
+    memset(mask, 255, n * channels);
+    return;
+  }
+
+  op.channels = channels;
+  current->kernel((const unsigned char *)image, mask, n, &op);
+} // end chromaKeyMask
+
+
+// Key and composite in one pass: output is the foreground where it is not
+// keyed and the background (black when background is NULL) where it is,
+// which is what blending through a chromaKeyMask mask gives.  output may be
+// the same as either input.
+void chromaKeyComposite(const Pixel *foreground, const Pixel *background, Pixel *output,
+                        long n, char keyColor) {
+  KeyOp op;
+
+  pthread_once(&chooseOnce, chooseKernel);
+
+  if(!keyChannels(&op, keyColor)) {
+    if(output != foreground)
+      memmove(output, foreground, n * sizeof(Pixel));
+    return;
+  }
+
+  op.channels = 3;
+  op.composite = 1;
+  op.background = (const unsigned char *)background;
+  current->kernel((const unsigned char *)foreground, (unsigned char *)output, n, &op);
+} // end chromaKeyComposite
+
+
+// name of the kernel chromaKeyMask uses
+const char *chromaKeyKernel(void) {
+  pthread_once(&chooseOnce, chooseKernel);
+
+  return(current->choice.name);
+} // end chromaKeyKernel
+
+
+// Switch to the named kernel, for benchmarks and testing.  Returns -1 if it
+// is not built in or the processor cannot run it.
+int useChromaKeyKernel(const char *name) {
+  int i;
+
+  pthread_once(&chooseOnce, chooseKernel);
+
+  i = findKernel(kernels, sizeof(kernels[0]), name);
+  if(i < 0)
+    return(-1);
+  current = &kernels[i];
+
+  return(0);
+} // end useChromaKeyKernel
@@ -0,0 +1,255 @@
+// Pointwise colour operations.  An operation that maps a channel to itself
+// depends on nothing but that channel's value, so any chain of them comes to
+// one table of 256 entries per channel: compileColorOps runs every value
+// through the chain once and applyColorLUT is then three lookups a pixel,
+// however long the chain.  Rules that mix channels cannot be tabled that
+// way, so they get kernels of their own, written without branches so that
+// sixteen pixels at a time go through SSSE3 registers.  isolateRed is the
+// only such rule so far, and it runs its scalar kernel on processors
+// without SSSE3 and for thresholds outside 0 to 255.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "colorOps.h"
+#include "kernelChoice.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define COLOROPS_X86 1
+#endif
+
+// apply isolateRed's rule to n pixels of three samples
+typedef void (*IsolateKernel)(unsigned char *output, const unsigned char *input, long n,
+                              int threshold);
+
+typedef struct {
+  KernelChoice choice;
+  IsolateKernel kernel;
+} ColorOpsKernelInfo;
+
+static pthread_once_t chooseOnce = PTHREAD_ONCE_INIT;
+static const ColorOpsKernelInfo *current;
+
+
+// one value through one operation
+static int applyOp(const ColorOp *op, int value) {
+  double result;
+
+  if(value <= op->low || value >= op->high)
+    return(value);
+
+  switch(op->type) {
+  case COLOR_OP_ADD:
+    result = value + op->amount;
+    break;
+  case COLOR_OP_SCALE:
+    result = value * op->amount;
+    break;
+  case COLOR_OP_SET:
+    result = op->amount;
+    break;
+  default:
+    return(value);
+  }
+
+  return(result < 0 ? 0 : result > 255 ? 255 : (int)result);
+} // end applyOp
+
+
+// Compile a chain of count operations, applied in order, into a table per
+// channel.  An empty chain gives the identity.
+void compileColorOps(ColorLUT *lut, const ColorOp *ops, int count) {
+  int c, v, i;
+
+  for(c = 0; c < 3; c++) {
+    for(v = 0; v < 256; v++) {
+      int value = v;
+
+      for(i = 0; i < count; i++) {
+        if(ops[i].channel == c)
+          value = applyOp(&ops[i], value);
+      }
+      lut->table[c][v] = (unsigned char)value;
+    }
+  }
+} // end compileColorOps
+
+
+// Map n pixels through the tables; output may be the input.
+void applyColorLUT(const ColorLUT *lut, Pixel *output, const Pixel *input, long n) {
+  const unsigned char *red = lut->table[COLOR_RED];
+  const unsigned char *green = lut->table[COLOR_GREEN];
+  const unsigned char *blue = lut->table[COLOR_BLUE];
+  long i;
+
+  for(i = 0; i < n; i++) {
+    output[i].r = red[input[i].r];
+    output[i].g = green[input[i].g];
+    output[i].b = blue[input[i].b];
+  }
+} // end applyColorLUT
+
+
+static void isolateScalar(unsigned char *output, const unsigned char *input, long n,
+                          int threshold) {
+  long i;
+
+  for(i = 0; i < n; i++, input += 3, output += 3) {
+    int r = input[0], g = input[1], b = input[2];
+    int low = g < b ? g : b;
+    int grey, red;
+
+    low = r < low ? r : low;
+    grey = low < 128 ? low : low >> 1;
+    red = r < 128 ? r << 1 : r;
+    output[0] = (unsigned char)(r - ((g + b) >> 1) > threshold ? red : grey);
+    output[1] = output[2] = (unsigned char)grey;
+  }
+} // end isolateScalar
+
+
+#ifdef COLOROPS_X86
+// pshufb controls that gather each channel of 16 pixels out of the three
+// vectors holding them, and that scatter the channels back
+static unsigned char gather[3][3][16];
+static unsigned char scatter[3][3][16];
+
+static void buildShuffles(void) {
+  int c, v, k;
+
+  for(c = 0; c < 3; c++) {
+    for(v = 0; v < 3; v++) {
+      for(k = 0; k < 16; k++) {
+        int b = 3 * k + c;          // byte of channel c of pixel k
+        int o = 16 * v + k;         // byte k of vector v
+
+        gather[c][v][k] = b / 16 == v ? b % 16 : 0x80;
+        scatter[v][c][k] = o % 3 == c ? o / 3 : 0x80;
+      }
+    }
+  }
+} // end buildShuffles
+
+
+// select a where mask is set, else b
+__attribute__((target("ssse3")))
+static inline __m128i select8(__m128i mask, __m128i a, __m128i b) {
+  return(_mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b)));
+} // end select8
+
+
+__attribute__((target("ssse3")))
+static void isolateSSSE3(unsigned char *output, const unsigned char *input, long n,
+                         int threshold) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i one = _mm_set1_epi8(1);
+  __m128i high = _mm_set1_epi8(0x7f);
+  __m128i limit = _mm_set1_epi8((char)threshold);
+  __m128i gatherMask[3][3], scatterMask[3][3];
+  long i;
+  int c, v;
+
+  for(c = 0; c < 3; c++) {
+    for(v = 0; v < 3; v++) {
+      gatherMask[c][v] = _mm_loadu_si128((const __m128i *)gather[c][v]);
+      scatterMask[v][c] = _mm_loadu_si128((const __m128i *)scatter[v][c]);
+    }
+  }
+
+  for(i = 0; i + 16 <= n; i += 16, input += 48, output += 48) {
+    __m128i a[3], ch[3], half, grey, red, low, plain;
+
+    for(v = 0; v < 3; v++)
+      a[v] = _mm_loadu_si128((const __m128i *)(input + 16 * v));
+    for(c = 0; c < 3; c++) {
+      ch[c] = zero;
+      for(v = 0; v < 3; v++)
+        ch[c] = _mm_or_si128(ch[c], _mm_shuffle_epi8(a[v], gatherMask[c][v]));
+    }
+
+    // (g + b) / 2 rounded down; r is red when r - half > threshold, which
+    // saturating subtraction tells without leaving eight bits
+    half = _mm_sub_epi8(_mm_avg_epu8(ch[1], ch[2]),
+                        _mm_and_si128(_mm_xor_si128(ch[1], ch[2]), one));
+    plain = _mm_cmpeq_epi8(_mm_subs_epu8(_mm_subs_epu8(ch[0], half), limit), zero);
+
+    // the minimum, halved from 128 up; red doubled below 128
+    low = _mm_min_epu8(ch[0], _mm_min_epu8(ch[1], ch[2]));
+    grey = select8(_mm_cmplt_epi8(low, zero), _mm_and_si128(_mm_srli_epi16(low, 1), high), low);
+    red = select8(_mm_cmplt_epi8(ch[0], zero), ch[0], _mm_add_epi8(ch[0], ch[0]));
+
+    ch[0] = select8(plain, grey, red);
+    ch[1] = ch[2] = grey;
+    for(v = 0; v < 3; v++) {
+      __m128i out = zero;
+
+      for(c = 0; c < 3; c++)
+        out = _mm_or_si128(out, _mm_shuffle_epi8(ch[c], scatterMask[v][c]));
+      _mm_storeu_si128((__m128i *)(output + 16 * v), out);
+    }
+  }
+
+  isolateScalar(output, input, n - i, threshold);
+} // end isolateSSSE3
+#endif
+
+
+// every kernel built into the library, best first
+static const ColorOpsKernelInfo kernels[] = {
+#ifdef COLOROPS_X86
+  {{"ssse3", "ssse3"}, isolateSSSE3},
+#endif
+  {{"scalar", NULL}, isolateScalar},
+  {{NULL, NULL}, NULL}
+};
+
+
+static void chooseKernel(void) {
+#ifdef COLOROPS_X86
+  buildShuffles();
+#endif
+  current = &kernels[bestKernel(kernels, sizeof(kernels[0]))];
+} // end chooseKernel
+
+
+// Keep strongly red pixels red and turn the rest grey.  A pixel whose red
+// exceeds the mean of its green and blue by more than threshold has its red
+// doubled if below 128; any other takes the minimum of its channels for red.
+// Green and blue always take that minimum, halved from 128 up.  output may
+// be the input.  The vector kernels take thresholds of 0 to 255.
+void isolateRed(Pixel *output, const Pixel *input, long n, int threshold) {
+  pthread_once(&chooseOnce, chooseKernel);
+
+  if(threshold < 0 || threshold > 255) {
+    isolateScalar((unsigned char *)output, (const unsigned char *)input, n, threshold);
+    return;
+  }
+
+  current->kernel((unsigned char *)output, (const unsigned char *)input, n, threshold);
+} // end isolateRed
+
+
+// name of the kernel isolateRed uses
+const char *colorOpsKernel(void) {
+  pthread_once(&chooseOnce, chooseKernel);
+
+  return(current->choice.name);
+} // end colorOpsKernel
+
+
+// Switch to the named kernel, for benchmarks and testing.  Returns -1 if it
+// is not built in or the processor cannot run it.
+int useColorOpsKernel(const char *name) {
+  int i;
+
+  pthread_once(&chooseOnce, chooseKernel);
+
+  i = findKernel(kernels, sizeof(kernels[0]), name);
+  if(i < 0)
+    return(-1);
+  current = &kernels[i];
+
+  return(0);
+} // end useColorOpsKernel
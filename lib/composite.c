@@ -0,0 +1,421 @@
+// Tiled compositing.  The output is cut into tiles sized so that a tile of
+// background, foreground, mask and output fits in part of the L2 cache, and
+// the tiles are shared out by a thread pool.  A tile copies the background
+// where the foreground does not reach and blends where it does, so the
+// background is read once and no separate copy pass is needed.  Given the
+// mask's spans, only the edges are blended: clear pixels keep the
+// background and solid ones take the foreground with plain copies.  A scaled
+// foreground is sampled straight from the original images through tables of
+// source rows and columns, so no scaled copies are ever made; scaleNearest
+// makes one through the same tables for callers that need it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include "blend.h"
+#include "composite.h"
+
+// pixels gathered from a scaled foreground for each call to alphaBlend
+#define GATHER_PIXELS 256
+
+typedef struct {
+  Pixel *output;
+  const Pixel *background;      // NULL to blend over output in place
+  int bgRows, bgCols;
+  const Pixel *foreground;
+  const unsigned char *alpha;
+  int channels;
+  int fgRows, fgCols;
+  int dx, dy;
+  const MaskSpans *spans;
+  int tileRows, tileCols, tilesAcross;
+  // scaled compositing: the foreground is fgRows x fgCols scaled to
+  // scaledRows x scaledCols, and spans are those of the unscaled mask
+  int scaledRows, scaledCols;
+  const int *rowIndex;          // source row of each scaled row
+  const int *colIndex;          // source column of each scaled column
+  const int *colStart;          // first scaled column of each source column, and one past
+} CompositeJob;
+
+// an image being scaled by scaleNearest
+typedef struct {
+  unsigned char *output;
+  const unsigned char *input;
+  int cols, channels;
+  int scaledCols;
+  const int *rowIndex;          // source row of each scaled row
+  const int *colIndex;          // source column of each scaled column
+} ScaleJob;
+
+
+// bytes of L2 cache each core has
+static long level2Size(void) {
+  long size = 0;
+
+#ifdef _SC_LEVEL2_CACHE_SIZE
+  size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+
+  return(size > 0 ? size : COMPOSITE_DEFAULT_L2);
+} // end level2Size
+
+
+// Pick the tile size for compositing onto an image cols pixels wide: tiles
+// a multiple of 64 pixels wide (or the whole width) and as tall as fits in
+// the cache share.
+void compositeTileSize(int cols, int channels, int *tileRows, int *tileCols) {
+  long budget = level2Size() / COMPOSITE_L2_SHARE;
+  long perPixel = 3 * sizeof(Pixel) + channels;
+  long width = budget / (perPixel * 16);
+
+  // at least 16 rows of the widest tile that allows it
+  width = width / 64 * 64;
+  if(width < 64)
+    width = 64;
+  if(width > cols)
+    width = cols;
+
+  *tileCols = (int)(width > 0 ? width : 1);
+  *tileRows = (int)(budget / (perPixel * *tileCols));
+  if(*tileRows < 1)
+    *tileRows = 1;
+} // end compositeTileSize
+
+
+static void compositeTile(void *arg, long index) {
+  CompositeJob *job = (CompositeJob *)arg;
+  int y0 = (int)(index / job->tilesAcross) * job->tileRows;
+  int x0 = (int)(index % job->tilesAcross) * job->tileCols;
+  int y1 = y0 + job->tileRows < job->bgRows ? y0 + job->tileRows : job->bgRows;
+  int x1 = x0 + job->tileCols < job->bgCols ? x0 + job->tileCols : job->bgCols;
+  int copy = job->background && job->background != job->output;
+  int y;
+
+  for(y = y0; y < y1; y++) {
+    Pixel *out = job->output + (long)y * job->bgCols;
+    const Pixel *bg = job->background ? job->background + (long)y * job->bgCols : out;
+    int fy = y - job->dy;
+    int a = x1, b = x1;
+
+    // the part of this row of the tile the foreground covers, [a, b)
+    if(fy >= 0 && fy < job->fgRows) {
+      a = x0 > job->dx ? x0 : job->dx;
+      b = x1 < job->dx + job->fgCols ? x1 : job->dx + job->fgCols;
+      if(a > b)
+        a = b = x1;
+    }
+
+    // rows of the foreground above or below everything the mask shows
+    if(job->spans && (fy < job->spans->top || fy >= job->spans->bottom))
+      a = b = x1;
+
+    if(copy && a > x0)
+      memcpy(out + x0, bg + x0, (a - x0) * sizeof(Pixel));
+    if(a < b && job->spans) {
+      long f = (long)fy * job->fgCols;
+
+      blendSpanRow(job->spans, fy, a - job->dx, b - job->dx, out + job->dx,
+                   job->foreground + f, job->background ? bg + job->dx : NULL,
+                   job->alpha + f * job->channels);
+    }
+    else if(a < b) {
+      long f = (long)fy * job->fgCols + (a - job->dx);
+
+      alphaBlend(out + a, job->foreground + f, bg + a, job->alpha + f * job->channels,
+                 job->channels, b - a);
+    }
+    if(copy && x1 > b)
+      memcpy(out + b, bg + b, (x1 - b) * sizeof(Pixel));
+  }
+} // end compositeTile
+
+
+// Blend a foreground of fgRows x fgCols pixels, through a mask with one or
+// three samples per pixel, onto the background at (dx, dy), writing output.
+// The foreground must lie inside the background's columns; rows of it above
+// or below the background are left out, so a band of background rows can be
+// composited on its own.  With a NULL background the output is blended in
+// place.  spans, when not NULL, are those of the mask.
+// pool may be NULL to run on the calling thread.
+void compositeOffset(ThreadPool *pool, Pixel *output, const Pixel *background,
+                     int bgRows, int bgCols, const Pixel *foreground,
+                     const unsigned char *alpha, int channels, int fgRows, int fgCols,
+                     int dx, int dy, const MaskSpans *spans) {
+  CompositeJob job;
+
+  if(bgRows <= 0 || bgCols <= 0)
+    return;
+
+  job.output = output;
+  job.background = background;
+  job.bgRows = bgRows;
+  job.bgCols = bgCols;
+  job.foreground = foreground;
+  job.alpha = alpha;
+  job.channels = channels;
+  job.fgRows = fgRows;
+  job.fgCols = fgCols;
+  job.dx = dx;
+  job.dy = dy;
+  job.spans = spans;
+  compositeTileSize(bgCols, channels, &job.tileRows, &job.tileCols);
+  job.tilesAcross = (bgCols + job.tileCols - 1) / job.tileCols;
+
+  poolFor(pool, (long)job.tilesAcross * ((bgRows + job.tileRows - 1) / job.tileRows),
+          compositeTile, &job);
+} // end compositeOffset
+
+
+// Size of an image of rows x cols pixels scaled by scaleFactor.  Returns 0,
+// or -1 with both sizes 0 if the scale is negative or not finite or a side
+// would not fit in an int.
+int scaledSize(int rows, int cols, float scaleFactor, int *newRows, int *newCols) {
+  float scaledRows = rows * scaleFactor;
+  float scaledCols = cols * scaleFactor;
+
+  // written so that NaN fails every test
+  if(!(scaleFactor >= 0) || !(scaledRows < (float)INT_MAX) || !(scaledCols < (float)INT_MAX)) {
+    *newRows = *newCols = 0;
+    return(-1);
+  }
+
+  *newRows = (int)scaledRows;
+  *newCols = (int)scaledCols;
+  return(0);
+} // end scaledSize
+
+
+// source of scaled index i out of n, the nearest neighbour below i / scaleFactor
+static int sourceIndex(int i, float scaleFactor, int n) {
+  int source = (int)(i / scaleFactor);
+
+  return(source < n ? source : n - 1);
+} // end sourceIndex
+
+
+// Blend scaled columns x0 to x1 of one row, where out and bg are offset so
+// that out[x] is under scaled column x and fgRow and alphaRow are the source
+// row.  A solid run is copied without blending.
+static void blendScaled(const CompositeJob *job, Pixel *out, const Pixel *bg,
+                        const Pixel *fgRow, const unsigned char *alphaRow,
+                        int x0, int x1, int solid) {
+  Pixel gathered[GATHER_PIXELS];
+  unsigned char alpha[GATHER_PIXELS * 3];
+  const int *col = job->colIndex;
+  int channels = job->channels;
+  int x, i, n;
+
+  if(solid) {
+    for(x = x0; x < x1; x++)
+      out[x] = fgRow[col[x]];
+    return;
+  }
+
+  for(x = x0; x < x1; x += n) {
+    n = x1 - x < GATHER_PIXELS ? x1 - x : GATHER_PIXELS;
+    for(i = 0; i < n; i++)
+      gathered[i] = fgRow[col[x + i]];
+    if(channels == 1) {
+      for(i = 0; i < n; i++)
+        alpha[i] = alphaRow[col[x + i]];
+    }
+    else {
+      for(i = 0; i < n; i++)
+        memcpy(alpha + 3 * i, alphaRow + 3L * col[x + i], 3);
+    }
+    alphaBlend(out + x, gathered, bg + x, alpha, channels, n);
+  }
+} // end blendScaled
+
+
+// composite scaled columns x0 to x1 of scaled foreground row fy, with out
+// and bg offset as for blendScaled
+static void scaledRow(const CompositeJob *job, Pixel *out, const Pixel *bg, int copy,
+                      int fy, int x0, int x1) {
+  const MaskSpans *spans = job->spans;
+  int sy = job->rowIndex[fy];
+  const Pixel *fgRow = job->foreground + (long)sy * job->fgCols;
+  const unsigned char *alphaRow = job->alpha + (long)sy * job->fgCols * job->channels;
+  int cursor = x0;
+  long s;
+
+  if(!spans) {
+    blendScaled(job, out, bg, fgRow, alphaRow, x0, x1, 0);
+    return;
+  }
+
+  // each source span covers the scaled columns from colStart[start] on
+  for(s = spans->rowStart[sy]; s < spans->rowStart[sy + 1] && cursor < x1; s++) {
+    const MaskSpan *span = &spans->spans[s];
+    int a = job->colStart[span->start];
+    int b = job->colStart[span->start + span->length];
+
+    a = a > x0 ? a : x0;
+    b = b < x1 ? b : x1;
+    if(b <= a)
+      continue;
+
+    if(copy && a > cursor)
+      memcpy(out + cursor, bg + cursor, (a - cursor) * sizeof(Pixel));
+    blendScaled(job, out, bg, fgRow, alphaRow, a, b, span->type == SPAN_SOLID);
+    cursor = b;
+  }
+
+  if(copy && x1 > cursor)
+    memcpy(out + cursor, bg + cursor, (x1 - cursor) * sizeof(Pixel));
+} // end scaledRow
+
+
+static void compositeScaledTile(void *arg, long index) {
+  CompositeJob *job = (CompositeJob *)arg;
+  int y0 = (int)(index / job->tilesAcross) * job->tileRows;
+  int x0 = (int)(index % job->tilesAcross) * job->tileCols;
+  int y1 = y0 + job->tileRows < job->bgRows ? y0 + job->tileRows : job->bgRows;
+  int x1 = x0 + job->tileCols < job->bgCols ? x0 + job->tileCols : job->bgCols;
+  int copy = job->background && job->background != job->output;
+  int y;
+
+  for(y = y0; y < y1; y++) {
+    Pixel *out = job->output + (long)y * job->bgCols;
+    const Pixel *bg = job->background ? job->background + (long)y * job->bgCols : out;
+    int fy = y - job->dy;
+    int a = x1, b = x1;
+
+    // the part of this row of the tile the scaled foreground covers, [a, b)
+    if(fy >= 0 && fy < job->scaledRows) {
+      a = x0 > job->dx ? x0 : job->dx;
+      b = x1 < job->dx + job->scaledCols ? x1 : job->dx + job->scaledCols;
+      if(a > b)
+        a = b = x1;
+    }
+
+    if(copy && a > x0)
+      memcpy(out + x0, bg + x0, (a - x0) * sizeof(Pixel));
+    if(a < b)
+      scaledRow(job, out + job->dx, bg + job->dx, copy, fy, a - job->dx, b - job->dx);
+    if(copy && x1 > b)
+      memcpy(out + b, bg + b, (x1 - b) * sizeof(Pixel));
+  }
+} // end compositeScaledTile
+
+
+// Composite as compositeOffset does, but with the foreground and mask
+// (fgRows x fgCols) scaled by scaleFactor with nearest neighbour sampling, as
+// if scaled copies had been made first.  The scaled foreground, of the size
+// scaledSize gives, must lie inside the background's columns.  spans, when
+// not NULL, are those of the unscaled mask.  Returns 0, or -1 if scaledSize
+// rejects the scale or memory for the index tables runs out.
+int compositeScaled(ThreadPool *pool, Pixel *output, const Pixel *background,
+                    int bgRows, int bgCols, const Pixel *foreground,
+                    const unsigned char *alpha, int channels, int fgRows, int fgCols,
+                    float scaleFactor, int dx, int dy, const MaskSpans *spans) {
+  CompositeJob job;
+  int *tables;
+  int i, x;
+
+  // unscaled, there is nothing to look up
+  if(scaleFactor == 1.0f) {
+    compositeOffset(pool, output, background, bgRows, bgCols, foreground, alpha, channels,
+                    fgRows, fgCols, dx, dy, spans);
+    return(0);
+  }
+
+  memset(&job, 0, sizeof(job));
+  if(scaledSize(fgRows, fgCols, scaleFactor, &job.scaledRows, &job.scaledCols) != 0)
+    return(-1);
+  if(bgRows <= 0 || bgCols <= 0 || job.scaledRows <= 0 || job.scaledCols <= 0) {
+    if(background && background != output && bgRows > 0 && bgCols > 0)
+      memcpy(output, background, (long)bgRows * bgCols * sizeof(Pixel));
+    return(0);
+  }
+
+  tables = (int *)malloc((job.scaledRows + job.scaledCols + fgCols + 1L) * sizeof(int));
+  if(!tables)
+    return(-1);
+  job.rowIndex = tables;
+  job.colIndex = tables + job.scaledRows;
+  job.colStart = tables + job.scaledRows + job.scaledCols;
+
+  // the divides are done once per row and column, not once per pixel
+  for(i = 0; i < job.scaledRows; i++)
+    tables[i] = sourceIndex(i, scaleFactor, fgRows);
+  for(i = 0; i < job.scaledCols; i++)
+    tables[job.scaledRows + i] = sourceIndex(i, scaleFactor, fgCols);
+  for(i = 0, x = 0; i <= fgCols; i++) {
+    while(x < job.scaledCols && job.colIndex[x] < i)
+      x++;
+    tables[job.scaledRows + job.scaledCols + i] = x;
+  }
+
+  job.output = output;
+  job.background = background;
+  job.bgRows = bgRows;
+  job.bgCols = bgCols;
+  job.foreground = foreground;
+  job.alpha = alpha;
+  job.channels = channels;
+  job.fgRows = fgRows;
+  job.fgCols = fgCols;
+  job.dx = dx;
+  job.dy = dy;
+  job.spans = spans;
+  compositeTileSize(bgCols, channels, &job.tileRows, &job.tileCols);
+  job.tilesAcross = (bgCols + job.tileCols - 1) / job.tileCols;
+
+  poolFor(pool, (long)job.tilesAcross * ((bgRows + job.tileRows - 1) / job.tileRows),
+          compositeScaledTile, &job);
+
+  free(tables);
+  return(0);
+} // end compositeScaled
+
+
+// fill one row of a scaled copy, a PoolTask
+static void scaleRow(void *arg, long y) {
+  ScaleJob *job = (ScaleJob *)arg;
+  int c = job->channels, x;
+  const unsigned char *in = job->input + (long)job->rowIndex[y] * job->cols * c;
+  unsigned char *out = job->output + y * job->scaledCols * c;
+
+  for(x = 0; x < job->scaledCols; x++)
+    memcpy(out + x * c, in + job->colIndex[x] * c, c);
+} // end scaleRow
+
+
+// Scale an image of rows x cols pixels with channels samples each by
+// scaleFactor into output, of the size scaledSize gives, taking the same
+// source pixels compositeScaled does.  Rows are shared out by the pool,
+// which may be NULL.  Returns 0, or -1 if scaledSize rejects the scale or
+// memory for the index tables runs out.
+int scaleNearest(ThreadPool *pool, unsigned char *output, const unsigned char *input,
+                 int rows, int cols, int channels, float scaleFactor) {
+  ScaleJob job;
+  int *tables;
+  int scaledRows, i;
+
+  if(scaledSize(rows, cols, scaleFactor, &scaledRows, &job.scaledCols) != 0)
+    return(-1);
+  if(scaledRows <= 0 || job.scaledCols <= 0)
+    return(0);
+
+  tables = (int *)malloc(((long)scaledRows + job.scaledCols) * sizeof(int));
+  if(!tables)
+    return(-1);
+  for(i = 0; i < scaledRows; i++)
+    tables[i] = sourceIndex(i, scaleFactor, rows);
+  for(i = 0; i < job.scaledCols; i++)
+    tables[scaledRows + i] = sourceIndex(i, scaleFactor, cols);
+
+  job.output = output;
+  job.input = input;
+  job.cols = cols;
+  job.channels = channels;
+  job.rowIndex = tables;
+  job.colIndex = tables + scaledRows;
+  poolFor(pool, scaledRows, scaleRow, &job);
+
+  free(tables);
+  return(0);
+} // end scaleNearest
@@ -0,0 +1,199 @@
+// Mask feathering.  A gaussian blur is approximated by FEATHER_PASSES box
+// blurs, each done as a horizontal and a vertical pass over running sums, so
+// the cost per pixel does not depend on the radius.  Rows are split across
+// threads for the horizontal passes and columns for the vertical ones; a
+// vertical pass walks its columns a row at a time so it reads memory in
+// order.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "feather.h"
+
+typedef struct {
+  const unsigned char *input;
+  unsigned char *output;
+  int rows, cols;               // size in samples, so cols counts every channel
+  int channels;
+  int radius;
+  int first, last;              // rows or sample columns of this thread
+  long *sums;                   // running sums of a vertical pass
+} FeatherRange;
+
+
+// widths of the box blurs whose repeated application best matches a gaussian
+// of the given sigma (each width is odd)
+static void boxWidths(double sigma, int *widths) {
+  double ideal = sqrt(12 * sigma * sigma / FEATHER_PASSES + 1);
+  int lower = (int)floor(ideal), i, m;
+
+  if(lower % 2 == 0)
+    lower--;
+  if(lower < 1)
+    lower = 1;
+
+  // m passes at the lower width and the rest two wider
+  m = (int)floor((12 * sigma * sigma - FEATHER_PASSES * lower * lower -
+                  4.0 * FEATHER_PASSES * lower - 3 * FEATHER_PASSES) / (-4.0 * lower - 4) + 0.5);
+  for(i = 0; i < FEATHER_PASSES; i++)
+    widths[i] = i < m ? lower : lower + 2;
+} // end boxWidths
+
+
+// box blur each row of the range along x, with the edges extended
+static void *horizontalPass(void *arg) {
+  FeatherRange *range = (FeatherRange *)arg;
+  int c = range->channels, cols = range->cols / c, r = range->radius;
+  long width = 2 * r + 1;
+  int y, ch, x;
+
+  for(y = range->first; y < range->last; y++) {
+    const unsigned char *in = range->input + (long)y * range->cols;
+    unsigned char *out = range->output + (long)y * range->cols;
+
+    for(ch = 0; ch < c; ch++) {
+      long sum = (long)(r + 1) * in[ch];
+
+      for(x = 1; x <= r; x++)
+        sum += in[(x < cols ? x : cols - 1) * c + ch];
+
+      for(x = 0; x < cols; x++) {
+        int add = x + r + 1 < cols ? x + r + 1 : cols - 1;
+        int drop = x - r > 0 ? x - r : 0;
+
+        out[x * c + ch] = (unsigned char)((sum + width / 2) / width);
+        sum += in[add * c + ch] - in[drop * c + ch];
+      }
+    }
+  }
+
+  return(NULL);
+} // end horizontalPass
+
+
+// box blur the sample columns of the range along y, a row at a time
+static void *verticalPass(void *arg) {
+  FeatherRange *range = (FeatherRange *)arg;
+  int rows = range->rows, r = range->radius;
+  int first = range->first, n = range->last - range->first;
+  long stride = range->cols, width = 2 * r + 1;
+  long *sums = range->sums;
+  int x, y;
+
+  for(x = 0; x < n; x++)
+    sums[x] = (long)(r + 1) * range->input[first + x];
+  for(y = 1; y <= r; y++) {
+    const unsigned char *in = range->input + (y < rows ? y : rows - 1) * stride + first;
+
+    for(x = 0; x < n; x++)
+      sums[x] += in[x];
+  }
+
+  for(y = 0; y < rows; y++) {
+    const unsigned char *add = range->input + (y + r + 1 < rows ? y + r + 1 : rows - 1) * stride + first;
+    const unsigned char *drop = range->input + (y - r > 0 ? y - r : 0) * stride + first;
+    unsigned char *out = range->output + y * stride + first;
+
+    for(x = 0; x < n; x++) {
+      out[x] = (unsigned char)((sums[x] + width / 2) / width);
+      sums[x] += add[x] - drop[x];
+    }
+  }
+
+  return(NULL);
+} // end verticalPass
+
+
+// run one pass with the work split into nthreads ranges of count rows or
+// columns; ranges whose thread could not be started run here
+static void runPass(void *(*pass)(void *), FeatherRange *ranges, int count, int nthreads) {
+  pthread_t threads[MAX_FEATHER_THREADS];
+  int started[MAX_FEATHER_THREADS];
+  int i;
+
+  for(i = 0; i < nthreads; i++) {
+    ranges[i].first = (int)((long)count * i / nthreads);
+    ranges[i].last = (int)((long)count * (i + 1) / nthreads);
+    started[i] = i > 0 && pthread_create(&threads[i], NULL, pass, &ranges[i]) == 0;
+  }
+
+  for(i = 0; i < nthreads; i++) {
+    if(!started[i])
+      pass(&ranges[i]);
+  }
+
+  for(i = 0; i < nthreads; i++) {
+    if(started[i])
+      pthread_join(threads[i], NULL);
+  }
+} // end runPass
+
+
+// Feather a mask of rows x cols pixels with channels samples each, using
+// nthreads threads (0 uses one per processor).  output may be the same as
+// mask.  Returns -1 if memory runs out.
+int featherMask(const unsigned char *mask, unsigned char *output, int rows, int cols,
+                int channels, double sigma, int nthreads) {
+  FeatherRange ranges[MAX_FEATHER_THREADS];
+  long samples = (long)rows * cols * channels;
+  int widths[FEATHER_PASSES];
+  unsigned char *temp;
+  long *sums;
+  int i, p;
+
+  if(sigma <= 0 || rows == 0 || cols == 0) {
+    if(output != mask)
+      memmove(output, mask, samples);
+    return(0);
+  }
+
+  if(nthreads <= 0)
+    nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if(nthreads > MAX_FEATHER_THREADS)
+    nthreads = MAX_FEATHER_THREADS;
+  if(nthreads > rows)
+    nthreads = rows;
+  if(nthreads < 1)
+    nthreads = 1;
+
+  temp = (unsigned char *)malloc(samples);
+  sums = (long *)malloc((long)cols * channels * sizeof(long));
+  if(!temp || !sums) {
+    free(temp);
+    free(sums);
+    return(-1);
+  }
+
+  boxWidths(sigma, widths);
+  for(p = 0; p < FEATHER_PASSES; p++) {
+    for(i = 0; i < nthreads; i++) {
+      ranges[i].rows = rows;
+      ranges[i].cols = cols * channels;
+      ranges[i].channels = channels;
+      ranges[i].radius = widths[p] / 2;
+    }
+
+    // rows into temp
+    for(i = 0; i < nthreads; i++) {
+      ranges[i].input = p == 0 ? mask : output;
+      ranges[i].output = temp;
+    }
+    runPass(horizontalPass, ranges, rows, nthreads);
+
+    // columns back out; each thread sums its own part of the row
+    for(i = 0; i < nthreads; i++) {
+      ranges[i].input = temp;
+      ranges[i].output = output;
+      ranges[i].sums = sums + (long)cols * channels * i / nthreads;
+    }
+    runPass(verticalPass, ranges, cols * channels, nthreads);
+  }
+
+  free(temp);
+  free(sums);
+
+  return(0);
+} // end featherMask
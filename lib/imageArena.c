@@ -0,0 +1,175 @@
+// Arena allocator for frame buffers.  Memory comes from the OS in large
+// blocks, optionally backed by huge pages, and is handed out in 64-byte
+// aligned pieces.  Nothing is freed one buffer at a time: a mark taken before
+// a batch of scratch buffers lets them all be released at once, and the
+// blocks stay mapped (and faulted in) for the next image.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "imageArena.h"
+
+#define HUGE_PAGE (2L << 20)
+
+typedef struct ArenaBlock {
+  unsigned char *base;
+  long size;
+  long start;                   // arena offset of the first byte
+  int huge;                     // mapped with MAP_HUGETLB
+  struct ArenaBlock *next;
+} ArenaBlock;
+
+struct ImageArena {
+  int flags;
+  ArenaBlock *first;
+  ArenaBlock *current;          // block the next allocation comes from
+  long used;                    // arena offset of the next free byte
+  long peak;
+};
+
+
+// map a block of at least size bytes, or return NULL
+static ArenaBlock *mapBlock(long size, int flags) {
+  ArenaBlock *block = (ArenaBlock *)calloc(1, sizeof(ArenaBlock));
+
+  if(!block)
+    return(NULL);
+
+  block->base = MAP_FAILED;
+  block->size = size;
+  if(flags & ARENA_HUGE_PAGES) {
+    block->size = (size + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+#ifdef MAP_HUGETLB
+    // explicit huge pages need a reserved pool, so this often fails
+    block->base = mmap(NULL, block->size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    block->huge = block->base != MAP_FAILED;
+#endif
+  }
+
+  if(block->base == MAP_FAILED)
+    block->base = mmap(NULL, block->size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(block->base == MAP_FAILED) {
+    free(block);
+    return(NULL);
+  }
+
+#ifdef MADV_HUGEPAGE
+  // otherwise ask for transparent huge pages
+  if((flags & ARENA_HUGE_PAGES) && !block->huge)
+    madvise(block->base, block->size, MADV_HUGEPAGE);
+#endif
+
+  return(block);
+} // end mapBlock
+
+
+static void unmapBlocks(ArenaBlock *block) {
+  while(block) {
+    ArenaBlock *next = block->next;
+
+    munmap(block->base, block->size);
+    free(block);
+    block = next;
+  }
+} // end unmapBlocks
+
+
+// Create an arena with room for capacity bytes up front (0 picks one block).
+// The arena grows by further blocks as needed.
+ImageArena *createArena(long capacity, int flags) {
+  ImageArena *arena = (ImageArena *)calloc(1, sizeof(ImageArena));
+
+  if(!arena)
+    return(NULL);
+
+  arena->flags = flags;
+  arena->first = mapBlock(capacity > ARENA_BLOCK ? capacity : ARENA_BLOCK, flags);
+  if(!arena->first) {
+    free(arena);
+    return(NULL);
+  }
+  arena->current = arena->first;
+
+  return(arena);
+} // end createArena
+
+
+// Allocate bytes aligned to ARENA_ALIGN; returns NULL when out of memory.
+// The memory holds whatever the last user left in it.
+void *arenaAlloc(ImageArena *arena, long bytes) {
+  ArenaBlock *block = arena->current;
+  long offset = ((arena->used - block->start) + ARENA_ALIGN - 1) & ~(long)(ARENA_ALIGN - 1);
+
+  if(bytes < 0)
+    return(NULL);
+
+  if(offset + bytes > block->size) {
+    // move on to the next block, replacing the rest of the chain if it is too small
+    if(!block->next || block->next->size < bytes) {
+      ArenaBlock *fresh = mapBlock(bytes > ARENA_BLOCK ? bytes : ARENA_BLOCK, arena->flags);
+
+      if(!fresh)
+        return(NULL);
+      unmapBlocks(block->next);
+      block->next = fresh;
+    }
+    block->next->start = block->start + block->size;
+    block = arena->current = block->next;
+    offset = 0;
+  }
+
+  arena->used = block->start + offset + bytes;
+  if(arena->used > arena->peak)
+    arena->peak = arena->used;
+
+  return(block->base + offset);
+} // end arenaAlloc
+
+
+// allocate a rows x cols frame
+Pixel *arenaPixels(ImageArena *arena, int rows, int cols) {
+  return((Pixel *)arenaAlloc(arena, (long)rows * cols * sizeof(Pixel)));
+} // end arenaPixels
+
+
+// remember the current position so later allocations can be released together
+long arenaMark(ImageArena *arena) {
+  return(arena->used);
+} // end arenaMark
+
+
+// release everything allocated since mark was taken (0 releases everything);
+// the blocks stay mapped for reuse
+void arenaReset(ImageArena *arena, long mark) {
+  ArenaBlock *block = arena->first;
+
+  while(block->next && block->next->start <= mark && block->next->start != 0)
+    block = block->next;
+
+  arena->current = block;
+  arena->used = mark;
+} // end arenaReset
+
+
+// bytes between the start of the arena and the next free byte
+long arenaInUse(ImageArena *arena) {
+  return(arena->used);
+} // end arenaInUse
+
+
+// most bytes ever in use at once
+long arenaPeak(ImageArena *arena) {
+  return(arena->peak);
+} // end arenaPeak
+
+
+void destroyArena(ImageArena *arena) {
+  if(!arena)
+    return;
+
+  unmapBlocks(arena->first);
+  free(arena);
+} // end destroyArena
@@ -0,0 +1,313 @@
+// A cache of decoded images for long-lived processes.  Images and masks are
+// kept on the heap, keyed by file name, and dropped least recently used first
+// once the decoded bytes pass the capacity.  Each lookup checks the file's
+// size and modification time, so an image rewritten on disk is read again.
+// Images handed out are pinned until released, and the cache may be shared
+// by several threads.  A miss publishes a placeholder and decodes with the
+// lock dropped, so other lookups go on meanwhile; those wanting the same
+// file wait for the placeholder instead of decoding it again.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "imageCache.h"
+
+#define CACHE_IMAGE 0
+#define CACHE_MASK 1
+
+typedef struct CacheEntry {
+  char *filename;
+  int kind;
+  struct timespec mtime;
+  off_t size;
+  Pixel *pixels;                // CACHE_IMAGE
+  int rows, cols, colors;
+  AlphaPlane *plane;            // CACHE_MASK
+  long bytes;
+  int users;                    // lookups not yet released
+  int stale;                    // replaced, freed when the last user releases it
+  int loading;                  // still being decoded by the lookup that missed
+  int failed;                   // the decode failed; waiters give up on it
+  struct CacheEntry *prev, *next;
+} CacheEntry;
+
+struct ImageCache {
+  long capacity;
+  CacheEntry *first, *last;     // most to least recently used
+  CacheStats stats;
+  pthread_mutex_t lock;
+  pthread_cond_t loaded;        // a placeholder has finished loading
+};
+
+
+ImageCache *createImageCache(long capacity) {
+  ImageCache *cache = (ImageCache *)calloc(1, sizeof(ImageCache));
+
+  if(!cache)
+    return(NULL);
+
+  cache->capacity = capacity > 0 ? capacity : IMAGE_CACHE_DEFAULT;
+  pthread_mutex_init(&cache->lock, NULL);
+  pthread_cond_init(&cache->loaded, NULL);
+
+  return(cache);
+} // end createImageCache
+
+
+static void unlinkEntry(ImageCache *cache, CacheEntry *entry) {
+  if(entry->prev)
+    entry->prev->next = entry->next;
+  else
+    cache->first = entry->next;
+  if(entry->next)
+    entry->next->prev = entry->prev;
+  else
+    cache->last = entry->prev;
+  entry->prev = entry->next = NULL;
+} // end unlinkEntry
+
+
+static void pushFront(ImageCache *cache, CacheEntry *entry) {
+  entry->prev = NULL;
+  entry->next = cache->first;
+  if(cache->first)
+    cache->first->prev = entry;
+  else
+    cache->last = entry;
+  cache->first = entry;
+} // end pushFront
+
+
+static void freeEntry(ImageCache *cache, CacheEntry *entry) {
+  unlinkEntry(cache, entry);
+  cache->stats.bytes -= entry->bytes;
+  cache->stats.entries--;
+
+  free(entry->pixels);
+  freeAlphaPlane(entry->plane);
+  free(entry->filename);
+  free(entry);
+} // end freeEntry
+
+
+// drop unused entries, oldest first, until the cache is back under capacity
+static void evict(ImageCache *cache) {
+  CacheEntry *entry = cache->last;
+
+  while(entry && cache->stats.bytes > cache->capacity) {
+    CacheEntry *prev = entry->prev;
+
+    if(entry->users == 0) {
+      freeEntry(cache, entry);
+      cache->stats.evictions++;
+    }
+    entry = prev;
+  }
+} // end evict
+
+
+// Read an image into memory that belongs to the cache.  Mapped files are
+// copied out, since a file rewritten while mapped would change under us.
+static int loadEntry(CacheEntry *entry) {
+  long bytes;
+
+  if(entry->kind == CACHE_IMAGE) {
+    const Pixel *mapped = mapPPM(&entry->rows, &entry->cols, &entry->colors, entry->filename);
+
+    if(!mapped)
+      return(-1);
+    bytes = (long)entry->rows * entry->cols * sizeof(Pixel);
+    entry->pixels = (Pixel *)malloc(bytes);
+    if(entry->pixels)
+      memcpy(entry->pixels, mapped, bytes);
+    unmapPPM(mapped);
+    entry->bytes = bytes;
+
+    return(entry->pixels ? 0 : -1);
+  }
+
+  entry->plane = readAlphaPlane(entry->filename);
+  if(!entry->plane)
+    return(-1);
+  bytes = (long)entry->plane->rows * entry->plane->cols * entry->plane->channels;
+  entry->bytes = bytes;
+
+  if(entry->plane->mapped) {
+    unsigned char *owned = (unsigned char *)malloc(bytes);
+
+    if(!owned)
+      return(-1);
+    memcpy(owned, entry->plane->alpha, bytes);
+    if(entry->plane->channels == 1)
+      unmapPGM((const unsigned char *)entry->plane->mapped);
+    else
+      unmapPPM((const Pixel *)entry->plane->mapped);
+    entry->plane->mapped = NULL;
+    entry->plane->owned = owned;
+    entry->plane->alpha = owned;
+  }
+
+  return(0);
+} // end loadEntry
+
+
+// find or load the entry for filename, pinned for the caller
+static CacheEntry *lookup(ImageCache *cache, char *filename, int kind) {
+  CacheEntry *entry;
+  struct stat st;
+  int error;
+
+  if(filename == NULL || !strlen(filename) || stat(filename, &st) != 0)
+    return(NULL);
+
+  pthread_mutex_lock(&cache->lock);
+  for(entry = cache->first; entry; entry = entry->next)
+    if(!entry->stale && entry->kind == kind && strcmp(entry->filename, filename) == 0)
+      break;
+
+  // a file changed since it was read is read again
+  if(entry && (entry->size != st.st_size ||
+               entry->mtime.tv_sec != st.st_mtim.tv_sec ||
+               entry->mtime.tv_nsec != st.st_mtim.tv_nsec)) {
+    if(entry->users == 0)
+      freeEntry(cache, entry);
+    else
+      entry->stale = 1;
+    entry = NULL;
+    cache->stats.reloads++;
+  }
+
+  // another lookup is reading the file; wait for it rather than read it too
+  if(entry) {
+    entry->users++;
+    cache->stats.hits++;
+    while(entry->loading)
+      pthread_cond_wait(&cache->loaded, &cache->lock);
+    if(entry->failed) {
+      if(--entry->users == 0)
+        freeEntry(cache, entry);
+      pthread_mutex_unlock(&cache->lock);
+      return(NULL);
+    }
+    if(!entry->stale) {
+      unlinkEntry(cache, entry);
+      pushFront(cache, entry);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return(entry);
+  }
+
+  cache->stats.misses++;
+  entry = (CacheEntry *)calloc(1, sizeof(CacheEntry));
+  if(entry)
+    entry->filename = strdup(filename);
+  if(!entry || !entry->filename) {
+    free(entry);
+    pthread_mutex_unlock(&cache->lock);
+    return(NULL);
+  }
+  entry->kind = kind;
+  entry->mtime = st.st_mtim;
+  entry->size = st.st_size;
+  entry->users = 1;
+  entry->loading = 1;
+  pushFront(cache, entry);
+  cache->stats.entries++;
+  pthread_mutex_unlock(&cache->lock);
+
+  // decode without the lock, then publish the result to any waiters
+  error = loadEntry(entry);
+
+  pthread_mutex_lock(&cache->lock);
+  entry->loading = 0;
+  if(error) {
+    entry->failed = 1;
+    entry->stale = 1;
+    entry->bytes = 0;
+  }
+  else
+    cache->stats.bytes += entry->bytes;
+  pthread_cond_broadcast(&cache->loaded);
+
+  if(error) {
+    if(--entry->users == 0)
+      freeEntry(cache, entry);
+    entry = NULL;
+  }
+  else
+    evict(cache);
+  pthread_mutex_unlock(&cache->lock);
+
+  return(entry);
+} // end lookup
+
+
+// Return the pixels of a ppm (or any image readPPM reads), read once and kept
+// until evicted.  Call releaseCached when done with them.
+const Pixel *cacheImage(ImageCache *cache, char *filename, int *rows, int *cols,
+                        int *colors) {
+  CacheEntry *entry = lookup(cache, filename, CACHE_IMAGE);
+
+  if(!entry)
+    return(NULL);
+
+  *rows = entry->rows;
+  *cols = entry->cols;
+  *colors = entry->colors;
+
+  return(entry->pixels);
+} // end cacheImage
+
+
+// Return a mask as readAlphaPlane reads it.  Call releaseCached when done.
+const AlphaPlane *cacheMask(ImageCache *cache, char *filename) {
+  CacheEntry *entry = lookup(cache, filename, CACHE_MASK);
+
+  return(entry ? entry->plane : NULL);
+} // end cacheMask
+
+
+// unpin an image or mask from cacheImage or cacheMask
+void releaseCached(ImageCache *cache, const void *image) {
+  CacheEntry *entry;
+
+  if(!image)
+    return;
+
+  pthread_mutex_lock(&cache->lock);
+  // an entry still loading belongs to its loader, which has not handed it out
+  for(entry = cache->first; entry; entry = entry->next)
+    if(entry->users > 0 && !entry->loading &&
+       (image == (const void *)entry->pixels || image == (const void *)entry->plane))
+      break;
+
+  if(entry) {
+    entry->users--;
+    if(entry->users == 0 && entry->stale)
+      freeEntry(cache, entry);
+    else
+      evict(cache);
+  }
+  pthread_mutex_unlock(&cache->lock);
+} // end releaseCached
+
+
+void imageCacheStats(ImageCache *cache, CacheStats *stats) {
+  pthread_mutex_lock(&cache->lock);
+  *stats = cache->stats;
+  pthread_mutex_unlock(&cache->lock);
+} // end imageCacheStats
+
+
+void destroyImageCache(ImageCache *cache) {
+  if(!cache)
+    return;
+
+  while(cache->first)
+    freeEntry(cache, cache->first);
+  pthread_mutex_destroy(&cache->lock);
+  pthread_cond_destroy(&cache->loaded);
+  free(cache);
+} // end destroyImageCache
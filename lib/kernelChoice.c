@@ -0,0 +1,88 @@
+// Choosing between the kernels a module is built with.  Modules keep their
+// own tables of typed kernels and settle which one to use once, under a
+// pthread_once; the walk over the table and the test of the processor's
+// features are the same everywhere and live here.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kernelChoice.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CHOICE_X86 1
+#endif
+
+
+// whether the processor has the length characters of feature, which
+// __builtin_cpu_supports will only take as a literal
+static int hasFeature(const char *feature, size_t length) {
+#ifdef CHOICE_X86
+  __builtin_cpu_init();
+
+#define FEATURE(name)                                                   \
+  if(length == sizeof(name) - 1 && strncmp(feature, name, length) == 0) \
+    return(__builtin_cpu_supports(name) != 0);
+
+  FEATURE("sse2")
+  FEATURE("ssse3")
+  FEATURE("avx2")
+  FEATURE("avx512f")
+  FEATURE("avx512bw")
+#undef FEATURE
+#else
+  (void)feature;
+  (void)length;
+#endif
+
+  return(0);
+} // end hasFeature
+
+
+// whether the processor has every feature the choice needs
+static int canRun(const KernelChoice *choice) {
+  const char *feature = choice->features;
+
+  while(feature && *feature) {
+    size_t length = strcspn(feature, " ");
+
+    if(length > 0 && !hasFeature(feature, length))
+      return(0);
+    feature += length;
+    feature += strspn(feature, " ");
+  }
+
+  return(1);
+} // end canRun
+
+
+static const KernelChoice *entry(const void *table, size_t entrySize, int i) {
+  return((const KernelChoice *)((const char *)table + i * entrySize));
+} // end entry
+
+
+// Index of the first kernel in the table the processor can run.  table
+// holds entries of entrySize bytes, each starting with a KernelChoice.
+int bestKernel(const void *table, size_t entrySize) {
+  int i;
+
+  for(i = 0; entry(table, entrySize, i + 1)->name; i++) {
+    if(canRun(entry(table, entrySize, i)))
+      break;
+  }
+
+  return(i);
+} // end bestKernel
+
+
+// Index of the named kernel, or -1 if it is not in the table or the
+// processor cannot run it.
+int findKernel(const void *table, size_t entrySize, const char *name) {
+  int i;
+
+  for(i = 0; entry(table, entrySize, i)->name; i++) {
+    if(strcmp(entry(table, entrySize, i)->name, name) == 0)
+      return(canRun(entry(table, entrySize, i)) ? i : -1);
+  }
+
+  return(-1);
+} // end findKernel
@@ -0,0 +1,359 @@
+// Colour lookup table keyers.  A key rule, however costly, is evaluated once
+// for every colour of a (possibly quantized) RGB cube and the answers are kept
+// as a bitset, so keying a pixel is one table lookup.  Tables are cached on
+// disk by rule so later runs only read them back.
+//
+// Rules are written as
+//   b, g                          the standard 4/3 ratio rule for that colour
+//   ratio:<b|g>[:ratio[:min]]     key > ratio * both others and key > min
+//   diff:<b|g>[:threshold]        key - each other > threshold
+//   dist:<rgb|ycc>:r,g,b:radius   within radius of the colour r,g,b
+// where a ratio may be given as a fraction such as 4/3.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "keyLUT.h"
+
+#define KEYLUT_MAGIC "KLUT"
+
+
+// read a number, or a fraction a/b; returns the end of it or NULL
+static const char *parseNumber(const char *s, double *value) {
+  char *end;
+  double d;
+
+  *value = strtod(s, &end);
+  if(end == s)
+    return(NULL);
+
+  if(*end == '/') {
+    s = end + 1;
+    d = strtod(s, &end);
+    if(end == s || d == 0)
+      return(NULL);
+    *value /= d;
+  }
+
+  return(end);
+} // end parseNumber
+
+
+// read the key colour at s; returns the end of it or NULL
+static const char *parseKeyColor(const char *s, KeyRule *rule) {
+  if((*s != 'b' && *s != 'g') || (s[1] != '\0' && s[1] != ':'))
+    return(NULL);
+
+  rule->key = *s == 'b' ? 2 : 1;
+  rule->other = *s == 'b' ? 1 : 2;
+
+  return(s + 1);
+} // end parseKeyColor
+
+
+// Parse a rule spec.  Returns 0, or -1 if it is malformed.
+int parseKeyRule(const char *spec, KeyRule *rule) {
+  const char *s;
+  int i;
+
+  memset(rule, 0, sizeof(KeyRule));
+  rule->ratio = 4.0 / 3.0;
+  rule->minimum = 50;
+  rule->threshold = 30;
+
+  if(strncmp(spec, "ratio:", 6) == 0) {
+    rule->type = KEY_RULE_RATIO;
+    if(!(s = parseKeyColor(spec + 6, rule)))
+      return(-1);
+    if(*s == ':' && !(s = parseNumber(s + 1, &rule->ratio)))
+      return(-1);
+    if(*s == ':' && !(s = parseNumber(s + 1, &rule->minimum)))
+      return(-1);
+  }
+  else if(strncmp(spec, "diff:", 5) == 0) {
+    rule->type = KEY_RULE_DIFF;
+    if(!(s = parseKeyColor(spec + 5, rule)))
+      return(-1);
+    if(*s == ':' && !(s = parseNumber(s + 1, &rule->threshold)))
+      return(-1);
+  }
+  else if(strncmp(spec, "dist:", 5) == 0) {
+    rule->type = KEY_RULE_DIST;
+    s = spec + 5;
+    if(strncmp(s, "rgb:", 4) == 0)
+      rule->space = KEY_SPACE_RGB;
+    else if(strncmp(s, "ycc:", 4) == 0)
+      rule->space = KEY_SPACE_YCC;
+    else
+      return(-1);
+    s += 4;
+    for(i = 0; i < 3; i++) {
+      if(!(s = parseNumber(s, &rule->target[i])) || *s != (i < 2 ? ',' : ':'))
+        return(-1);
+      s++;
+    }
+    if(!(s = parseNumber(s, &rule->radius)))
+      return(-1);
+  }
+  else {
+    // a bare key colour is the standard ratio rule
+    rule->type = KEY_RULE_RATIO;
+    s = parseKeyColor(spec, rule);
+  }
+
+  return(s && *s == '\0' ? 0 : -1);
+} // end parseKeyRule
+
+
+// write a rule out in full, so equal rules give equal strings
+static void ruleSpec(const KeyRule *rule, char *spec) {
+  char key = rule->key == 2 ? 'b' : 'g';
+
+  switch(rule->type) {
+  case KEY_RULE_RATIO:
+    snprintf(spec, KEYLUT_SPEC, "ratio:%c:%.17g:%.17g", key, rule->ratio, rule->minimum);
+    break;
+  case KEY_RULE_DIFF:
+    snprintf(spec, KEYLUT_SPEC, "diff:%c:%.17g", key, rule->threshold);
+    break;
+  default:
+    snprintf(spec, KEYLUT_SPEC, "dist:%s:%.9g,%.9g,%.9g:%.9g",
+             rule->space == KEY_SPACE_YCC ? "ycc" : "rgb",
+             rule->target[0], rule->target[1], rule->target[2], rule->radius);
+  }
+} // end ruleSpec
+
+
+// chroma of an RGB colour (BT.601, full range)
+static void chroma(const double *rgb, double *cb, double *cr) {
+  *cb = 128 - 0.168736 * rgb[0] - 0.331264 * rgb[1] + 0.5 * rgb[2];
+  *cr = 128 + 0.5 * rgb[0] - 0.418688 * rgb[1] - 0.081312 * rgb[2];
+} // end chroma
+
+
+// true if the rule keys out the colour
+static int ruleKeys(const KeyRule *rule, const double *rgb) {
+  double k = rgb[rule->key], other = rgb[rule->other], red = rgb[0];
+  double cb, cr, tcb, tcr, d;
+  int i;
+
+  switch(rule->type) {
+  case KEY_RULE_RATIO:
+    return(k > rule->ratio * other && k > rule->ratio * red && k > rule->minimum);
+  case KEY_RULE_DIFF:
+    return(k - other > rule->threshold && k - red > rule->threshold);
+  }
+
+  if(rule->space == KEY_SPACE_YCC) {
+    chroma(rgb, &cb, &cr);
+    chroma(rule->target, &tcb, &tcr);
+    return((cb - tcb) * (cb - tcb) + (cr - tcr) * (cr - tcr) <= rule->radius * rule->radius);
+  }
+
+  for(i = 0, d = 0; i < 3; i++)
+    d += (rgb[i] - rule->target[i]) * (rgb[i] - rule->target[i]);
+
+  return(d <= rule->radius * rule->radius);
+} // end ruleKeys
+
+
+// evaluate the rule at the centre of every cell of the cube
+static void buildTable(KeyLUT *lut) {
+  int side = 1 << lut->bits, shift = 8 - lut->bits;
+  int half = shift ? 1 << (shift - 1) : 0;
+  double rgb[3];
+  long i = 0;
+  int r, g, b;
+
+  memset(lut->table, 0, (lut->entries + 7) / 8);
+  for(r = 0; r < side; r++)
+    for(g = 0; g < side; g++)
+      for(b = 0; b < side; b++, i++) {
+        rgb[0] = (r << shift) + half;
+        rgb[1] = (g << shift) + half;
+        rgb[2] = (b << shift) + half;
+        if(ruleKeys(&lut->rule, rgb))
+          lut->table[i >> 3] |= 1 << (i & 7);
+      }
+} // end buildTable
+
+
+// directory tables are cached in, or NULL when caching is off (KEYLUT_CACHE
+// set but empty)
+static const char *cacheDirectory(char *path, long size) {
+  const char *dir = getenv("KEYLUT_CACHE");
+  const char *home;
+
+  if(dir)
+    return(*dir ? dir : NULL);
+
+  if((dir = getenv("XDG_CACHE_HOME")) && *dir)
+    snprintf(path, size, "%s/imageIO", dir);
+  else if((home = getenv("HOME")) && *home) {
+    snprintf(path, size, "%s/.cache", home);
+    mkdir(path, 0755);
+    snprintf(path, size, "%s/.cache/imageIO", home);
+  }
+  else
+    snprintf(path, size, "/tmp/imageIO-%d", (int)getuid());
+  mkdir(path, 0755);
+
+  return(path);
+} // end cacheDirectory
+
+
+// the cache file for a table and its header line; returns -1 if there is none
+static int cacheFile(const KeyLUT *lut, char *path, long size, char *header, long headerSize) {
+  char dir[1024];
+  const char *base = cacheDirectory(dir, sizeof(dir));
+  unsigned long long hash = 14695981039346656037ULL;
+  const char *p;
+
+  if(!base)
+    return(-1);
+
+  snprintf(header, headerSize, "%s %d %s\n", KEYLUT_MAGIC, lut->bits, lut->spec);
+  for(p = header; *p; p++)
+    hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+  snprintf(path, size, "%s/keylut-%016llx.bin", base, hash);
+
+  return(0);
+} // end cacheFile
+
+
+// read the table from the cache; returns 0 if it was there
+static int loadTable(KeyLUT *lut) {
+  char path[1100], header[KEYLUT_SPEC + 32], line[KEYLUT_SPEC + 32];
+  long bytes = (lut->entries + 7) / 8;
+  FILE *fp;
+  int ok;
+
+  if(cacheFile(lut, path, sizeof(path), header, sizeof(header)) != 0)
+    return(-1);
+  if(!(fp = fopen(path, "rb")))
+    return(-1);
+
+  ok = fgets(line, sizeof(line), fp) && strcmp(line, header) == 0 &&
+       fread(lut->table, 1, bytes, fp) == (size_t)bytes && fgetc(fp) == EOF;
+  fclose(fp);
+
+  return(ok ? 0 : -1);
+} // end loadTable
+
+
+// write the table to the cache, through a temporary file so that readers
+// never see half of one; failing to is not an error
+static void saveTable(const KeyLUT *lut) {
+  char path[1100], temp[1200], header[KEYLUT_SPEC + 32];
+  long bytes = (lut->entries + 7) / 8;
+  FILE *fp;
+  int ok;
+
+  if(cacheFile(lut, path, sizeof(path), header, sizeof(header)) != 0)
+    return;
+  snprintf(temp, sizeof(temp), "%s.%d", path, (int)getpid());
+  if(!(fp = fopen(temp, "wb")))
+    return;
+
+  ok = fputs(header, fp) >= 0 && fwrite(lut->table, 1, bytes, fp) == (size_t)bytes;
+  ok = fclose(fp) == 0 && ok;
+  if(!ok || rename(temp, path) != 0)
+    unlink(temp);
+} // end saveTable
+
+
+// Compile a rule into a table indexed by the top bits of each channel,
+// reading it from the disk cache when it has been built before.  Returns NULL
+// if the rule is malformed.
+KeyLUT *createKeyLUT(const char *spec, int bits) {
+  KeyLUT *lut;
+
+  if(bits < 1 || bits > 8) {
+    fprintf(stderr, "key table bits must be 1 to 8\n");
+    return(NULL);
+  }
+
+  lut = (KeyLUT *)calloc(1, sizeof(KeyLUT));
+  if(!lut)
+    return(NULL);
+
+  if(parseKeyRule(spec, &lut->rule) != 0) {
+    fprintf(stderr, "bad key rule %s\n", spec);
+    free(lut);
+    return(NULL);
+  }
+  ruleSpec(&lut->rule, lut->spec);
+
+  lut->bits = bits;
+  lut->entries = 1L << (3 * bits);
+  lut->table = (unsigned char *)malloc((lut->entries + 7) / 8);
+  if(!lut->table) {
+    free(lut);
+    return(NULL);
+  }
+
+  if(loadTable(lut) == 0)
+    lut->cached = 1;
+  else {
+    buildTable(lut);
+    saveTable(lut);
+  }
+
+  return(lut);
+} // end createKeyLUT
+
+
+// table index of a pixel
+static inline long lutIndex(const KeyLUT *lut, const Pixel *p) {
+  int shift = 8 - lut->bits;
+
+  return(((long)(p->r >> shift) << (2 * lut->bits)) | ((p->g >> shift) << lut->bits) |
+         (p->b >> shift));
+} // end lutIndex
+
+
+static inline int lutKeys(const KeyLUT *lut, const Pixel *p) {
+  long i = lutIndex(lut, p);
+
+  return((lut->table[i >> 3] >> (i & 7)) & 1);
+} // end lutKeys
+
+
+// Build a mask that is black where the table keys the image and white
+// elsewhere, with one (grey) or three (RGB) samples per pixel.
+void keyLUTMask(const KeyLUT *lut, const Pixel *image, unsigned char *mask, long n,
+                int channels) {
+  long i;
+
+  for(i = 0; i < n; i++, mask += channels)
+    mask[0] = mask[channels / 2] = mask[channels - 1] = lutKeys(lut, image + i) ? 0 : 255;
+} // end keyLUTMask
+
+
+// Key and composite in one pass, as chromaKeyComposite does: the foreground
+// where it is not keyed, the background (black when NULL) where it is.
+// output may be the same as either input.
+void keyLUTComposite(const KeyLUT *lut, const Pixel *foreground, const Pixel *background,
+                     Pixel *output, long n) {
+  static const Pixel black = {0, 0, 0};
+  long i;
+
+  for(i = 0; i < n; i++) {
+    if(!lutKeys(lut, foreground + i))
+      output[i] = foreground[i];
+    else
+      output[i] = background ? background[i] : black;
+  }
+} // end keyLUTComposite
+
+
+void freeKeyLUT(KeyLUT *lut) {
+  if(!lut)
+    return;
+
+  free(lut->table);
+  free(lut);
+} // end freeKeyLUT
@@ -0,0 +1,179 @@
+// Mask span analysis.  A blend mask is mostly clear (alpha 0) around a
+// sprite, solid (alpha 255) inside it and partial only along the edges, so
+// each row is reduced once to its solid and edge runs.  Blending then skips
+// the clear pixels, copies the solid runs and blends only the edges.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "blend.h"
+#include "maskSpans.h"
+
+#define SPAN_CLEAR 0
+
+
+// type of the pixel at a
+static inline int pixelType(const unsigned char *a, int channels) {
+  int c, all0 = 1, all255 = 1;
+
+  for(c = 0; c < channels; c++) {
+    all0 &= a[c] == 0;
+    all255 &= a[c] == 255;
+  }
+
+  return(all0 ? SPAN_CLEAR : all255 ? SPAN_SOLID : SPAN_EDGE);
+} // end pixelType
+
+
+// length of the run of pixels from x on that are all of type, checking
+// eight grey samples at a time where it can
+static int runLength(const unsigned char *row, int x, int cols, int channels, int type) {
+  int end = x + 1;
+
+  if(channels == 1 && type != SPAN_EDGE) {
+    uint64_t want = type == SPAN_CLEAR ? 0 : ~(uint64_t)0, word;
+
+    while(end + 8 <= cols) {
+      memcpy(&word, row + end, 8);
+      if(word != want)
+        break;
+      end += 8;
+    }
+  }
+
+  while(end < cols && pixelType(row + (long)end * channels, channels) == type)
+    end++;
+
+  return(end - x);
+} // end runLength
+
+
+static int addSpan(MaskSpans *spans, long *capacity, int start, int length, int type) {
+  if(spans->count == *capacity) {
+    long grown = *capacity ? 2 * *capacity : 1024;
+    MaskSpan *more = (MaskSpan *)realloc(spans->spans, grown * sizeof(MaskSpan));
+
+    if(!more)
+      return(-1);
+    spans->spans = more;
+    *capacity = grown;
+  }
+
+  spans->spans[spans->count].start = start;
+  spans->spans[spans->count].length = length;
+  spans->spans[spans->count].type = type;
+  spans->count++;
+
+  return(0);
+} // end addSpan
+
+
+// Reduce a mask with one (grey) or three (RGB) samples per pixel to its runs.
+// Returns NULL if memory runs out.
+MaskSpans *buildMaskSpans(const unsigned char *alpha, int rows, int cols, int channels) {
+  MaskSpans *spans = (MaskSpans *)calloc(1, sizeof(MaskSpans));
+  long capacity = 0;
+  int x, y;
+
+  if(!spans)
+    return(NULL);
+
+  spans->rows = rows;
+  spans->cols = cols;
+  spans->channels = channels;
+  spans->left = cols;
+  spans->top = rows;
+  spans->rowStart = (long *)malloc((rows + 1L) * sizeof(long));
+  if(!spans->rowStart) {
+    free(spans);
+    return(NULL);
+  }
+
+  for(y = 0; y < rows; y++) {
+    const unsigned char *row = alpha + (long)y * cols * channels;
+
+    spans->rowStart[y] = spans->count;
+    for(x = 0; x < cols;) {
+      int type = pixelType(row + (long)x * channels, channels);
+      int length = runLength(row, x, cols, channels, type);
+
+      if(type != SPAN_CLEAR) {
+        if(addSpan(spans, &capacity, x, length, type) != 0) {
+          freeMaskSpans(spans);
+          return(NULL);
+        }
+        if(type == SPAN_SOLID)
+          spans->solid += length;
+        else
+          spans->edge += length;
+
+        // grow the bounding box
+        if(x < spans->left)
+          spans->left = x;
+        if(x + length > spans->right)
+          spans->right = x + length;
+        if(y < spans->top)
+          spans->top = y;
+        spans->bottom = y + 1;
+      }
+      x += length;
+    }
+  }
+  spans->rowStart[rows] = spans->count;
+
+  // an all clear mask has an empty box
+  if(spans->count == 0)
+    spans->left = spans->right = spans->top = spans->bottom = 0;
+
+  return(spans);
+} // end buildMaskSpans
+
+
+// Blend columns x0 to x1 of mask row y.  foreground and alpha point at the
+// start of that row of the foreground and mask, and output and background
+// are offset so that output[x] is under mask column x.  Clear pixels are
+// copied from the background, or left alone when background is NULL or the
+// output itself.
+void blendSpanRow(const MaskSpans *spans, int y, int x0, int x1, Pixel *output,
+                  const Pixel *foreground, const Pixel *background,
+                  const unsigned char *alpha) {
+  int copy = background && background != output;
+  int channels = spans->channels;
+  int cursor = x0;
+  long s;
+
+  if(!background)
+    background = output;
+
+  for(s = spans->rowStart[y]; s < spans->rowStart[y + 1] && cursor < x1; s++) {
+    const MaskSpan *span = &spans->spans[s];
+    int a = span->start > x0 ? span->start : x0;
+    int b = span->start + span->length < x1 ? span->start + span->length : x1;
+
+    if(b <= a)
+      continue;
+
+    if(copy && a > cursor)
+      memcpy(output + cursor, background + cursor, (a - cursor) * sizeof(Pixel));
+    if(span->type == SPAN_SOLID)
+      memcpy(output + a, foreground + a, (b - a) * sizeof(Pixel));
+    else
+      alphaBlend(output + a, foreground + a, background + a, alpha + (long)a * channels,
+                 channels, b - a);
+    cursor = b;
+  }
+
+  if(copy && x1 > cursor)
+    memcpy(output + cursor, background + cursor, (x1 - cursor) * sizeof(Pixel));
+} // end blendSpanRow
+
+
+void freeMaskSpans(MaskSpans *spans) {
+  if(!spans)
+    return;
+
+  free(spans->rowStart);
+  free(spans->spans);
+  free(spans);
+} // end freeMaskSpans
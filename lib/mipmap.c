@@ -0,0 +1,277 @@
+// Mipmap pyramids.  The levels of an image are kept next to it in one file,
+// the image's name with MIPMAP_EXTENSION appended, holding a raw ppm (or pgm
+// for a grey image) per level, largest first, as netpbm allows several
+// images to a file.  The pyramid is built in one streaming pass over the
+// image: each pair of rows read is averaged into a row of level 1, each pair
+// of those into a row of level 2 and so on, so only a row per level is held
+// and every row is written as soon as it is made.  An odd last row or column
+// is dropped.  A pyramid older than its image, or made for another size, is
+// built again, under a temporary name renamed into place so that no reader
+// sees it half written.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mipmap.h"
+#include "ppmIO.h"
+#include "ppmStream.h"
+
+// longest pyramid file name
+#define MAX_MIPMAP_NAME 4096
+
+typedef struct {
+  int rows, cols;
+  long offset;                  // file offset of the level's first sample
+  unsigned char *pending;       // first row of a pair, waiting for the second
+  int havePending;
+  unsigned char *row;           // row being made
+  int rowsMade;
+} LevelWriter;
+
+
+// halvings before a side of rows x cols would reach zero
+static int levelsFor(int rows, int cols) {
+  int levels = 0;
+
+  while(levels < MAX_MIPMAP_LEVELS && rows >> (levels + 1) > 0 && cols >> (levels + 1) > 0)
+    levels++;
+
+  return(levels);
+} // end levelsFor
+
+
+// Take a row of level l.  The second row of each pair is averaged with the
+// first into a row of level l + 1, which is written and taken in turn.
+// Returns -1 if a write fails.
+static int pushRow(int fd, LevelWriter *level, int l, int levels, int channels,
+                   const unsigned char *row) {
+  LevelWriter *next = &level[l + 1];
+  const unsigned char *above = level[l].pending;
+  long rowBytes;
+  int x, c;
+
+  if(l == levels)
+    return(0);
+  if(!level[l].havePending) {
+    memcpy(level[l].pending, row, (long)level[l].cols * channels);
+    level[l].havePending = 1;
+    return(0);
+  }
+  level[l].havePending = 0;
+  if(next->rowsMade == next->rows)
+    return(0);
+
+  for(x = 0; x < next->cols; x++) {
+    long left = 2L * x * channels, right = left + channels;
+
+    for(c = 0; c < channels; c++)
+      next->row[x * channels + c] =
+        (unsigned char)((above[left + c] + above[right + c] + row[left + c] +
+                         row[right + c] + 2) >> 2);
+  }
+
+  rowBytes = (long)next->cols * channels;
+  if(pwrite(fd, next->row, rowBytes, next->offset + next->rowsMade * rowBytes) != rowBytes)
+    return(-1);
+  next->rowsMade++;
+
+  return(pushRow(fd, level, l + 1, levels, channels, next->row));
+} // end pushRow
+
+
+// Build the pyramid of an image in one pass.  Returns the number of levels
+// below the image, or -1 if the image cannot be read or the pyramid written.
+int buildMipmaps(char *filename) {
+  LevelWriter level[MAX_MIPMAP_LEVELS + 1];
+  char name[MAX_MIPMAP_NAME], temp[MAX_MIPMAP_NAME + 32];
+  unsigned char *band;
+  PPMReader *reader;
+  int rows, cols, colors, channels, levels, l, y, i, n;
+  long offset = 0;
+  int error = 0;
+  int fd;
+
+  if(snprintf(name, sizeof(name), "%s%s", filename, MIPMAP_EXTENSION) >= (int)sizeof(name))
+    return(-1);
+  snprintf(temp, sizeof(temp), "%s.%ld", name, (long)getpid());
+
+  reader = openImageReader(&rows, &cols, &colors, &channels, filename, 0);
+  if(!reader)
+    return(-1);
+
+  levels = levelsFor(rows, cols);
+  memset(level, 0, sizeof(level));
+  band = (unsigned char *)malloc((long)STREAM_BAND_ROWS * cols * channels);
+  fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(!band || fd < 0)
+    error = -1;
+
+  // every level's header goes out first, so rows can be written as made
+  for(l = 0; l <= levels && !error; l++) {
+    level[l].rows = rows >> l;
+    level[l].cols = cols >> l;
+    if(l < levels) {
+      level[l].pending = (unsigned char *)malloc((long)level[l].cols * channels);
+      if(!level[l].pending)
+        error = -1;
+    }
+    if(l > 0) {
+      char header[64];
+      int length = snprintf(header, sizeof(header), "%s\n%d %d\n%d\n",
+                            channels == 1 ? "P5" : "P6", level[l].cols, level[l].rows, colors);
+
+      level[l].row = (unsigned char *)malloc((long)level[l].cols * channels);
+      if(!level[l].row || pwrite(fd, header, length, offset) != length)
+        error = -1;
+      level[l].offset = offset + length;
+      offset = level[l].offset + (long)level[l].rows * level[l].cols * channels;
+    }
+  }
+
+  for(y = 0; y < rows && !error; y += n) {
+    n = rows - y < STREAM_BAND_ROWS ? rows - y : STREAM_BAND_ROWS;
+    if(readImageRows(reader, band, n) != n)
+      error = -1;
+    for(i = 0; i < n && !error; i++)
+      error = pushRow(fd, level, 0, levels, channels, band + (long)i * cols * channels);
+  }
+
+  closePPMReader(reader);
+  for(l = 0; l <= levels; l++) {
+    free(level[l].pending);
+    free(level[l].row);
+  }
+  free(band);
+
+  if(fd >= 0 && close(fd) != 0)
+    error = -1;
+  if(!error && rename(temp, name) != 0)
+    error = -1;
+  if(error && fd >= 0)
+    unlink(temp);
+
+  return(error ? -1 : levels);
+} // end buildMipmaps
+
+
+// map a pyramid file, or return NULL if it is not the pyramid of a rows x
+// cols image
+static Mipmap *mapPyramid(char *name, int rows, int cols) {
+  const unsigned char *buf;
+  Mipmap *mipmap;
+  struct stat st;
+  long pos = 0;
+  int fd, l = 0;
+
+  fd = open(name, O_RDONLY);
+  if(fd < 0)
+    return(NULL);
+  if(fstat(fd, &st) != 0) {
+    close(fd);
+    return(NULL);
+  }
+
+  mipmap = (Mipmap *)calloc(1, sizeof(Mipmap));
+  if(!mipmap) {
+    close(fd);
+    return(NULL);
+  }
+  mipmap->rows[0] = rows;
+  mipmap->cols[0] = cols;
+  mipmap->length = st.st_size;
+  if(mipmap->length > 0) {
+    mipmap->base = mmap(NULL, mipmap->length, PROT_READ, MAP_SHARED, fd, 0);
+    if(mipmap->base == MAP_FAILED)
+      mipmap->base = NULL;
+  }
+  close(fd);
+  if(mipmap->length > 0 && !mipmap->base) {
+    free(mipmap);
+    return(NULL);
+  }
+
+  // each level must be half the one above it
+  buf = (const unsigned char *)mipmap->base;
+  while(pos < mipmap->length) {
+    char magic[3];
+    int num[3], channels;
+    long start = parseNetpbmHeader(buf + pos, mipmap->length - pos, magic, num);
+
+    if(start < 0)
+      break;
+    channels = strcmp(magic, "P5") == 0 ? 1 : strcmp(magic, "P6") == 0 ? 3 : 0;
+    if(channels == 0 || l == MAX_MIPMAP_LEVELS ||
+       (l > 0 && channels != mipmap->channels) ||
+       num[0] != mipmap->cols[l] / 2 || num[1] != mipmap->rows[l] / 2)
+      break;
+
+    l++;
+    mipmap->cols[l] = num[0];
+    mipmap->rows[l] = num[1];
+    mipmap->channels = channels;
+    mipmap->samples[l] = buf + pos + start;
+    pos += start + (long)num[0] * num[1] * channels;
+  }
+  mipmap->levels = l;
+
+  if(pos != mipmap->length || l != levelsFor(rows, cols)) {
+    closeMipmaps(mipmap);
+    return(NULL);
+  }
+
+  return(mipmap);
+} // end mapPyramid
+
+
+// Map the pyramid of a rows x cols image, building it first if it is
+// missing, older than the image or made for another size.  Returns NULL if
+// the image cannot be read or the pyramid written; a pyramid left over from
+// an older image is never mapped, since it may be of the same size.
+Mipmap *openMipmaps(char *filename, int rows, int cols) {
+  char name[MAX_MIPMAP_NAME];
+  struct stat image, pyramid;
+  Mipmap *mipmap;
+
+  if(stat(filename, &image) != 0 ||
+     snprintf(name, sizeof(name), "%s%s", filename, MIPMAP_EXTENSION) >= (int)sizeof(name))
+    return(NULL);
+
+  if(stat(name, &pyramid) != 0 || pyramid.st_mtim.tv_sec < image.st_mtim.tv_sec ||
+     (pyramid.st_mtim.tv_sec == image.st_mtim.tv_sec &&
+      pyramid.st_mtim.tv_nsec < image.st_mtim.tv_nsec)) {
+    if(buildMipmaps(filename) < 0)
+      return(NULL);
+  }
+
+  mipmap = mapPyramid(name, rows, cols);
+  if(!mipmap && buildMipmaps(filename) >= 0)
+    mipmap = mapPyramid(name, rows, cols);
+
+  return(mipmap);
+} // end openMipmaps
+
+
+// the smallest level that is still at least rows x cols, 0 for the image
+int mipmapLevelFor(const Mipmap *mipmap, int rows, int cols) {
+  int level = 0;
+
+  while(level < mipmap->levels && mipmap->rows[level + 1] >= rows &&
+        mipmap->cols[level + 1] >= cols)
+    level++;
+
+  return(level);
+} // end mipmapLevelFor
+
+
+void closeMipmaps(Mipmap *mipmap) {
+  if(!mipmap)
+    return;
+
+  if(mipmap->base)
+    munmap(mipmap->base, mipmap->length);
+  free(mipmap);
+} // end closeMipmaps
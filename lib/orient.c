@@ -0,0 +1,353 @@
+// Image orientation: the rotations by quarter turns and the flips, the
+// eight orientations EXIF describes.  The four that keep rows as rows copy
+// (or reverse) whole rows, reading and writing in order.  The four that turn
+// rows into columns work through the output a square tile of ORIENT_TILE
+// pixels at a time, so the input and output lines a tile touches stay in
+// the cache and TLB rather than every store landing on a new line and page.
+// Inside a tile, blocks of 8 x 8 grey or 4 x 4 RGB pixels are transposed in
+// registers.  The flip that goes with each transpose is only a matter of
+// which input row feeds each block row and which output row each block
+// column goes to, so one block kernel serves all four; it is done with
+// SSSE3 byte shuffles where the processor has them.  Tiles are spread over
+// the thread pool.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "orient.h"
+#include "kernelChoice.h"
+#include "ppmIO.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ORIENT_X86 1
+#endif
+
+// transpose a block of 8 x 8 pixels of one sample or 4 x 4 of three: output
+// row i takes pixel i of each input row in turn
+typedef void (*TransposeKernel)(unsigned char *const *output, const unsigned char *const *input,
+                                int channels);
+
+typedef struct {
+  KernelChoice choice;
+  TransposeKernel kernel;
+} OrientKernelInfo;
+
+typedef struct {
+  const unsigned char *input;
+  unsigned char *output;
+  int rows, cols, newRows, newCols, channels;
+  int orientation;
+  int tilesAcross;
+} OrientJob;
+
+static const char *orientationNames[] = {"none", "fliph", "180", "flipv",
+                                         "transpose", "90", "transverse", "270"};
+
+static pthread_once_t chooseOnce = PTHREAD_ONCE_INIT;
+static const OrientKernelInfo *current;
+
+
+static inline int blockSize(int channels) {
+  return(channels == 1 ? 8 : 4);
+} // end blockSize
+
+
+static void transposeScalar(unsigned char *const *output, const unsigned char *const *input,
+                            int channels) {
+  int n = blockSize(channels), i, k, c;
+
+  for(i = 0; i < n; i++)
+    for(k = 0; k < n; k++)
+      for(c = 0; c < channels; c++)
+        output[i][k * channels + c] = input[k][i * channels + c];
+} // end transposeScalar
+
+
+#ifdef ORIENT_X86
+// grey blocks take three rounds of unpacking: bytes, then pairs, then quads
+__attribute__((target("ssse3")))
+static inline void transposeGrey(unsigned char *const *output, const unsigned char *const *input) {
+  __m128i t0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)input[0]),
+                                 _mm_loadl_epi64((const __m128i *)input[1]));
+  __m128i t1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)input[2]),
+                                 _mm_loadl_epi64((const __m128i *)input[3]));
+  __m128i t2 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)input[4]),
+                                 _mm_loadl_epi64((const __m128i *)input[5]));
+  __m128i t3 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)input[6]),
+                                 _mm_loadl_epi64((const __m128i *)input[7]));
+  __m128i u0 = _mm_unpacklo_epi16(t0, t1), u1 = _mm_unpackhi_epi16(t0, t1);
+  __m128i u2 = _mm_unpacklo_epi16(t2, t3), u3 = _mm_unpackhi_epi16(t2, t3);
+  __m128i v[4];
+  int i;
+
+  v[0] = _mm_unpacklo_epi32(u0, u2);
+  v[1] = _mm_unpackhi_epi32(u0, u2);
+  v[2] = _mm_unpacklo_epi32(u1, u3);
+  v[3] = _mm_unpackhi_epi32(u1, u3);
+  for(i = 0; i < 4; i++) {
+    _mm_storel_epi64((__m128i *)output[2 * i], v[i]);
+    _mm_storel_epi64((__m128i *)output[2 * i + 1], _mm_srli_si128(v[i], 8));
+  }
+} // end transposeGrey
+
+
+// RGB blocks are spread to a pixel per 32 bit lane, transposed as 4 x 4
+// lanes and packed back to three bytes a pixel
+__attribute__((target("ssse3")))
+static inline void transposeRGB(unsigned char *const *output, const unsigned char *const *input) {
+  __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+  __m128i a[4], t0, t1, t2, t3, o[4];
+  int i;
+
+  // twelve bytes a row, so nothing past the block is read
+  for(i = 0; i < 4; i++) {
+    int last;
+
+    memcpy(&last, input[i] + 8, 4);
+    a[i] = _mm_shuffle_epi8(_mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)input[i]),
+                                               _mm_cvtsi32_si128(last)), spread);
+  }
+
+  t0 = _mm_unpacklo_epi32(a[0], a[1]);
+  t1 = _mm_unpacklo_epi32(a[2], a[3]);
+  t2 = _mm_unpackhi_epi32(a[0], a[1]);
+  t3 = _mm_unpackhi_epi32(a[2], a[3]);
+  o[0] = _mm_unpacklo_epi64(t0, t1);
+  o[1] = _mm_unpackhi_epi64(t0, t1);
+  o[2] = _mm_unpacklo_epi64(t2, t3);
+  o[3] = _mm_unpackhi_epi64(t2, t3);
+
+  for(i = 0; i < 4; i++) {
+    __m128i packed = _mm_shuffle_epi8(o[i], pack);
+    int last = _mm_cvtsi128_si32(_mm_srli_si128(packed, 8));
+
+    _mm_storel_epi64((__m128i *)output[i], packed);
+    memcpy(output[i] + 8, &last, 4);
+  }
+} // end transposeRGB
+
+
+__attribute__((target("ssse3")))
+static void transposeSSSE3(unsigned char *const *output, const unsigned char *const *input,
+                           int channels) {
+  if(channels == 1)
+    transposeGrey(output, input);
+  else
+    transposeRGB(output, input);
+} // end transposeSSSE3
+#endif
+
+
+// every kernel built into the library, best first
+static const OrientKernelInfo kernels[] = {
+#ifdef ORIENT_X86
+  {{"ssse3", "ssse3"}, transposeSSSE3},
+#endif
+  {{"scalar", NULL}, transposeScalar},
+  {{NULL, NULL}, NULL}
+};
+
+
+static void chooseKernel(void) {
+  current = &kernels[bestKernel(kernels, sizeof(kernels[0]))];
+} // end chooseKernel
+
+
+// Copy a band of rows, reversing them for the flips about the vertical
+// axis and taking them from the bottom up for those about the horizontal.
+static void flipTask(void *arg, long band) {
+  OrientJob *job = (OrientJob *)arg;
+  int c = job->channels, cols = job->cols;
+  int reverse = job->orientation == ORIENT_FLIP_HORIZONTAL ||
+                job->orientation == ORIENT_ROTATE_180;
+  int upward = job->orientation == ORIENT_ROTATE_180 ||
+               job->orientation == ORIENT_FLIP_VERTICAL;
+  int y = (int)band * ORIENT_TILE, x, s;
+  int last = y + ORIENT_TILE < job->rows ? y + ORIENT_TILE : job->rows;
+
+  for(; y < last; y++) {
+    const unsigned char *in = job->input + (long)(upward ? job->rows - 1 - y : y) * cols * c;
+    unsigned char *out = job->output + (long)y * cols * c;
+
+    if(!reverse)
+      memcpy(out, in, (long)cols * c);
+    else if(c == 3) {
+      const Pixel *from = (const Pixel *)in + cols - 1;
+      Pixel *to = (Pixel *)out;
+
+      for(x = 0; x < cols; x++)
+        *to++ = *from--;
+    }
+    else if(c == 1) {
+      for(x = 0; x < cols; x++)
+        out[x] = in[cols - 1 - x];
+    }
+    else {
+      for(x = 0; x < cols; x++)
+        for(s = 0; s < c; s++)
+          out[x * c + s] = in[(cols - 1 - x) * c + s];
+    }
+  }
+} // end flipTask
+
+
+// Fill one tile of an orientation that swaps rows and columns.  Output row
+// r comes from input column r, or cols - 1 - r when the columns run
+// backwards, and output column k from input row k, or rows - 1 - k.
+static void transposeTask(void *arg, long tile) {
+  OrientJob *job = (OrientJob *)arg;
+  int c = job->channels, n = blockSize(c);
+  int backColumns = job->orientation == ORIENT_TRANSVERSE ||
+                    job->orientation == ORIENT_ROTATE_270;
+  int backRows = job->orientation == ORIENT_ROTATE_90 ||
+                 job->orientation == ORIENT_TRANSVERSE;
+  int top = (int)(tile / job->tilesAcross) * ORIENT_TILE;
+  int left = (int)(tile % job->tilesAcross) * ORIENT_TILE;
+  int bottom = top + ORIENT_TILE < job->newRows ? top + ORIENT_TILE : job->newRows;
+  int right = left + ORIENT_TILE < job->newCols ? left + ORIENT_TILE : job->newCols;
+  int r, k, i, j;
+
+  for(r = top; r < bottom; r += n) {
+    for(k = left; k < right; k += n) {
+      // a whole block: lane i of each input row is input column first + i
+      if(r + n <= bottom && k + n <= right && (c == 1 || c == 3)) {
+        const unsigned char *in[8];
+        unsigned char *out[8];
+        int first = backColumns ? job->cols - r - n : r;
+
+        for(j = 0; j < n; j++) {
+          int row = backRows ? job->rows - 1 - (k + j) : k + j;
+
+          in[j] = job->input + ((long)row * job->cols + first) * c;
+        }
+        for(i = 0; i < n; i++)
+          out[i] = job->output + ((long)(backColumns ? r + n - 1 - i : r + i) * job->newCols + k) * c;
+        current->kernel(out, in, c);
+        continue;
+      }
+
+      // a block cut off by the edge of the tile, a pixel at a time
+      for(i = r; i < r + n && i < bottom; i++) {
+        int column = backColumns ? job->cols - 1 - i : i;
+
+        for(j = k; j < k + n && j < right; j++) {
+          int row = backRows ? job->rows - 1 - j : j;
+
+          memcpy(job->output + ((long)i * job->newCols + j) * c,
+                 job->input + ((long)row * job->cols + column) * c, c);
+        }
+      }
+    }
+  }
+} // end transposeTask
+
+
+// Orientation for a name as orientationName gives it, or for the 0 and 1 of
+// the tools' old rotate flag; -1 if unknown.
+int orientationFor(const char *text) {
+  int i;
+
+  if(strcmp(text, "0") == 0)
+    return(ORIENT_NORMAL);
+  if(strcmp(text, "1") == 0)
+    return(ORIENT_ROTATE_90);
+  for(i = 0; i < 8; i++)
+    if(strcmp(orientationNames[i], text) == 0)
+      return(ORIENT_NORMAL + i);
+
+  return(-1);
+} // end orientationFor
+
+
+const char *orientationName(int orientation) {
+  if(orientation < ORIENT_NORMAL || orientation > ORIENT_ROTATE_270)
+    return(NULL);
+
+  return(orientationNames[orientation - ORIENT_NORMAL]);
+} // end orientationName
+
+
+// size of a rows x cols image once oriented
+void orientedSize(int rows, int cols, int orientation, int *newRows, int *newCols) {
+  int swap = orientation >= ORIENT_TRANSPOSE;
+
+  *newRows = swap ? cols : rows;
+  *newCols = swap ? rows : cols;
+} // end orientedSize
+
+
+// Write an image of rows x cols pixels with channels samples each to output
+// in the given orientation, spreading the work over the pool (which may be
+// NULL).  output is orientedSize and must not overlap the input.  Returns
+// -1 for an unknown orientation.
+int orientImage(ThreadPool *pool, unsigned char *output, const unsigned char *input,
+                int rows, int cols, int channels, int orientation) {
+  OrientJob job;
+
+  if(orientation < ORIENT_NORMAL || orientation > ORIENT_ROTATE_270)
+    return(-1);
+
+  pthread_once(&chooseOnce, chooseKernel);
+
+  job.input = input;
+  job.output = output;
+  job.rows = rows;
+  job.cols = cols;
+  job.channels = channels;
+  job.orientation = orientation;
+  orientedSize(rows, cols, orientation, &job.newRows, &job.newCols);
+
+  if(orientation < ORIENT_TRANSPOSE) {
+    poolFor(pool, (rows + ORIENT_TILE - 1) / ORIENT_TILE, flipTask, &job);
+    return(0);
+  }
+
+  job.tilesAcross = (job.newCols + ORIENT_TILE - 1) / ORIENT_TILE;
+  poolFor(pool, (long)job.tilesAcross * ((job.newRows + ORIENT_TILE - 1) / ORIENT_TILE),
+          transposeTask, &job);
+
+  return(0);
+} // end orientImage
+
+
+// Orient an image into a new buffer from the arena, setting *newRows and
+// *newCols to its size.  Returns NULL if the arena is out of memory or the
+// orientation is unknown.
+unsigned char *orientedCopy(ImageArena *arena, ThreadPool *pool, const unsigned char *input,
+                            int rows, int cols, int channels, int orientation,
+                            int *newRows, int *newCols) {
+  unsigned char *output = arenaAlloc(arena, (long)rows * cols * channels);
+
+  if(!output || orientImage(pool, output, input, rows, cols, channels, orientation) != 0)
+    return(NULL);
+  orientedSize(rows, cols, orientation, newRows, newCols);
+
+  return(output);
+} // end orientedCopy
+
+
+// name of the kernel orientImage uses
+const char *orientKernel(void) {
+  pthread_once(&chooseOnce, chooseKernel);
+
+  return(current->choice.name);
+} // end orientKernel
+
+
+// Switch to the named kernel, for benchmarks and testing.  Returns -1 if it
+// is not built in or the processor cannot run it.
+int useOrientKernel(const char *name) {
+  int i;
+
+  pthread_once(&chooseOnce, chooseKernel);
+
+  i = findKernel(kernels, sizeof(kernels[0]), name);
+  if(i < 0)
+    return(-1);
+  current = &kernels[i];
+
+  return(0);
+} // end useOrientKernel
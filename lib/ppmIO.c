@@ -5,191 +5,1046 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "ppmIO.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #define USECPP 0
 
-// read in rgb values from the ppm file output by cqcam
-Pixel *readPPM(int *rows, int *cols, int * colors, char *filename) {
-   char tag[40];
-   Pixel *image;
-   FILE *fp;
-   int read, num[3], curchar;
-
-   if(filename != NULL && strlen(filename))
-     fp = fopen(filename, "r");
-   else
-     fp = stdin;
-
-   if(fp) {
-     fscanf(fp, "%s\n", tag);
-
-     // Read the "magic number" at the beginning of the ppm
-     if (strncmp(tag, "P6", 40) != 0) {
-       fprintf(stderr, "not a ppm!\n");
-       exit(1);
-     }
-     
-     // Read the rows, columns, and color depth output by cqcam
-     // need to read in three numbers and skip any lines that start with a #
-     read = 0;
-     while(read < 3) {
-       curchar = fgetc(fp);
-       if((char)curchar == '#') { // skip this line
-	 while(fgetc(fp) != '\n')
-	   /* do nothing */;
-       }
-       else {
-	 ungetc(curchar, fp);
-	 fscanf(fp, "%d", &(num[read]));
-	 read++;
-       }
-     }
-     while(fgetc(fp) != '\n')
-       /* pass the last newline character */;
-
-     *cols = num[0];
-     *rows = num[1];
-     *colors = num[2];
-
-     if(*cols > 0 && *rows > 0) {
-#if USECPP
-       image = new Pixel[(*rows) * (*cols)];
+// slots the table of mapped images starts with; it doubles when full
+#define MAPPING_SLOTS 64
+
+// pixels the QOI writer encodes per call
+#define QOI_CHUNK 4096
+
+// bookkeeping for the images handed out by mapPPM/mapPGM, so that unmapping
+// only needs the pixel pointer the caller was given.  Images that had to be
+// decoded are kept on the heap and have no base.  The table is shared by
+// every thread, so it is only touched with mappingLock held.
+typedef struct {
+  const void *data;
+  void *base;
+  size_t length;
+} Mapping;
+
+static Mapping *mappings;
+static int mappingSlots;
+static pthread_mutex_t mappingLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Files written in place of an image and not yet renamed over it.  Any left
+// when the program exits are removed, so an abandoned write leaves nothing
+// beside its target.
+typedef struct Replacement {
+  char *name;
+  struct Replacement *next;
+} Replacement;
+
+static Replacement *replacements;
+static pthread_mutex_t replacementLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t replacementOnce = PTHREAD_ONCE_INIT;
+
+// Parse a netpbm header held in memory: the magic number followed by the
+// width, height and maxval, separated by whitespace, where a # starts a
+// comment that runs to the end of the line.  Returns the offset of the first
+// data byte (one whitespace character after the maxval) or -1 if the header
+// is malformed or truncated.
+long parseNetpbmHeader(const unsigned char *buf, long len, char *magic, int num[3]) {
+  long pos = 2;
+  int read;
+
+  if(len < 2 || buf[0] != 'P')
+    return(-1);
+  magic[0] = buf[0];
+  magic[1] = buf[1];
+  magic[2] = '\0';
+
+  for(read = 0; read < 3; read++) {
+    // skip whitespace and comment lines
+    while(pos < len && (buf[pos] == '#' || buf[pos] == ' ' || buf[pos] == '\t' ||
+                        buf[pos] == '\n' || buf[pos] == '\r')) {
+      if(buf[pos] == '#') {
+        while(pos < len && buf[pos] != '\n')
+          pos++;
+      }
+      else
+        pos++;
+    }
+
+    if(pos >= len || buf[pos] < '0' || buf[pos] > '9')
+      return(-1);
+    num[read] = 0;
+    while(pos < len && buf[pos] >= '0' && buf[pos] <= '9') {
+      if(num[read] > 100000000)
+        return(-1);
+      num[read] = num[read] * 10 + (buf[pos] - '0');
+      pos++;
+    }
+  }
+
+  // a single whitespace character separates the header from the data
+  if(pos >= len)
+    return(-1);
+
+  return(pos + 1);
+} // end parseNetpbmHeader
+
+// Classify 16 bytes of an ASCII raster: bit i of *digits is set when byte i
+// is a decimal digit and bit i of *spaces when it is whitespace.
+#if defined(__SSE2__)
+static void classifyBlock(const unsigned char *p, unsigned int *digits, unsigned int *spaces) {
+  __m128i x = _mm_loadu_si128((const __m128i *)p);
+  __m128i d = _mm_sub_epi8(x, _mm_set1_epi8('0'));
+  __m128i c = _mm_sub_epi8(x, _mm_set1_epi8('\t'));
+
+  // unsigned x < n is min(x, n - 1) == x
+  d = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+  c = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(c, _mm_set1_epi8(4)), c),
+                   _mm_cmpeq_epi8(x, _mm_set1_epi8(' ')));
+
+  *digits = _mm_movemask_epi8(d);
+  *spaces = _mm_movemask_epi8(c);
+} // end classifyBlock
+#elif defined(__aarch64__)
+static void classifyBlock(const unsigned char *p, unsigned int *digits, unsigned int *spaces) {
+  static const unsigned char weights[16] = {1, 2, 4, 8, 16, 32, 64, 128,
+                                            1, 2, 4, 8, 16, 32, 64, 128};
+  uint8x16_t x = vld1q_u8(p);
+  uint8x16_t w = vld1q_u8(weights);
+  uint8x16_t d = vcltq_u8(vsubq_u8(x, vdupq_n_u8('0')), vdupq_n_u8(10));
+  uint8x16_t c = vorrq_u8(vcltq_u8(vsubq_u8(x, vdupq_n_u8('\t')), vdupq_n_u8(5)),
+                          vceqq_u8(x, vdupq_n_u8(' ')));
+
+  d = vandq_u8(d, w);
+  c = vandq_u8(c, w);
+  *digits = vaddv_u8(vget_low_u8(d)) | (vaddv_u8(vget_high_u8(d)) << 8);
+  *spaces = vaddv_u8(vget_low_u8(c)) | (vaddv_u8(vget_high_u8(c)) << 8);
+} // end classifyBlock
 #else
-       image = (Pixel *)malloc(sizeof(Pixel)* (*rows) * (*cols));
+static void classifyBlock(const unsigned char *p, unsigned int *digits, unsigned int *spaces) {
+  int i;
+
+  *digits = *spaces = 0;
+  for(i = 0; i < 16; i++) {
+    if(p[i] >= '0' && p[i] <= '9')
+      *digits |= 1u << i;
+    else if(p[i] == ' ' || (p[i] >= '\t' && p[i] <= '\r'))
+      *spaces |= 1u << i;
+  }
+} // end classifyBlock
 #endif
-       if(image) {
-	 // Read the data
-	 fread(image, sizeof(Pixel), (*rows) * (*cols), fp);
 
-	 if(fp != stdin)
-	   fclose(fp);
 
-	 return(image);
-       }
-     }
+// Parse up to count whitespace separated decimal samples from an ASCII (P2
+// or P3) raster.  Sixteen bytes are classified at a time and the digits of
+// each run are accumulated directly, so whitespace costs nothing.  Returns
+// the number of samples parsed, or -1 on a stray character or a sample with
+// more than five digits.
+long parseASCIISamples(const unsigned char *buf, long len, unsigned short *out, long count) {
+  // digit weights for samples one, two and three digits long
+  static const int scale[4][3] = {{0, 0, 0}, {1, 0, 0}, {10, 1, 0}, {100, 10, 1}};
+  unsigned int value = 0;
+  long pos = 0, n = 0;
+  int ndigits = 0, k;
 
-   }
-   
-   return(NULL);
-     
-} // end read_ppm
+  while(pos + 16 <= len && n < count) {
+    unsigned int digits, spaces;
+    int i = 0;
 
+    classifyBlock(buf + pos, &digits, &spaces);
+    if((digits | spaces) != 0xFFFF)
+      break; // let the scalar loop deal with the odd character
 
+    while(i < 16) {
+      unsigned int rest = digits >> i;
 
-// Write the modified image out as a ppm in the correct format to be read by 
-// read_ppm.  xv will read these properly.
-void writePPM(Pixel *image, int rows, int cols, int colors, char *filename)
-{
+      if(rest & 1) {
+        // ~rest has bit 16 - i set, so the run stops at the block end
+        int run = __builtin_ctz(~rest);
+        const unsigned char *p = buf + pos + i;
+
+        if(!ndigits && run <= 3 && pos + i + 3 <= len) {
+          // a whole sample of up to three digits, combined without branches
+          value = (p[0] - '0') * scale[run][0] + (p[1] - '0') * scale[run][1] +
+                  (p[2] - '0') * scale[run][2];
+          ndigits = run;
+        }
+        else {
+          ndigits += run;
+          if(ndigits > 5)
+            return(-1);
+          for(k = 0; k < run; k++)
+            value = value * 10 + (p[k] - '0');
+        }
+        i += run;
+      }
+      else {
+        if(ndigits) {
+          out[n++] = value > 65535 ? 65535 : value;
+          value = 0;
+          ndigits = 0;
+          if(n == count)
+            return(n);
+        }
+        if(!rest)
+          break;
+        i += __builtin_ctz(rest);
+      }
+    }
+    pos += 16;
+  }
+
+  // finish the last partial block one character at a time
+  for(; pos < len && n < count; pos++) {
+    unsigned char ch = buf[pos];
+
+    if(ch >= '0' && ch <= '9') {
+      if(++ndigits > 5)
+        return(-1);
+      value = value * 10 + (ch - '0');
+    }
+    else if(ch == ' ' || (ch >= '\t' && ch <= '\r')) {
+      if(ndigits) {
+        out[n++] = value > 65535 ? 65535 : value;
+        value = 0;
+        ndigits = 0;
+      }
+    }
+    else
+      return(-1);
+  }
+
+  if(ndigits && n < count)
+    out[n++] = value > 65535 ? 65535 : value;
+
+  return(n);
+} // end parseASCIISamples
+
+
+// Decode a P2, P3, P5 or P6 image held in memory into 8-bit samples, one
+// channel for grey images and three for colour.  Samples are kept as they
+// are when the maxval fits in a byte and rescaled to 0-255 otherwise.
+unsigned char *decodeNetpbm(const unsigned char *buf, long len, int *rows, int *cols,
+                            int *colors, int *channels) {
+  unsigned char *image;
+  unsigned short *samples = NULL;
+  char magic[3];
+  int num[3], maxval;
+  long offset, count, i;
+
+  offset = parseNetpbmHeader(buf, len, magic, num);
+  if(offset < 0 || magic[1] < '2' || magic[1] > '6' || magic[1] == '4') {
+    fprintf(stderr, "not a ppm or pgm!\n");
+    return(NULL);
+  }
+
+  *cols = num[0];
+  *rows = num[1];
+  maxval = num[2];
+  *channels = magic[1] == '3' || magic[1] == '6' ? 3 : 1;
+  if(*cols <= 0 || *rows <= 0 || maxval <= 0 || maxval > 65535) {
+    fprintf(stderr, "bad image header\n");
+    return(NULL);
+  }
+
+  count = (long)(*rows) * (*cols) * (*channels);
+  image = (unsigned char *)malloc(count);
+  if(!image)
+    return(NULL);
+
+  if(magic[1] == '5' || magic[1] == '6') {
+    // binary rasters hold one byte per sample, or two big-endian bytes
+    if(maxval < 256) {
+      if(len - offset < count) {
+        fprintf(stderr, "image data is truncated\n");
+        free(image);
+        return(NULL);
+      }
+      memcpy(image, buf + offset, count);
+    }
+    else {
+      if(len - offset < 2 * count) {
+        fprintf(stderr, "image data is truncated\n");
+        free(image);
+        return(NULL);
+      }
+      for(i = 0; i < count; i++) {
+        long v = (buf[offset + 2 * i] << 8) | buf[offset + 2 * i + 1];
+        image[i] = (unsigned char)((v * 255 + maxval / 2) / maxval);
+      }
+    }
+  }
+  else {
+    samples = (unsigned short *)malloc(sizeof(unsigned short) * count);
+    if(!samples || parseASCIISamples(buf + offset, len - offset, samples, count) != count) {
+      fprintf(stderr, "image data is truncated or malformed\n");
+      free(samples);
+      free(image);
+      return(NULL);
+    }
+    for(i = 0; i < count; i++) {
+      long v = samples[i] > maxval ? maxval : samples[i];
+      image[i] = maxval < 256 ? (unsigned char)v : (unsigned char)((v * 255 + maxval / 2) / maxval);
+    }
+    free(samples);
+  }
+
+  *colors = maxval < 256 ? maxval : 255;
+
+  return(image);
+} // end decodeNetpbm
+
+
+// true when filename ends in .qoi, the extension that selects the QOI codec
+int isQOIFile(char *filename) {
+  size_t n = filename ? strlen(filename) : 0;
+
+  return(n > 4 && strcmp(filename + n - 4, ".qoi") == 0);
+} // end isQOIFile
+
+
+// start a QOI encoder or decoder: black previous pixel, empty index
+void qoiInit(QOIState *state) {
+  memset(state, 0, sizeof(QOIState));
+  state->prev[3] = 255;
+} // end qoiInit
+
+
+// write the 14-byte QOI header for an rgb image
+void qoiHeader(unsigned char *out, int rows, int cols) {
+  memcpy(out, "qoif", 4);
+  out[4] = (cols >> 24) & 255;
+  out[5] = (cols >> 16) & 255;
+  out[6] = (cols >> 8) & 255;
+  out[7] = cols & 255;
+  out[8] = (rows >> 24) & 255;
+  out[9] = (rows >> 16) & 255;
+  out[10] = (rows >> 8) & 255;
+  out[11] = rows & 255;
+  out[12] = 3;  // channels
+  out[13] = 0;  // sRGB with linear alpha
+} // end qoiHeader
+
+
+// Encode n pixels, continuing from the state left by earlier calls, into
+// out, which must have room for QOI_ENCODED_BYTES(n): a run left open by the
+// previous call is closed first, then each pixel takes at most four bytes.
+// A run still open at the end is kept in the state.  Returns the number of
+// bytes written.
+long qoiEncode(QOIState *state, const Pixel *pixels, long n, unsigned char *out) {
+  unsigned char *p = out;
+  long i;
+
+  for(i = 0; i < n; i++) {
+    const Pixel px = pixels[i];
+    unsigned char *prev = state->prev;
+    int hash;
+
+    if(px.r == prev[0] && px.g == prev[1] && px.b == prev[2] && prev[3] == 255) {
+      if(++state->run == 62) {
+        *p++ = QOI_OP_RUN | (state->run - 1);
+        state->run = 0;
+      }
+      continue;
+    }
+
+    if(state->run) {
+      *p++ = QOI_OP_RUN | (state->run - 1);
+      state->run = 0;
+    }
+
+    hash = QOI_HASH(px.r, px.g, px.b, 255);
+    if(state->index[hash][0] == px.r && state->index[hash][1] == px.g &&
+       state->index[hash][2] == px.b && state->index[hash][3] == 255) {
+      *p++ = QOI_OP_INDEX | hash;
+    }
+    else {
+      signed char vr = px.r - prev[0];
+      signed char vg = px.g - prev[1];
+      signed char vb = px.b - prev[2];
+      signed char vgr = vr - vg;
+      signed char vgb = vb - vg;
+
+      state->index[hash][0] = px.r;
+      state->index[hash][1] = px.g;
+      state->index[hash][2] = px.b;
+      state->index[hash][3] = 255;
+
+      if(prev[3] != 255) {
+        *p++ = QOI_OP_RGBA;
+        *p++ = px.r;
+        *p++ = px.g;
+        *p++ = px.b;
+        *p++ = 255;
+      }
+      else if(vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+        *p++ = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+      }
+      else if(vgr > -9 && vgr < 8 && vg > -33 && vg < 32 && vgb > -9 && vgb < 8) {
+        *p++ = QOI_OP_LUMA | (vg + 32);
+        *p++ = (vgr + 8) << 4 | (vgb + 8);
+      }
+      else {
+        *p++ = QOI_OP_RGB;
+        *p++ = px.r;
+        *p++ = px.g;
+        *p++ = px.b;
+      }
+    }
+
+    prev[0] = px.r;
+    prev[1] = px.g;
+    prev[2] = px.b;
+    prev[3] = 255;
+  }
+
+  return(p - out);
+} // end qoiEncode
+
+
+// close any open run and write the end marker; out needs QOI_END_BYTES
+long qoiEncodeEnd(QOIState *state, unsigned char *out) {
+  static const unsigned char end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+  long n = 0;
+
+  if(state->run) {
+    out[n++] = QOI_OP_RUN | (state->run - 1);
+    state->run = 0;
+  }
+  memcpy(out + n, end, 8);
+
+  return(n + 8);
+} // end qoiEncodeEnd
+
+
+// Decode up to n pixels from in, continuing from the state left by earlier
+// calls.  Only whole chunks are consumed, so the caller can refill the input
+// and carry on.  Returns the number of input bytes used and sets *decoded to
+// the number of pixels produced.
+long qoiDecode(QOIState *state, const unsigned char *in, long len, Pixel *pixels, long n,
+               long *decoded) {
+  unsigned char *prev = state->prev;
+  long pos = 0, i;
+
+  for(i = 0; i < n; i++) {
+    if(state->run) {
+      state->run--;
+    }
+    else {
+      int b1, need;
+
+      if(pos >= len)
+        break;
+      b1 = in[pos];
+      need = b1 == QOI_OP_RGB ? 4 : b1 == QOI_OP_RGBA ? 5 : (b1 & 0xC0) == QOI_OP_LUMA ? 2 : 1;
+      if(pos + need > len)
+        break;
+
+      if(b1 == QOI_OP_RGB) {
+        prev[0] = in[pos + 1];
+        prev[1] = in[pos + 2];
+        prev[2] = in[pos + 3];
+      }
+      else if(b1 == QOI_OP_RGBA) {
+        prev[0] = in[pos + 1];
+        prev[1] = in[pos + 2];
+        prev[2] = in[pos + 3];
+        prev[3] = in[pos + 4];
+      }
+      else if((b1 & 0xC0) == QOI_OP_INDEX) {
+        memcpy(prev, state->index[b1], 4);
+      }
+      else if((b1 & 0xC0) == QOI_OP_DIFF) {
+        prev[0] += ((b1 >> 4) & 3) - 2;
+        prev[1] += ((b1 >> 2) & 3) - 2;
+        prev[2] += (b1 & 3) - 2;
+      }
+      else if((b1 & 0xC0) == QOI_OP_LUMA) {
+        int b2 = in[pos + 1];
+        int vg = (b1 & 0x3F) - 32;
+
+        prev[0] += vg - 8 + ((b2 >> 4) & 15);
+        prev[1] += vg;
+        prev[2] += vg - 8 + (b2 & 15);
+      }
+      else {
+        state->run = b1 & 0x3F;
+      }
+      pos += need;
+    }
+
+    memcpy(state->index[QOI_HASH(prev[0], prev[1], prev[2], prev[3])], prev, 4);
+    pixels[i].r = prev[0];
+    pixels[i].g = prev[1];
+    pixels[i].b = prev[2];
+  }
+
+  *decoded = i;
+
+  return(pos);
+} // end qoiDecode
+
+
+// decode a whole QOI image held in memory into rgb pixels
+static unsigned char *decodeQOI(const unsigned char *buf, long len, int *rows, int *cols,
+                                int *colors) {
+  unsigned char *image;
+  QOIState state;
+  long count, decoded;
+
+  if(len < QOI_HEADER_BYTES || memcmp(buf, "qoif", 4) != 0) {
+    fprintf(stderr, "not a qoi image!\n");
+    return(NULL);
+  }
+
+  *cols = (buf[4] << 24) | (buf[5] << 16) | (buf[6] << 8) | buf[7];
+  *rows = (buf[8] << 24) | (buf[9] << 16) | (buf[10] << 8) | buf[11];
+  *colors = 255;
+  if(*cols <= 0 || *rows <= 0)
+    return(NULL);
+
+  count = (long)(*rows) * (*cols);
+  image = (unsigned char *)malloc(count * sizeof(Pixel));
+  if(!image)
+    return(NULL);
+
+  qoiInit(&state);
+  qoiDecode(&state, buf + QOI_HEADER_BYTES, len - QOI_HEADER_BYTES, (Pixel *)image, count,
+            &decoded);
+  if(decoded != count) {
+    fprintf(stderr, "qoi image is truncated\n");
+    free(image);
+    return(NULL);
+  }
+
+  return(image);
+} // end decodeQOI
+
+
+// Encode image as QOI into fp, a few thousand pixels at a time.  Returns the
+// bytes written, or -1.
+static long writeQOI(const unsigned char *image, int channels, long rows, long cols,
+                     FILE *fp) {
+  unsigned char out[QOI_ENCODED_BYTES(QOI_CHUNK)];
+  Pixel grey[QOI_CHUNK];
+  QOIState state;
+  long count = rows * cols, i, j, n, len, bytes;
+
+  qoiHeader(out, rows, cols);
+  if(fwrite(out, 1, QOI_HEADER_BYTES, fp) != QOI_HEADER_BYTES)
+    return(-1);
+  bytes = QOI_HEADER_BYTES;
+
+  qoiInit(&state);
+  for(i = 0; i < count; i += n) {
+    const Pixel *pixels = (const Pixel *)image + i;
+
+    n = count - i < QOI_CHUNK ? count - i : QOI_CHUNK;
+    if(channels == 1) {
+      // QOI has no grey format, so grey is stored as rgb
+      for(j = 0; j < n; j++)
+        grey[j].r = grey[j].g = grey[j].b = image[i + j];
+      pixels = grey;
+    }
+    len = qoiEncode(&state, pixels, n, out);
+    if((long)fwrite(out, 1, len, fp) != len)
+      return(-1);
+    bytes += len;
+  }
+  len = qoiEncodeEnd(&state, out);
+  if((long)fwrite(out, 1, len, fp) != len)
+    return(-1);
+
+  return(bytes + len);
+} // end writeQOI
+
+
+// convert count pixels between one and three channels: grey is spread over
+// rgb, and rgb is reduced to integer Rec. 601 luma, which is exact for grey
+static unsigned char *convertChannels(unsigned char *image, long count, int from, int to) {
+  unsigned char *result;
+  long i;
+
+  if(from == to)
+    return(image);
+
+  result = (unsigned char *)malloc(count * to);
+  if(result) {
+    for(i = 0; i < count; i++) {
+      if(to == 3)
+        result[3 * i] = result[3 * i + 1] = result[3 * i + 2] = image[i];
+      else
+        result[i] = (77 * image[3 * i] + 150 * image[3 * i + 1] + 29 * image[3 * i + 2] + 128) >> 8;
+    }
+  }
+  free(image);
+
+  return(result);
+} // end convertChannels
+
+
+// Read a netpbm or QOI file (or stdin) with the requested number of channels,
+// converting colour to grey or grey to colour when the file holds the other.
+// 8-bit binary images are read straight into the result after the header;
+// anything else is read whole and handed to decodeNetpbm or decodeQOI.
+static unsigned char *readNetpbm(int *rows, int *cols, int *colors, char *filename,
+                                 int want) {
+  unsigned char *buf, *image, *more;
   FILE *fp;
+  char magic[3];
+  int num[3], channels, qoi = 0;
+  long len = 0, size = 4096, offset = -1, n, count;
 
   if(filename != NULL && strlen(filename))
-    fp = fopen(filename, "w");
+    fp = fopen(filename, "r");
   else
-    fp = stdout;
+    fp = stdin;
+  if(!fp)
+    return(NULL);
+
+  buf = (unsigned char *)malloc(size);
+
+  // pull in blocks until the whole header has been seen
+  while(buf && offset < 0 && !qoi) {
+    if(len == size) {
+      more = (unsigned char *)realloc(buf, size * 2);
+      if(!more)
+        break;
+      buf = more;
+      size *= 2;
+    }
+    n = fread(buf + len, 1, size - len, fp);
+    if(n <= 0)
+      break;
+    len += n;
+    qoi = len >= 4 && memcmp(buf, "qoif", 4) == 0;
+    offset = parseNetpbmHeader(buf, len, magic, num);
+  }
+
+  if(!buf || (offset < 0 && !qoi)) {
+    fprintf(stderr, "not a ppm or pgm!\n");
+    free(buf);
+    if(fp != stdin)
+      fclose(fp);
+    return(NULL);
+  }
+
+  channels = !qoi && magic[1] == '6' ? 3 : 1;
+  if(!qoi && (magic[1] == '5' || magic[1] == '6') && channels == want && num[2] > 0 &&
+     num[2] < 256 && num[0] > 0 && num[1] > 0) {
+    // the common case: no parsing and no copy beyond the bytes read with the header
+    *cols = num[0];
+    *rows = num[1];
+    *colors = num[2];
+    count = (long)num[0] * num[1] * channels;
+    image = (unsigned char *)malloc(count);
+    if(image) {
+      n = len - offset < count ? len - offset : count;
+      memcpy(image, buf + offset, n);
+      if((long)fread(image + n, 1, count - n, fp) != count - n) {
+        fprintf(stderr, "image data is truncated\n");
+        free(image);
+        image = NULL;
+      }
+    }
+    free(buf);
+    if(fp != stdin)
+      fclose(fp);
+    return(image);
+  }
+
+  // read the rest of the file and decode it
+  for(;;) {
+    if(len == size) {
+      more = (unsigned char *)realloc(buf, size * 2);
+      if(!more) {
+        free(buf);
+        if(fp != stdin)
+          fclose(fp);
+        return(NULL);
+      }
+      buf = more;
+      size *= 2;
+    }
+    n = fread(buf + len, 1, size - len, fp);
+    if(n <= 0)
+      break;
+    len += n;
+  }
+  if(fp != stdin)
+    fclose(fp);
+
+  if(qoi) {
+    image = decodeQOI(buf, len, rows, cols, colors);
+    channels = 3;
+  }
+  else
+    image = decodeNetpbm(buf, len, rows, cols, colors, &channels);
+  free(buf);
+  if(!image)
+    return(NULL);
+
+  return(convertChannels(image, (long)(*rows) * (*cols), channels, want));
+} // end readNetpbm
+
+
+// read in rgb values from a ppm (P6 or P3) file; pgm files are read as grey
+Pixel *readPPM(int *rows, int *cols, int * colors, char *filename) {
+  return((Pixel *)readNetpbm(rows, cols, colors, filename, 3));
+} // end read_ppm
+
+
+// read in intensity values from a pgm (P5 or P2) file; ppm files are
+// converted to grey
+unsigned char *readPGM(int *rows, int *cols, int *intensities, char *filename) {
+  return(readNetpbm(rows, cols, intensities, filename, 1));
+} // end read_pgm
+
 
-  if(fp) {
-    fprintf(fp, "P6\n");
-    fprintf(fp, "%d %d\n%d\n", cols, rows, colors);
+// remove the replacements still open at exit
+static void removeReplacements(void) {
+  Replacement *r;
 
-    fwrite(image, sizeof(Pixel), rows * cols, fp);
+  pthread_mutex_lock(&replacementLock);
+  for(r = replacements; r; r = r->next)
+    unlink(r->name);
+  pthread_mutex_unlock(&replacementLock);
+} // end removeReplacements
+
+
+static void registerReplacements(void) {
+  atexit(removeReplacements);
+} // end registerReplacements
+
+
+// Open a file to write in place of filename.  A regular or missing filename
+// gets a new file beside it, named in *temp, that only replaces it in
+// finishReplacement; an image still mapped or read from filename is never
+// written over.  A symbolic link has the file it names replaced, and devices
+// and pipes are opened directly, with *temp NULL.  Returns the descriptor,
+// or -1.
+int openReplacement(char *filename, int flags, char **temp) {
+  Replacement *r;
+  struct stat st;
+  char *name, *target;
+  int exists, fd = -1, i;
+
+  *temp = NULL;
+  exists = stat(filename, &st) == 0;
+  if(exists && !S_ISREG(st.st_mode))
+    return(open(filename, flags | O_CREAT | O_TRUNC, 0644));
+
+  pthread_once(&replacementOnce, registerReplacements);
+  target = exists ? realpath(filename, NULL) : NULL;
+  if(!target)
+    target = filename;
+  r = (Replacement *)malloc(sizeof(Replacement));
+  name = (char *)malloc(strlen(target) + 32);
+  if(!r || !name) {
+    free(r);
+    free(name);
+    if(target != filename)
+      free(target);
+    return(-1);
   }
 
-  fclose(fp);
+  // the pid keeps processes apart and O_EXCL threads
+  for(i = 0; i < 100 && fd < 0; i++) {
+    sprintf(name, "%s.%ld.%d", target, (long)getpid(), i);
+    fd = open(name, flags | O_CREAT | O_EXCL, 0644);
+    if(fd < 0 && errno != EEXIST)
+      break;
+  }
+  if(target != filename)
+    free(target);
+  if(fd < 0) {
+    free(r);
+    free(name);
+    return(-1);
+  }
+
+  // an image being replaced keeps its permissions
+  if(exists)
+    fchmod(fd, st.st_mode & 07777);
+
+  r->name = name;
+  pthread_mutex_lock(&replacementLock);
+  r->next = replacements;
+  replacements = r;
+  pthread_mutex_unlock(&replacementLock);
+
+  *temp = name;
+  return(fd);
+} // end openReplacement
+
+
+// Rename the file opened by openReplacement over filename if ok, or remove
+// it; either way temp is freed.  Returns 0 if filename now holds the new file.
+int finishReplacement(char *filename, char *temp, int ok) {
+  Replacement **r, *done;
+  char *target;
+
+  if(!temp)
+    return(ok ? 0 : -1);
+
+  if(ok) {
+    target = realpath(filename, NULL);
+    if(rename(temp, target ? target : filename) != 0)
+      ok = 0;
+    free(target);
+  }
+  if(!ok)
+    unlink(temp);
+
+  pthread_mutex_lock(&replacementLock);
+  for(r = &replacements; *r && (*r)->name != temp; r = &(*r)->next)
+    /* find the file */;
+  if(*r) {
+    done = *r;
+    *r = done->next;
+    free(done);
+  }
+  pthread_mutex_unlock(&replacementLock);
+  free(temp);
+
+  return(ok ? 0 : -1);
+} // end finishReplacement
+
+
+// Write an image of one (grey) or three (rgb) channels as a pgm or ppm, or as
+// QOI when the name ends in .qoi; an empty name writes to stdout.  A file only
+// replaces filename once it is complete.  Returns the bytes written, or -1.
+long writeNetpbm(const unsigned char *image, int channels, long rows, long cols, int maxval,
+                 char *filename) {
+  FILE *fp = stdout;
+  char *temp = NULL;
+  long bytes;
+  int fd;
+
+  if(filename != NULL && strlen(filename)) {
+    fd = openReplacement(filename, O_WRONLY, &temp);
+    fp = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if(!fp) {
+      if(fd >= 0)
+        close(fd);
+      finishReplacement(filename, temp, 0);
+      return(-1);
+    }
+  }
+
+  if(isQOIFile(filename))
+    bytes = writeQOI(image, channels, rows, cols, fp);
+  else {
+    bytes = fprintf(fp, "%s\n%ld %ld\n%d\n", channels == 1 ? "P5" : "P6", cols, rows, maxval);
+    if(bytes < 0 || (long)fwrite(image, channels, rows * cols, fp) != rows * cols)
+      bytes = -1;
+    else
+      bytes += rows * cols * channels;
+  }
 
+  if(fp == stdout) {
+    if(fflush(fp) != 0)
+      bytes = -1;
+  }
+  else {
+    if(fclose(fp) != 0)
+      bytes = -1;
+    if(finishReplacement(filename, temp, bytes >= 0) != 0)
+      bytes = -1;
+  }
+
+  return(bytes);
+} // end writeNetpbm
+
+
+// Write the modified image out as a ppm in the correct format to be read by 
+// read_ppm.  xv will read these properly.  A name ending in .qoi writes QOI.
+void writePPM(Pixel *image, int rows, int cols, int colors, char *filename)
+{
+  writeNetpbm((const unsigned char *)image, 3, rows, cols, colors, filename);
 } // end write_ppm 
 
 
-// Write the modified image out as a pgm in the correct format
+// Write the modified image out as a pgm in the correct format, or as a grey
+// QOI image when the name ends in .qoi
 void writePGM(unsigned char *image, long rows, long cols, int intensities, char *filename)
 {
-  FILE *fp;
+  writeNetpbm(image, 1, rows, cols, intensities, filename);
+} // end write_pgm 
 
-  if(filename != NULL && strlen(filename))
-    fp = fopen(filename, "w");
-  else
-    fp = stdout;
 
-  if(fp) {
-    fprintf(fp, "P5\n");
-    fprintf(fp, "%ld %ld\n%d\n", cols, rows, intensities);
+// Remember an image handed out by mapImage, growing the table when it is
+// full.  Returns 0, or -1 if there is no memory for a larger table.
+static int recordMapping(const void *data, void *base, size_t length) {
+  int slot;
+
+  pthread_mutex_lock(&mappingLock);
+  for(slot = 0; slot < mappingSlots && mappings[slot].data; slot++)
+    /* find a free slot */;
 
-    fwrite(image, sizeof(unsigned char), rows * cols, fp);
+  if(slot == mappingSlots) {
+    int slots = mappingSlots ? 2 * mappingSlots : MAPPING_SLOTS;
+    Mapping *grown = (Mapping *)realloc(mappings, slots * sizeof(Mapping));
+
+    if(!grown) {
+      pthread_mutex_unlock(&mappingLock);
+      fprintf(stderr, "no memory to map another image\n");
+      return(-1);
+    }
+    memset(grown + mappingSlots, 0, (slots - mappingSlots) * sizeof(Mapping));
+    mappings = grown;
+    mappingSlots = slots;
   }
 
-  if(fp != stdout)
-    fclose(fp);
-} // end write_pgm 
+  mappings[slot].data = data;
+  mappings[slot].base = base;
+  mappings[slot].length = length;
+  pthread_mutex_unlock(&mappingLock);
 
+  return(0);
+} // end recordMapping
 
-// read in intensity values from the pgm file
-unsigned char *readPGM(int *rows, int *cols, int *intensities, char *filename) {
-   char tag[40];
-   unsigned char *image;
-   FILE *fp;
-   int read, num[3], curchar;
-
-   if(filename != NULL && strlen(filename))
-     fp = fopen(filename, "r");
-   else
-     fp = stdin;
-
-   if(fp) {
-     fscanf(fp, "%s\n", tag);
-
-     // Read the "magic number" at the beginning of the ppm
-     if (strncmp(tag, "P5", 40) != 0) {
-       fprintf(stderr, "not a ppm!\n");
-       exit(1);
-     }
-     
-     // Read the rows, columns, and color depth output by cqcam
-     // need to read in three numbers and skip any lines that start with a #
-     read = 0;
-     while(read < 3) {
-       curchar = fgetc(fp);
-       if((char)curchar == '#') { // skip this line
-	 while(fgetc(fp) != '\n')
-	   /* do nothing */;
-       }
-       else {
-	 ungetc(curchar, fp);
-	 fscanf(fp, "%d", &(num[read]));
-	 read++;
-       }
-     }
-     while(fgetc(fp) != '\n')
-       /* pass the last newline character */;
-
-     *cols = num[0];
-     *rows = num[1];
-     *intensities = num[2];
-
-     if(*intensities != 255) {
-       printf("Unable to read this file correctly\n");
-       return(NULL);
-     }
-
-     if(*cols > 0 && *rows > 0) {
-#if USECPP
-       image = new unsigned char[(*rows) * (*cols)];
-#else
-       image = (unsigned char *)malloc(sizeof(unsigned char) * (*rows) * (*cols));
-#endif
-       if(image) {
-	 // Read the data
-	 fread(image, sizeof(unsigned char), (*rows) * (*cols), fp);
 
-	 if(fp != stdin)
-	   fclose(fp);
+// Map an image file and locate the pixel data after its header.  A writable
+// mapping is private, so writes go to copies of the pages and never the file.
+static const void *mapImage(int *rows, int *cols, int *colors, char *filename,
+                            const char *tag, int channels, int writable) {
+  struct stat st;
+  unsigned char *base;
+  char magic[3];
+  int num[3], fd;
+  long offset;
+  size_t length;
 
-	 return(image);
-       }
-     }
+  if(filename == NULL || !strlen(filename))
+    return(NULL);
+
+  fd = open(filename, O_RDONLY);
+  if(fd < 0)
+    return(NULL);
+  if(fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return(NULL);
+  }
+
+  length = st.st_size;
+  base = mmap(NULL, length, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+              MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(base == MAP_FAILED)
+    return(NULL);
+
+  offset = parseNetpbmHeader(base, (long)length, magic, num);
+  if(offset < 0 || strcmp(magic, tag) != 0 || num[2] > 255) {
+    // anything but raw 8-bit data is decoded from the mapping instead
+    unsigned char *image;
+    int from = 3;
+
+    if(length >= 4 && memcmp(base, "qoif", 4) == 0)
+      image = decodeQOI(base, (long)length, rows, cols, colors);
+    else
+      image = decodeNetpbm(base, (long)length, rows, cols, colors, &from);
+    munmap(base, length);
+    if(image)
+      image = convertChannels(image, (long)(*rows) * (*cols), from, channels);
+    if(!image)
+      return(NULL);
+
+    if(recordMapping(image, NULL, 0) != 0) {
+      free(image);
+      return(NULL);
+    }
+    return(image);
+  }
+
+  *cols = num[0];
+  *rows = num[1];
+  *colors = num[2];
+
+  if(*cols <= 0 || *rows <= 0 ||
+     (size_t)offset + (size_t)channels * (*rows) * (*cols) > length) {
+    fprintf(stderr, "%s is truncated\n", filename);
+    munmap(base, length);
+    return(NULL);
+  }
+
+  // only a read-only image is usually read straight through
+  if(!writable)
+    madvise(base, length, MADV_SEQUENTIAL);
+
+  if(recordMapping(base + offset, base, length) != 0) {
+    munmap(base, length);
+    return(NULL);
+  }
+
+  return(base + offset);
+} // end mapImage
+
+
+// release a mapping handed out by mapImage
+static void unmapImage(const void *data) {
+  void *base = NULL;
+  size_t length = 0;
+  int slot;
+
+  if(data == NULL)
+    return;
+
+  pthread_mutex_lock(&mappingLock);
+  for(slot = 0; slot < mappingSlots && mappings[slot].data != data; slot++)
+    /* find the image */;
+  if(slot < mappingSlots) {
+    base = mappings[slot].base;
+    length = mappings[slot].length;
+    mappings[slot].data = NULL;
+  }
+  pthread_mutex_unlock(&mappingLock);
+
+  if(slot == mappingSlots)
+    return;
+  if(base)
+    munmap(base, length);
+  else
+    free((void *)data);
+} // end unmapImage
+
+
+// map a P6 file into memory and return a read-only pointer to its pixels,
+// without copying them.  The pointer stays valid until unmapPPM is called.
+// Other formats readPPM understands are decoded into memory instead.
+const Pixel *mapPPM(int *rows, int *cols, int *colors, char *filename) {
+  return((const Pixel *)mapImage(rows, cols, colors, filename, "P6", 3, 0));
+} // end mapPPM
+
+
+// Map a ppm copy-on-write: the pixels may be changed in place, and only the
+// pages written are copied.  The file itself is never modified.  Release the
+// image with unmapPPM.
+Pixel *mapPPMPrivate(int *rows, int *cols, int *colors, char *filename) {
+  return((Pixel *)mapImage(rows, cols, colors, filename, "P6", 3, 1));
+} // end mapPPMPrivate
+
+
+void unmapPPM(const Pixel *image) {
+  unmapImage(image);
+} // end unmapPPM
+
+
+// map a P5 file into memory and return a read-only pointer to its intensities
+const unsigned char *mapPGM(int *rows, int *cols, int *intensities, char *filename) {
+  return((const unsigned char *)mapImage(rows, cols, intensities, filename, "P5", 1, 0));
+} // end mapPGM
 
-   }
-   
-   return(NULL);
-     
-} // end read_pgm
 
+void unmapPGM(const unsigned char *image) {
+  unmapImage(image);
+} // end unmapPGM
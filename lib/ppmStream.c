@@ -0,0 +1,566 @@
+// Row streaming reader and writer for P6 and QOI images; the reader takes
+// P5 as well.  Each stream owns a
+// small ring of bands and a thread that reads ahead of (or writes behind) the
+// caller, so reading, computing and writing overlap and the memory used
+// does not depend on the size of the image.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "ppmStream.h"
+
+// largest header (including comments) the reader will accept
+#define MAX_HEADER 65536
+
+struct PPMReader {
+  int fd;
+  int rows, cols;
+  int channels;                 // 1 for P5, 3 for P6 and QOI
+  int bandRows;
+  int rowsQueued;               // rows handed to the ring by the thread
+  unsigned char *band[STREAM_BANDS];
+  int filled[STREAM_BANDS];     // rows held in each band, 0 when free
+  int head, headRow;            // band and row the caller reads next
+  int tail;                     // band the thread fills next
+  int done, error, stop;
+  unsigned char *pending;       // file bytes read but not yet used
+  long npending;
+  int qoi;                      // the file is QOI rather than P6
+  QOIState state;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+};
+
+struct PPMWriter {
+  int fd;
+  char *filename;               // target the finished file is renamed to
+  char *temp;                   // file being written, NULL if fd is the target
+  int cols;
+  int bandRows;
+  Pixel *band[STREAM_BANDS];
+  int filled[STREAM_BANDS];     // rows waiting to be written, 0 when free
+  int head;                     // band the thread writes next
+  int tail, tailRow;            // band and row the caller fills next
+  int done, error;
+  int qoi;                      // encode the bands as QOI
+  QOIState state;
+  unsigned char *encoded;       // one band after encoding
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+};
+
+
+// read exactly len bytes unless the file ends first; returns bytes read
+static long readFully(int fd, void *buf, long len) {
+  long got = 0, n;
+
+  while(got < len) {
+    n = read(fd, (char *)buf + got, len - got);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      break;
+    got += n;
+  }
+
+  return(got);
+} // end readFully
+
+
+// write all len bytes; returns 0 on success
+static int writeFully(int fd, const void *buf, long len) {
+  long put = 0, n;
+
+  while(put < len) {
+    n = write(fd, (const char *)buf + put, len - put);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      return(-1);
+    put += n;
+  }
+
+  return(0);
+} // end writeFully
+
+
+// decode n QOI pixels into dst, reading more of the file as needed;
+// returns the number of pixels decoded
+static long decodeQOIPixels(PPMReader *reader, Pixel *dst, long n) {
+  long done = 0, got, used, more;
+
+  while(done < n) {
+    used = qoiDecode(&reader->state, reader->pending, reader->npending, dst + done, n - done, &got);
+    memmove(reader->pending, reader->pending + used, reader->npending - used);
+    reader->npending -= used;
+    done += got;
+
+    if(done < n) {
+      more = read(reader->fd, reader->pending + reader->npending, MAX_HEADER - reader->npending);
+      if(more < 0 && errno == EINTR)
+        continue;
+      if(more <= 0)
+        break;
+      reader->npending += more;
+    }
+  }
+
+  return(done);
+} // end decodeQOIPixels
+
+
+// thread that fills the reader's ring one band at a time
+static void *readerThread(void *arg) {
+  PPMReader *reader = (PPMReader *)arg;
+  long rowBytes = (long)reader->cols * reader->channels;
+  int stop;
+
+  while(reader->rowsQueued < reader->rows) {
+    int n = reader->rows - reader->rowsQueued;
+    int slot = reader->tail;
+    unsigned char *dst;
+    long want, got = 0;
+
+    if(n > reader->bandRows)
+      n = reader->bandRows;
+
+    pthread_mutex_lock(&reader->lock);
+    while(reader->filled[slot] && !reader->stop)
+      pthread_cond_wait(&reader->changed, &reader->lock);
+    stop = reader->stop;
+    pthread_mutex_unlock(&reader->lock);
+    if(stop)
+      break;
+
+    // the first band starts with whatever came in along with the header
+    dst = reader->band[slot];
+    want = n * rowBytes;
+    if(reader->qoi)
+      got = decodeQOIPixels(reader, (Pixel *)dst, want / sizeof(Pixel)) * sizeof(Pixel);
+    else {
+      if(reader->npending) {
+        got = reader->npending < want ? reader->npending : want;
+        memcpy(dst, reader->pending, got);
+        memmove(reader->pending, reader->pending + got, reader->npending - got);
+        reader->npending -= got;
+      }
+      got += readFully(reader->fd, dst + got, want - got);
+    }
+
+    pthread_mutex_lock(&reader->lock);
+    if(got < want) {
+      reader->error = 1;
+      n = got / rowBytes;
+    }
+    reader->filled[slot] = n;
+    reader->rowsQueued += n;
+    reader->tail = (slot + 1) % STREAM_BANDS;
+    if(reader->error)
+      reader->done = 1;
+    pthread_cond_broadcast(&reader->changed);
+    pthread_mutex_unlock(&reader->lock);
+
+    if(reader->error)
+      return(NULL);
+  }
+
+  pthread_mutex_lock(&reader->lock);
+  reader->done = 1;
+  pthread_cond_broadcast(&reader->changed);
+  pthread_mutex_unlock(&reader->lock);
+
+  return(NULL);
+} // end readerThread
+
+
+// Open a P5, P6 or QOI file for reading bandRows rows at a time (0 picks the
+// default).  channels is set to 1 for P5 and 3 otherwise.
+PPMReader *openImageReader(int *rows, int *cols, int *colors, int *channels, char *filename,
+                           int bandRows) {
+  PPMReader *reader;
+  unsigned char *header;
+  char magic[3];
+  int num[3], i;
+  long len = 0, offset = -1, n;
+
+  reader = (PPMReader *)calloc(1, sizeof(PPMReader));
+  header = (unsigned char *)malloc(MAX_HEADER);
+  if(!reader || !header) {
+    free(reader);
+    free(header);
+    return(NULL);
+  }
+
+  if(filename != NULL && strlen(filename))
+    reader->fd = open(filename, O_RDONLY);
+  else
+    reader->fd = 0;
+  if(reader->fd < 0) {
+    free(reader);
+    free(header);
+    return(NULL);
+  }
+
+  // read until the whole header is in memory
+  while(offset < 0 && len < MAX_HEADER) {
+    n = read(reader->fd, header + len, MAX_HEADER - len > 4096 ? 4096 : MAX_HEADER - len);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      break;
+    len += n;
+    offset = parseNetpbmHeader(header, len, magic, num);
+    if(len >= QOI_HEADER_BYTES && memcmp(header, "qoif", 4) == 0) {
+      reader->qoi = 1;
+      qoiInit(&reader->state);
+      num[0] = (header[4] << 24) | (header[5] << 16) | (header[6] << 8) | header[7];
+      num[1] = (header[8] << 24) | (header[9] << 16) | (header[10] << 8) | header[11];
+      num[2] = 255;
+      strcpy(magic, "P6");
+      offset = QOI_HEADER_BYTES;
+    }
+  }
+
+  if(offset < 0 || (strcmp(magic, "P6") != 0 && strcmp(magic, "P5") != 0) || num[2] > 255 ||
+     num[0] <= 0 || num[1] <= 0) {
+    fprintf(stderr, "not an 8-bit ppm or pgm!\n");
+    if(reader->fd != 0)
+      close(reader->fd);
+    free(reader);
+    free(header);
+    return(NULL);
+  }
+
+  *cols = reader->cols = num[0];
+  *rows = reader->rows = num[1];
+  *colors = num[2];
+  *channels = reader->channels = magic[1] == '5' ? 1 : 3;
+
+  reader->bandRows = bandRows > 0 ? bandRows : STREAM_BAND_ROWS;
+  reader->pending = header;
+  reader->npending = len - offset;
+  memmove(header, header + offset, reader->npending);
+
+  for(i = 0; i < STREAM_BANDS; i++) {
+    reader->band[i] = (unsigned char *)malloc((long)reader->channels * reader->bandRows * reader->cols);
+    if(!reader->band[i]) {
+      reader->stop = 1;
+      closePPMReader(reader);
+      return(NULL);
+    }
+  }
+
+  pthread_mutex_init(&reader->lock, NULL);
+  pthread_cond_init(&reader->changed, NULL);
+  if(pthread_create(&reader->thread, NULL, readerThread, reader) != 0) {
+    pthread_mutex_destroy(&reader->lock);
+    pthread_cond_destroy(&reader->changed);
+    reader->stop = 1;
+    closePPMReader(reader);
+    return(NULL);
+  }
+
+  return(reader);
+} // end openImageReader
+
+
+// open a P6 or QOI file for reading bandRows rows at a time (0 picks the
+// default)
+PPMReader *openPPMReader(int *rows, int *cols, int *colors, char *filename, int bandRows) {
+  PPMReader *reader;
+  int channels;
+
+  reader = openImageReader(rows, cols, colors, &channels, filename, bandRows);
+  if(reader && channels != 3) {
+    fprintf(stderr, "not a ppm!\n");
+    closePPMReader(reader);
+    return(NULL);
+  }
+
+  return(reader);
+} // end openPPMReader
+
+
+// Copy the next nrows rows of samples into image; returns the number of rows
+// delivered, which is less than nrows only at the end of the image or on a
+// read error.
+int readImageRows(PPMReader *reader, unsigned char *image, int nrows) {
+  long rowBytes = (long)reader->cols * reader->channels;
+  int delivered = 0;
+
+  while(delivered < nrows) {
+    int slot = reader->head;
+    int n;
+
+    pthread_mutex_lock(&reader->lock);
+    while(!reader->filled[slot] && !reader->done)
+      pthread_cond_wait(&reader->changed, &reader->lock);
+    n = reader->filled[slot];
+    pthread_mutex_unlock(&reader->lock);
+    if(!n)
+      break;
+
+    n -= reader->headRow;
+    if(n > nrows - delivered)
+      n = nrows - delivered;
+    memcpy(image + delivered * rowBytes, reader->band[slot] + reader->headRow * rowBytes,
+           n * rowBytes);
+    delivered += n;
+    reader->headRow += n;
+
+    // hand the band back to the thread once it has been used up
+    if(reader->headRow == reader->filled[slot]) {
+      pthread_mutex_lock(&reader->lock);
+      reader->filled[slot] = 0;
+      reader->headRow = 0;
+      reader->head = (slot + 1) % STREAM_BANDS;
+      pthread_cond_broadcast(&reader->changed);
+      pthread_mutex_unlock(&reader->lock);
+    }
+  }
+
+  return(delivered);
+} // end readImageRows
+
+
+int readPPMRows(PPMReader *reader, Pixel *image, int nrows) {
+  return(readImageRows(reader, (unsigned char *)image, nrows));
+} // end readPPMRows
+
+
+void closePPMReader(PPMReader *reader) {
+  int i;
+
+  if(!reader)
+    return;
+
+  // a reader that was never started has stop set already
+  if(!reader->stop) {
+    pthread_mutex_lock(&reader->lock);
+    reader->stop = 1;
+    pthread_cond_broadcast(&reader->changed);
+    pthread_mutex_unlock(&reader->lock);
+    pthread_join(reader->thread, NULL);
+    pthread_mutex_destroy(&reader->lock);
+    pthread_cond_destroy(&reader->changed);
+  }
+
+  if(reader->fd != 0)
+    close(reader->fd);
+  for(i = 0; i < STREAM_BANDS; i++)
+    free(reader->band[i]);
+  free(reader->pending);
+  free(reader);
+} // end closePPMReader
+
+
+// thread that writes the writer's bands as they fill up
+static void *writerThread(void *arg) {
+  PPMWriter *writer = (PPMWriter *)arg;
+  long rowBytes = (long)writer->cols * sizeof(Pixel);
+  int error = 0;
+
+  // error is only set under the lock, as the caller reads it; the thread
+  // keeps its own copy to test between bands
+  for(;;) {
+    int slot = writer->head;
+    int n;
+
+    pthread_mutex_lock(&writer->lock);
+    while(!writer->filled[slot] && !writer->done)
+      pthread_cond_wait(&writer->changed, &writer->lock);
+    n = writer->filled[slot];
+    pthread_mutex_unlock(&writer->lock);
+    if(!n)
+      break;
+
+    if(writer->qoi) {
+      long len = qoiEncode(&writer->state, writer->band[slot], (long)n * writer->cols,
+                           writer->encoded);
+
+      if(!error && writeFully(writer->fd, writer->encoded, len) != 0)
+        error = 1;
+    }
+    else if(!error && writeFully(writer->fd, writer->band[slot], n * rowBytes) != 0)
+      error = 1;
+
+    pthread_mutex_lock(&writer->lock);
+    writer->error = error;
+    writer->filled[slot] = 0;
+    writer->head = (slot + 1) % STREAM_BANDS;
+    pthread_cond_broadcast(&writer->changed);
+    pthread_mutex_unlock(&writer->lock);
+  }
+
+  if(writer->qoi) {
+    long len = qoiEncodeEnd(&writer->state, writer->encoded);
+
+    if(!error && writeFully(writer->fd, writer->encoded, len) != 0) {
+      pthread_mutex_lock(&writer->lock);
+      writer->error = 1;
+      pthread_mutex_unlock(&writer->lock);
+    }
+  }
+
+  return(NULL);
+} // end writerThread
+
+
+// release a writer whose thread is not running, discarding what it wrote
+static void freeWriter(PPMWriter *writer) {
+  int i;
+
+  if(writer->fd != 1) {
+    close(writer->fd);
+    finishReplacement(writer->filename, writer->temp, 0);
+  }
+  free(writer->filename);
+  for(i = 0; i < STREAM_BANDS; i++)
+    free(writer->band[i]);
+  free(writer->encoded);
+  free(writer);
+} // end freeWriter
+
+
+// Open a file for writing bandRows rows at a time (0 picks the default).  A
+// name ending in .qoi is written as QOI, anything else as P6.  The rows go to
+// a file beside filename that replaces it only when closePPMWriter succeeds,
+// so filename may also be an image still being read.
+PPMWriter *openPPMWriter(int rows, int cols, int colors, char *filename, int bandRows) {
+  PPMWriter *writer;
+  char header[64];
+  long headerBytes;
+  int i;
+
+  writer = (PPMWriter *)calloc(1, sizeof(PPMWriter));
+  if(!writer)
+    return(NULL);
+
+  if(filename != NULL && strlen(filename)) {
+    writer->filename = strdup(filename);
+    writer->fd = writer->filename ? openReplacement(filename, O_WRONLY, &writer->temp) : -1;
+  }
+  else
+    writer->fd = 1;
+  if(writer->fd < 0) {
+    free(writer->filename);
+    free(writer);
+    return(NULL);
+  }
+
+  writer->cols = cols;
+  writer->bandRows = bandRows > 0 ? bandRows : STREAM_BAND_ROWS;
+  writer->qoi = isQOIFile(filename);
+  if(writer->qoi) {
+    qoiInit(&writer->state);
+    qoiHeader((unsigned char *)header, rows, cols);
+    headerBytes = QOI_HEADER_BYTES;
+    writer->encoded = (unsigned char *)malloc(QOI_ENCODED_BYTES((long)writer->bandRows * cols) +
+                                              QOI_END_BYTES);
+  }
+  else {
+    sprintf(header, "P6\n%d %d\n%d\n", cols, rows, colors);
+    headerBytes = strlen(header);
+  }
+
+  for(i = 0; i < STREAM_BANDS; i++)
+    writer->band[i] = (Pixel *)malloc(sizeof(Pixel) * writer->bandRows * cols);
+  for(i = 0; i < STREAM_BANDS && writer->band[i]; i++)
+    /* check the allocations */;
+
+  if(i < STREAM_BANDS || (writer->qoi && !writer->encoded) ||
+     writeFully(writer->fd, header, headerBytes) != 0) {
+    freeWriter(writer);
+    return(NULL);
+  }
+
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->changed, NULL);
+  if(pthread_create(&writer->thread, NULL, writerThread, writer) != 0) {
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->changed);
+    freeWriter(writer);
+    return(NULL);
+  }
+
+  return(writer);
+} // end openPPMWriter
+
+
+// queue nrows rows for writing; returns 0 on success
+int writePPMRows(PPMWriter *writer, const Pixel *image, int nrows) {
+  int error;
+
+  while(nrows > 0) {
+    int slot = writer->tail;
+    int n = writer->bandRows - writer->tailRow;
+
+    // wait for the thread to finish with the band we are about to fill
+    if(writer->tailRow == 0) {
+      pthread_mutex_lock(&writer->lock);
+      while(writer->filled[slot])
+        pthread_cond_wait(&writer->changed, &writer->lock);
+      pthread_mutex_unlock(&writer->lock);
+    }
+
+    if(n > nrows)
+      n = nrows;
+    memcpy(writer->band[slot] + (long)writer->tailRow * writer->cols, image,
+           sizeof(Pixel) * n * writer->cols);
+    image += (long)n * writer->cols;
+    nrows -= n;
+    writer->tailRow += n;
+
+    if(writer->tailRow == writer->bandRows) {
+      pthread_mutex_lock(&writer->lock);
+      writer->filled[slot] = writer->tailRow;
+      writer->tail = (slot + 1) % STREAM_BANDS;
+      writer->tailRow = 0;
+      pthread_cond_broadcast(&writer->changed);
+      pthread_mutex_unlock(&writer->lock);
+    }
+  }
+
+  pthread_mutex_lock(&writer->lock);
+  error = writer->error;
+  pthread_mutex_unlock(&writer->lock);
+
+  return(error ? -1 : 0);
+} // end writePPMRows
+
+
+// flush the last partial band, close the file and rename it over the target;
+// returns 0 on success
+int closePPMWriter(PPMWriter *writer) {
+  int error;
+
+  pthread_mutex_lock(&writer->lock);
+  if(writer->tailRow) {
+    while(writer->filled[writer->tail])
+      pthread_cond_wait(&writer->changed, &writer->lock);
+    writer->filled[writer->tail] = writer->tailRow;
+  }
+  writer->done = 1;
+  pthread_cond_broadcast(&writer->changed);
+  pthread_mutex_unlock(&writer->lock);
+
+  pthread_join(writer->thread, NULL);
+  pthread_mutex_destroy(&writer->lock);
+  pthread_cond_destroy(&writer->changed);
+
+  error = writer->error;
+  if(writer->fd != 1 && close(writer->fd) != 0)
+    error = 1;
+  if(writer->fd != 1 && finishReplacement(writer->filename, writer->temp, !error) != 0)
+    error = 1;
+  writer->fd = 1;
+  freeWriter(writer);
+
+  return(error ? -1 : 0);
+} // end closePPMWriter
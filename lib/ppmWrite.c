@@ -0,0 +1,540 @@
+// High throughput writers for ppm and pgm images.  The parallel writer sizes
+// the file up front and has several threads pwrite disjoint row ranges; the
+// asynchronous writer starts writing rows from a background thread as soon as
+// the caller reports them finished, so output overlaps the compute.  Names
+// ending in .qoi are encoded as QOI, which has to be written in order.  Files
+// are written under a temporary name and renamed over the target once
+// complete, since the target may be an input still mapped by the caller.  An
+// existing ppm can also be opened to rewrite just some of its rows.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "ppmWrite.h"
+#include "wallClock.h"
+
+// most threads the parallel writer will start
+#define MAX_WRITE_THREADS 16
+
+// largest single pwrite, so one call cannot stall a thread for too long
+#define WRITE_CHUNK (8L << 20)
+
+// rows the asynchronous writer encodes at a time for QOI output
+#define QOI_ROWS 16
+
+// one thread's share of a parallel write
+typedef struct {
+  int fd;
+  const unsigned char *data;
+  long length;
+  long offset;
+  int error;
+} WriteRange;
+
+struct AsyncWriter {
+  int fd;
+  char *filename;               // target the finished file is renamed to
+  char *temp;                   // file being written, NULL if fd is the target
+  int seekable;
+  const unsigned char *data;
+  long rowBytes;
+  long offset;
+  int rows;
+  int committed;                // rows the caller has finished
+  int written;                  // rows already on their way to the file
+  int error;
+  int qoi;                      // encode the rows as QOI
+  QOIState state;
+  Pixel *rgb;                   // grey rows spread to colour for QOI
+  unsigned char *encoded;       // QOI_ROWS rows after encoding
+  long bytes;                   // QOI bytes written so far
+  double start;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+};
+
+
+// write all len bytes at offset; a negative offset means the file position
+static int pwriteFully(int fd, const unsigned char *buf, long len, long offset) {
+  long n;
+
+  while(len > 0) {
+    n = len < WRITE_CHUNK ? len : WRITE_CHUNK;
+    if(offset >= 0)
+      n = pwrite(fd, buf, n, offset);
+    else
+      n = write(fd, buf, n);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      return(-1);
+    buf += n;
+    len -= n;
+    if(offset >= 0)
+      offset += n;
+  }
+
+  return(0);
+} // end pwriteFully
+
+
+// Create the replacement for filename, write the header and reserve room for
+// the data.  Returns the descriptor and sets the offset of the first data
+// byte and the name to pass to finishReplacement, or returns -1.
+static int createImageFile(char *filename, const char *magic, int rows, int cols,
+                           int maxval, int channels, long *offset, char **temp) {
+  char header[64];
+  long length;
+  int fd;
+
+  sprintf(header, "%s\n%d %d\n%d\n", magic, cols, rows, maxval);
+  *offset = strlen(header);
+  length = *offset + (long)rows * cols * channels;
+
+  fd = openReplacement(filename, O_RDWR, temp);
+  if(fd < 0)
+    return(-1);
+
+#ifdef __linux__
+  if(posix_fallocate(fd, 0, length) != 0 && ftruncate(fd, length) != 0) {
+#else
+  if(ftruncate(fd, length) != 0) {
+#endif
+    close(fd);
+    finishReplacement(filename, *temp, 0);
+    return(-1);
+  }
+
+  if(pwriteFully(fd, (const unsigned char *)header, *offset, 0) != 0) {
+    close(fd);
+    finishReplacement(filename, *temp, 0);
+    return(-1);
+  }
+
+  return(fd);
+} // end createImageFile
+
+
+static void *writeRangeThread(void *arg) {
+  WriteRange *range = (WriteRange *)arg;
+
+  range->error = pwriteFully(range->fd, range->data, range->length, range->offset);
+  return(NULL);
+} // end writeRangeThread
+
+
+static int writeParallel(const unsigned char *data, int rows, int cols, int maxval,
+                         char *filename, const char *magic, int channels, int nthreads,
+                         WriteStats *stats) {
+  pthread_t threads[MAX_WRITE_THREADS];
+  WriteRange ranges[MAX_WRITE_THREADS];
+  int started[MAX_WRITE_THREADS];
+  long rowBytes = (long)cols * channels;
+  long offset;
+  char *temp;
+  double start = wallSeconds();
+  int fd, i, error;
+
+  if(nthreads <= 0)
+    nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if(nthreads > MAX_WRITE_THREADS)
+    nthreads = MAX_WRITE_THREADS;
+  if(nthreads > rows)
+    nthreads = rows;
+  if(nthreads < 1)
+    nthreads = 1;
+
+  fd = createImageFile(filename, magic, rows, cols, maxval, channels, &offset, &temp);
+  if(fd < 0)
+    return(-1);
+
+  // split the rows evenly; the calling thread takes the first range
+  for(i = 0; i < nthreads; i++) {
+    int first = (int)((long)rows * i / nthreads);
+    int last = (int)((long)rows * (i + 1) / nthreads);
+
+    ranges[i].fd = fd;
+    ranges[i].data = data + first * rowBytes;
+    ranges[i].length = (last - first) * rowBytes;
+    ranges[i].offset = offset + first * rowBytes;
+    ranges[i].error = 0;
+    started[i] = i > 0 && pthread_create(&threads[i], NULL, writeRangeThread, &ranges[i]) == 0;
+  }
+
+  // ranges whose thread could not be started are written here
+  for(i = 0; i < nthreads; i++) {
+    if(!started[i])
+      writeRangeThread(&ranges[i]);
+  }
+
+  error = 0;
+  for(i = 0; i < nthreads; i++) {
+    if(started[i])
+      pthread_join(threads[i], NULL);
+    error |= ranges[i].error;
+  }
+
+  if(close(fd) != 0)
+    error = -1;
+  if(finishReplacement(filename, temp, !error) != 0)
+    error = -1;
+
+  if(stats) {
+    stats->bytes = offset + rows * rowBytes;
+    stats->seconds = wallSeconds() - start;
+  }
+
+  return(error ? -1 : 0);
+} // end writeParallel
+
+
+// Write a ppm using nthreads threads (0 uses one per processor).  Writing to
+// stdout or to a QOI file falls back to writeNetpbm since neither can be
+// written out of order.  Returns 0 on success.
+int writePPMParallel(const Pixel *image, int rows, int cols, int colors, char *filename,
+                     int nthreads, WriteStats *stats) {
+  if(filename == NULL || !strlen(filename) || isQOIFile(filename)) {
+    double start = wallSeconds();
+    long bytes = writeNetpbm((const unsigned char *)image, 3, rows, cols, colors, filename);
+
+    if(stats) {
+      stats->bytes = bytes < 0 ? 0 : bytes;
+      stats->seconds = wallSeconds() - start;
+    }
+    return(bytes < 0 ? -1 : 0);
+  }
+
+  return(writeParallel((const unsigned char *)image, rows, cols, colors, filename, "P6",
+                       sizeof(Pixel), nthreads, stats));
+} // end writePPMParallel
+
+
+int writePGMParallel(const unsigned char *image, int rows, int cols, int intensities,
+                     char *filename, int nthreads, WriteStats *stats) {
+  if(filename == NULL || !strlen(filename) || isQOIFile(filename)) {
+    double start = wallSeconds();
+    long bytes = writeNetpbm(image, 1, rows, cols, intensities, filename);
+
+    if(stats) {
+      stats->bytes = bytes < 0 ? 0 : bytes;
+      stats->seconds = wallSeconds() - start;
+    }
+    return(bytes < 0 ? -1 : 0);
+  }
+
+  return(writeParallel(image, rows, cols, intensities, filename, "P5", 1, nthreads, stats));
+} // end writePGMParallel
+
+
+// encode rows first to last onto the end of a QOI file; returns 0 on success
+static int writeQOIRows(AsyncWriter *writer, int first, int last) {
+  long cols = writer->rgb ? writer->rowBytes : writer->rowBytes / (long)sizeof(Pixel);
+  long len, i;
+  int n;
+
+  for(; first < last; first += n) {
+    const Pixel *pixels = (const Pixel *)(writer->data + first * writer->rowBytes);
+
+    n = last - first < QOI_ROWS ? last - first : QOI_ROWS;
+    if(writer->rgb) {
+      const unsigned char *grey = writer->data + first * writer->rowBytes;
+
+      for(i = 0; i < n * cols; i++)
+        writer->rgb[i].r = writer->rgb[i].g = writer->rgb[i].b = grey[i];
+      pixels = writer->rgb;
+    }
+
+    len = qoiEncode(&writer->state, pixels, n * cols, writer->encoded);
+    if(last == writer->rows && first + n == last)
+      len += qoiEncodeEnd(&writer->state, writer->encoded + len);
+    if(pwriteFully(writer->fd, writer->encoded, len, -1) != 0)
+      return(-1);
+    writer->bytes += len;
+  }
+
+  return(0);
+} // end writeQOIRows
+
+
+// background thread that writes rows as they are committed
+static void *asyncThread(void *arg) {
+  AsyncWriter *writer = (AsyncWriter *)arg;
+
+  for(;;) {
+    int first, last;
+
+    pthread_mutex_lock(&writer->lock);
+    while(writer->written == writer->committed)
+      pthread_cond_wait(&writer->changed, &writer->lock);
+    first = writer->written;
+    last = writer->committed;
+    pthread_mutex_unlock(&writer->lock);
+
+    if(writer->qoi) {
+      if(!writer->error && writeQOIRows(writer, first, last) != 0)
+        writer->error = 1;
+    }
+    else if(!writer->error &&
+       pwriteFully(writer->fd, writer->data + first * writer->rowBytes,
+                   (last - first) * writer->rowBytes,
+                   writer->seekable ? writer->offset + first * writer->rowBytes : -1) != 0)
+      writer->error = 1;
+
+    pthread_mutex_lock(&writer->lock);
+    writer->written = last;
+    pthread_mutex_unlock(&writer->lock);
+
+    if(last == writer->rows)
+      break;
+  }
+
+  return(NULL);
+} // end asyncThread
+
+
+static AsyncWriter *beginWrite(const unsigned char *data, int rows, int cols, int maxval,
+                               char *filename, const char *magic, int channels) {
+  AsyncWriter *writer;
+  char header[64];
+
+  writer = (AsyncWriter *)calloc(1, sizeof(AsyncWriter));
+  if(!writer)
+    return(NULL);
+
+  writer->start = wallSeconds();
+  writer->data = data;
+  writer->rows = rows;
+  writer->rowBytes = (long)cols * channels;
+
+  if(isQOIFile(filename)) {
+    // QOI is a stream of chunks, so it is written in order like stdout
+    writer->qoi = 1;
+    qoiInit(&writer->state);
+    qoiHeader((unsigned char *)header, rows, cols);
+    writer->offset = writer->bytes = QOI_HEADER_BYTES;
+    writer->encoded = (unsigned char *)malloc(QOI_ENCODED_BYTES((long)QOI_ROWS * cols) +
+                                              QOI_END_BYTES);
+    if(channels == 1)
+      writer->rgb = (Pixel *)malloc(sizeof(Pixel) * QOI_ROWS * cols);
+    writer->fd = openReplacement(filename, O_WRONLY, &writer->temp);
+    writer->seekable = 1;
+    if(writer->fd >= 0 && (!writer->encoded || (channels == 1 && !writer->rgb) ||
+                           pwriteFully(writer->fd, (const unsigned char *)header,
+                                       QOI_HEADER_BYTES, -1) != 0)) {
+      close(writer->fd);
+      finishReplacement(filename, writer->temp, 0);
+      writer->fd = -1;
+    }
+  }
+  else if(filename != NULL && strlen(filename)) {
+    writer->fd = createImageFile(filename, magic, rows, cols, maxval, channels, &writer->offset,
+                                 &writer->temp);
+    writer->seekable = 1;
+  }
+  else {
+    // stdout gets the rows in order with plain writes
+    writer->fd = 1;
+    sprintf(header, "%s\n%d %d\n%d\n", magic, cols, rows, maxval);
+    writer->offset = strlen(header);
+    if(pwriteFully(1, (const unsigned char *)header, writer->offset, -1) != 0)
+      writer->fd = -1;
+  }
+
+  if(writer->fd >= 0 && writer->seekable && !(writer->filename = strdup(filename))) {
+    close(writer->fd);
+    finishReplacement(filename, writer->temp, 0);
+    writer->fd = -1;
+  }
+
+  if(writer->fd < 0) {
+    free(writer->encoded);
+    free(writer->rgb);
+    free(writer);
+    return(NULL);
+  }
+
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->changed, NULL);
+  if(pthread_create(&writer->thread, NULL, asyncThread, writer) != 0) {
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->changed);
+    if(writer->seekable) {
+      close(writer->fd);
+      finishReplacement(writer->filename, writer->temp, 0);
+    }
+    free(writer->filename);
+    free(writer->encoded);
+    free(writer->rgb);
+    free(writer);
+    return(NULL);
+  }
+
+  return(writer);
+} // end beginWrite
+
+
+// Start writing image to filename in the background.  The image memory must
+// stay valid until endWrite; rows are written once passed to commitRows, and
+// filename is only replaced when endWrite succeeds.
+AsyncWriter *beginPPMWrite(const Pixel *image, int rows, int cols, int colors, char *filename) {
+  return(beginWrite((const unsigned char *)image, rows, cols, colors, filename, "P6",
+                    sizeof(Pixel)));
+} // end beginPPMWrite
+
+
+AsyncWriter *beginPGMWrite(const unsigned char *image, int rows, int cols, int intensities,
+                           char *filename) {
+  return(beginWrite(image, rows, cols, intensities, filename, "P5", 1));
+} // end beginPGMWrite
+
+
+// tell the writer that the first rows rows of the image are final
+void commitRows(AsyncWriter *writer, int rows) {
+  if(rows > writer->rows)
+    rows = writer->rows;
+
+  pthread_mutex_lock(&writer->lock);
+  if(rows > writer->committed) {
+    writer->committed = rows;
+    pthread_cond_signal(&writer->changed);
+  }
+  pthread_mutex_unlock(&writer->lock);
+} // end commitRows
+
+
+// commit any remaining rows, wait for them to reach the file, close it and
+// rename it over the target.  Returns 0 on success.
+int endWrite(AsyncWriter *writer, WriteStats *stats) {
+  int error;
+
+  commitRows(writer, writer->rows);
+  pthread_join(writer->thread, NULL);
+  pthread_mutex_destroy(&writer->lock);
+  pthread_cond_destroy(&writer->changed);
+
+  error = writer->error;
+  if(writer->seekable && close(writer->fd) != 0)
+    error = 1;
+  if(writer->seekable && finishReplacement(writer->filename, writer->temp, !error) != 0)
+    error = 1;
+
+  if(stats) {
+    stats->bytes = writer->qoi ? writer->bytes : writer->offset + writer->rows * writer->rowBytes;
+    stats->seconds = wallSeconds() - writer->start;
+  }
+
+  free(writer->filename);
+  free(writer->encoded);
+  free(writer->rgb);
+  free(writer);
+
+  return(error ? -1 : 0);
+} // end endWrite
+
+
+// read all len bytes at offset
+static int preadFully(int fd, unsigned char *buf, long len, long offset) {
+  long n;
+
+  while(len > 0) {
+    n = pread(fd, buf, len, offset);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      return(-1);
+    buf += n;
+    len -= n;
+    offset += n;
+  }
+
+  return(0);
+} // end preadFully
+
+
+// Open an existing raw ppm to rewrite some of its rows in place, or return
+// NULL if it is missing or not a complete 8-bit P6 file.
+PPMUpdate *openPPMUpdate(char *filename) {
+  unsigned char header[256];
+  PPMUpdate *file;
+  struct stat st;
+  char magic[3];
+  int num[3], fd;
+  long n;
+
+  fd = open(filename, O_RDWR);
+  if(fd < 0)
+    return(NULL);
+
+  n = pread(fd, header, sizeof(header), 0);
+  n = n > 0 ? parseNetpbmHeader(header, n, magic, num) : -1;
+  if(n < 0 || strcmp(magic, "P6") != 0 || num[2] > 255 || num[0] <= 0 || num[1] <= 0 ||
+     fstat(fd, &st) != 0 || st.st_size < n + (long)num[0] * num[1] * sizeof(Pixel)) {
+    close(fd);
+    return(NULL);
+  }
+
+  file = (PPMUpdate *)malloc(sizeof(PPMUpdate));
+  if(!file) {
+    close(fd);
+    return(NULL);
+  }
+  file->fd = fd;
+  file->cols = num[0];
+  file->rows = num[1];
+  file->colors = num[2];
+  file->offset = n;
+
+  return(file);
+} // end openPPMUpdate
+
+
+// read nrows rows starting at row first; returns 0 on success
+int readPPMRowsAt(PPMUpdate *file, Pixel *image, int first, int nrows) {
+  long rowBytes = (long)file->cols * sizeof(Pixel);
+
+  if(first < 0 || nrows < 0 || first + nrows > file->rows)
+    return(-1);
+
+  return(preadFully(file->fd, (unsigned char *)image, nrows * rowBytes,
+                    file->offset + first * rowBytes));
+} // end readPPMRowsAt
+
+
+// overwrite nrows rows starting at row first; returns 0 on success
+int writePPMRowsAt(PPMUpdate *file, const Pixel *image, int first, int nrows) {
+  long rowBytes = (long)file->cols * sizeof(Pixel);
+
+  if(first < 0 || nrows < 0 || first + nrows > file->rows)
+    return(-1);
+
+  return(pwriteFully(file->fd, (const unsigned char *)image, nrows * rowBytes,
+                     file->offset + first * rowBytes));
+} // end writePPMRowsAt
+
+
+int closePPMUpdate(PPMUpdate *file) {
+  int error;
+
+  if(!file)
+    return(0);
+
+  error = close(file->fd);
+  free(file);
+
+  return(error ? -1 : 0);
+} // end closePPMUpdate
+
+
+// achieved bandwidth in megabytes per second
+double writeBandwidth(const WriteStats *stats) {
+  if(stats->seconds <= 0)
+    return(0);
+
+  return(stats->bytes / (1024.0 * 1024.0) / stats->seconds);
+} // end writeBandwidth
@@ -0,0 +1,497 @@
+// Image resampling with box, bilinear and Lanczos-3 filters.  An image is
+// resized by a horizontal pass into a buffer of newCols wide rows and then a
+// vertical pass out to newRows rows.  Each pass takes its weights from a
+// table built once per call: for every output column (or row), the first
+// input it reads and RESAMPLE_BITS fixed point weights summing to exactly
+// one, the filter widened when shrinking so it covers every input pixel.
+// Sums are 32 bit integers rounded back to 8 bits after each pass, so the
+// vector kernels give the same results as the scalar one.  The vertical
+// pass, where the taps are whole rows, has SSE2 and AVX2 kernels; the
+// horizontal pass gathers taps per pixel and has only an SSE2 one.  Bands
+// of rows are spread over the thread pool.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "resample.h"
+#include "kernelChoice.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RESAMPLE_X86 1
+#endif
+
+#define RESAMPLE_ROUND (1 << (RESAMPLE_BITS - 1))
+
+typedef struct {
+  int *first;                   // first input read by each output
+  int *count;                   // inputs each output reads
+  short *weights;               // stride per output, zero padded
+  int stride;                   // a multiple of 8
+} ResampleTable;
+
+// resample a row of cols pixels to newCols along x
+typedef void (*RowKernel)(unsigned char *output, const unsigned char *input, int cols,
+                          int newCols, int channels, const ResampleTable *table);
+
+// weigh taps rows of samples, stride bytes apart, into one row
+typedef void (*ColumnKernel)(unsigned char *output, const unsigned char *input, long stride,
+                             const short *weights, int taps, long samples);
+
+typedef struct {
+  KernelChoice choice;
+  RowKernel row;
+  ColumnKernel column;
+} ResampleKernelInfo;
+
+typedef struct {
+  const unsigned char *input;
+  unsigned char *temp, *output;
+  int rows, cols, newRows, newCols, channels;
+  int firstRow, lastRow;        // input rows the vertical pass reads
+  ResampleTable across, down;
+} ResampleJob;
+
+static const char *filterNames[] = {"nearest", "box", "bilinear", "lanczos3", NULL};
+
+static pthread_once_t chooseOnce = PTHREAD_ONCE_INIT;
+static const ResampleKernelInfo *current;
+
+
+static double boxFilter(double x) {
+  return(x > -0.5 && x <= 0.5 ? 1.0 : 0.0);
+} // end boxFilter
+
+
+static double triangleFilter(double x) {
+  if(x < 0)
+    x = -x;
+
+  return(x < 1.0 ? 1.0 - x : 0.0);
+} // end triangleFilter
+
+
+static double sinc(double x) {
+  if(x == 0.0)
+    return(1.0);
+  x *= M_PI;
+
+  return(sin(x) / x);
+} // end sinc
+
+
+static double lanczosFilter(double x) {
+  return(x > -3.0 && x < 3.0 ? sinc(x) * sinc(x / 3) : 0.0);
+} // end lanczosFilter
+
+
+static void freeTable(ResampleTable *table) {
+  free(table->first);
+  free(table->count);
+  free(table->weights);
+} // end freeTable
+
+
+// Weights taking inSize samples to outSize.  Output i is centred on input
+// (i + 0.5) * inSize / outSize; rounding may leave the fixed point weights a
+// little off one, and the largest takes up the difference so flat areas stay
+// flat.  Returns -1 if memory runs out.
+static int buildTable(ResampleTable *table, int inSize, int outSize, int filter) {
+  double (*f)(double) = filter == RESAMPLE_BOX ? boxFilter :
+                        filter == RESAMPLE_BILINEAR ? triangleFilter : lanczosFilter;
+  double support = filter == RESAMPLE_BOX ? 0.5 : filter == RESAMPLE_BILINEAR ? 1.0 : 3.0;
+  double scale = (double)inSize / outSize, filterScale = scale > 1.0 ? scale : 1.0;
+  double *w;
+  int i, k;
+
+  support *= filterScale;
+  table->stride = ((int)ceil(support) * 2 + 1 + 7) & ~7;
+  table->first = (int *)malloc(outSize * sizeof(int));
+  table->count = (int *)malloc(outSize * sizeof(int));
+  table->weights = (short *)calloc((long)outSize * table->stride, sizeof(short));
+  w = (double *)malloc(table->stride * sizeof(double));
+  if(!table->first || !table->count || !table->weights || !w) {
+    free(w);
+    return(-1);
+  }
+
+  for(i = 0; i < outSize; i++) {
+    double center = (i + 0.5) * scale, total = 0;
+    int first = (int)(center - support + 0.5), last = (int)(center + support + 0.5);
+    short *fixed = table->weights + (long)i * table->stride;
+    int n, sum = 0, big = 0;
+
+    if(first < 0)
+      first = 0;
+    if(last > inSize)
+      last = inSize;
+    n = last - first;
+
+    for(k = 0; k < n; k++) {
+      w[k] = f((first + k - center + 0.5) / filterScale);
+      total += w[k];
+    }
+    for(k = 0; k < n; k++) {
+      fixed[k] = (short)floor(w[k] / total * (1 << RESAMPLE_BITS) + 0.5);
+      sum += fixed[k];
+      if(fixed[k] > fixed[big])
+        big = k;
+    }
+    fixed[big] += (1 << RESAMPLE_BITS) - sum;
+
+    table->first[i] = first;
+    table->count[i] = n;
+  }
+
+  free(w);
+  return(0);
+} // end buildTable
+
+
+static inline unsigned char clampSample(int sum) {
+  sum >>= RESAMPLE_BITS;
+
+  return((unsigned char)(sum < 0 ? 0 : sum > 255 ? 255 : sum));
+} // end clampSample
+
+
+// one output pixel of a row
+static inline void pixelScalar(unsigned char *output, const unsigned char *input,
+                               int channels, const short *weights, int n) {
+  int c, k;
+
+  for(c = 0; c < channels; c++) {
+    int sum = RESAMPLE_ROUND;
+
+    for(k = 0; k < n; k++)
+      sum += input[k * channels + c] * weights[k];
+    output[c] = clampSample(sum);
+  }
+} // end pixelScalar
+
+
+static void rowScalar(unsigned char *output, const unsigned char *input, int cols,
+                      int newCols, int channels, const ResampleTable *table) {
+  int x;
+
+  for(x = 0; x < newCols; x++)
+    pixelScalar(output + x * channels, input + table->first[x] * channels, channels,
+                table->weights + (long)x * table->stride, table->count[x]);
+} // end rowScalar
+
+
+static void columnScalar(unsigned char *output, const unsigned char *input, long stride,
+                         const short *weights, int taps, long samples) {
+  long i;
+  int k;
+
+  for(i = 0; i < samples; i++) {
+    int sum = RESAMPLE_ROUND;
+
+    for(k = 0; k < taps; k++)
+      sum += input[k * stride + i] * weights[k];
+    output[i] = clampSample(sum);
+  }
+} // end columnScalar
+
+
+#ifdef RESAMPLE_X86
+// two weights for _mm_madd_epi16, the first in the low half
+static inline int weightPair(short a, short b) {
+  return((int)((unsigned short)a | (unsigned)(unsigned short)b << 16));
+} // end weightPair
+
+
+// four samples widened to 16 bits
+__attribute__((target("sse2")))
+static inline __m128i load4(const unsigned char *p) {
+  int v;
+
+  memcpy(&v, p, 4);
+  return(_mm_unpacklo_epi8(_mm_cvtsi32_si128(v), _mm_setzero_si128()));
+} // end load4
+
+
+// A grey pixel takes eight taps per multiply against the zero padded
+// weights; an RGB one holds its samples and a spare in four 32 bit lanes and
+// takes two taps per multiply.  Both read a little past their last tap, so
+// the pixels at the end of the row are left to the scalar loop.
+__attribute__((target("sse2")))
+static void rowSSE2(unsigned char *output, const unsigned char *input, int cols,
+                    int newCols, int channels, const ResampleTable *table) {
+  __m128i zero = _mm_setzero_si128();
+  int x, k;
+
+  for(x = 0; x < newCols; x++) {
+    const unsigned char *in = input + table->first[x] * channels;
+    const short *w = table->weights + (long)x * table->stride;
+    int n = table->count[x];
+    __m128i sum;
+
+    if(channels == 1 && table->first[x] + ((n + 7) & ~7) <= cols) {
+      sum = zero;
+      for(k = 0; k < n; k += 8)
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(
+                              _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(in + k)), zero),
+                              _mm_loadu_si128((const __m128i *)(w + k))));
+      sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+      sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+      output[x] = clampSample(_mm_cvtsi128_si32(sum) + RESAMPLE_ROUND);
+    }
+    else if(channels == 3 && table->first[x] + n < cols) {
+      int v;
+
+      sum = _mm_set1_epi32(RESAMPLE_ROUND);
+      for(k = 0; k + 1 < n; k += 2)
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_unpacklo_epi16(load4(in + 3 * k),
+                                                                   load4(in + 3 * k + 3)),
+                                                _mm_set1_epi32(weightPair(w[k], w[k + 1]))));
+      if(k < n)
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_unpacklo_epi16(load4(in + 3 * k), zero),
+                                                _mm_set1_epi32(weightPair(w[k], 0))));
+      sum = _mm_srai_epi32(sum, RESAMPLE_BITS);
+      sum = _mm_packs_epi32(sum, sum);
+      v = _mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+      memcpy(output + 3 * x, &v, 3);
+    }
+    else
+      pixelScalar(output + x * channels, in, channels, w, n);
+  }
+} // end rowSSE2
+
+
+// Sixteen samples at a time: the bytes of two rows are interleaved so each
+// multiply weighs a pair of taps.
+__attribute__((target("sse2")))
+static void columnSSE2(unsigned char *output, const unsigned char *input, long stride,
+                       const short *weights, int taps, long samples) {
+  __m128i zero = _mm_setzero_si128(), round = _mm_set1_epi32(RESAMPLE_ROUND);
+  long i;
+  int k;
+
+  for(i = 0; i + 16 <= samples; i += 16) {
+    __m128i s0 = round, s1 = round, s2 = round, s3 = round;
+
+    for(k = 0; k < taps; k += 2) {
+      const unsigned char *p = input + k * stride + i;
+      int pair = k + 1 < taps;
+      __m128i a = _mm_loadu_si128((const __m128i *)p);
+      __m128i b = pair ? _mm_loadu_si128((const __m128i *)(p + stride)) : zero;
+      __m128i w = _mm_set1_epi32(weightPair(weights[k], pair ? weights[k + 1] : 0));
+      __m128i lo = _mm_unpacklo_epi8(a, b), hi = _mm_unpackhi_epi8(a, b);
+
+      s0 = _mm_add_epi32(s0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), w));
+      s1 = _mm_add_epi32(s1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), w));
+      s2 = _mm_add_epi32(s2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), w));
+      s3 = _mm_add_epi32(s3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), w));
+    }
+
+    s0 = _mm_packs_epi32(_mm_srai_epi32(s0, RESAMPLE_BITS), _mm_srai_epi32(s1, RESAMPLE_BITS));
+    s2 = _mm_packs_epi32(_mm_srai_epi32(s2, RESAMPLE_BITS), _mm_srai_epi32(s3, RESAMPLE_BITS));
+    _mm_storeu_si128((__m128i *)(output + i), _mm_packus_epi16(s0, s2));
+  }
+
+  columnScalar(output + i, input + i, stride, weights, taps, samples - i);
+} // end columnSSE2
+
+
+// the same on 32 samples; unpacking and packing both stay within 128-bit
+// lanes, so the samples come back out in order
+__attribute__((target("avx2")))
+static void columnAVX2(unsigned char *output, const unsigned char *input, long stride,
+                       const short *weights, int taps, long samples) {
+  __m256i zero = _mm256_setzero_si256(), round = _mm256_set1_epi32(RESAMPLE_ROUND);
+  long i;
+  int k;
+
+  for(i = 0; i + 32 <= samples; i += 32) {
+    __m256i s0 = round, s1 = round, s2 = round, s3 = round;
+
+    for(k = 0; k < taps; k += 2) {
+      const unsigned char *p = input + k * stride + i;
+      int pair = k + 1 < taps;
+      __m256i a = _mm256_loadu_si256((const __m256i *)p);
+      __m256i b = pair ? _mm256_loadu_si256((const __m256i *)(p + stride)) : zero;
+      __m256i w = _mm256_set1_epi32(weightPair(weights[k], pair ? weights[k + 1] : 0));
+      __m256i lo = _mm256_unpacklo_epi8(a, b), hi = _mm256_unpackhi_epi8(a, b);
+
+      s0 = _mm256_add_epi32(s0, _mm256_madd_epi16(_mm256_unpacklo_epi8(lo, zero), w));
+      s1 = _mm256_add_epi32(s1, _mm256_madd_epi16(_mm256_unpackhi_epi8(lo, zero), w));
+      s2 = _mm256_add_epi32(s2, _mm256_madd_epi16(_mm256_unpacklo_epi8(hi, zero), w));
+      s3 = _mm256_add_epi32(s3, _mm256_madd_epi16(_mm256_unpackhi_epi8(hi, zero), w));
+    }
+
+    s0 = _mm256_packs_epi32(_mm256_srai_epi32(s0, RESAMPLE_BITS),
+                            _mm256_srai_epi32(s1, RESAMPLE_BITS));
+    s2 = _mm256_packs_epi32(_mm256_srai_epi32(s2, RESAMPLE_BITS),
+                            _mm256_srai_epi32(s3, RESAMPLE_BITS));
+    _mm256_storeu_si256((__m256i *)(output + i), _mm256_packus_epi16(s0, s2));
+  }
+
+  columnSSE2(output + i, input + i, stride, weights, taps, samples - i);
+} // end columnAVX2
+#endif
+
+
+// every kernel built into the library, best first
+static const ResampleKernelInfo kernels[] = {
+#ifdef RESAMPLE_X86
+  {{"avx2", "avx2"}, rowSSE2, columnAVX2},
+  {{"sse2", "sse2"}, rowSSE2, columnSSE2},
+#endif
+  {{"scalar", NULL}, rowScalar, columnScalar},
+  {{NULL, NULL}, NULL, NULL}
+};
+
+
+static void chooseKernel(void) {
+  current = &kernels[bestKernel(kernels, sizeof(kernels[0]))];
+} // end chooseKernel
+
+
+// resample a band of input rows along x into temp
+static void acrossTask(void *arg, long band) {
+  ResampleJob *job = (ResampleJob *)arg;
+  long rowBytes = (long)job->newCols * job->channels;
+  int y = job->firstRow + (int)band * RESAMPLE_BAND;
+  int last = y + RESAMPLE_BAND < job->lastRow ? y + RESAMPLE_BAND : job->lastRow;
+
+  for(; y < last; y++)
+    current->row(job->temp + (y - job->firstRow) * rowBytes,
+                 job->input + (long)y * job->cols * job->channels, job->cols, job->newCols,
+                 job->channels, &job->across);
+} // end acrossTask
+
+
+// resample a band of output rows along y out of temp
+static void downTask(void *arg, long band) {
+  ResampleJob *job = (ResampleJob *)arg;
+  long rowBytes = (long)job->newCols * job->channels;
+  int y = (int)band * RESAMPLE_BAND;
+  int last = y + RESAMPLE_BAND < job->newRows ? y + RESAMPLE_BAND : job->newRows;
+
+  for(; y < last; y++)
+    current->column(job->output + y * rowBytes,
+                    job->temp + (job->down.first[y] - job->firstRow) * rowBytes, rowBytes,
+                    job->down.weights + (long)y * job->down.stride, job->down.count[y],
+                    rowBytes);
+} // end downTask
+
+
+// pick the input pixel under the centre of each output pixel
+static void nearestTask(void *arg, long band) {
+  ResampleJob *job = (ResampleJob *)arg;
+  int c = job->channels;
+  int y = (int)band * RESAMPLE_BAND, x;
+  int last = y + RESAMPLE_BAND < job->newRows ? y + RESAMPLE_BAND : job->newRows;
+
+  for(; y < last; y++) {
+    const unsigned char *in = job->input +
+      ((2L * y + 1) * job->rows / (2L * job->newRows)) * job->cols * c;
+    unsigned char *out = job->output + (long)y * job->newCols * c;
+
+    for(x = 0; x < job->newCols; x++)
+      memcpy(out + x * c, in + ((2L * x + 1) * job->cols / (2L * job->newCols)) * c, c);
+  }
+} // end nearestTask
+
+
+// filter number for a name, or -1
+int resampleFilter(const char *name) {
+  int i;
+
+  for(i = 0; filterNames[i]; i++)
+    if(strcmp(filterNames[i], name) == 0)
+      return(i);
+
+  return(-1);
+} // end resampleFilter
+
+
+const char *resampleFilterName(int filter) {
+  if(filter < RESAMPLE_NEAREST || filter > RESAMPLE_LANCZOS3)
+    return(NULL);
+
+  return(filterNames[filter]);
+} // end resampleFilterName
+
+
+// Resample an image of rows x cols pixels with channels samples each to
+// newRows x newCols in output, spreading bands of rows over the pool (which
+// may be NULL).  Returns -1 for a bad size or filter or if memory runs out.
+int resampleImage(ThreadPool *pool, unsigned char *output, int newRows, int newCols,
+                  const unsigned char *input, int rows, int cols, int channels, int filter) {
+  ResampleJob job;
+  int error = 0;
+
+  if(rows <= 0 || cols <= 0 || newRows <= 0 || newCols <= 0 ||
+     filter < RESAMPLE_NEAREST || filter > RESAMPLE_LANCZOS3)
+    return(-1);
+
+  pthread_once(&chooseOnce, chooseKernel);
+
+  memset(&job, 0, sizeof(job));
+  job.input = input;
+  job.output = output;
+  job.rows = rows;
+  job.cols = cols;
+  job.newRows = newRows;
+  job.newCols = newCols;
+  job.channels = channels;
+
+  if(filter == RESAMPLE_NEAREST) {
+    poolFor(pool, (newRows + RESAMPLE_BAND - 1) / RESAMPLE_BAND, nearestTask, &job);
+    return(0);
+  }
+
+  if(buildTable(&job.across, cols, newCols, filter) != 0 ||
+     buildTable(&job.down, rows, newRows, filter) != 0)
+    error = -1;
+
+  // only the input rows the vertical pass reads are resampled across
+  if(!error) {
+    job.firstRow = job.down.first[0];
+    job.lastRow = job.down.first[newRows - 1] + job.down.count[newRows - 1];
+    job.temp = (unsigned char *)malloc((long)(job.lastRow - job.firstRow) * newCols * channels);
+    if(!job.temp)
+      error = -1;
+  }
+
+  if(!error) {
+    poolFor(pool, (job.lastRow - job.firstRow + RESAMPLE_BAND - 1) / RESAMPLE_BAND,
+            acrossTask, &job);
+    poolFor(pool, (newRows + RESAMPLE_BAND - 1) / RESAMPLE_BAND, downTask, &job);
+  }
+
+  free(job.temp);
+  freeTable(&job.across);
+  freeTable(&job.down);
+
+  return(error);
+} // end resampleImage
+
+
+// name of the kernels resampleImage uses
+const char *resampleKernel(void) {
+  pthread_once(&chooseOnce, chooseKernel);
+
+  return(current->choice.name);
+} // end resampleKernel
+
+
+// Switch to the named kernels, for benchmarks and testing.  Returns -1 if
+// they are not built in or the processor cannot run them.
+int useResampleKernel(const char *name) {
+  int i;
+
+  pthread_once(&chooseOnce, chooseKernel);
+
+  i = findKernel(kernels, sizeof(kernels[0]), name);
+  if(i < 0)
+    return(-1);
+  current = &kernels[i];
+
+  return(0);
+} // end useResampleKernel
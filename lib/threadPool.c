@@ -0,0 +1,222 @@
+// A small work-stealing thread pool for parallel loops.  poolFor splits the
+// indices of a loop evenly between the threads (the calling thread is one of
+// them).  Each thread works through its own range from the front, and a
+// thread that runs out steals the back half of another's, so uneven pieces
+// of work still keep every thread busy to the end.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "threadPool.h"
+
+// the indices a thread has left, next up to end
+typedef struct {
+  pthread_mutex_t lock;
+  long next, end;
+} WorkRange;
+
+typedef struct {
+  ThreadPool *pool;
+  int id;
+} WorkerArg;
+
+struct ThreadPool {
+  int nthreads;                 // including the thread calling poolFor
+  pthread_t threads[MAX_POOL_THREADS];
+  WorkerArg args[MAX_POOL_THREADS];
+  WorkRange ranges[MAX_POOL_THREADS];
+
+  pthread_mutex_t lock;
+  pthread_cond_t start, finished;
+  long generation;              // counts the loops run
+  int busy;                     // workers still in the current loop
+  int stopping;
+
+  PoolTask task;
+  void *arg;
+};
+
+
+// the next index of a thread's own range, or -1
+static long takeOwn(ThreadPool *pool, int id) {
+  WorkRange *range = &pool->ranges[id];
+  long index = -1;
+
+  pthread_mutex_lock(&range->lock);
+  if(range->next < range->end)
+    index = range->next++;
+  pthread_mutex_unlock(&range->lock);
+
+  return(index);
+} // end takeOwn
+
+
+// take the back half of another thread's range; returns its first index and
+// makes the rest this thread's range, or returns -1 if there is nothing left
+static long steal(ThreadPool *pool, int id) {
+  int k;
+
+  for(k = 1; k < pool->nthreads; k++) {
+    WorkRange *victim = &pool->ranges[(id + k) % pool->nthreads];
+    long first = -1, end = 0;
+
+    pthread_mutex_lock(&victim->lock);
+    if(victim->next < victim->end) {
+      end = victim->end;
+      first = end - (end - victim->next + 1) / 2;
+      victim->end = first;
+    }
+    pthread_mutex_unlock(&victim->lock);
+
+    if(first >= 0) {
+      WorkRange *own = &pool->ranges[id];
+
+      pthread_mutex_lock(&own->lock);
+      own->next = first + 1;
+      own->end = end;
+      pthread_mutex_unlock(&own->lock);
+      return(first);
+    }
+  }
+
+  return(-1);
+} // end steal
+
+
+static void runLoop(ThreadPool *pool, int id) {
+  long index;
+
+  while((index = takeOwn(pool, id)) >= 0 || (index = steal(pool, id)) >= 0)
+    pool->task(pool->arg, index);
+} // end runLoop
+
+
+static void *workerThread(void *arg) {
+  ThreadPool *pool = ((WorkerArg *)arg)->pool;
+  int id = ((WorkerArg *)arg)->id;
+  long seen = 0;
+
+  for(;;) {
+    pthread_mutex_lock(&pool->lock);
+    while(pool->generation == seen && !pool->stopping)
+      pthread_cond_wait(&pool->start, &pool->lock);
+    if(pool->stopping) {
+      pthread_mutex_unlock(&pool->lock);
+      return(NULL);
+    }
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    runLoop(pool, id);
+
+    pthread_mutex_lock(&pool->lock);
+    if(--pool->busy == 0)
+      pthread_cond_signal(&pool->finished);
+    pthread_mutex_unlock(&pool->lock);
+  }
+} // end workerThread
+
+
+// Start a pool of nthreads threads counting the caller (0 uses one per
+// processor).  A pool of one runs every loop on the calling thread.
+ThreadPool *createThreadPool(int nthreads) {
+  ThreadPool *pool;
+  int i;
+
+  if(nthreads <= 0)
+    nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if(nthreads > MAX_POOL_THREADS)
+    nthreads = MAX_POOL_THREADS;
+  if(nthreads < 1)
+    nthreads = 1;
+
+  pool = (ThreadPool *)calloc(1, sizeof(ThreadPool));
+  if(!pool)
+    return(NULL);
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->finished, NULL);
+  for(i = 0; i < MAX_POOL_THREADS; i++)
+    pthread_mutex_init(&pool->ranges[i].lock, NULL);
+
+  // the pool shrinks to the workers that could be started
+  pool->nthreads = 1;
+  for(i = 1; i < nthreads; i++) {
+    pool->args[i].pool = pool;
+    pool->args[i].id = i;
+    if(pthread_create(&pool->threads[i], NULL, workerThread, &pool->args[i]) != 0)
+      break;
+    pool->nthreads++;
+  }
+
+  return(pool);
+} // end createThreadPool
+
+
+// Run task(arg, i) for i from 0 to count - 1 across the pool and wait for
+// all of them.  Tasks must not call poolFor on the same pool.
+void poolFor(ThreadPool *pool, long count, PoolTask task, void *arg) {
+  int i, n;
+  long index;
+
+  if(count <= 0)
+    return;
+
+  n = pool ? pool->nthreads : 1;
+  if(n == 1 || count == 1) {
+    for(index = 0; index < count; index++)
+      task(arg, index);
+    return;
+  }
+
+  // the workers are all waiting, so the ranges can be set without locks
+  for(i = 0; i < n; i++) {
+    pool->ranges[i].next = count * i / n;
+    pool->ranges[i].end = count * (i + 1) / n;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->task = task;
+  pool->arg = arg;
+  pool->busy = n - 1;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+
+  runLoop(pool, 0);
+
+  pthread_mutex_lock(&pool->lock);
+  while(pool->busy > 0)
+    pthread_cond_wait(&pool->finished, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+} // end poolFor
+
+
+int poolThreads(ThreadPool *pool) {
+  return(pool ? pool->nthreads : 1);
+} // end poolThreads
+
+
+void destroyThreadPool(ThreadPool *pool) {
+  int i;
+
+  if(!pool)
+    return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = 1;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+
+  for(i = 1; i < pool->nthreads; i++)
+    pthread_join(pool->threads[i], NULL);
+
+  for(i = 0; i < MAX_POOL_THREADS; i++)
+    pthread_mutex_destroy(&pool->ranges[i].lock);
+  pthread_cond_destroy(&pool->start);
+  pthread_cond_destroy(&pool->finished);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+} // end destroyThreadPool
@@ -0,0 +1,433 @@
+// Tiled image files.  The image is cut into square tiles of tileSize pixels
+// (edge tiles are padded to full size) and a table after the header gives
+// the file offset of every tile, so a rectangle can be read or written by
+// touching only the tiles it overlaps.
+//
+// Layout, all integers little-endian:
+//   "TPM1", cols, rows, tileSize, 0      five 32-bit words
+//   offset of each tile, row by row      64-bit words
+//   tile data, tileSize rows of tileSize rgb pixels each
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "tileIO.h"
+#include "ppmStream.h"
+
+#define HEADER_BYTES 20
+
+// size of the buffer used when copying a tiled file
+#define COPY_CHUNK (1L << 20)
+
+
+static void put32(unsigned char *p, unsigned long v) {
+  p[0] = v & 255;
+  p[1] = (v >> 8) & 255;
+  p[2] = (v >> 16) & 255;
+  p[3] = (v >> 24) & 255;
+} // end put32
+
+
+static unsigned long get32(const unsigned char *p) {
+  return(p[0] | (p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24));
+} // end get32
+
+
+// read or write exactly len bytes at offset; returns 0 on success
+static int preadFully(int fd, void *buf, long len, long offset) {
+  long n;
+
+  while(len > 0) {
+    n = pread(fd, buf, len, offset);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      return(-1);
+    buf = (char *)buf + n;
+    len -= n;
+    offset += n;
+  }
+
+  return(0);
+} // end preadFully
+
+
+static int pwriteFully(int fd, const void *buf, long len, long offset) {
+  long n;
+
+  while(len > 0) {
+    n = pwrite(fd, buf, len, offset);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      return(-1);
+    buf = (const char *)buf + n;
+    len -= n;
+    offset += n;
+  }
+
+  return(0);
+} // end pwriteFully
+
+
+static TiledImage *newTiled(int fd, int rows, int cols, int tileSize) {
+  TiledImage *image = (TiledImage *)malloc(sizeof(TiledImage));
+
+  if(!image)
+    return(NULL);
+
+  image->fd = fd;
+  image->rows = rows;
+  image->cols = cols;
+  image->tileSize = tileSize;
+  image->tilesAcross = (int)(((long)cols + tileSize - 1) / tileSize);
+  image->tilesDown = (int)(((long)rows + tileSize - 1) / tileSize);
+  image->offsets = (long *)malloc(sizeof(long) * image->tilesAcross * image->tilesDown);
+  if(!image->offsets) {
+    free(image);
+    return(NULL);
+  }
+
+  return(image);
+} // end newTiled
+
+
+// true when filename ends in the tiled image extension
+int isTiledFile(char *filename) {
+  size_t n = filename ? strlen(filename) : 0;
+  size_t m = strlen(TILED_EXTENSION);
+
+  return(n > m && strcmp(filename + n - m, TILED_EXTENSION) == 0);
+} // end isTiledFile
+
+
+// create a tiled image of the given size with every pixel black
+TiledImage *createTiled(char *filename, int rows, int cols, int tileSize) {
+  TiledImage *image;
+  unsigned char *table;
+  long tileBytes, ntiles, i;
+  int fd;
+
+  if(rows <= 0 || cols <= 0 || tileSize <= 0)
+    return(NULL);
+
+  fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0)
+    return(NULL);
+
+  image = newTiled(fd, rows, cols, tileSize);
+  if(!image) {
+    close(fd);
+    return(NULL);
+  }
+
+  ntiles = (long)image->tilesAcross * image->tilesDown;
+  tileBytes = (long)tileSize * tileSize * sizeof(Pixel);
+  table = (unsigned char *)calloc(HEADER_BYTES + 8 * ntiles, 1);
+  if(!table) {
+    closeTiled(image);
+    return(NULL);
+  }
+
+  memcpy(table, "TPM1", 4);
+  put32(table + 4, cols);
+  put32(table + 8, rows);
+  put32(table + 12, tileSize);
+  for(i = 0; i < ntiles; i++) {
+    image->offsets[i] = HEADER_BYTES + 8 * ntiles + i * tileBytes;
+    put32(table + HEADER_BYTES + 8 * i, image->offsets[i] & 0xFFFFFFFFL);
+    put32(table + HEADER_BYTES + 8 * i + 4, (unsigned long)image->offsets[i] >> 32);
+  }
+
+  if(pwriteFully(fd, table, HEADER_BYTES + 8 * ntiles, 0) != 0 ||
+     ftruncate(fd, HEADER_BYTES + 8 * ntiles + ntiles * tileBytes) != 0) {
+    free(table);
+    closeTiled(image);
+    return(NULL);
+  }
+  free(table);
+
+  return(image);
+} // end createTiled
+
+
+// Open an existing tiled image, for writing too when writable is set.  The
+// header and offset table are checked against the file's size, so a
+// damaged file is refused rather than read past its end.
+TiledImage *openTiled(char *filename, int writable) {
+  TiledImage *image;
+  unsigned char header[HEADER_BYTES], *table;
+  unsigned long rows, cols, tileSize;
+  long ntiles, tileBytes, tableEnd, i;
+  struct stat st;
+  int fd;
+
+  fd = open(filename, writable ? O_RDWR : O_RDONLY);
+  if(fd < 0)
+    return(NULL);
+
+  if(fstat(fd, &st) != 0 || preadFully(fd, header, HEADER_BYTES, 0) != 0 ||
+     memcmp(header, "TPM1", 4) != 0) {
+    fprintf(stderr, "%s is not a tiled image\n", filename);
+    close(fd);
+    return(NULL);
+  }
+
+  // sizes must be positive, and the table and one tile must fit in the file
+  cols = get32(header + 4);
+  rows = get32(header + 8);
+  tileSize = get32(header + 12);
+  if(rows == 0 || cols == 0 || tileSize == 0 || rows > INT_MAX || cols > INT_MAX ||
+     tileSize > INT_MAX || tileSize * tileSize > (unsigned long)st.st_size / sizeof(Pixel)) {
+    fprintf(stderr, "%s has a bad tiled image header\n", filename);
+    close(fd);
+    return(NULL);
+  }
+  tileBytes = (long)(tileSize * tileSize * sizeof(Pixel));
+  ntiles = (long)((rows + tileSize - 1) / tileSize) * (long)((cols + tileSize - 1) / tileSize);
+  if(ntiles > (st.st_size - HEADER_BYTES) / 8) {
+    fprintf(stderr, "%s is too short for its tile table\n", filename);
+    close(fd);
+    return(NULL);
+  }
+  tableEnd = HEADER_BYTES + 8 * ntiles;
+
+  image = newTiled(fd, (int)rows, (int)cols, (int)tileSize);
+  if(!image) {
+    close(fd);
+    return(NULL);
+  }
+
+  table = (unsigned char *)malloc(8 * ntiles);
+  if(!table || preadFully(fd, table, 8 * ntiles, HEADER_BYTES) != 0) {
+    free(table);
+    closeTiled(image);
+    return(NULL);
+  }
+  for(i = 0; i < ntiles; i++) {
+    unsigned long offset = get32(table + 8 * i) | ((unsigned long)get32(table + 8 * i + 4) << 32);
+
+    // every tile lies after the table and inside the file
+    if(offset < (unsigned long)tableEnd || offset > (unsigned long)(st.st_size - tileBytes)) {
+      fprintf(stderr, "%s has a tile outside the file\n", filename);
+      free(table);
+      closeTiled(image);
+      return(NULL);
+    }
+    image->offsets[i] = (long)offset;
+  }
+  free(table);
+
+  return(image);
+} // end openTiled
+
+
+// Open filename for writing as a copy of the tiled image source.  When both
+// name the same file it is opened for update and nothing is copied.
+TiledImage *openTiledCopy(char *source, char *filename) {
+  unsigned char *buf;
+  long n;
+  int in, out, error = 0;
+
+  if(strcmp(source, filename) == 0)
+    return(openTiled(filename, 1));
+
+  in = open(source, O_RDONLY);
+  if(in < 0)
+    return(NULL);
+  out = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  buf = (unsigned char *)malloc(COPY_CHUNK);
+  if(out < 0 || !buf) {
+    close(in);
+    if(out >= 0)
+      close(out);
+    free(buf);
+    return(NULL);
+  }
+
+  while((n = read(in, buf, COPY_CHUNK)) != 0) {
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n < 0 || write(out, buf, n) != n) {
+      error = 1;
+      break;
+    }
+  }
+
+  close(in);
+  if(close(out) != 0)
+    error = 1;
+  free(buf);
+
+  return(error ? NULL : openTiled(filename, 1));
+} // end openTiledCopy
+
+
+// Visit every tile overlapping the rectangle, reading the overlapped rows of
+// each tile into scratch first (unless whole rows are about to be replaced),
+// copying pixels in or out, and writing the rows back when storing.
+static int accessRect(TiledImage *image, int x, int y, int width, int height,
+                      Pixel *pixels, int store) {
+  int ts = image->tileSize;
+  long tileRowBytes = (long)ts * sizeof(Pixel);
+  Pixel *scratch;
+  int tx, ty, r, error = 0;
+
+  if(x < 0 || y < 0 || width <= 0 || height <= 0 ||
+     x + width > image->cols || y + height > image->rows)
+    return(-1);
+
+  scratch = (Pixel *)calloc((long)ts * ts, sizeof(Pixel));
+  if(!scratch)
+    return(-1);
+
+  for(ty = y / ts; ty <= (y + height - 1) / ts && !error; ty++) {
+    int r0 = y > ty * ts ? y : ty * ts;
+    int r1 = y + height < (ty + 1) * ts ? y + height : (ty + 1) * ts;
+
+    for(tx = x / ts; tx <= (x + width - 1) / ts && !error; tx++) {
+      int c0 = x > tx * ts ? x : tx * ts;
+      int c1 = x + width < (tx + 1) * ts ? x + width : (tx + 1) * ts;
+      int tileEnd = (tx + 1) * ts < image->cols ? (tx + 1) * ts : image->cols;
+      long offset = image->offsets[(long)ty * image->tilesAcross + tx] +
+                    (r0 - ty * ts) * tileRowBytes;
+      long length = (r1 - r0) * tileRowBytes;
+
+      // only a partial row of a tile has to be read before it is written
+      if(!store || c0 != tx * ts || c1 != tileEnd) {
+        if(preadFully(image->fd, scratch, length, offset) != 0) {
+          error = 1;
+          break;
+        }
+      }
+      else
+        memset(scratch, 0, length);
+
+      for(r = r0; r < r1; r++) {
+        Pixel *tileRow = scratch + (long)(r - r0) * ts + (c0 - tx * ts);
+        Pixel *rectRow = pixels + (long)(r - y) * width + (c0 - x);
+
+        if(store)
+          memcpy(tileRow, rectRow, (c1 - c0) * sizeof(Pixel));
+        else
+          memcpy(rectRow, tileRow, (c1 - c0) * sizeof(Pixel));
+      }
+
+      if(store && pwriteFully(image->fd, scratch, length, offset) != 0)
+        error = 1;
+    }
+  }
+
+  free(scratch);
+
+  return(error ? -1 : 0);
+} // end accessRect
+
+
+// read the width x height rectangle at x, y into pixels
+int readTiledRect(TiledImage *image, int x, int y, int width, int height, Pixel *pixels) {
+  return(accessRect(image, x, y, width, height, pixels, 0));
+} // end readTiledRect
+
+
+// replace the width x height rectangle at x, y with pixels
+int writeTiledRect(TiledImage *image, int x, int y, int width, int height,
+                   const Pixel *pixels) {
+  return(accessRect(image, x, y, width, height, (Pixel *)pixels, 1));
+} // end writeTiledRect
+
+
+// close the file; returns 0 if everything written reached it
+int closeTiled(TiledImage *image) {
+  int error = 0;
+
+  if(!image)
+    return(-1);
+
+  if(close(image->fd) != 0)
+    error = -1;
+  free(image->offsets);
+  free(image);
+
+  return(error);
+} // end closeTiled
+
+
+// convert a ppm into a tiled image, streaming one row of tiles at a time
+int ppmToTiled(char *ppmFile, char *tiledFile, int tileSize) {
+  PPMReader *reader;
+  TiledImage *image;
+  Pixel *band;
+  int rows, cols, colors, y, n, error = 0;
+
+  if(tileSize <= 0)
+    tileSize = TILE_SIZE;
+
+  reader = openPPMReader(&rows, &cols, &colors, ppmFile, tileSize);
+  if(!reader)
+    return(-1);
+
+  image = createTiled(tiledFile, rows, cols, tileSize);
+  band = (Pixel *)malloc(sizeof(Pixel) * tileSize * cols);
+  if(!image || !band) {
+    closePPMReader(reader);
+    closeTiled(image);
+    free(band);
+    return(-1);
+  }
+
+  for(y = 0; y < rows && !error; y += n) {
+    n = rows - y < tileSize ? rows - y : tileSize;
+    if(readPPMRows(reader, band, n) != n || writeTiledRect(image, 0, y, cols, n, band) != 0)
+      error = 1;
+  }
+
+  closePPMReader(reader);
+  free(band);
+  if(closeTiled(image) != 0)
+    error = 1;
+
+  return(error ? -1 : 0);
+} // end ppmToTiled
+
+
+// convert a tiled image back into a ppm
+int tiledToPPM(char *tiledFile, char *ppmFile) {
+  TiledImage *image;
+  PPMWriter *writer;
+  Pixel *band;
+  int y, n, error = 0;
+
+  image = openTiled(tiledFile, 0);
+  if(!image)
+    return(-1);
+
+  writer = openPPMWriter(image->rows, image->cols, 255, ppmFile, image->tileSize);
+  band = (Pixel *)malloc(sizeof(Pixel) * image->tileSize * image->cols);
+  if(!writer || !band) {
+    if(writer)
+      closePPMWriter(writer);
+    closeTiled(image);
+    free(band);
+    return(-1);
+  }
+
+  for(y = 0; y < image->rows && !error; y += n) {
+    n = image->rows - y < image->tileSize ? image->rows - y : image->tileSize;
+    if(readTiledRect(image, 0, y, image->cols, n, band) != 0 ||
+       writePPMRows(writer, band, n) != 0)
+      error = 1;
+  }
+
+  if(closePPMWriter(writer) != 0)
+    error = 1;
+  closeTiled(image);
+  free(band);
+
+  return(error ? -1 : 0);
+} // end tiledToPPM
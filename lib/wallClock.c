@@ -0,0 +1,13 @@
+// Elapsed time for the writers' statistics and the tools' timings.
+
+#include <time.h>
+#include "wallClock.h"
+
+
+// seconds on a monotonic clock, for measuring intervals
+double wallSeconds(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return(ts.tv_sec + ts.tv_nsec * 1e-9);
+} // end wallSeconds
@@ -0,0 +1,346 @@
+// Affine compositing.  The foreground and mask are scaled, turned by any
+// angle about their centre and blended onto the background in one pass,
+// with no warped copy made: each output pixel is mapped back into the
+// foreground and sampled there, nearest or bilinear.  Along an output row
+// the source position moves by a constant step, so it is carried in fixed
+// point with WARP_BITS fractional bits and advanced by an add per pixel.
+// Each row is clipped to the columns whose source lies inside the
+// foreground, so only the warped sprite's footprint is sampled.  As in
+// compositeScaled the output is cut into tiles shared out by a thread pool,
+// and a tile copies the background where the sprite does not reach.
+
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "blend.h"
+#include "composite.h"
+#include "resample.h"
+#include "warp.h"
+
+// pixels sampled from the foreground for each call to alphaBlend
+#define GATHER_PIXELS 256
+
+typedef struct {
+  Pixel *output;
+  const Pixel *background;      // NULL to blend over output in place
+  int bgRows, bgCols;
+  const Pixel *foreground;
+  const unsigned char *alpha;
+  int channels;
+  int fgRows, fgCols;
+  int filter;
+  double u0, v0;                // source position of output pixel (0, 0)
+  double dudx, dvdx, dudy, dvdy;
+  double uMin, uMax, vMin, vMax; // source positions that reach the foreground
+  int tileRows, tileCols, tilesAcross;
+} WarpJob;
+
+
+// cosine and sine of angle degrees, exact for quarter turns so that they
+// map pixels to pixels
+static void turn(float angle, double *c, double *s) {
+  double a = fmod(angle, 360.0);
+
+  if(a < 0)
+    a += 360.0;
+
+  if(a == 0.0 || a == 180.0) {
+    *c = a == 0.0 ? 1.0 : -1.0;
+    *s = 0.0;
+  }
+  else if(a == 90.0 || a == 270.0) {
+    *c = 0.0;
+    *s = a == 90.0 ? 1.0 : -1.0;
+  }
+  else {
+    *c = cos(a * M_PI / 180.0);
+    *s = sin(a * M_PI / 180.0);
+  }
+} // end turn
+
+
+static void boxSize(int rows, int cols, float scaleFactor, double c, double s,
+                    double *width, double *height) {
+  *width = scaleFactor * (cols * fabs(c) + rows * fabs(s));
+  *height = scaleFactor * (cols * fabs(s) + rows * fabs(c));
+} // end boxSize
+
+
+// a box side in whole pixels, INT_MAX if it is larger than that
+static int boxSide(double side) {
+  side = ceil(side - 1e-6);
+
+  return(side < INT_MAX ? (int)side : INT_MAX);
+} // end boxSide
+
+
+// size of the box bounding a rows x cols image scaled by scaleFactor and
+// turned clockwise by angle degrees
+void affineSize(int rows, int cols, float scaleFactor, float angle, int *newRows, int *newCols) {
+  double c, s, width, height;
+
+  turn(angle, &c, &s);
+  boxSize(rows, cols, scaleFactor, c, s, &width, &height);
+
+  *newRows = boxSide(height);
+  *newCols = boxSide(width);
+} // end affineSize
+
+
+// narrow [lo, hi) to the x for which p + step * x lies in [min, max)
+static void clipSpan(double p, double step, double min, double max, double *lo, double *hi) {
+  double t0, t1;
+
+  if(step == 0.0) {
+    if(p < min || p >= max)
+      *hi = *lo;
+    return;
+  }
+
+  t0 = (min - p) / step;
+  t1 = (max - p) / step;
+  if(step < 0.0) {
+    double t = t0;
+    t0 = t1;
+    t1 = t;
+  }
+
+  if(t0 > *lo)
+    *lo = t0;
+  if(t1 < *hi)
+    *hi = t1;
+} // end clipSpan
+
+
+// the columns [a, b) of row y, within [x0, x1), that sample the foreground
+static void rowSpan(const WarpJob *job, int y, int x0, int x1, int *a, int *b) {
+  double lo = x0, hi = x1;
+
+  clipSpan(job->u0 + job->dudy * y, job->dudx, job->uMin, job->uMax, &lo, &hi);
+  clipSpan(job->v0 + job->dvdy * y, job->dvdx, job->vMin, job->vMax, &lo, &hi);
+  if(hi <= lo) {
+    *a = *b = x1;
+    return;
+  }
+
+  // a column more each side absorbs rounding; every sample is bounds checked
+  *a = (int)floor(lo) - 1;
+  *b = (int)ceil(hi) + 1;
+  *a = *a > x0 ? *a : x0;
+  *b = *b < x1 ? *b : x1;
+} // end rowSpan
+
+
+// n nearest samples from source position (u, v) on, stepping by (du, dv);
+// positions off the foreground take the background with no alpha
+static void sampleNearest(const WarpJob *job, Pixel *gathered, unsigned char *alpha,
+                          const Pixel *bg, long u, long v, long du, long dv, int n) {
+  int channels = job->channels;
+  int i;
+
+  for(i = 0; i < n; i++, u += du, v += dv) {
+    int ix = (int)(u >> WARP_BITS), iy = (int)(v >> WARP_BITS);
+    long offset;
+
+    if(ix < 0 || ix >= job->fgCols || iy < 0 || iy >= job->fgRows) {
+      gathered[i] = bg[i];
+      memset(alpha + i * channels, 0, channels);
+      continue;
+    }
+
+    offset = (long)iy * job->fgCols + ix;
+    gathered[i] = job->foreground[offset];
+    if(channels == 1)
+      alpha[i] = job->alpha[offset];
+    else
+      memcpy(alpha + 3 * i, job->alpha + 3 * offset, 3);
+  }
+} // end sampleNearest
+
+
+// n bilinear samples as for sampleNearest.  Taps off the foreground repeat
+// its edge for colour but add no alpha, so the sprite's edges are smoothed
+// into the background.
+static void sampleBilinear(const WarpJob *job, Pixel *gathered, unsigned char *alpha,
+                           const Pixel *bg, long u, long v, long du, long dv, int n) {
+  const unsigned char *fg = (const unsigned char *)job->foreground;
+  unsigned char *out = (unsigned char *)gathered;
+  int channels = job->channels;
+  int cols = job->fgCols, rows = job->fgRows;
+  int i, k, c;
+
+  for(i = 0; i < n; i++, u += du, v += dv) {
+    int ix = (int)(u >> WARP_BITS), iy = (int)(v >> WARP_BITS);
+    int fx = (int)(u >> (WARP_BITS - 8)) & 255, fy = (int)(v >> (WARP_BITS - 8)) & 255;
+    int left, right, top, bottom;
+    long tap[4];
+    int weight[4];
+
+    if(ix < -1 || ix >= cols || iy < -1 || iy >= rows) {
+      gathered[i] = bg[i];
+      memset(alpha + i * channels, 0, channels);
+      continue;
+    }
+
+    left = ix < 0 ? 0 : ix;
+    right = ix + 1 < cols ? ix + 1 : cols - 1;
+    top = iy < 0 ? 0 : iy;
+    bottom = iy + 1 < rows ? iy + 1 : rows - 1;
+    tap[0] = (long)top * cols + left;
+    tap[1] = (long)top * cols + right;
+    tap[2] = (long)bottom * cols + left;
+    tap[3] = (long)bottom * cols + right;
+    weight[0] = (256 - fx) * (256 - fy);
+    weight[1] = fx * (256 - fy);
+    weight[2] = (256 - fx) * fy;
+    weight[3] = fx * fy;
+
+    for(c = 0; c < 3; c++) {
+      int sum = 32768;
+
+      for(k = 0; k < 4; k++)
+        sum += weight[k] * fg[3 * tap[k] + c];
+      out[3 * i + c] = (unsigned char)(sum >> 16);
+    }
+
+    if(ix < 0)
+      weight[0] = weight[2] = 0;
+    if(ix + 1 >= cols)
+      weight[1] = weight[3] = 0;
+    if(iy < 0)
+      weight[0] = weight[1] = 0;
+    if(iy + 1 >= rows)
+      weight[2] = weight[3] = 0;
+
+    for(c = 0; c < channels; c++) {
+      int sum = 32768;
+
+      for(k = 0; k < 4; k++)
+        sum += weight[k] * job->alpha[channels * tap[k] + c];
+      alpha[channels * i + c] = (unsigned char)(sum >> 16);
+    }
+  }
+} // end sampleBilinear
+
+
+// blend columns [a, b) of output row y, out and bg pointing at the row
+static void warpRow(const WarpJob *job, Pixel *out, const Pixel *bg, int y, int a, int b) {
+  Pixel gathered[GATHER_PIXELS];
+  unsigned char alpha[3 * GATHER_PIXELS];
+  double one = (double)(1L << WARP_BITS);
+  long du = lround(job->dudx * one), dv = lround(job->dvdx * one);
+  long u = lround((job->u0 + job->dudx * a + job->dudy * y) * one);
+  long v = lround((job->v0 + job->dvdx * a + job->dvdy * y) * one);
+  int x, n;
+
+  for(x = a; x < b; x += n) {
+    n = b - x < GATHER_PIXELS ? b - x : GATHER_PIXELS;
+    if(job->filter == RESAMPLE_BILINEAR)
+      sampleBilinear(job, gathered, alpha, bg + x, u, v, du, dv, n);
+    else
+      sampleNearest(job, gathered, alpha, bg + x, u, v, du, dv, n);
+    alphaBlend(out + x, gathered, bg + x, alpha, job->channels, n);
+    u += du * n;
+    v += dv * n;
+  }
+} // end warpRow
+
+
+static void warpTile(void *arg, long index) {
+  WarpJob *job = (WarpJob *)arg;
+  int y0 = (int)(index / job->tilesAcross) * job->tileRows;
+  int x0 = (int)(index % job->tilesAcross) * job->tileCols;
+  int y1 = y0 + job->tileRows < job->bgRows ? y0 + job->tileRows : job->bgRows;
+  int x1 = x0 + job->tileCols < job->bgCols ? x0 + job->tileCols : job->bgCols;
+  int copy = job->background && job->background != job->output;
+  int y;
+
+  for(y = y0; y < y1; y++) {
+    Pixel *out = job->output + (long)y * job->bgCols;
+    const Pixel *bg = job->background ? job->background + (long)y * job->bgCols : out;
+    int a, b;
+
+    rowSpan(job, y, x0, x1, &a, &b);
+
+    if(copy && a > x0)
+      memcpy(out + x0, bg + x0, (a - x0) * sizeof(Pixel));
+    if(a < b)
+      warpRow(job, out, bg, y, a, b);
+    if(copy && x1 > b)
+      memcpy(out + b, bg + b, (x1 - b) * sizeof(Pixel));
+  }
+} // end warpTile
+
+
+// Composite the foreground and mask (fgRows x fgCols, one or three mask
+// samples per pixel) onto the background, scaled by scaleFactor and turned
+// clockwise by angle degrees about their centre, with the top left of the
+// box affineSize gives at (dx, dy).  Parts falling off the background are
+// clipped.  filter is RESAMPLE_NEAREST or RESAMPLE_BILINEAR.  With a NULL
+// background the output is blended in place; pool may be NULL to run on
+// the calling thread.  Returns 0, or -1 for a bad filter, an angle that is
+// not finite or a scale that is not finite, is below WARP_MIN_SCALE or
+// makes the box larger than an int can hold.
+int compositeAffine(ThreadPool *pool, Pixel *output, const Pixel *background,
+                    int bgRows, int bgCols, const Pixel *foreground,
+                    const unsigned char *alpha, int channels, int fgRows, int fgCols,
+                    float scaleFactor, float angle, int dx, int dy, int filter) {
+  WarpJob job;
+  double c, s, width, height, cx, cy;
+
+  if(!isfinite(scaleFactor) || !isfinite(angle) || scaleFactor < WARP_MIN_SCALE ||
+     (filter != RESAMPLE_NEAREST && filter != RESAMPLE_BILINEAR))
+    return(-1);
+
+  turn(angle, &c, &s);
+  boxSize(fgRows, fgCols, scaleFactor, c, s, &width, &height);
+  if(width >= INT_MAX || height >= INT_MAX)
+    return(-1);
+  if(bgRows <= 0 || bgCols <= 0)
+    return(0);
+
+  memset(&job, 0, sizeof(job));
+  job.output = output;
+  job.background = background;
+  job.bgRows = bgRows;
+  job.bgCols = bgCols;
+  job.foreground = foreground;
+  job.alpha = alpha;
+  job.channels = channels;
+  job.fgRows = fgRows;
+  job.fgCols = fgCols;
+  job.filter = filter;
+
+  // output pixel (x, y) maps back to the foreground position whose offset
+  // from the foreground's centre, turned and scaled, is its offset from the
+  // box's centre; pixel centres lie at whole positions on both sides
+  cx = dx + width / 2 - 0.5;
+  cy = dy + height / 2 - 0.5;
+  job.dudx = c / scaleFactor;
+  job.dudy = s / scaleFactor;
+  job.dvdx = -s / scaleFactor;
+  job.dvdy = c / scaleFactor;
+  job.u0 = fgCols / 2.0 - 0.5 - (cx * job.dudx + cy * job.dudy);
+  job.v0 = fgRows / 2.0 - 0.5 - (cx * job.dvdx + cy * job.dvdy);
+
+  // nearest sampling truncates, so it steps from half a pixel on; bilinear
+  // sampling reaches a pixel further, blending the edge into nothing
+  if(filter == RESAMPLE_NEAREST) {
+    job.u0 += 0.5;
+    job.v0 += 0.5;
+  }
+  else
+    job.uMin = job.vMin = -1.0;
+  job.uMax = fgRows > 0 ? fgCols : 0;
+  job.vMax = fgCols > 0 ? fgRows : 0;
+
+  compositeTileSize(bgCols, channels, &job.tileRows, &job.tileCols);
+  job.tilesAcross = (bgCols + job.tileCols - 1) / job.tileCols;
+
+  poolFor(pool, (long)job.tilesAcross * ((bgRows + job.tileRows - 1) / job.tileRows),
+          warpTile, &job);
+
+  return(0);
+} // end compositeAffine
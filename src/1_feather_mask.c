@@ -0,0 +1,86 @@
+#include "alphaPlane.h"
+#include "feather.h"
+#include "imageArena.h"
+#include "ppmIO.h"
+#include "wallClock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define USECPP 0
+
+/* soften the hard 0/255 edges of a mask from 1_generate_mask before it is
+ * handed to the blend tools; sigma is the width of the feather in pixels
+ * and costs the same whatever it is */
+
+/* Compile with: ../bin/1_feather_mask mask_powerpuff.pgm
+ * feather_powerpuff.pgm 2.5 */
+
+int main(int argc, char *argv[]) {
+  AlphaPlane *mask;
+  unsigned char *output;
+  ImageArena *arena;
+  double sigma, start;
+  long samples;
+  int threads = 0;
+  int bad = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "j:")) != -1) {
+    switch (opt) {
+    case 'j': // threads to feather with, 0 for one per processor
+      threads = atoi(optarg);
+      break;
+    default:
+      bad = 1;
+    }
+  }
+
+  if (bad || argc - optind != 3) {
+    printf("Usage: %s [-j threads] <mask file> <output file> <sigma>\n",
+           argv[0]);
+    return -1;
+  }
+  argv += optind - 1;
+
+  sigma = atof(argv[3]);
+  if (sigma < 0) {
+    fprintf(stderr, "Sigma must not be negative\n");
+    exit(-1);
+  }
+
+  /* read the mask, as a single alpha plane when it is grey */
+  mask = readAlphaPlane(argv[1]);
+  if (!mask) {
+    fprintf(stderr, "Unable to read %s\n", argv[1]);
+    exit(-1);
+  }
+
+  samples = (long)mask->rows * mask->cols * mask->channels;
+  arena = createArena(samples, ARENA_HUGE_PAGES);
+  output = arena ? arenaAlloc(arena, samples) : NULL;
+  if (!output) {
+    fprintf(stderr, "Unable to allocate memory for the feathered mask\n");
+    exit(-1);
+  }
+
+  start = wallSeconds();
+  if (featherMask(mask->alpha, output, mask->rows, mask->cols, mask->channels,
+                  sigma, threads) != 0) {
+    fprintf(stderr, "Unable to allocate memory to feather the mask\n");
+    exit(-1);
+  }
+  fprintf(stderr, "feathered %d x %d in %.3f s\n", mask->cols, mask->rows,
+          wallSeconds() - start);
+
+  /* a grey mask stays a pgm alpha plane */
+  if (mask->channels == 1)
+    writePGM(output, mask->rows, mask->cols, 255, argv[2]);
+  else
+    writePPM((Pixel *)output, mask->rows, mask->cols, 255, argv[2]);
+
+  freeAlphaPlane(mask);
+  destroyArena(arena);
+
+  return 0;
+}
@@ -1,25 +1,60 @@
+#include "chromaKey.h"
+#include "imageArena.h"
+#include "keyLUT.h"
 #include "ppmIO.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #define USECPP 0
 // #define COLOR_THRESHOLD 30 // for in-between values of blue and green
+// is now the rule diff:b:30 or diff:g:30
+
+/* The mask color is b or g for the standard 4/3 ratio key, or a key rule
+ * (see keyLUT.c) such as ratio:g:3/2:40, diff:b:30 or dist:ycc:0,177,64:40,
+ * which is compiled into a lookup table with -q bits per channel. */
 
 int main(int argc, char *argv[]) {
   Pixel *image;
-  Pixel *mask;
+  unsigned char *mask;
+  ImageArena *arena;
+  KeyLUT *lut = NULL;
   int rows, cols, colors;
+  int bits = KEYLUT_BITS;
   long imagesize;
-  long i;
+  int bad = 0;
+  int opt;
 
-  if (argc != 4) {
-    printf("Usage: %s <input file> <output file> <mask color (b/g)>\n",
+  while ((opt = getopt(argc, argv, "q:")) != -1) {
+    switch (opt) {
+    case 'q': // bits of each channel the key table is indexed by
+      bits = atoi(optarg);
+      break;
+    default:
+      bad = 1;
+    }
+  }
+
+  if (bad || argc - optind != 3) {
+    printf("Usage: %s [-q bits] <input file> <output file> <mask color (b/g) "
+           "or key rule>\n",
            argv[0]);
     return -1;
   }
+  argv += optind - 1;
 
   char maskColor = argv[3][0]; // 'b' for blue, 'g' for green
 
+  /* anything but a bare b or g is a rule for the lookup table */
+  if (strchr(argv[3], ':')) {
+    lut = createKeyLUT(argv[3], bits);
+    if (!lut)
+      exit(-1);
+    fprintf(stderr, "key rule %s, %s\n", lut->spec,
+            lut->cached ? "table from cache" : "table built");
+  }
+
   /* read in the image */
   image = readPPM(&rows, &cols, &colors, argv[1]);
   if (!image) {
@@ -27,8 +62,9 @@ int main(int argc, char *argv[]) {
     exit(-1);
   }
 
-  /* Allocate memory for the mask */
-  mask = (Pixel *)malloc(rows * cols * sizeof(Pixel));
+  /* Allocate memory for the mask, one alpha sample per pixel */
+  arena = createArena((long)rows * cols, ARENA_HUGE_PAGES);
+  mask = arena ? arenaAlloc(arena, (long)rows * cols) : NULL;
   if (!mask) {
     fprintf(stderr, "Unable to allocate memory for mask\n");
     exit(-1);
@@ -37,41 +73,24 @@ int main(int argc, char *argv[]) {
   /* calculate the image size */
   imagesize = (long)rows * (long)cols;
 
-  /* create the mask based on the blue or green threshold */
-  for (i = 0; i < imagesize; i++) {
-    float r, g, b;
-    r = image[i].r;
-    g = image[i].g;
-    b = image[i].b;
-
-    // if ((maskColor == 'b' && ((b - r) > COLOR_THRESHOLD) && ((b - g) >
-    // COLOR_THRESHOLD)) ||
-    //     (maskColor == 'g' && ((g - r) > COLOR_THRESHOLD) && ((g - b) >
-    //     COLOR_THRESHOLD))) {
-    if ((maskColor == 'b' && (b > (4.0 / 3.0) * g) && (b > (4.0 / 3.0) * r) &&
-         (b > 50)) ||
-        (maskColor == 'g' && (g > (4.0 / 3.0) * b) && (g > (4.0 / 3.0) * r) &&
-         (g > 50))) {
-      mask[i].r = 0; // Background
-      mask[i].g = 0;
-      mask[i].b = 0;
-    } else {
-      mask[i].r = 255; // Foreground
-      mask[i].g = 255;
-      mask[i].b = 255;
-    }
-  }
+  /* create the mask based on the blue or green threshold: background is
+   * black where the key channel exceeds 4/3 of both others and 50 */
+  if (lut)
+    keyLUTMask(lut, image, mask, imagesize, 1);
+  else
+    chromaKeyMask(image, mask, imagesize, maskColor, 1);
 
-  /* Output the mask */
-  writePPM(mask, rows, cols, colors, argv[2]);
+  /* Output the mask as an alpha plane (pgm) */
+  writePGM(mask, rows, cols, colors, argv[2]);
 
   /* free the image memory */
 #if USECPP
   delete[] image;
 #else
   free(image);
-  free(mask);
 #endif
+  destroyArena(arena);
+  freeKeyLUT(lut);
 
   return (0);
 }
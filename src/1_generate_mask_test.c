@@ -1,3 +1,4 @@
+#include "chromaKey.h"
 #include "ppmIO.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,10 +8,8 @@
 
 int main(int argc, char *argv[]) {
   Pixel *image;
-  Pixel *mask;
   int rows, cols, colors;
   long imagesize;
-  long i;
 
   if (argc != 4) {
     printf("Usage: %s <input file> <output file> <mask color (b/g)>\n",
@@ -27,47 +26,13 @@ int main(int argc, char *argv[]) {
     exit(-1);
   }
 
-  /* Allocate memory for the mask */
-  mask = (Pixel *)malloc(rows * cols * sizeof(Pixel));
-  if (!mask) {
-    fprintf(stderr, "Unable to allocate memory for mask\n");
-    exit(-1);
-  }
-
   /* calculate the image size */
   imagesize = (long)rows * (long)cols;
 
-  /* create the mask based on the blue or green threshold */
-  for (i = 0; i < imagesize; i++) {
-    float r, g, b;
-    r = image[i].r;
-    g = image[i].g;
-    b = image[i].b;
-
-    // if ((maskColor == 'b' && ((b - r) > COLOR_THRESHOLD) && ((b - g) >
-    // COLOR_THRESHOLD)) ||
-    //     (maskColor == 'g' && ((g - r) > COLOR_THRESHOLD) && ((g - b) >
-    //     COLOR_THRESHOLD))) {
-    if ((maskColor == 'b' && (b > (4.0 / 3.0) * g) && (b > (4.0 / 3.0) * r) &&
-         (b > 50)) ||
-        (maskColor == 'g' && (g > (4.0 / 3.0) * b) && (g > (4.0 / 3.0) * r) &&
-         (g > 50))) {
-      mask[i].r = 0; // Background
-      mask[i].g = 0;
-      mask[i].b = 0;
-    } else {
-      mask[i].r = 255; // Foreground
-      mask[i].g = 255;
-      mask[i].b = 255;
-    }
-  }
-
-  /* Apply the mask to the image */
-  for (i = 0; i < imagesize; i++) {
-    image[i].r = (image[i].r * mask[i].r) / 255;
-    image[i].g = (image[i].g * mask[i].g) / 255;
-    image[i].b = (image[i].b * mask[i].b) / 255;
-  }
+  /* key and apply the mask in one pass over the image: pixels where the key
+   * channel exceeds 4/3 of both others and 50 go black, the rest are kept,
+   * without the mask ever being stored */
+  chromaKeyComposite(image, NULL, image, imagesize, maskColor);
 
   /* Output the image with mask applied */
   writePPM(image, rows, cols, colors, argv[2]);
@@ -75,10 +40,8 @@ int main(int argc, char *argv[]) {
   /* free the image and mask memory */
 #if USECPP
   delete[] image;
-  delete[] mask;
 #else
   free(image);
-  free(mask);
 #endif
 
   return 0;
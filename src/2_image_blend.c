@@ -1,6 +1,15 @@
+#include "alphaPlane.h"
+#include "blend.h"
+#include "chromaKey.h"
+#include "imageArena.h"
+#include "keyLUT.h"
 #include "ppmIO.h"
+#include "ppmStream.h"
+#include "ppmWrite.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #define USECPP 0
 
@@ -12,79 +21,247 @@
 /* Compile with: ../bin/2_image_blend powerpuff.ppm background.ppm
  * mask_powerpuff.ppm blend_result_powerpuff.ppm */
 
-int main(int argc, char *argv[]) {
+/* With -k b or -k g the foreground is keyed as it is blended, the way
+ * 1_generate_mask would key it, so no mask is read or written:
+ * ../bin/2_image_blend -k g powerpuff.ppm background.ppm result.ppm
+ * -k also takes a key rule such as diff:g:30, keyed through a lookup table
+ * with -q bits per channel. */
+
+/* key n pixels of the foreground over the background, through the lookup
+ * table when there is one */
+static void keyPixels(Pixel *output, const Pixel *foreground,
+                      const Pixel *background, char keyColor,
+                      const KeyLUT *lut, long n);
+
+/* blend the images a band of rows at a time without loading them; with a
+ * key colour the mask file is not used */
+static int streamBlend(char *fgFile, char *bgFile, char *maskFile,
+                       char keyColor, const KeyLUT *lut, char *outFile);
+
+void keyPixels(Pixel *output, const Pixel *foreground,
+               const Pixel *background, char keyColor, const KeyLUT *lut,
+               long n) {
+  if (lut)
+    keyLUTComposite(lut, foreground, background, output, n);
+  else
+    chromaKeyComposite(foreground, background, output, n, keyColor);
+}
+
+int streamBlend(char *fgFile, char *bgFile, char *maskFile, char keyColor,
+                const KeyLUT *lut, char *outFile) {
+  PPMReader *fgReader, *bgReader, *maskReader = NULL;
+  PPMWriter *writer;
   Pixel *foreground, *background, *output;
-  Pixel *mask;
-  int rows, cols, colors;
-  long imagesize;
-  long i;
-
-  if (argc != 5) {
-    printf("Usage: %s <foreground file> <background file> <mask file> <output "
-           "file>\n",
-           argv[0]);
+  unsigned char *mask;
+  ImageArena *arena;
+  int rows, cols, colors, bgRows, bgCols;
+  int maskRows = 0, maskCols = 0, maskChannels = 0;
+  int y, n;
+
+  fgReader = openPPMReader(&rows, &cols, &colors, fgFile, 0);
+  bgReader = openPPMReader(&bgRows, &bgCols, &colors, bgFile, 0);
+  if (keyColor) {
+    maskRows = rows;
+    maskCols = cols;
+  } else
+    maskReader = openImageReader(&maskRows, &maskCols, &colors, &maskChannels,
+                                 maskFile, 0);
+  if (!fgReader || !bgReader || (!keyColor && !maskReader)) {
+    fprintf(stderr, "Unable to open the input images\n");
+    exit(-1);
+  }
+
+  if (rows != bgRows || cols != bgCols || rows != maskRows ||
+      cols != maskCols) {
+    fprintf(stderr, "Dimension mismatch\n");
+    exit(-1);
+  }
+
+  writer = openPPMWriter(rows, cols, 255, outFile, 0);
+  if (!writer) {
+    fprintf(stderr, "Unable to open %s\n", outFile);
+    exit(-1);
+  }
+
+  /* one band of each image is all that is held at a time */
+  arena = createArena(4L * STREAM_BAND_ROWS * cols * sizeof(Pixel), 0);
+  if (!arena) {
+    fprintf(stderr, "Unable to allocate memory for the bands\n");
+    exit(-1);
+  }
+  foreground = arenaPixels(arena, STREAM_BAND_ROWS, cols);
+  background = arenaPixels(arena, STREAM_BAND_ROWS, cols);
+  mask = maskChannels
+             ? arenaAlloc(arena, (long)STREAM_BAND_ROWS * cols * maskChannels)
+             : NULL;
+  output = arenaPixels(arena, STREAM_BAND_ROWS, cols);
+  if (!foreground || !background || (maskChannels && !mask) || !output) {
+    fprintf(stderr, "Unable to allocate memory for the bands\n");
+    exit(-1);
+  }
+
+  for (y = 0; y < rows; y += n) {
+    n = rows - y < STREAM_BAND_ROWS ? rows - y : STREAM_BAND_ROWS;
+    if (readPPMRows(fgReader, foreground, n) != n ||
+        readPPMRows(bgReader, background, n) != n ||
+        (maskReader && readImageRows(maskReader, mask, n) != n)) {
+      fprintf(stderr, "Input image is truncated\n");
+      exit(-1);
+    }
+    if (keyColor)
+      keyPixels(output, foreground, background, keyColor, lut, (long)n * cols);
+    else
+      alphaBlend(output, foreground, background, mask, maskChannels,
+                 (long)n * cols);
+    writePPMRows(writer, output, n);
+  }
+
+  closePPMReader(fgReader);
+  closePPMReader(bgReader);
+  if (maskReader)
+    closePPMReader(maskReader);
+  destroyArena(arena);
+
+  return closePPMWriter(writer);
+}
+
+int main(int argc, char *argv[]) {
+  const Pixel *foreground, *background;
+  AlphaPlane *mask = NULL;
+  Pixel *output;
+  ImageArena *arena;
+  AsyncWriter *writer;
+  WriteStats stats;
+  int rows, cols, colors, bgRows, bgCols;
+  int y, n;
+  int stream = 0;
+  char keyColor = 0;
+  KeyLUT *lut = NULL;
+  char *keyRule = NULL;
+  int bits = KEYLUT_BITS;
+  char *outFile;
+  int bad = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "sk:q:")) != -1) {
+    switch (opt) {
+    case 's': // stream the images instead of loading them whole
+      stream = 1;
+      break;
+    case 'k': // key the foreground on the fly instead of reading a mask
+      keyColor = optarg[0];
+      if (strchr(optarg, ':'))
+        keyRule = optarg;
+      else if ((keyColor != 'b' && keyColor != 'g') || optarg[1])
+        bad = 1;
+      break;
+    case 'q': // bits of each channel the key table is indexed by
+      bits = atoi(optarg);
+      break;
+    default:
+      bad = 1;
+    }
+  }
+
+  if (bad || argc - optind != (keyColor ? 3 : 4)) {
+    printf("Usage: %s [-s] <foreground file> <background file> <mask file> "
+           "<output file>\n"
+           "       %s [-s] -k <b|g|key rule> [-q bits] <foreground file> "
+           "<background file> <output file>\n",
+           argv[0], argv[0]);
     return -1;
   }
+  argv += optind - 1;
+  outFile = keyColor ? argv[3] : argv[4];
+
+  if (keyRule) {
+    lut = createKeyLUT(keyRule, bits);
+    if (!lut)
+      exit(-1);
+  }
+
+  if (stream) {
+    if (streamBlend(argv[1], argv[2], keyColor ? NULL : argv[3], keyColor,
+                    lut, outFile) != 0) {
+      fprintf(stderr, "Unable to write %s\n", outFile);
+      exit(-1);
+    }
+    return 0;
+  }
 
   /* read foreground image */
-  foreground = readPPM(&rows, &cols, &colors, argv[1]);
+  foreground = mapPPM(&rows, &cols, &colors, argv[1]);
   if (!foreground) {
     fprintf(stderr, "Unable to read %s\n", argv[1]);
     exit(-1);
   }
 
   /* read background image */
-  background = readPPM(&rows, &cols, &colors, argv[2]);
+  background = mapPPM(&bgRows, &bgCols, &colors, argv[2]);
   if (!background) {
     fprintf(stderr, "Unable to read %s\n", argv[2]);
     exit(-1);
   }
 
-  /* read mask image */
-  mask = (Pixel *)readPPM(&rows, &cols, &colors, argv[3]);
-  if (!mask) {
-    fprintf(stderr, "Unable to read %s\n", argv[3]);
+  /* read mask image, as a single alpha plane when it is grey */
+  if (!keyColor) {
+    mask = readAlphaPlane(argv[3]);
+    if (!mask) {
+      fprintf(stderr, "Unable to read %s\n", argv[3]);
+      exit(-1);
+    }
+  }
+  if (bgRows != rows || bgCols != cols ||
+      (mask && (mask->rows != rows || mask->cols != cols))) {
+    fprintf(stderr, "Dimension mismatch\n");
     exit(-1);
   }
 
   /* allocate memory for the output image */
-  output = (Pixel *)malloc(rows * cols * sizeof(Pixel));
+  arena = createArena((long)rows * cols * sizeof(Pixel), ARENA_HUGE_PAGES);
+  output = arena ? arenaPixels(arena, rows, cols) : NULL;
   if (!output) {
     fprintf(stderr, "Unable to allocate memory for output image\n");
     exit(-1);
   }
 
-  imagesize = (long)rows * (long)cols;
+  /* start writing the output while it is still being blended */
+  writer = beginPPMWrite(output, rows, cols, 255, outFile);
+  if (!writer) {
+    fprintf(stderr, "Unable to open %s\n", outFile);
+    exit(-1);
+  }
+
+  /* blend the images together, handing each finished band to the writer */
+  for (y = 0; y < rows; y += n) {
+    long offset = (long)y * cols;
 
-  /* blend the images together */
-  for (i = 0; i < imagesize; i++) {
-    float alpha = mask[i].g / 255.0;
-    float beta = mask[i].r / 255.0;
-    float gamma = mask[i].b / 255.0;
-    // float alpha = 1;
-    output[i].r =
-        (unsigned char)(beta * foreground[i].r + (1 - beta) * background[i].r);
-    output[i].g = (unsigned char)(alpha * foreground[i].g +
-                                  (1 - alpha) * background[i].g);
-    output[i].b = (unsigned char)(gamma * foreground[i].b +
-                                  (1 - gamma) * background[i].b);
+    n = rows - y < STREAM_BAND_ROWS ? rows - y : STREAM_BAND_ROWS;
+    if (keyColor)
+      keyPixels(output + offset, foreground + offset, background + offset,
+                keyColor, lut, (long)n * cols);
+    else
+      alphaBlend(output + offset, foreground + offset, background + offset,
+                 mask->alpha + offset * mask->channels, mask->channels,
+                 (long)n * cols);
+    commitRows(writer, y + n);
   }
 
-  /* output the blended image */
-  writePPM(output, rows, cols, 255, argv[4]);
+  /* wait for the blended image to be written */
+  if (endWrite(writer, &stats) != 0) {
+    fprintf(stderr, "Unable to write %s\n", outFile);
+    exit(-1);
+  }
+  fprintf(stderr, "wrote %ld bytes in %.3f s (%.1f MB/s)\n", stats.bytes,
+          stats.seconds, writeBandwidth(&stats));
+  fprintf(stderr, "arena peak: %.1f MB\n", arenaPeak(arena) / (1024.0 * 1024.0));
 
   // Free memory
-#if USECPP
-  delete[] foreground;
-  delete[] background;
-  delete[] mask;
-  delete[] output;
-#else
-  free(foreground);
-  free(background);
-  free(mask);
-  free(output);
-#endif
+  unmapPPM(foreground);
+  unmapPPM(background);
+  freeAlphaPlane(mask);
+  freeKeyLUT(lut);
+  destroyArena(arena);
 
   return 0;
 }
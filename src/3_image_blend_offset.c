@@ -1,6 +1,15 @@
+#include "alphaPlane.h"
+#include "blend.h"
+#include "composite.h"
+#include "imageArena.h"
 #include "ppmIO.h"
+#include "ppmStream.h"
+#include "ppmWrite.h"
+#include "tileIO.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define USECPP 0
 
@@ -11,48 +20,376 @@
 /* Compile with ../bin/3_image_blend_offset powerpuff.ppm background_large.ppm
  * mask_powerpuff.ppm 300 0 blend_result_offset_powerpuff.ppm */
 
+/* blend one row of the foreground into the output in place using a mask
+ * with one (grey) or three (RGB) alpha samples per pixel */
+static void blendRow(Pixel *output, const Pixel *foreground,
+                     const unsigned char *mask, int channels, long n);
+
+/* composite a band of rows at a time without loading the images */
+static int streamBlendOffset(char *fgFile, char *bgFile, char *maskFile,
+                             int dx, int dy, char *outFile);
+
+/* composite onto a tiled background, touching only the tiles under the
+ * foreground */
+static int blendTiled(ImageArena *arena, ThreadPool *pool, char *bgFile,
+                      char *outFile, const Pixel *foreground,
+                      const unsigned char *mask, int maskChannels, int fgRows,
+                      int fgCols, int dx, int dy);
+
+/* composite onto the image already in a ppm output file, reading and
+ * rewriting only the rows the mask shows; a missing output file starts as a
+ * copy of the background */
+static int blendUpdate(ImageArena *arena, ThreadPool *pool, char *bgFile,
+                       char *outFile, const Pixel *foreground,
+                       const unsigned char *mask, int maskChannels, int fgRows,
+                       int fgCols, int dx, int dy);
+
+/* true when both names lead to the same existing file */
+static int sameFile(char *a, char *b);
+
+void blendRow(Pixel *output, const Pixel *foreground,
+              const unsigned char *mask, int channels, long n) {
+  alphaBlend(output, foreground, output, mask, channels, n);
+}
+
+int streamBlendOffset(char *fgFile, char *bgFile, char *maskFile, int dx,
+                      int dy, char *outFile) {
+  PPMReader *fgReader, *bgReader, *maskReader;
+  PPMWriter *writer;
+  Pixel *foreground, *output;
+  unsigned char *mask;
+  ImageArena *arena;
+  int fgRows, fgCols, bgRows, bgCols, maskRows, maskCols, maskChannels;
+  int colors;
+  int y, n, j, first, last;
+
+  fgReader = openPPMReader(&fgRows, &fgCols, &colors, fgFile, 0);
+  maskReader = openImageReader(&maskRows, &maskCols, &colors, &maskChannels,
+                               maskFile, 0);
+  bgReader = openPPMReader(&bgRows, &bgCols, &colors, bgFile, 0);
+  if (!fgReader || !bgReader || !maskReader) {
+    fprintf(stderr, "Unable to open the input images\n");
+    exit(-1);
+  }
+
+  if (fgRows != maskRows || fgCols != maskCols || dx < 0 || dy < 0 ||
+      dx + fgCols > bgCols || dy + fgRows > bgRows) {
+    fprintf(stderr, "Dimension mismatch or invalid offsets\n");
+    exit(-1);
+  }
+
+  writer = openPPMWriter(bgRows, bgCols, colors, outFile, 0);
+  if (!writer) {
+    fprintf(stderr, "Unable to open %s\n", outFile);
+    exit(-1);
+  }
+
+  /* the background band is blended in place and written straight out */
+  arena = createArena((bgCols + 2L * fgCols) * STREAM_BAND_ROWS * sizeof(Pixel), 0);
+  if (!arena) {
+    fprintf(stderr, "Unable to allocate memory for the bands\n");
+    exit(-1);
+  }
+  output = arenaPixels(arena, STREAM_BAND_ROWS, bgCols);
+  foreground = arenaPixels(arena, STREAM_BAND_ROWS, fgCols);
+  mask = arenaAlloc(arena, (long)STREAM_BAND_ROWS * fgCols * maskChannels);
+  if (!output || !foreground || !mask) {
+    fprintf(stderr, "Unable to allocate memory for the bands\n");
+    exit(-1);
+  }
+
+  for (y = 0; y < bgRows; y += n) {
+    n = bgRows - y < STREAM_BAND_ROWS ? bgRows - y : STREAM_BAND_ROWS;
+    if (readPPMRows(bgReader, output, n) != n) {
+      fprintf(stderr, "Input image is truncated\n");
+      exit(-1);
+    }
+
+    /* rows of this band covered by the foreground */
+    first = y > dy ? y : dy;
+    last = y + n < dy + fgRows ? y + n : dy + fgRows;
+    if (first < last) {
+      if (readPPMRows(fgReader, foreground, last - first) != last - first ||
+          readImageRows(maskReader, mask, last - first) != last - first) {
+        fprintf(stderr, "Input image is truncated\n");
+        exit(-1);
+      }
+      for (j = first; j < last; j++) {
+        blendRow(output + (long)(j - y) * bgCols + dx,
+                 foreground + (long)(j - first) * fgCols,
+                 mask + (long)(j - first) * fgCols * maskChannels, maskChannels,
+                 fgCols);
+      }
+    }
+
+    writePPMRows(writer, output, n);
+  }
+
+  closePPMReader(fgReader);
+  closePPMReader(bgReader);
+  closePPMReader(maskReader);
+  destroyArena(arena);
+
+  return closePPMWriter(writer);
+}
+
+int blendTiled(ImageArena *arena, ThreadPool *pool, char *bgFile,
+               char *outFile, const Pixel *foreground,
+               const unsigned char *mask, int maskChannels, int fgRows,
+               int fgCols, int dx, int dy) {
+  TiledImage *output;
+  MaskSpans *spans;
+  Pixel *region;
+  int error;
+
+  if (!isTiledFile(outFile)) {
+    fprintf(stderr, "Output must be a %s file when the background is\n",
+            TILED_EXTENSION);
+    return -1;
+  }
+
+  output = openTiledCopy(bgFile, outFile);
+  if (!output) {
+    fprintf(stderr, "Unable to open %s\n", outFile);
+    return -1;
+  }
+
+  fprintf(stderr, "bgRows: %d, bgCols: %d\n", output->rows, output->cols);
+  if (dx < 0 || dy < 0 || dx + fgCols > output->cols ||
+      dy + fgRows > output->rows) {
+    fprintf(stderr, "Invalid offsets or dimensions too large for background\n");
+    closeTiled(output);
+    return -1;
+  }
+
+  region = arenaPixels(arena, fgRows, fgCols);
+  spans = buildMaskSpans(mask, fgRows, fgCols, maskChannels);
+  if (!region || !spans) {
+    fprintf(stderr, "Unable to allocate memory for the region\n");
+    exit(-1);
+  }
+
+  /* read back only the rectangle under the foreground */
+  error = readTiledRect(output, dx, dy, fgCols, fgRows, region);
+  if (!error)
+    compositeOffset(pool, region, NULL, fgRows, fgCols, foreground, mask,
+                    maskChannels, fgRows, fgCols, 0, 0, spans);
+  if (!error)
+    error = writeTiledRect(output, dx, dy, fgCols, fgRows, region);
+
+  if (closeTiled(output) != 0)
+    error = -1;
+  freeMaskSpans(spans);
+
+  return error;
+}
+
+int blendUpdate(ImageArena *arena, ThreadPool *pool, char *bgFile,
+                char *outFile, const Pixel *foreground,
+                const unsigned char *mask, int maskChannels, int fgRows,
+                int fgCols, int dx, int dy) {
+  PPMUpdate *output;
+  MaskSpans *spans;
+  Pixel *rows;
+  int first, n;
+  int error = 0;
+
+  output = openPPMUpdate(outFile);
+  if (!output) {
+    const Pixel *background;
+    int bgRows, bgCols, colors;
+
+    background = mapPPM(&bgRows, &bgCols, &colors, bgFile);
+    if (!background || writePPMParallel(background, bgRows, bgCols, colors,
+                                        outFile, 0, NULL) != 0) {
+      fprintf(stderr, "Unable to copy %s to %s\n", bgFile, outFile);
+      return -1;
+    }
+    unmapPPM(background);
+    fprintf(stderr, "copied %s to %s\n", bgFile, outFile);
+
+    output = openPPMUpdate(outFile);
+    if (!output) {
+      fprintf(stderr, "%s is not a ppm that can be updated\n", outFile);
+      return -1;
+    }
+  }
+
+  fprintf(stderr, "bgRows: %d, bgCols: %d\n", output->rows, output->cols);
+  if (dx < 0 || dy < 0 || dx + fgCols > output->cols ||
+      dy + fgRows > output->rows) {
+    fprintf(stderr, "Invalid offsets or dimensions too large for background\n");
+    closePPMUpdate(output);
+    return -1;
+  }
+
+  spans = buildMaskSpans(mask, fgRows, fgCols, maskChannels);
+  if (!spans) {
+    fprintf(stderr, "Unable to allocate memory for the mask spans\n");
+    exit(-1);
+  }
+
+  /* only the band of rows from the first to the last the mask shows */
+  first = dy + spans->top;
+  n = spans->bottom - spans->top;
+  if (n > 0) {
+    rows = arenaPixels(arena, n, output->cols);
+    if (!rows) {
+      fprintf(stderr, "Unable to allocate memory for the rows\n");
+      exit(-1);
+    }
+
+    error = readPPMRowsAt(output, rows, first, n);
+    if (!error)
+      compositeOffset(pool, rows, NULL, n, output->cols, foreground, mask,
+                      maskChannels, fgRows, fgCols, dx, -spans->top, spans);
+    if (!error)
+      error = writePPMRowsAt(output, rows, first, n);
+    fprintf(stderr, "updated rows %d to %d, %ld bytes\n", first, first + n - 1,
+            (long)n * output->cols * sizeof(Pixel));
+  }
+
+  if (closePPMUpdate(output) != 0)
+    error = -1;
+  freeMaskSpans(spans);
+
+  return error;
+}
+
+int sameFile(char *a, char *b) {
+  struct stat sa, sb;
+
+  return stat(a, &sa) == 0 && stat(b, &sb) == 0 && sa.st_dev == sb.st_dev &&
+         sa.st_ino == sb.st_ino;
+}
+
 int main(int argc, char *argv[]) {
-  Pixel *foreground, *background, *output;
-  Pixel *mask;
+  const Pixel *foreground, *background;
+  AlphaPlane *mask;
+  MaskSpans *spans;
+  Pixel *output = NULL;
+  ImageArena *arena;
   int fgRows, fgCols, bgRows, bgCols, maskRows, maskCols;
   int colors;
-  long i, j;
+  WriteStats stats;
   int dx, dy;
+  ThreadPool *pool;
+  int threads = 1;
+  int stream = 0;
+  int inPlace = 0;
+  int update = 0;
+  int bad = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "siuj:")) != -1) {
+    switch (opt) {
+    case 's': // stream the images instead of loading them whole
+      stream = 1;
+      break;
+    case 'i': // blend into a copy-on-write mapping of the background
+      inPlace = 1;
+      break;
+    case 'u': // rewrite only the changed rows of the output file
+      update = 1;
+      break;
+    case 'j': // threads to composite with, 0 for one per processor
+      threads = atoi(optarg);
+      break;
+    default:
+      bad = 1;
+    }
+  }
 
-  if (argc != 7) {
-    printf("Usage: %s <foreground file> <background file> <mask file> <dx> "
-           "<dy> <output file>\n",
+  if (bad || argc - optind != 6 || stream + inPlace + update > 1) {
+    printf("Usage: %s [-s | -i | -u] [-j threads] <foreground file> "
+           "<background file> <mask file> <dx> <dy> <output file>\n",
            argv[0]);
     return -1;
   }
+  argv += optind - 1;
 
   dx = atoi(argv[4]);
   dy = atoi(argv[5]);
 
+  if (stream) {
+    if (streamBlendOffset(argv[1], argv[2], argv[3], dx, dy, argv[6]) != 0) {
+      fprintf(stderr, "Unable to write %s\n", argv[6]);
+      exit(-1);
+    }
+    return 0;
+  }
+
   /* read foreground image */
-  foreground = readPPM(&fgRows, &fgCols, &colors, argv[1]);
+  foreground = mapPPM(&fgRows, &fgCols, &colors, argv[1]);
   if (!foreground) {
     fprintf(stderr, "Unable to read %s\n", argv[1]);
     exit(-1);
   }
 
-  /* read background image */
-  background = readPPM(&bgRows, &bgCols, &colors, argv[2]);
-  if (!background) {
-    fprintf(stderr, "Unable to read %s\n", argv[2]);
+  /* read mask image, as a single alpha plane when it is grey */
+  mask = readAlphaPlane(argv[3]);
+  if (!mask) {
+    fprintf(stderr, "Unable to read %s\n", argv[3]);
     exit(-1);
   }
+  maskRows = mask->rows;
+  maskCols = mask->cols;
 
-  /* read mask image */
-  mask = readPPM(&maskRows, &maskCols, &colors, argv[3]);
-  if (!mask) {
-    fprintf(stderr, "Unable to read %s\n", argv[3]);
+  /* all frame buffers come from one arena */
+  arena = createArena(0, ARENA_HUGE_PAGES);
+  pool = createThreadPool(threads);
+  if (!arena || !pool) {
+    fprintf(stderr, "Unable to allocate memory for the images\n");
     exit(-1);
   }
 
-  fprintf(stdout, "maskRows: %d, maskCols: %d\n", maskRows, maskCols);
-  fprintf(stdout, "fgRows: %d, fgCols: %d\n", fgRows, fgCols);
-  fprintf(stdout, "bgRows: %d, bgCols: %d\n", bgRows, bgCols);
+  /* with a tiled background only the tiles under the foreground are touched */
+  if (isTiledFile(argv[2])) {
+    if (fgRows != maskRows || fgCols != maskCols ||
+        blendTiled(arena, pool, argv[2], argv[6], foreground, mask->alpha,
+                   mask->channels, fgRows, fgCols, dx, dy) != 0) {
+      fprintf(stderr, "Unable to composite onto %s\n", argv[2]);
+      exit(-1);
+    }
+    unmapPPM(foreground);
+    freeAlphaPlane(mask);
+    destroyThreadPool(pool);
+    destroyArena(arena);
+    return 0;
+  }
+
+  /* with -u only the rows under the foreground are read and written; so too
+   * with -i onto the background itself, which is then updated where it is */
+  if (inPlace && sameFile(argv[2], argv[6]))
+    update = 1;
+  if (update) {
+    if (fgRows != maskRows || fgCols != maskCols ||
+        blendUpdate(arena, pool, argv[2], argv[6], foreground, mask->alpha,
+                    mask->channels, fgRows, fgCols, dx, dy) != 0) {
+      fprintf(stderr, "Unable to update %s\n", argv[6]);
+      exit(-1);
+    }
+    unmapPPM(foreground);
+    freeAlphaPlane(mask);
+    destroyThreadPool(pool);
+    destroyArena(arena);
+    return 0;
+  }
+
+  /* read background image, as a private copy to blend into with -i */
+  if (inPlace) {
+    output = mapPPMPrivate(&bgRows, &bgCols, &colors, argv[2]);
+    background = output;
+  } else
+    background = mapPPM(&bgRows, &bgCols, &colors, argv[2]);
+  if (!background) {
+    fprintf(stderr, "Unable to read %s\n", argv[2]);
+    exit(-1);
+  }
+
+  fprintf(stderr, "maskRows: %d, maskCols: %d\n", maskRows, maskCols);
+  fprintf(stderr, "fgRows: %d, fgCols: %d\n", fgRows, fgCols);
+  fprintf(stderr, "bgRows: %d, bgCols: %d\n", bgRows, bgCols);
 
   /* ensure foreground, mask, and background dimensions and offsets are
    * compatible */
@@ -62,51 +399,42 @@ int main(int argc, char *argv[]) {
     exit(-1);
   }
 
-  /* allocate memory for the output image */
-  output = malloc(bgRows * bgCols * sizeof(Pixel));
-  if (!output) {
+  /* allocate memory for the output image, unless blending in place */
+  if (!inPlace)
+    output = arenaPixels(arena, bgRows, bgCols);
+
+  /* find the clear, solid and edge runs of the mask */
+  spans = buildMaskSpans(mask->alpha, maskRows, maskCols, mask->channels);
+  if (!output || !spans) {
     fprintf(stderr, "Unable to allocate memory for output image\n");
     exit(-1);
   }
 
-  /* Copy background to output initially */
-  for (i = 0; i < bgRows * bgCols; i++) {
-    output[i] = background[i];
-  }
-
-  /* blend the images together at the offsets */
-  for (j = 0; j < fgRows; j++) {
-    for (i = 0; i < fgCols; i++) {
-      long indexFG = j * fgCols + i;
-      long indexBG = (j + dy) * bgCols + (i + dx);
-      float alpha = mask[indexFG].g / 255.0;
-      float beta = mask[indexFG].r / 255.0;
-      float gamma = mask[indexFG].b / 255.0;
-
-      output[indexBG].r = (unsigned char)(beta * foreground[indexFG].r +
-                                          (1 - beta) * output[indexBG].r);
-      output[indexBG].g = (unsigned char)(alpha * foreground[indexFG].g +
-                                          (1 - alpha) * output[indexBG].g);
-      output[indexBG].b = (unsigned char)(gamma * foreground[indexFG].b +
-                                          (1 - gamma) * output[indexBG].b);
-    }
-  }
+  /* copy the background and blend the images together at the offsets, a
+   * tile per task */
+  compositeOffset(pool, output, inPlace ? NULL : background, bgRows, bgCols,
+                  foreground, mask->alpha, mask->channels, fgRows, fgCols, dx,
+                  dy, spans);
+  fprintf(stderr, "mask: %ld solid, %ld edge of %ld pixels in %d x %d\n",
+          spans->solid, spans->edge, (long)spans->rows * spans->cols,
+          spans->right - spans->left, spans->bottom - spans->top);
 
   /* output the blended image */
-  writePPM(output, bgRows, bgCols, colors, argv[6]);
+  if (writePPMParallel(output, bgRows, bgCols, colors, argv[6], 0, &stats) != 0) {
+    fprintf(stderr, "Unable to write %s\n", argv[6]);
+    exit(-1);
+  }
+  fprintf(stderr, "wrote %ld bytes in %.3f s (%.1f MB/s)\n", stats.bytes,
+          stats.seconds, writeBandwidth(&stats));
+  fprintf(stderr, "arena peak: %.1f MB\n", arenaPeak(arena) / (1024.0 * 1024.0));
 
   /* Free memory */
-#if USECPP
-  delete[] foreground;
-  delete[] background;
-  delete[] mask;
-  delete[] output;
-#else
-  free(foreground);
-  free(background);
-  free(mask);
-  free(output);
-#endif
+  unmapPPM(foreground);
+  unmapPPM(background);
+  freeAlphaPlane(mask);
+  freeMaskSpans(spans);
+  destroyThreadPool(pool);
+  destroyArena(arena);
 
   return 0;
 }
@@ -1,86 +1,243 @@
+#include "alphaPlane.h"
+#include "composite.h"
+#include "imageArena.h"
+#include "mipmap.h"
 #include "ppmIO.h"
+#include "ppmWrite.h"
+#include "resample.h"
+#include "tileIO.h"
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #define USECPP 0
 
-/* scale an image using nearest neighbor interpolation */
-static Pixel *scaleImage(Pixel *input, int oldRows, int oldCols,
-                         float scaleFactor, int *newRows, int *newCols);
+/* composite the scaled foreground onto a tiled background, touching only
+ * the tiles under it */
+static int blendTiled(ImageArena *arena, ThreadPool *pool, char *bgFile,
+                      char *outFile, const Pixel *foreground,
+                      const unsigned char *mask, int maskChannels, int fgRows,
+                      int fgCols, float scaleFactor, int dx, int dy);
 
-Pixel *scaleImage(Pixel *input, int oldRows, int oldCols, float scaleFactor,
-                  int *newRows, int *newCols) {
-  *newRows = (int)(oldRows * scaleFactor);
-  *newCols = (int)(oldCols * scaleFactor);
-  Pixel *output = malloc(*newRows * *newCols * sizeof(Pixel));
+int blendTiled(ImageArena *arena, ThreadPool *pool, char *bgFile,
+               char *outFile, const Pixel *foreground,
+               const unsigned char *mask, int maskChannels, int fgRows,
+               int fgCols, float scaleFactor, int dx, int dy) {
+  TiledImage *output;
+  MaskSpans *spans;
+  Pixel *region;
+  int scaledRows, scaledCols;
+  int error;
+
+  if (!isTiledFile(outFile)) {
+    fprintf(stderr, "Output must be a %s file when the background is\n",
+            TILED_EXTENSION);
+    return -1;
+  }
+
+  output = openTiledCopy(bgFile, outFile);
   if (!output) {
-    fprintf(stderr, "Unable to allocate memory for scaled image\n");
-    exit(-1);
+    fprintf(stderr, "Unable to open %s\n", outFile);
+    return -1;
   }
 
-  for (int y = 0; y < *newRows; ++y) {
-    for (int x = 0; x < *newCols; ++x) {
-      int oldX = (int)(x / scaleFactor);
-      int oldY = (int)(y / scaleFactor);
-      output[y * (*newCols) + x] = input[oldY * oldCols + oldX];
-    }
+  fprintf(stderr, "bgRows: %d, bgCols: %d\n", output->rows, output->cols);
+  if (scaledSize(fgRows, fgCols, scaleFactor, &scaledRows, &scaledCols) != 0) {
+    fprintf(stderr, "Scale factor is not finite or too large\n");
+    closeTiled(output);
+    return -1;
+  }
+  if (dx < 0 || dy < 0 || dx + scaledCols > output->cols ||
+      dy + scaledRows > output->rows) {
+    fprintf(stderr, "Invalid offsets or dimensions too large for background\n");
+    closeTiled(output);
+    return -1;
+  }
+
+  region = arenaPixels(arena, scaledRows, scaledCols);
+  spans = buildMaskSpans(mask, fgRows, fgCols, maskChannels);
+  if (!region || !spans) {
+    fprintf(stderr, "Unable to allocate memory for the region\n");
+    exit(-1);
   }
 
-  return output;
+  /* read back only the rectangle under the foreground */
+  error = readTiledRect(output, dx, dy, scaledCols, scaledRows, region);
+  if (!error)
+    error = compositeScaled(pool, region, NULL, scaledRows, scaledCols,
+                            foreground, mask, maskChannels, fgRows, fgCols,
+                            scaleFactor, 0, 0, spans);
+  if (!error)
+    error = writeTiledRect(output, dx, dy, scaledCols, scaledRows, region);
+
+  if (closeTiled(output) != 0)
+    error = -1;
+  freeMaskSpans(spans);
+
+  return error;
 }
 
 int main(int argc, char *argv[]) {
-  Pixel *foreground, *background, *output;
-  Pixel *mask, *scaledForeground, *scaledMask;
+  const Pixel *foreground, *background;
+  const unsigned char *alpha;
+  AlphaPlane *mask;
+  Mipmap *fgMipmap = NULL, *maskMipmap = NULL;
+  Pixel *output;
+  MaskSpans *spans;
+  ImageArena *arena;
   int fgRows, fgCols, bgRows, bgCols, maskRows, maskCols;
   int scaledFgRows, scaledFgCols;
   int colors;
-  long i, j;
+  WriteStats stats;
+  ThreadPool *pool;
+  int threads = 1;
+  int filter = RESAMPLE_NEAREST;
+  int mipmaps = 0;
+  int level = 0;
+  int channels;
   int dx, dy;
   float scaleFactor;
+  int bad = 0;
+  int opt;
 
-  if (argc != 8) {
-    printf("Usage: %s <foreground file> <background file> <mask file> <dx> "
-           "<dy> <scaleFactor> <output file>\n",
+  while ((opt = getopt(argc, argv, "j:f:m")) != -1) {
+    switch (opt) {
+    case 'j': // threads to composite with, 0 for one per processor
+      threads = atoi(optarg);
+      break;
+    case 'f': // filter to scale with
+      filter = resampleFilter(optarg);
+      if (filter < 0)
+        bad = 1;
+      break;
+    case 'm': // scale from the mipmap pyramids kept next to the images
+      mipmaps = 1;
+      break;
+    default:
+      bad = 1;
+    }
+  }
+
+  if (bad || argc - optind != 7) {
+    printf("Usage: %s [-j threads] [-f nearest|box|bilinear|lanczos3] [-m] "
+           "<foreground file> <background file> "
+           "<mask file> <dx> <dy> <scaleFactor> <output file>\n",
            argv[0]);
     return -1;
   }
+  argv += optind - 1;
 
   dx = atoi(argv[4]);
   dy = atoi(argv[5]);
   scaleFactor = atof(argv[6]);
 
   /* read foreground image */
-  foreground = readPPM(&fgRows, &fgCols, &colors, argv[1]);
+  foreground = mapPPM(&fgRows, &fgCols, &colors, argv[1]);
   if (!foreground) {
     fprintf(stderr, "Unable to read %s\n", argv[1]);
     exit(-1);
   }
 
-  /* read background image */
-  background = readPPM(&bgRows, &bgCols, &colors, argv[2]);
-  if (!background) {
-    fprintf(stderr, "Unable to read %s\n", argv[2]);
+  /* read mask image, as a single alpha plane when it is grey */
+  mask = readAlphaPlane(argv[3]);
+  if (!mask) {
+    fprintf(stderr, "Unable to read %s\n", argv[3]);
     exit(-1);
   }
+  alpha = mask->alpha;
+  channels = mask->channels;
+  maskRows = mask->rows;
+  maskCols = mask->cols;
 
-  /* read mask image */
-  mask = readPPM(&maskRows, &maskCols, &colors, argv[3]);
-  if (!mask) {
-    fprintf(stderr, "Unable to read %s\n", argv[3]);
+  /* all frame buffers come from one arena */
+  arena = createArena(0, ARENA_HUGE_PAGES);
+  pool = createThreadPool(threads);
+  if (!arena || !pool) {
+    fprintf(stderr, "Unable to allocate memory for the images\n");
     exit(-1);
   }
 
-  /* Scale foreground and mask images */
-  scaledForeground = scaleImage(foreground, fgRows, fgCols, scaleFactor,
-                                &scaledFgRows, &scaledFgCols);
-  scaledMask = scaleImage(mask, maskRows, maskCols, scaleFactor, &scaledFgRows,
-                          &scaledFgCols);
+  /* the foreground and mask are scaled as they are blended */
+  if (fgRows != maskRows || fgCols != maskCols || scaleFactor <= 0 ||
+      scaledSize(maskRows, maskCols, scaleFactor, &scaledFgRows,
+                 &scaledFgCols) != 0) {
+    fprintf(stderr, "Dimension mismatch or invalid scale factor\n");
+    exit(-1);
+  }
 
-  fprintf(stdout, "Scaled maskRows: %d, Scaled maskCols: %d\n", scaledFgRows,
+  fprintf(stderr, "Scaled maskRows: %d, Scaled maskCols: %d\n", scaledFgRows,
           scaledFgCols);
-  fprintf(stdout, "bgRows: %d, bgCols: %d\n", bgRows, bgCols);
+
+  /* with -m the scaling starts from the smallest pyramid level that is
+   * still at least the scaled size, building the pyramids if need be */
+  if (mipmaps) {
+    fgMipmap = openMipmaps(argv[1], fgRows, fgCols);
+    maskMipmap = openMipmaps(argv[3], maskRows, maskCols);
+    if (!fgMipmap || !maskMipmap || fgMipmap->channels == 1)
+      fprintf(stderr, "Unable to build the mipmaps, scaling from full size\n");
+    else
+      level = mipmapLevelFor(fgMipmap, scaledFgRows, scaledFgCols);
+    fprintf(stderr, "mipmap level %d: %d x %d\n", level,
+            level ? fgMipmap->cols[level] : fgCols,
+            level ? fgMipmap->rows[level] : fgRows);
+  }
+
+  /* a pyramid level or any other filter is resampled up front, leaving the
+   * compositor nothing to scale */
+  if (filter != RESAMPLE_NEAREST || level > 0) {
+    const unsigned char *source = level ? fgMipmap->samples[level]
+                                        : (const unsigned char *)foreground;
+    const unsigned char *sourceMask = level ? maskMipmap->samples[level] : alpha;
+    int sourceChannels = level ? maskMipmap->channels : channels;
+    int sourceRows = level ? fgMipmap->rows[level] : fgRows;
+    int sourceCols = level ? fgMipmap->cols[level] : fgCols;
+    Pixel *resampled = arenaPixels(arena, scaledFgRows, scaledFgCols);
+    unsigned char *resampledMask = arenaAlloc(
+        arena, (long)scaledFgRows * scaledFgCols * sourceChannels);
+
+    if (!resampled || !resampledMask ||
+        resampleImage(pool, (unsigned char *)resampled, scaledFgRows,
+                      scaledFgCols, source, sourceRows, sourceCols, 3,
+                      filter) != 0 ||
+        resampleImage(pool, resampledMask, scaledFgRows, scaledFgCols,
+                      sourceMask, sourceRows, sourceCols, sourceChannels,
+                      filter) != 0) {
+      fprintf(stderr, "Unable to resample the foreground and mask\n");
+      exit(-1);
+    }
+    unmapPPM(foreground);
+    foreground = resampled;
+    alpha = resampledMask;
+    channels = sourceChannels;
+    fgRows = maskRows = scaledFgRows;
+    fgCols = maskCols = scaledFgCols;
+    scaleFactor = 1.0f;
+  }
+  closeMipmaps(fgMipmap);
+  closeMipmaps(maskMipmap);
+
+  /* with a tiled background only the tiles under the foreground are touched */
+  if (isTiledFile(argv[2])) {
+    if (blendTiled(arena, pool, argv[2], argv[7], foreground, alpha,
+                   channels, fgRows, fgCols, scaleFactor, dx, dy) != 0) {
+      fprintf(stderr, "Unable to composite onto %s\n", argv[2]);
+      exit(-1);
+    }
+    unmapPPM(foreground);
+    freeAlphaPlane(mask);
+    destroyThreadPool(pool);
+    destroyArena(arena);
+    return 0;
+  }
+
+  /* read background image */
+  background = mapPPM(&bgRows, &bgCols, &colors, argv[2]);
+  if (!background) {
+    fprintf(stderr, "Unable to read %s\n", argv[2]);
+    exit(-1);
+  }
+  fprintf(stderr, "bgRows: %d, bgCols: %d\n", bgRows, bgCols);
 
   /* ensure scaled dimensions and offsets are compatible */
   if (dx < 0 || dy < 0 || dx + scaledFgCols > bgCols ||
@@ -90,53 +247,43 @@ int main(int argc, char *argv[]) {
   }
 
   /* allocate memory for the output image */
-  output = malloc(bgRows * bgCols * sizeof(Pixel));
-  if (!output) {
+  output = arenaPixels(arena, bgRows, bgCols);
+
+  /* find the clear, solid and edge runs of the mask */
+  spans = buildMaskSpans(alpha, maskRows, maskCols, channels);
+  if (!output || !spans) {
     fprintf(stderr, "Unable to allocate memory for output image\n");
     exit(-1);
   }
 
-  /* Copy background to output initially */
-  for (i = 0; i < bgRows * bgCols; i++) {
-    output[i] = background[i];
+  /* copy the background and blend the images together at the offsets,
+   * sampling the scaled foreground and mask from the originals, a tile per
+   * task */
+  if (compositeScaled(pool, output, background, bgRows, bgCols, foreground,
+                      alpha, channels, fgRows, fgCols, scaleFactor,
+                      dx, dy, spans) != 0) {
+    fprintf(stderr, "Unable to allocate memory for the scale tables\n");
+    exit(-1);
   }
+  fprintf(stderr, "mask: %ld solid, %ld edge of %ld pixels in %d x %d\n",
+          spans->solid, spans->edge, (long)spans->rows * spans->cols,
+          spans->right - spans->left, spans->bottom - spans->top);
 
-  /* blend the scaled images together at the offsets */
-  for (j = 0; j < scaledFgRows; j++) {
-    for (i = 0; i < scaledFgCols; i++) {
-      long indexFG = j * scaledFgCols + i;
-      long indexBG = (j + dy) * bgCols + (i + dx);
-      float alpha = scaledMask[indexFG].g / 255.0;
-      float beta = scaledMask[indexFG].r / 255.0;
-      float gamma = scaledMask[indexFG].b / 255.0;
-
-      output[indexBG].r = (unsigned char)(beta * scaledForeground[indexFG].r +
-                                          (1 - beta) * output[indexBG].r);
-      output[indexBG].g = (unsigned char)(alpha * scaledForeground[indexFG].g +
-                                          (1 - alpha) * output[indexBG].g);
-      output[indexBG].b = (unsigned char)(gamma * scaledForeground[indexFG].b +
-                                          (1 - gamma) * output[indexBG].b);
-    }
+  /* output the blended image */
+  if (writePPMParallel(output, bgRows, bgCols, colors, argv[7], 0, &stats) != 0) {
+    fprintf(stderr, "Unable to write %s\n", argv[7]);
+    exit(-1);
   }
+  fprintf(stderr, "wrote %ld bytes in %.3f s (%.1f MB/s)\n", stats.bytes,
+          stats.seconds, writeBandwidth(&stats));
+  fprintf(stderr, "arena peak: %.1f MB\n", arenaPeak(arena) / (1024.0 * 1024.0));
 
-  /* output the blended image */
-  writePPM(output, bgRows, bgCols, colors, argv[7]);
-
-#if USECPP
-  delete[] foreground;
-  delete[] background;
-  delete[] mask;
-  delete[] output;
-  delete[] scaledForeground;
-  delete[] scaledMask;
-#else
-  free(foreground);
-  free(background);
-  free(mask);
-  free(output);
-  free(scaledForeground);
-  free(scaledMask);
-#endif
+  unmapPPM(foreground);
+  unmapPPM(background);
+  freeAlphaPlane(mask);
+  freeMaskSpans(spans);
+  destroyThreadPool(pool);
+  destroyArena(arena);
 
   return 0;
 }
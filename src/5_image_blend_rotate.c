@@ -1,122 +1,159 @@
+#include "alphaPlane.h"
+#include "composite.h"
+#include "imageArena.h"
+#include "orient.h"
 #include "ppmIO.h"
+#include "ppmWrite.h"
+#include "resample.h"
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #define USECPP 0
 
-/* scale an image using nearest neighbor interpolation */
-static Pixel *scaleImage(Pixel *input, int oldRows, int oldCols,
-                         float scaleFactor, int *newRows, int *newCols);
-
-/* rotate an image by 90 degrees clockwise */
-static Pixel *rotateImage90(Pixel *input, int oldRows, int oldCols,
-                            int *newRows, int *newCols);
-
-
-Pixel *scaleImage(Pixel *input, int oldRows, int oldCols, float scaleFactor,
-                  int *newRows, int *newCols) {
-  *newRows = (int)(oldRows * scaleFactor);
-  *newCols = (int)(oldCols * scaleFactor);
-  Pixel *output = malloc(*newRows * *newCols * sizeof(Pixel));
-  if (!output) {
-    fprintf(stderr, "Unable to allocate memory for scaled image\n");
-    exit(-1);
-  }
-
-  for (int y = 0; y < *newRows; ++y) {
-    for (int x = 0; x < *newCols; ++x) {
-      int oldX = (int)(x / scaleFactor);
-      int oldY = (int)(y / scaleFactor);
-      output[y * (*newCols) + x] = input[oldY * oldCols + oldX];
-    }
-  }
-
-  return output;
-}
-
-Pixel *rotateImage90(Pixel *input, int oldRows, int oldCols, int *newRows,
-                     int *newCols) {
-  *newRows = oldCols;
-  *newCols = oldRows;
-  Pixel *output = malloc(*newRows * *newCols * sizeof(Pixel));
-  if (!output) {
-    fprintf(stderr, "Unable to allocate memory for rotated image\n");
-    exit(-1);
-  }
-
-  for (int y = 0; y < oldRows; ++y) {
-    for (int x = 0; x < oldCols; ++x) {
-      output[x * (*newCols) + (oldRows - y - 1)] = input[y * oldCols + x];
-    }
-  }
-
-  return output;
-}
 
 int main(int argc, char *argv[]) {
-  Pixel *foreground, *background, *output;
-  Pixel *mask, *scaledForeground, *scaledMask;
+  const Pixel *foreground, *background;
+  const unsigned char *mask;
+  AlphaPlane *maskPlane;
+  Pixel *output;
+  MaskSpans *spans;
+  ImageArena *arena;
   int fgRows, fgCols, bgRows, bgCols, maskRows, maskCols;
   int scaledFgRows, scaledFgCols;
   int colors;
-  long i, j;
+  WriteStats stats;
+  ThreadPool *pool;
+  int threads = 1;
+  int filter = RESAMPLE_NEAREST;
   int dx, dy;
   float scaleFactor;
-  int rotate;
+  int orientation;
+  int channels;
+  int bad = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "j:f:")) != -1) {
+    switch (opt) {
+    case 'j': // threads to composite with, 0 for one per processor
+      threads = atoi(optarg);
+      break;
+    case 'f': // filter to scale with
+      filter = resampleFilter(optarg);
+      if (filter < 0)
+        bad = 1;
+      break;
+    default:
+      bad = 1;
+    }
+  }
 
-  if (argc != 9) {
-    printf("Usage: %s <foreground file> <background file> <mask file> <dx> "
-           "<dy> <scaleFactor> <rotate (0 or 1)> <output file>\n",
+  if (bad || argc - optind != 8) {
+    printf("Usage: %s [-j threads] [-f nearest|box|bilinear|lanczos3] "
+           "<foreground file> <background file> "
+           "<mask file> <dx> <dy> <scaleFactor> <orientation> <output file>\n"
+           "  orientation: 0 or none, 1 or 90, 180, 270, fliph, flipv, "
+           "transpose or transverse\n",
            argv[0]);
     return -1;
   }
+  argv += optind - 1;
 
   dx = atoi(argv[4]);
   dy = atoi(argv[5]);
   scaleFactor = atof(argv[6]);
-  rotate = atoi(argv[7]);
+  orientation = orientationFor(argv[7]);
+  if (orientation < 0) {
+    fprintf(stderr, "Unknown orientation %s\n", argv[7]);
+    exit(-1);
+  }
 
   /* read foreground image */
-  foreground = readPPM(&fgRows, &fgCols, &colors, argv[1]);
+  foreground = mapPPM(&fgRows, &fgCols, &colors, argv[1]);
   if (!foreground) {
     fprintf(stderr, "Unable to read %s\n", argv[1]);
     exit(-1);
   }
 
   /* read background image */
-  background = readPPM(&bgRows, &bgCols, &colors, argv[2]);
+  background = mapPPM(&bgRows, &bgCols, &colors, argv[2]);
   if (!background) {
     fprintf(stderr, "Unable to read %s\n", argv[2]);
     exit(-1);
   }
 
-  /* read mask image */
-  mask = readPPM(&maskRows, &maskCols, &colors, argv[3]);
-  if (!mask) {
+  /* read mask image, as a single alpha plane when it is grey */
+  maskPlane = readAlphaPlane(argv[3]);
+  if (!maskPlane) {
     fprintf(stderr, "Unable to read %s\n", argv[3]);
     exit(-1);
   }
+  mask = maskPlane->alpha;
+  maskRows = maskPlane->rows;
+  maskCols = maskPlane->cols;
+  channels = maskPlane->channels;
+
+  /* all frame buffers come from one arena */
+  arena = createArena(0, ARENA_HUGE_PAGES);
+  pool = createThreadPool(threads);
+  if (!arena || !pool) {
+    fprintf(stderr, "Unable to allocate memory for the images\n");
+    exit(-1);
+  }
 
-  /* rotate foreground and mask images if needed */
-  if (rotate) {
-    Pixel *rotatedForeground = rotateImage90(foreground, fgRows, fgCols, &fgRows, &fgCols);
-    free(foreground);
-    foreground = rotatedForeground;
-    Pixel *rotatedMask = rotateImage90(mask, maskRows, maskCols, &maskRows, &maskCols);
-    free(mask);
-    mask = rotatedMask;
+  /* rotate or flip foreground and mask images if needed */
+  if (orientation != ORIENT_NORMAL) {
+    const Pixel *oriented;
+
+    oriented = (const Pixel *)orientedCopy(
+        arena, pool, (const unsigned char *)foreground, fgRows, fgCols, 3,
+        orientation, &fgRows, &fgCols);
+    unmapPPM(foreground);
+    foreground = oriented;
+    mask = orientedCopy(arena, pool, mask, maskRows, maskCols, channels,
+                        orientation, &maskRows, &maskCols);
+    if (!foreground || !mask) {
+      fprintf(stderr, "Unable to allocate memory for oriented image\n");
+      exit(-1);
+    }
+  }
+
+  /* the foreground and mask are scaled as they are blended */
+  if (fgRows != maskRows || fgCols != maskCols || scaleFactor <= 0 ||
+      scaledSize(maskRows, maskCols, scaleFactor, &scaledFgRows,
+                 &scaledFgCols) != 0) {
+    fprintf(stderr, "Dimension mismatch or invalid scale factor\n");
+    exit(-1);
   }
 
-  /* scale foreground and mask images */
-  scaledForeground = scaleImage(foreground, fgRows, fgCols, scaleFactor,
-                                &scaledFgRows, &scaledFgCols);
-  scaledMask = scaleImage(mask, maskRows, maskCols, scaleFactor, &scaledFgRows,
-                          &scaledFgCols);
+  /* any other filter resamples the foreground and mask up front, leaving
+   * the compositor nothing to scale */
+  if (filter != RESAMPLE_NEAREST) {
+    Pixel *resampled = arenaPixels(arena, scaledFgRows, scaledFgCols);
+    unsigned char *resampledMask =
+        arenaAlloc(arena, (long)scaledFgRows * scaledFgCols * channels);
+
+    if (!resampled || !resampledMask ||
+        resampleImage(pool, (unsigned char *)resampled, scaledFgRows,
+                      scaledFgCols, (const unsigned char *)foreground, fgRows,
+                      fgCols, 3, filter) != 0 ||
+        resampleImage(pool, resampledMask, scaledFgRows, scaledFgCols, mask,
+                      maskRows, maskCols, channels, filter) != 0) {
+      fprintf(stderr, "Unable to resample the foreground and mask\n");
+      exit(-1);
+    }
+    unmapPPM(foreground);
+    foreground = resampled;
+    mask = resampledMask;
+    fgRows = maskRows = scaledFgRows;
+    fgCols = maskCols = scaledFgCols;
+    scaleFactor = 1.0f;
+  }
 
-  fprintf(stdout, "Scaled maskRows: %d, Scaled maskCols: %d\n", scaledFgRows,
+  fprintf(stderr, "Scaled maskRows: %d, Scaled maskCols: %d\n", scaledFgRows,
           scaledFgCols);
-  fprintf(stdout, "bgRows: %d, bgCols: %d\n", bgRows, bgCols);
+  fprintf(stderr, "bgRows: %d, bgCols: %d\n", bgRows, bgCols);
 
   /* ensure scaled dimensions and offsets are compatible */
   if (dx < 0 || dy < 0 || dx + scaledFgCols > bgCols ||
@@ -126,53 +163,43 @@ int main(int argc, char *argv[]) {
   }
 
   /* allocate memory for the output image */
-  output = malloc(bgRows * bgCols * sizeof(Pixel));
-  if (!output) {
+  output = arenaPixels(arena, bgRows, bgCols);
+
+  /* find the clear, solid and edge runs of the mask */
+  spans = buildMaskSpans(mask, maskRows, maskCols, channels);
+  if (!output || !spans) {
     fprintf(stderr, "Unable to allocate memory for output image\n");
     exit(-1);
   }
 
-  /* Copy background to output initially */
-  for (i = 0; i < bgRows * bgCols; i++) {
-    output[i] = background[i];
-  }
-
-  /* blend the scaled images together at the offsets */
-  for (j = 0; j < scaledFgRows; j++) {
-    for (i = 0; i < scaledFgCols; i++) {
-      long indexFG = j * scaledFgCols + i;
-      long indexBG = (j + dy) * bgCols + (i + dx);
-      float alpha = scaledMask[indexFG].g / 255.0;
-      float beta = scaledMask[indexFG].r / 255.0;
-      float gamma = scaledMask[indexFG].b / 255.0;
-
-      output[indexBG].r = (unsigned char)(beta * scaledForeground[indexFG].r +
-                                          (1 - beta) * output[indexBG].r);
-      output[indexBG].g = (unsigned char)(alpha * scaledForeground[indexFG].g +
-                                          (1 - alpha) * output[indexBG].g);
-      output[indexBG].b = (unsigned char)(gamma * scaledForeground[indexFG].b +
-                                          (1 - gamma) * output[indexBG].b);
-    }
+  /* copy the background and blend the images together at the offsets,
+   * sampling the scaled foreground and mask from the originals, a tile per
+   * task */
+  if (compositeScaled(pool, output, background, bgRows, bgCols, foreground,
+                      mask, channels, maskRows, maskCols, scaleFactor, dx, dy,
+                      spans) != 0) {
+    fprintf(stderr, "Unable to allocate memory for the scale tables\n");
+    exit(-1);
   }
+  fprintf(stderr, "mask: %ld solid, %ld edge of %ld pixels in %d x %d\n",
+          spans->solid, spans->edge, (long)spans->rows * spans->cols,
+          spans->right - spans->left, spans->bottom - spans->top);
 
   /* output the blended image */
-  writePPM(output, bgRows, bgCols, colors, argv[8]);
-
-#if USECPP
-  delete[] foreground;
-  delete[] background;
-  delete[] mask;
-  delete[] output;
-  delete[] scaledForeground;
-  delete[] scaledMask;
-#else
-  free(foreground);
-  free(background);
-  free(mask);
-  free(output);
-  free(scaledForeground);
-  free(scaledMask);
-#endif
+  if (writePPMParallel(output, bgRows, bgCols, colors, argv[8], 0, &stats) != 0) {
+    fprintf(stderr, "Unable to write %s\n", argv[8]);
+    exit(-1);
+  }
+  fprintf(stderr, "wrote %ld bytes in %.3f s (%.1f MB/s)\n", stats.bytes,
+          stats.seconds, writeBandwidth(&stats));
+  fprintf(stderr, "arena peak: %.1f MB\n", arenaPeak(arena) / (1024.0 * 1024.0));
+
+  unmapPPM(foreground);
+  unmapPPM(background);
+  freeAlphaPlane(maskPlane);
+  freeMaskSpans(spans);
+  destroyThreadPool(pool);
+  destroyArena(arena);
 
   return 0;
 }
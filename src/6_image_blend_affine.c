@@ -0,0 +1,145 @@
+#include "alphaPlane.h"
+#include "imageArena.h"
+#include "ppmIO.h"
+#include "ppmWrite.h"
+#include "resample.h"
+#include "warp.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define USECPP 0
+
+/* Take in a foreground image, a background image and a mask image, scale the
+ * foreground and mask by any factor, turn them clockwise by any angle about
+ * their centre and blend them onto the background with the top left of the
+ * box bounding them at dx and dy.  Every output pixel is mapped straight back
+ * into the foreground and mask, so no rotated or scaled copies are made;
+ * whatever falls off the background is clipped. */
+
+/* Compile with ../bin/6_image_blend_affine -f bilinear powerpuff.ppm
+ * background_large.ppm mask_powerpuff.ppm 100 50 0.8 30
+ * blend_result_affine_powerpuff.ppm */
+
+int main(int argc, char *argv[]) {
+  const Pixel *foreground, *background;
+  AlphaPlane *maskPlane;
+  Pixel *output;
+  ImageArena *arena;
+  int fgRows, fgCols, bgRows, bgCols;
+  int boxRows, boxCols;
+  int colors;
+  WriteStats stats;
+  ThreadPool *pool;
+  int threads = 1;
+  int filter = RESAMPLE_NEAREST;
+  int dx, dy;
+  float scaleFactor, angle;
+  int bad = 0;
+  int opt;
+
+  /* options stop at the first operand, so negative offsets and angles are
+   * not taken for options */
+  while ((opt = getopt(argc, argv, "+j:f:")) != -1) {
+    switch (opt) {
+    case 'j': // threads to composite with, 0 for one per processor
+      threads = atoi(optarg);
+      break;
+    case 'f': // filter to sample with
+      filter = resampleFilter(optarg);
+      if (filter != RESAMPLE_NEAREST && filter != RESAMPLE_BILINEAR)
+        bad = 1;
+      break;
+    default:
+      bad = 1;
+    }
+  }
+
+  if (bad || argc - optind != 8) {
+    printf("Usage: %s [-j threads] [-f nearest|bilinear] "
+           "<foreground file> <background file> "
+           "<mask file> <dx> <dy> <scaleFactor> <angle (degrees clockwise)> "
+           "<output file>\n",
+           argv[0]);
+    return -1;
+  }
+  argv += optind - 1;
+
+  dx = atoi(argv[4]);
+  dy = atoi(argv[5]);
+  scaleFactor = atof(argv[6]);
+  angle = atof(argv[7]);
+  if (!isfinite(scaleFactor) || !isfinite(angle) ||
+      scaleFactor < WARP_MIN_SCALE) {
+    fprintf(stderr,
+            "Usage: <scaleFactor> must be a finite number of at least %g and "
+            "<angle> a finite number of degrees\n",
+            WARP_MIN_SCALE);
+    exit(-1);
+  }
+
+  /* read foreground image */
+  foreground = mapPPM(&fgRows, &fgCols, &colors, argv[1]);
+  if (!foreground) {
+    fprintf(stderr, "Unable to read %s\n", argv[1]);
+    exit(-1);
+  }
+
+  /* read background image */
+  background = mapPPM(&bgRows, &bgCols, &colors, argv[2]);
+  if (!background) {
+    fprintf(stderr, "Unable to read %s\n", argv[2]);
+    exit(-1);
+  }
+
+  /* read mask image, as a single alpha plane when it is grey */
+  maskPlane = readAlphaPlane(argv[3]);
+  if (!maskPlane) {
+    fprintf(stderr, "Unable to read %s\n", argv[3]);
+    exit(-1);
+  }
+
+  if (fgRows != maskPlane->rows || fgCols != maskPlane->cols) {
+    fprintf(stderr, "Dimension mismatch\n");
+    exit(-1);
+  }
+  affineSize(fgRows, fgCols, scaleFactor, angle, &boxRows, &boxCols);
+  fprintf(stderr, "Warped maskRows: %d, Warped maskCols: %d\n", boxRows,
+          boxCols);
+  fprintf(stderr, "bgRows: %d, bgCols: %d\n", bgRows, bgCols);
+
+  /* allocate memory for the output image */
+  arena = createArena(0, ARENA_HUGE_PAGES);
+  pool = createThreadPool(threads);
+  output = arena ? arenaPixels(arena, bgRows, bgCols) : NULL;
+  if (!output || !pool) {
+    fprintf(stderr, "Unable to allocate memory for output image\n");
+    exit(-1);
+  }
+
+  /* copy the background and blend the warped foreground over it in one
+   * pass, a tile per task */
+  if (compositeAffine(pool, output, background, bgRows, bgCols, foreground,
+                      maskPlane->alpha, maskPlane->channels, fgRows, fgCols,
+                      scaleFactor, angle, dx, dy, filter) != 0) {
+    fprintf(stderr, "Unable to warp the foreground\n");
+    exit(-1);
+  }
+
+  /* output the blended image */
+  if (writePPMParallel(output, bgRows, bgCols, colors, argv[8], 0, &stats) != 0) {
+    fprintf(stderr, "Unable to write %s\n", argv[8]);
+    exit(-1);
+  }
+  fprintf(stderr, "wrote %ld bytes in %.3f s (%.1f MB/s)\n", stats.bytes,
+          stats.seconds, writeBandwidth(&stats));
+
+  unmapPPM(foreground);
+  unmapPPM(background);
+  freeAlphaPlane(maskPlane);
+  destroyThreadPool(pool);
+  destroyArena(arena);
+
+  return 0;
+}
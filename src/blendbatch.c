@@ -0,0 +1,355 @@
+#include "alphaPlane.h"
+#include "composite.h"
+#include "imageArena.h"
+#include "maskSpans.h"
+#include "orient.h"
+#include "ppmIO.h"
+#include "ppmWrite.h"
+#include "threadPool.h"
+#include "wallClock.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define USECPP 0
+
+/* Run many composites in one process.  Each line of the job list is one
+ * composite, with the arguments of 5_image_blend_rotate:
+ *
+ *   <foreground> <background> <mask> <dx> <dy> <scale> <orientation> <output>
+ *
+ * Blank lines and lines starting with # are skipped.  Every distinct
+ * background is read once and shared by all the jobs that use it, and the
+ * jobs run concurrently, one per thread.  Each thread keeps one arena for
+ * the frame buffers of all the jobs it runs. */
+
+/* Compile with: ../bin/blendbatch -j 4 jobs.txt */
+
+typedef struct {
+  char *filename;
+  const Pixel *pixels;
+  int rows, cols, colors;
+} Background;
+
+typedef struct {
+  char *foreground, *mask, *output;
+  int background; /* index into the batch's backgrounds */
+  int dx, dy;
+  float scaleFactor;
+  int orientation;
+  int failed;
+} Job;
+
+typedef struct {
+  Job *jobs;
+  long count;
+  Background *backgrounds;
+  int nbackgrounds;
+} Batch;
+
+/* each thread's arena, emptied after every job it runs */
+static pthread_key_t arenaKey;
+
+/* read the job list, adding each distinct background to the batch once;
+ * returns 0 or -1 after reporting a bad line */
+static int readJobs(FILE *fp, Batch *batch);
+
+/* composite one job of the batch, a PoolTask */
+static void runJob(void *arg, long index);
+
+/* composite a job, returning 0 or -1 after reporting what went wrong */
+static int composite(const Job *job, long number, const Background *bg);
+
+/* the calling thread's arena, created by its first job; NULL if that fails */
+static ImageArena *threadArena(void);
+
+/* release a thread's arena, the destructor of arenaKey */
+static void freeArena(void *arena);
+
+int readJobs(FILE *fp, Batch *batch) {
+  char *line = NULL;
+  size_t size = 0;
+  long capacity = 0;
+  long lineNumber = 0;
+
+  while (getline(&line, &size, fp) != -1) {
+    char *field[8], *save = NULL, *token;
+    Job *job;
+    int n = 0, b;
+
+    lineNumber++;
+    for (token = strtok_r(line, " \t\r\n", &save); token && n < 8;
+         token = strtok_r(NULL, " \t\r\n", &save))
+      field[n++] = token;
+    if (n == 0 || field[0][0] == '#')
+      continue;
+    if (n != 8 || token) {
+      fprintf(stderr, "line %ld: expected 8 fields\n", lineNumber);
+      free(line);
+      return -1;
+    }
+
+    /* share the background with the jobs before this one */
+    for (b = 0; b < batch->nbackgrounds; b++)
+      if (strcmp(batch->backgrounds[b].filename, field[1]) == 0)
+        break;
+    if (b == batch->nbackgrounds) {
+      Background *more = realloc(batch->backgrounds,
+                                 (b + 1) * sizeof(Background));
+      if (!more) {
+        fprintf(stderr, "Unable to allocate memory for the job list\n");
+        exit(-1);
+      }
+      batch->backgrounds = more;
+      memset(&more[b], 0, sizeof(Background));
+      more[b].filename = strdup(field[1]);
+      batch->nbackgrounds++;
+    }
+
+    if (batch->count == capacity) {
+      Job *more;
+
+      capacity = capacity ? 2 * capacity : 256;
+      more = realloc(batch->jobs, capacity * sizeof(Job));
+      if (!more) {
+        fprintf(stderr, "Unable to allocate memory for the job list\n");
+        exit(-1);
+      }
+      batch->jobs = more;
+    }
+
+    job = &batch->jobs[batch->count++];
+    job->foreground = strdup(field[0]);
+    job->background = b;
+    job->mask = strdup(field[2]);
+    job->dx = atoi(field[3]);
+    job->dy = atoi(field[4]);
+    job->scaleFactor = atof(field[5]);
+    job->orientation = orientationFor(field[6]);
+    job->output = strdup(field[7]);
+    job->failed = 0;
+    if (!job->foreground || !job->mask || !job->output ||
+        !batch->backgrounds[b].filename) {
+      fprintf(stderr, "Unable to allocate memory for the job list\n");
+      exit(-1);
+    }
+    if (job->scaleFactor <= 0) {
+      fprintf(stderr, "line %ld: scale must be positive\n", lineNumber);
+      free(line);
+      return -1;
+    }
+    if (job->orientation < 0) {
+      fprintf(stderr, "line %ld: unknown orientation %s\n", lineNumber,
+              field[6]);
+      free(line);
+      return -1;
+    }
+  }
+
+  free(line);
+  return 0;
+}
+
+void runJob(void *arg, long index) {
+  Batch *batch = (Batch *)arg;
+  Job *job = &batch->jobs[index];
+  const Background *bg = &batch->backgrounds[job->background];
+
+  if (!bg->pixels || composite(job, index + 1, bg) != 0)
+    job->failed = 1;
+}
+
+ImageArena *threadArena(void) {
+  ImageArena *arena = pthread_getspecific(arenaKey);
+
+  if (!arena) {
+    arena = createArena(0, ARENA_HUGE_PAGES);
+    if (arena && pthread_setspecific(arenaKey, arena) != 0) {
+      destroyArena(arena);
+      arena = NULL;
+    }
+  }
+  return arena;
+}
+
+void freeArena(void *arena) { destroyArena((ImageArena *)arena); }
+
+int composite(const Job *job, long number, const Background *bg) {
+  const Pixel *foreground, *fgImage;
+  const unsigned char *mask;
+  AlphaPlane *maskPlane;
+  Pixel *output = NULL;
+  MaskSpans *spans = NULL;
+  ImageArena *arena;
+  int fgRows, fgCols, maskRows, maskCols, colors, channels;
+  int scaledRows, scaledCols;
+  int status = -1;
+  long mark = 0;
+
+  fgImage = mapPPM(&fgRows, &fgCols, &colors, job->foreground);
+  maskPlane = readAlphaPlane(job->mask);
+  arena = threadArena();
+  if (arena)
+    mark = arenaMark(arena);
+  if (!fgImage || !maskPlane || !arena) {
+    fprintf(stderr, "job %ld: unable to read %s or %s\n", number,
+            job->foreground, job->mask);
+    goto done;
+  }
+  if (maskPlane->rows != fgRows || maskPlane->cols != fgCols) {
+    fprintf(stderr, "job %ld: %s and %s differ in size\n", number,
+            job->foreground, job->mask);
+    goto done;
+  }
+
+  foreground = fgImage;
+  mask = maskPlane->alpha;
+  maskRows = maskPlane->rows;
+  maskCols = maskPlane->cols;
+  channels = maskPlane->channels;
+
+  /* jobs already run in parallel, so each orients on its own thread */
+  if (job->orientation != ORIENT_NORMAL) {
+    foreground = (const Pixel *)orientedCopy(
+        arena, NULL, (const unsigned char *)foreground, fgRows, fgCols, 3,
+        job->orientation, &fgRows, &fgCols);
+    mask = orientedCopy(arena, NULL, mask, maskRows, maskCols, channels,
+                        job->orientation, &maskRows, &maskCols);
+  }
+
+  if (foreground && mask) {
+    output = arenaPixels(arena, bg->rows, bg->cols);
+    spans = buildMaskSpans(mask, maskRows, maskCols, channels);
+  }
+  if (!output || !spans) {
+    fprintf(stderr, "job %ld: unable to allocate memory for the images\n",
+            number);
+    goto done;
+  }
+
+  /* the foreground and mask are scaled as they are blended */
+  if (scaledSize(fgRows, fgCols, job->scaleFactor, &scaledRows,
+                 &scaledCols) != 0) {
+    fprintf(stderr, "job %ld: scale is not finite or too large\n", number);
+    goto done;
+  }
+  if (job->dx < 0 || job->dy < 0 || job->dx + scaledCols > bg->cols ||
+      job->dy + scaledRows > bg->rows) {
+    fprintf(stderr, "job %ld: invalid offsets or foreground too large for %s\n",
+            number, bg->filename);
+    goto done;
+  }
+
+  /* the jobs are already spread over the threads, so each composites on
+   * its own thread */
+  if (compositeScaled(NULL, output, bg->pixels, bg->rows, bg->cols,
+                      foreground, mask, channels, fgRows, fgCols,
+                      job->scaleFactor, job->dx, job->dy, spans) != 0) {
+    fprintf(stderr, "job %ld: unable to allocate memory for the images\n",
+            number);
+    goto done;
+  }
+
+  if (writePPMParallel(output, bg->rows, bg->cols, bg->colors, job->output, 1,
+                       NULL) != 0) {
+    fprintf(stderr, "job %ld: unable to write %s\n", number, job->output);
+    goto done;
+  }
+  status = 0;
+
+done:
+  freeMaskSpans(spans);
+  if (arena)
+    arenaReset(arena, mark);
+  if (maskPlane)
+    freeAlphaPlane(maskPlane);
+  unmapPPM(fgImage);
+
+  return status;
+}
+
+int main(int argc, char *argv[]) {
+  Batch batch = {NULL, 0, NULL, 0};
+  ThreadPool *pool;
+  FILE *fp;
+  double start, seconds;
+  long i, failed = 0;
+  int threads = 0;
+  int bad = 0;
+  int opt, b;
+
+  while ((opt = getopt(argc, argv, "j:")) != -1) {
+    switch (opt) {
+    case 'j': // jobs to run at once, 0 for one per processor
+      threads = atoi(optarg);
+      break;
+    default:
+      bad = 1;
+    }
+  }
+
+  if (bad || argc - optind != 1) {
+    printf("Usage: %s [-j threads] <job list, - for stdin>\n", argv[0]);
+    printf("  each line: <foreground> <background> <mask> <dx> <dy> "
+           "<scaleFactor> <orientation> <output>\n");
+    printf("  orientation: 0 or none, 1 or 90, 180, 270, fliph, flipv, "
+           "transpose or transverse\n");
+    exit(-1);
+  }
+
+  fp = strcmp(argv[optind], "-") == 0 ? stdin : fopen(argv[optind], "r");
+  if (!fp) {
+    fprintf(stderr, "Unable to open %s\n", argv[optind]);
+    exit(-1);
+  }
+  if (readJobs(fp, &batch) != 0)
+    exit(-1);
+  if (fp != stdin)
+    fclose(fp);
+
+  start = wallSeconds();
+
+  /* read each background once for all of its jobs */
+  for (b = 0; b < batch.nbackgrounds; b++) {
+    Background *bg = &batch.backgrounds[b];
+
+    bg->pixels = mapPPM(&bg->rows, &bg->cols, &bg->colors, bg->filename);
+    if (!bg->pixels)
+      fprintf(stderr, "Unable to read %s\n", bg->filename);
+  }
+
+  pool = createThreadPool(threads);
+  if (!pool || pthread_key_create(&arenaKey, freeArena) != 0) {
+    fprintf(stderr, "Unable to start the threads\n");
+    exit(-1);
+  }
+  poolFor(pool, batch.count, runJob, &batch);
+  seconds = wallSeconds() - start;
+
+  for (i = 0; i < batch.count; i++)
+    failed += batch.jobs[i].failed;
+  fprintf(stdout, "%ld jobs (%ld failed) on %d backgrounds with %d threads\n",
+          batch.count, failed, batch.nbackgrounds, poolThreads(pool));
+  fprintf(stdout, "%.3f s, %.1f jobs/s\n", seconds,
+          seconds > 0 ? batch.count / seconds : 0.0);
+
+  /* the workers' arenas go with their threads; this thread's is left */
+  destroyThreadPool(pool);
+  freeArena(pthread_getspecific(arenaKey));
+  pthread_key_delete(arenaKey);
+  for (b = 0; b < batch.nbackgrounds; b++) {
+    unmapPPM(batch.backgrounds[b].pixels);
+    free(batch.backgrounds[b].filename);
+  }
+  for (i = 0; i < batch.count; i++) {
+    free(batch.jobs[i].foreground);
+    free(batch.jobs[i].mask);
+    free(batch.jobs[i].output);
+  }
+  free(batch.backgrounds);
+  free(batch.jobs);
+
+  return failed ? -1 : 0;
+}
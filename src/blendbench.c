@@ -0,0 +1,281 @@
+/*
+  Measure alpha blend throughput and accuracy.  The floating point loop the
+  blend tools used to run is timed against every alphaBlend kernel the
+  processor supports, with a grey alpha plane and with an RGB mask.  Every
+  kernel is also run over every possible foreground, background and alpha
+  and must round each blend exactly, and so stay within FLOAT_BOUND of the
+  float loop.  Exits nonzero if any kernel does not.
+*/
+
+#include "alphaPlane.h"
+#include "blend.h"
+#include "ppmIO.h"
+#include "wallClock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* most a blend may differ from the float loop */
+#define FLOAT_BOUND 1
+
+/* a * f + (255 - a) * b over 255, rounded to nearest */
+static int exactBlend(int f, int b, int a);
+
+/* blend every foreground, background and alpha through the current kernel,
+ * with grey and RGB alpha; returns the samples not exactly rounded, and
+ * the largest difference from the float loop and how many differ */
+static long sweepBlends(int *floatWorst, long *floatOff);
+
+/* the original per pixel loop, kept as the reference */
+static void floatBlend(Pixel *output, const Pixel *foreground,
+                       const Pixel *background, const unsigned char *alpha,
+                       int channels, long n);
+
+/* largest difference between two buffers */
+static int maxDifference(const unsigned char *a, const unsigned char *b,
+                         long n);
+
+void floatBlend(Pixel *output, const Pixel *foreground,
+                const Pixel *background, const unsigned char *alpha,
+                int channels, long n) {
+  const Pixel *mask = (const Pixel *)alpha;
+  long i;
+
+  if (channels == 1) {
+    for (i = 0; i < n; i++) {
+      float a = alpha[i] / 255.0;
+
+      output[i].r =
+          (unsigned char)(a * foreground[i].r + (1 - a) * background[i].r);
+      output[i].g =
+          (unsigned char)(a * foreground[i].g + (1 - a) * background[i].g);
+      output[i].b =
+          (unsigned char)(a * foreground[i].b + (1 - a) * background[i].b);
+    }
+    return;
+  }
+
+  for (i = 0; i < n; i++) {
+    float alpha = mask[i].g / 255.0;
+    float beta = mask[i].r / 255.0;
+    float gamma = mask[i].b / 255.0;
+
+    output[i].r =
+        (unsigned char)(beta * foreground[i].r + (1 - beta) * background[i].r);
+    output[i].g = (unsigned char)(alpha * foreground[i].g +
+                                  (1 - alpha) * background[i].g);
+    output[i].b = (unsigned char)(gamma * foreground[i].b +
+                                  (1 - gamma) * background[i].b);
+  }
+}
+
+int exactBlend(int f, int b, int a) {
+  return (2 * (a * f + (255 - a) * b) + 255) / 510;
+}
+
+long sweepBlends(int *floatWorst, long *floatOff) {
+  static Pixel fg[1 << 16], bg[1 << 16], out[1 << 16];
+  static unsigned char grey[1 << 16], rgb[3 << 16];
+  long wrong = 0;
+  int f, i, c, channels;
+
+  *floatWorst = 0;
+  *floatOff = 0;
+
+  /* each channel of each pixel is a different (f, b, a), so the three
+   * channels of a chunk cover every b and a for their own f */
+  for (f = 0; f < 256; f++) {
+    for (i = 0; i < 1 << 16; i++) {
+      int b = i >> 8, a = i & 255;
+
+      fg[i].r = f;
+      fg[i].g = 255 - f;
+      fg[i].b = f ^ 0x55;
+      bg[i].r = b;
+      bg[i].g = 255 - b;
+      bg[i].b = b ^ 0x55;
+      grey[i] = a;
+      rgb[3 * i] = a;
+      rgb[3 * i + 1] = 255 - a;
+      rgb[3 * i + 2] = a ^ 0xaa;
+    }
+
+    for (channels = 1; channels <= 3; channels += 2) {
+      alphaBlend(out, fg, bg, channels == 1 ? grey : rgb, channels, 1 << 16);
+
+      for (i = 0; i < 1 << 16; i++) {
+        const unsigned char *o = (const unsigned char *)&out[i];
+        const unsigned char *fs = (const unsigned char *)&fg[i];
+        const unsigned char *bs = (const unsigned char *)&bg[i];
+
+        for (c = 0; c < 3; c++) {
+          int a = channels == 1 ? grey[i] : rgb[3 * i + c];
+
+          wrong += o[c] != exactBlend(fs[c], bs[c], a);
+        }
+
+        /* the float loop, on the first channel of the grey blends */
+        if (channels == 1) {
+          float alpha = grey[i] / 255.0;
+          int old = (unsigned char)(alpha * fs[0] + (1 - alpha) * bs[0]);
+
+          if (abs(o[0] - old) > *floatWorst)
+            *floatWorst = abs(o[0] - old);
+          *floatOff += o[0] != old;
+        }
+      }
+    }
+  }
+
+  return wrong;
+}
+
+int maxDifference(const unsigned char *a, const unsigned char *b, long n) {
+  int most = 0;
+  long i;
+
+  for (i = 0; i < n; i++) {
+    int d = abs(a[i] - b[i]);
+
+    if (d > most)
+      most = d;
+  }
+
+  return most;
+}
+
+int main(int argc, char *argv[]) {
+  static const char *kernels[] = {"scalar", "ssse3", "avx2", "avx512", "neon"};
+  const Pixel *foreground, *background;
+  Pixel *output, *reference, *exact, *exactRGB;
+  AlphaPlane *mask;
+  unsigned char *grey, *rgb;
+  int rows, cols, colors, bgRows, bgCols;
+  int iterations = 50;
+  int failed = 0;
+  long n, i;
+  double start, greySeconds, rgbSeconds;
+  int it, k;
+
+  if (argc < 4) {
+    printf("Usage: %s <foreground> <background> <mask> [iterations]\n",
+           argv[0]);
+    exit(-1);
+  }
+
+  if (argc > 4)
+    iterations = atoi(argv[4]);
+  if (iterations <= 0) {
+    fprintf(stderr, "Iterations must be positive\n");
+    exit(-1);
+  }
+
+  foreground = mapPPM(&rows, &cols, &colors, argv[1]);
+  background = mapPPM(&bgRows, &bgCols, &colors, argv[2]);
+  mask = readAlphaPlane(argv[3]);
+  if (!foreground || !background || !mask) {
+    fprintf(stderr, "Unable to read the images\n");
+    exit(-1);
+  }
+  if (bgRows != rows || bgCols != cols || mask->rows != rows ||
+      mask->cols != cols) {
+    fprintf(stderr, "Dimension mismatch\n");
+    exit(-1);
+  }
+
+  /* the mask as both a grey plane and RGB */
+  n = (long)rows * cols;
+  grey = malloc(n);
+  rgb = malloc(3 * n);
+  output = malloc(n * sizeof(Pixel));
+  reference = malloc(n * sizeof(Pixel));
+  exact = malloc(n * sizeof(Pixel));
+  exactRGB = malloc(n * sizeof(Pixel));
+  if (!grey || !rgb || !output || !reference || !exact || !exactRGB) {
+    fprintf(stderr, "Unable to allocate memory for the images\n");
+    exit(-1);
+  }
+  for (i = 0; i < n; i++) {
+    grey[i] = mask->alpha[i * mask->channels + mask->channels / 2];
+    rgb[3 * i] = mask->alpha[i * mask->channels];
+    rgb[3 * i + 1] = grey[i];
+    rgb[3 * i + 2] = mask->alpha[i * mask->channels + mask->channels - 1];
+  }
+
+  printf("%d x %d, default kernel %s\n", cols, rows, blendKernel());
+
+  /* every possible blend through each kernel */
+  for (k = 0; k < (int)(sizeof(kernels) / sizeof(kernels[0])); k++) {
+    int floatWorst;
+    long wrong, floatOff;
+
+    if (useBlendKernel(kernels[k]) != 0)
+      continue;
+
+    wrong = sweepBlends(&floatWorst, &floatOff);
+    printf("%-10s  all 2^24 blends: %ld not exactly rounded, max %d from the "
+           "float loop (%.1f%% differ)\n",
+           kernels[k], wrong, floatWorst, 100.0 * floatOff / (1 << 24));
+    if (wrong || floatWorst > FLOAT_BOUND)
+      failed = 1;
+  }
+
+  start = wallSeconds();
+  for (it = 0; it < iterations; it++)
+    floatBlend(reference, foreground, background, grey, 1, n);
+  greySeconds = (wallSeconds() - start) / iterations;
+  start = wallSeconds();
+  for (it = 0; it < iterations; it++)
+    floatBlend(reference, foreground, background, rgb, 3, n);
+  rgbSeconds = (wallSeconds() - start) / iterations;
+  printf("            %8s   %8s\n", "grey", "rgb");
+  printf("float loop: %8.1f   %8.1f MP/s\n", n / 1e6 / greySeconds,
+         n / 1e6 / rgbSeconds);
+
+  useBlendKernel("scalar");
+  alphaBlend(exact, foreground, background, grey, 1, n);
+  alphaBlend(exactRGB, foreground, background, rgb, 3, n);
+
+  for (k = 0; k < (int)(sizeof(kernels) / sizeof(kernels[0])); k++) {
+    int same, diff;
+
+    if (useBlendKernel(kernels[k]) != 0)
+      continue;
+
+    memset(output, 1, n * sizeof(Pixel));
+    start = wallSeconds();
+    for (it = 0; it < iterations; it++)
+      alphaBlend(output, foreground, background, grey, 1, n);
+    greySeconds = (wallSeconds() - start) / iterations;
+    same = memcmp(output, exact, n * sizeof(Pixel)) == 0;
+
+    floatBlend(reference, foreground, background, grey, 1, n);
+    diff = maxDifference((unsigned char *)output, (unsigned char *)reference,
+                         3 * n);
+
+    memset(output, 1, n * sizeof(Pixel));
+    start = wallSeconds();
+    for (it = 0; it < iterations; it++)
+      alphaBlend(output, foreground, background, rgb, 3, n);
+    rgbSeconds = (wallSeconds() - start) / iterations;
+    same = same && memcmp(output, exactRGB, n * sizeof(Pixel)) == 0;
+
+    printf("%-10s  %8.1f   %8.1f MP/s  %s, max %d from float\n", kernels[k],
+           n / 1e6 / greySeconds, n / 1e6 / rgbSeconds,
+           same ? "identical" : "MISMATCH", diff);
+    if (!same || diff > FLOAT_BOUND)
+      failed = 1;
+  }
+
+  free(grey);
+  free(rgb);
+  free(output);
+  free(reference);
+  free(exact);
+  free(exactRGB);
+  freeAlphaPlane(mask);
+  unmapPPM(foreground);
+  unmapPPM(background);
+
+  return failed ? -1 : 0;
+}
@@ -0,0 +1,186 @@
+#include "wallClock.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define USECPP 0
+
+/* Send a request to blendd and print its reply.  With -n the request is
+ * sent that many times over one connection and the latencies are reported;
+ * with -t the one-shot tool given (5_image_blend_rotate takes the same
+ * arguments) is also run that many times for comparison. */
+
+/* Compile with: ../bin/blendclient -n 50 -t ../bin/5_image_blend_rotate
+ * /tmp/blendd.sock powerpuff.ppm background_large.ppm mask_powerpuff.ppm
+ * 10 20 1.3 1 result.ppm */
+
+/* longest request or reply line */
+#define LINE_LENGTH 4096
+
+/* sort helper for latencies */
+static int compareDoubles(const void *a, const void *b);
+
+/* print the fastest, median and mean of n latencies in seconds */
+static void reportLatency(const char *name, double *seconds, int n);
+
+/* run the tool once with the blend arguments, its output and the report it
+ * prints on stderr discarded; returns the exit status */
+static int runTool(char *tool, char **args);
+
+int compareDoubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+void reportLatency(const char *name, double *seconds, int n) {
+  double total = 0;
+  int i;
+
+  for (i = 0; i < n; i++)
+    total += seconds[i];
+  qsort(seconds, n, sizeof(double), compareDoubles);
+  printf("%-10s %9.3f %9.3f %9.3f ms\n", name, seconds[0] * 1000,
+         seconds[n / 2] * 1000, total / n * 1000);
+}
+
+int runTool(char *tool, char **args) {
+  char *argv[10];
+  pid_t pid;
+  int status, i;
+
+  argv[0] = tool;
+  for (i = 0; i < 8; i++)
+    argv[i + 1] = args[i];
+  argv[9] = NULL;
+
+  pid = fork();
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+
+    if (null >= 0) {
+      dup2(null, STDOUT_FILENO);
+      dup2(null, STDERR_FILENO);
+      close(null);
+    }
+    execv(tool, argv);
+    _exit(127);
+  }
+  if (pid < 0 || waitpid(pid, &status, 0) != pid)
+    return -1;
+
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int main(int argc, char *argv[]) {
+  struct sockaddr_un address;
+  char request[LINE_LENGTH], reply[2 * LINE_LENGTH];
+  char *tool = NULL;
+  double *seconds;
+  FILE *in;
+  int repeat = 1;
+  int bad = 0;
+  int opt, fd, i, n;
+
+  while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+    switch (opt) {
+    case 'n': // times to send the request
+      repeat = atoi(optarg);
+      break;
+    case 't': // one-shot tool to compare with
+      tool = optarg;
+      break;
+    default:
+      bad = 1;
+    }
+  }
+
+  n = argc - optind;
+  if (bad || repeat <= 0 || (n != 2 && n != 9) ||
+      (n == 2 && strcmp(argv[optind + 1], "stats") != 0)) {
+    printf("Usage: %s [-n repeat] [-t tool] <socket path> stats\n", argv[0]);
+    printf("       %s [-n repeat] [-t tool] <socket path> <foreground> "
+           "<background> <mask> <dx> <dy> <scaleFactor> <orientation> "
+           "<output file or shm:name>\n",
+           argv[0]);
+    exit(-1);
+  }
+  if (tool && n != 9) {
+    fprintf(stderr, "Only blend requests can be compared with a tool\n");
+    exit(-1);
+  }
+
+  /* one request line */
+  if (n == 2)
+    snprintf(request, sizeof(request), "stats\n");
+  else {
+    int length = snprintf(request, sizeof(request), "blend");
+
+    for (i = optind + 1; i < argc && length < (int)sizeof(request); i++)
+      length += snprintf(request + length, sizeof(request) - length, " %s",
+                         argv[i]);
+    if (length + 1 >= (int)sizeof(request)) {
+      fprintf(stderr, "Request too long\n");
+      exit(-1);
+    }
+    strcat(request, "\n");
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, argv[optind], sizeof(address.sun_path) - 1);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 ||
+      connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+    fprintf(stderr, "Unable to connect to %s\n", argv[optind]);
+    exit(-1);
+  }
+  in = fdopen(fd, "r");
+  seconds = malloc(repeat * sizeof(double));
+  if (!in || !seconds) {
+    fprintf(stderr, "Unable to allocate memory\n");
+    exit(-1);
+  }
+
+  for (i = 0; i < repeat; i++) {
+    double start = wallSeconds();
+
+    if (write(fd, request, strlen(request)) != (ssize_t)strlen(request) ||
+        !fgets(reply, sizeof(reply), in)) {
+      fprintf(stderr, "The server closed the connection\n");
+      exit(-1);
+    }
+    seconds[i] = wallSeconds() - start;
+  }
+  fputs(reply, stdout);
+  if (strncmp(reply, "ok", 2) != 0)
+    exit(-1);
+
+  if (repeat > 1 || tool) {
+    printf("%-10s %9s %9s %9s\n", "", "fastest", "median", "mean");
+    reportLatency("daemon", seconds, repeat);
+  }
+
+  if (tool) {
+    for (i = 0; i < repeat; i++) {
+      double start = wallSeconds();
+
+      if (runTool(tool, argv + optind + 1) != 0) {
+        fprintf(stderr, "%s failed\n", tool);
+        exit(-1);
+      }
+      seconds[i] = wallSeconds() - start;
+    }
+    reportLatency("one-shot", seconds, repeat);
+  }
+
+  fclose(in);
+  free(seconds);
+
+  return 0;
+}
@@ -0,0 +1,383 @@
+#include "alphaPlane.h"
+#include "composite.h"
+#include "imageArena.h"
+#include "imageCache.h"
+#include "maskSpans.h"
+#include "orient.h"
+#include "ppmIO.h"
+#include "ppmWrite.h"
+#include "threadPool.h"
+#include "wallClock.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define USECPP 0
+
+/* A compositing server.  It listens on a Unix domain socket and answers one
+ * request per line, keeping the images it has decoded in an LRU cache so a
+ * request for images it has seen recently reads nothing from disk.
+ *
+ *   blend <foreground> <background> <mask> <dx> <dy> <scale> <orientation>
+ *         <output>
+ *     composite as 5_image_blend_rotate does; answers "ok <rows> <cols>
+ *     <milliseconds>".  An output of shm:<name> is written as a ppm into
+ *     the POSIX shared memory object <name> instead of a file.
+ *   stats
+ *     answers "ok <hits> <misses> <reloads> <evictions> <entries> <bytes>"
+ *
+ * Failures are answered with "error <message>", and a request line longer
+ * than 4094 bytes is refused whole.  Clients are served concurrently;
+ * blendclient is a small client. */
+
+/* Compile with: ../bin/blendd -m 512 /tmp/blendd.sock */
+
+/* longest request or reply line */
+#define LINE_LENGTH 4096
+
+typedef struct {
+  ImageCache *cache;
+  ThreadPool *pool;
+  pthread_mutex_t poolLock; /* the pool runs one composite at a time */
+} Server;
+
+typedef struct {
+  Server *server;
+  int fd;
+} Client;
+
+static volatile sig_atomic_t stopping = 0;
+
+/* ask the accept loop to stop */
+static void stopServer(int sig);
+
+/* create a shared memory object holding a ppm header and room for the
+ * pixels; returns the pixels, with the mapping in *map and *length */
+static Pixel *sharedOutput(char *name, int rows, int cols, int colors,
+                           void **map, size_t *length);
+
+/* run a blend request, writing the reply */
+static void blend(Server *server, ImageArena *arena, char **field,
+                  char *reply);
+
+/* run one request line, writing the reply */
+static void handleRequest(Server *server, ImageArena *arena, char *line,
+                          char *reply);
+
+/* answer the requests of one connection until it closes */
+static void *serveClient(void *arg);
+
+void stopServer(int sig) {
+  (void)sig;
+  stopping = 1;
+}
+
+Pixel *sharedOutput(char *name, int rows, int cols, int colors, void **map,
+                    size_t *length) {
+  char path[LINE_LENGTH + 1], header[64];
+  int headerLength, fd;
+
+  /* shm_open wants one leading slash */
+  snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+  headerLength =
+      snprintf(header, sizeof(header), "P6\n%d %d\n%d\n", cols, rows, colors);
+  *length = headerLength + (size_t)rows * cols * sizeof(Pixel);
+
+  fd = shm_open(path, O_RDWR | O_CREAT, 0600);
+  if (fd < 0)
+    return NULL;
+  if (ftruncate(fd, *length) != 0) {
+    close(fd);
+    return NULL;
+  }
+  *map = mmap(NULL, *length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (*map == MAP_FAILED)
+    return NULL;
+
+  memcpy(*map, header, headerLength);
+  return (Pixel *)((unsigned char *)*map + headerLength);
+}
+
+void blend(Server *server, ImageArena *arena, char **field, char *reply) {
+  const Pixel *fgImage, *bgImage, *foreground;
+  const AlphaPlane *maskPlane;
+  const unsigned char *mask;
+  Pixel *output = NULL;
+  MaskSpans *spans = NULL;
+  void *map = NULL;
+  size_t length = 0;
+  int fgRows, fgCols, bgRows, bgCols, maskRows, maskCols, colors, bgColors;
+  int scaledRows, scaledCols;
+  int channels, dx, dy, orientation, error;
+  float scaleFactor;
+  double start = wallSeconds();
+  long mark = arenaMark(arena);
+
+  dx = atoi(field[4]);
+  dy = atoi(field[5]);
+  scaleFactor = atof(field[6]);
+  orientation = orientationFor(field[7]);
+
+  fgImage = cacheImage(server->cache, field[1], &fgRows, &fgCols, &colors);
+  bgImage = cacheImage(server->cache, field[2], &bgRows, &bgCols, &bgColors);
+  maskPlane = cacheMask(server->cache, field[3]);
+  if (!fgImage || !bgImage || !maskPlane) {
+    sprintf(reply, "error unable to read %s\n",
+            !fgImage ? field[1] : !bgImage ? field[2] : field[3]);
+    goto done;
+  }
+  if (maskPlane->rows != fgRows || maskPlane->cols != fgCols ||
+      scaleFactor <= 0) {
+    sprintf(reply, "error mask size or scale does not fit the foreground\n");
+    goto done;
+  }
+  if (orientation < 0) {
+    sprintf(reply, "error unknown orientation\n");
+    goto done;
+  }
+
+  foreground = fgImage;
+  mask = maskPlane->alpha;
+  maskRows = maskPlane->rows;
+  maskCols = maskPlane->cols;
+  channels = maskPlane->channels;
+
+  if (orientation != ORIENT_NORMAL) {
+    foreground = (const Pixel *)orientedCopy(
+        arena, NULL, (const unsigned char *)foreground, fgRows, fgCols, 3,
+        orientation, &fgRows, &fgCols);
+    mask = orientedCopy(arena, NULL, mask, maskRows, maskCols, channels,
+                        orientation, &maskRows, &maskCols);
+  }
+
+  if (!foreground || !mask) {
+    sprintf(reply, "error out of memory\n");
+    goto done;
+  }
+
+  /* the foreground and mask are scaled as they are blended */
+  if (scaledSize(fgRows, fgCols, scaleFactor, &scaledRows, &scaledCols) !=
+      0) {
+    sprintf(reply, "error scale is not finite or too large\n");
+    goto done;
+  }
+  if (dx < 0 || dy < 0 || dx + scaledCols > bgCols ||
+      dy + scaledRows > bgRows) {
+    sprintf(reply, "error invalid offsets or foreground too large\n");
+    goto done;
+  }
+
+  if (strncmp(field[8], "shm:", 4) == 0)
+    output = sharedOutput(field[8] + 4, bgRows, bgCols, bgColors, &map,
+                          &length);
+  else
+    output = arenaPixels(arena, bgRows, bgCols);
+  spans = buildMaskSpans(mask, maskRows, maskCols, channels);
+  if (!output || !spans) {
+    sprintf(reply, "error unable to allocate %s\n", field[8]);
+    goto done;
+  }
+
+  pthread_mutex_lock(&server->poolLock);
+  error = compositeScaled(server->pool, output, bgImage, bgRows, bgCols,
+                          foreground, mask, channels, fgRows, fgCols,
+                          scaleFactor, dx, dy, spans);
+  pthread_mutex_unlock(&server->poolLock);
+  if (error) {
+    sprintf(reply, "error out of memory\n");
+    goto done;
+  }
+
+  if (!map && writePPMParallel(output, bgRows, bgCols, bgColors, field[8],
+                               poolThreads(server->pool), NULL) != 0) {
+    sprintf(reply, "error unable to write %s\n", field[8]);
+    goto done;
+  }
+
+  sprintf(reply, "ok %d %d %.3f\n", bgRows, bgCols,
+          (wallSeconds() - start) * 1000);
+
+done:
+  if (map && map != MAP_FAILED)
+    munmap(map, length);
+  freeMaskSpans(spans);
+  releaseCached(server->cache, fgImage);
+  releaseCached(server->cache, bgImage);
+  releaseCached(server->cache, maskPlane);
+  arenaReset(arena, mark);
+}
+
+void handleRequest(Server *server, ImageArena *arena, char *line,
+                   char *reply) {
+  char *field[10], *save = NULL, *token;
+  CacheStats stats;
+  int n = 0;
+
+  for (token = strtok_r(line, " \t\r\n", &save); token && n < 10;
+       token = strtok_r(NULL, " \t\r\n", &save))
+    field[n++] = token;
+
+  if (n == 9 && strcmp(field[0], "blend") == 0)
+    blend(server, arena, field, reply);
+  else if (n == 1 && strcmp(field[0], "stats") == 0) {
+    imageCacheStats(server->cache, &stats);
+    sprintf(reply, "ok %ld %ld %ld %ld %d %ld\n", stats.hits, stats.misses,
+            stats.reloads, stats.evictions, stats.entries, stats.bytes);
+  } else
+    sprintf(reply, "error unknown request\n");
+}
+
+void *serveClient(void *arg) {
+  Client *client = (Client *)arg;
+  char line[LINE_LENGTH], reply[2 * LINE_LENGTH];
+  ImageArena *arena;
+  FILE *in;
+
+  in = fdopen(client->fd, "r");
+  arena = createArena(0, ARENA_HUGE_PAGES);
+  if (!in || !arena) {
+    fprintf(stderr, "Unable to serve a client\n");
+    if (in)
+      fclose(in);
+    else
+      close(client->fd);
+    destroyArena(arena);
+    free(client);
+    return NULL;
+  }
+
+  while (fgets(line, sizeof(line), in)) {
+    size_t length = strlen(line);
+
+    /* a line too long for the buffer is refused whole rather than run in
+     * pieces */
+    if (length == sizeof(line) - 1 && line[length - 1] != '\n') {
+      int c;
+
+      while ((c = getc(in)) != EOF && c != '\n')
+        ;
+      sprintf(reply, "error request longer than %d bytes\n", LINE_LENGTH - 2);
+    } else
+      handleRequest(client->server, arena, line, reply);
+    length = strlen(reply);
+    if (write(client->fd, reply, length) != (ssize_t)length)
+      break;
+  }
+
+  fclose(in);
+  destroyArena(arena);
+  free(client);
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  struct sockaddr_un address;
+  struct sigaction action;
+  Server server;
+  CacheStats stats;
+  long megabytes = IMAGE_CACHE_DEFAULT >> 20;
+  int threads = 0;
+  int bad = 0;
+  int opt, listener;
+
+  while ((opt = getopt(argc, argv, "j:m:")) != -1) {
+    switch (opt) {
+    case 'j': // threads to composite with, 0 for one per processor
+      threads = atoi(optarg);
+      break;
+    case 'm': // megabytes of decoded images to keep
+      megabytes = atol(optarg);
+      break;
+    default:
+      bad = 1;
+    }
+  }
+
+  if (bad || argc - optind != 1 || megabytes <= 0) {
+    printf("Usage: %s [-j threads] [-m cache megabytes] <socket path>\n",
+           argv[0]);
+    exit(-1);
+  }
+  if (strlen(argv[optind]) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Socket path %s is too long\n", argv[optind]);
+    exit(-1);
+  }
+
+  server.cache = createImageCache(megabytes << 20);
+  server.pool = createThreadPool(threads);
+  pthread_mutex_init(&server.poolLock, NULL);
+  if (!server.cache || !server.pool) {
+    fprintf(stderr, "Unable to start the server\n");
+    exit(-1);
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, argv[optind]);
+  listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(address.sun_path);
+  if (listener < 0 ||
+      bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+      listen(listener, 16) != 0) {
+    fprintf(stderr, "Unable to listen on %s: %s\n", argv[optind],
+            strerror(errno));
+    exit(-1);
+  }
+
+  /* stop on a signal without restarting accept, and let a client that
+   * hangs up early only end its own connection */
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stopServer;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  fprintf(stdout, "listening on %s with %d threads and a %ld MB cache\n",
+          argv[optind], poolThreads(server.pool), megabytes);
+  fflush(stdout);
+
+  while (!stopping) {
+    Client *client;
+    pthread_t thread;
+    int fd = accept(listener, NULL, NULL);
+
+    if (fd < 0) {
+      if (errno != EINTR)
+        fprintf(stderr, "accept: %s\n", strerror(errno));
+      continue;
+    }
+
+    client = malloc(sizeof(Client));
+    if (client) {
+      client->server = &server;
+      client->fd = fd;
+    }
+    if (!client || pthread_create(&thread, NULL, serveClient, client) != 0) {
+      fprintf(stderr, "Unable to serve a client\n");
+      free(client);
+      close(fd);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+
+  close(listener);
+  unlink(address.sun_path);
+
+  imageCacheStats(server.cache, &stats);
+  fprintf(stdout, "%ld hits, %ld misses, %ld reloads, %ld evictions\n",
+          stats.hits, stats.misses, stats.reloads, stats.evictions);
+
+  /* connections may still be open, so the cache and pool are left to the
+   * exit */
+  return 0;
+}
@@ -0,0 +1,491 @@
+#include "alphaPlane.h"
+#include "composite.h"
+#include "imageArena.h"
+#include "imageCache.h"
+#include "maskSpans.h"
+#include "orient.h"
+#include "ppmIO.h"
+#include "ppmWrite.h"
+#include "threadPool.h"
+#include "wallClock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define USECPP 0
+
+/* Place many sprites on one background in a single pass.  Each line of the
+ * placement list is
+ *
+ *   <foreground> <mask> <dx> <dy> <scale> <orientation> <z>
+ *
+ * with dx, dy, scale and orientation as for 5_image_blend_rotate; sprites
+ * with a higher z are drawn over those with a lower one, and equal z keeps
+ * the order of the list.  The output is cut into square bins, each bin lists the
+ * sprites whose mask touches it, and every bin is composited once, in
+ * parallel, applying just its own sprites.  The work grows with the area the
+ * sprites cover rather than with their number times the frame size. */
+
+/* Compile with: ../bin/blendsprites -j 4 background_large.ppm sprites.txt
+ * sprites_result.ppm */
+
+/* edge of a bin in pixels */
+#define BIN_SIZE 128
+
+/* a foreground and mask after orienting and scaling, shared by every
+ * placement that uses them the same way */
+typedef struct {
+  char *fgFile, *maskFile;
+  float scaleFactor;
+  int orientation;
+  const Pixel *foreground;
+  const unsigned char *mask;
+  int rows, cols, channels;
+  MaskSpans *spans;
+  /* cached images used as they are, pinned until the frame is written */
+  const Pixel *pinnedImage;
+  const AlphaPlane *pinnedMask;
+} Sprite;
+
+typedef struct {
+  int sprite;
+  int dx, dy;
+  int z;
+  int order; /* line of the list, to keep equal z in order */
+} Placement;
+
+typedef struct {
+  Pixel *output;
+  const Pixel *background;
+  int rows, cols;
+  int binsAcross, binsDown;
+  const Sprite *sprites;
+  const Placement *placements;
+  const long *binStart; /* first entry of each bin, and one past the last */
+  const int *binEntries; /* placements of each bin in z order */
+} Frame;
+
+/* scale an image of 1 or 3 channel samples into the arena with the nearest
+ * neighbours the scale tools use */
+static unsigned char *scaleImage(ImageArena *arena, ThreadPool *pool,
+                                 const unsigned char *input, int channels,
+                                 int oldRows, int oldCols, float scaleFactor,
+                                 int *newRows, int *newCols);
+
+/* find or make the sprite for a foreground and mask used this way */
+static int findSprite(Sprite **sprites, int *count, int *capacity,
+                      char *fgFile, char *maskFile, float scaleFactor,
+                      int orientation);
+
+/* read, orient and scale a sprite's images and find its mask's spans; the
+ * cached files are released unless the sprite uses them as they are */
+static void prepareSprite(Sprite *sprite, ImageArena *arena,
+                          ImageCache *cache, ThreadPool *pool);
+
+/* sort placements by z, then by their order in the list */
+static int compareZ(const void *a, const void *b);
+
+/* composite one bin of the frame, a PoolTask */
+static void compositeBin(void *arg, long index);
+
+unsigned char *scaleImage(ImageArena *arena, ThreadPool *pool,
+                          const unsigned char *input, int channels,
+                          int oldRows, int oldCols, float scaleFactor,
+                          int *newRows, int *newCols) {
+  unsigned char *output;
+
+  if (scaledSize(oldRows, oldCols, scaleFactor, newRows, newCols) != 0) {
+    fprintf(stderr, "Scale factor %g is too large\n", scaleFactor);
+    exit(-1);
+  }
+  output = arenaAlloc(arena, (long)*newRows * *newCols * channels);
+  if (!output || scaleNearest(pool, output, input, oldRows, oldCols, channels,
+                              scaleFactor) != 0) {
+    fprintf(stderr, "Unable to allocate memory for scaled image\n");
+    exit(-1);
+  }
+
+  return output;
+}
+
+int findSprite(Sprite **sprites, int *count, int *capacity, char *fgFile,
+               char *maskFile, float scaleFactor, int orientation) {
+  Sprite *sprite;
+  int i;
+
+  for (i = 0; i < *count; i++) {
+    sprite = &(*sprites)[i];
+    if (sprite->scaleFactor == scaleFactor &&
+        sprite->orientation == orientation &&
+        strcmp(sprite->fgFile, fgFile) == 0 &&
+        strcmp(sprite->maskFile, maskFile) == 0)
+      return i;
+  }
+
+  if (*count == *capacity) {
+    *capacity = *capacity ? 2 * *capacity : 64;
+    *sprites = realloc(*sprites, *capacity * sizeof(Sprite));
+    if (!*sprites) {
+      fprintf(stderr, "Unable to allocate memory for the sprites\n");
+      exit(-1);
+    }
+  }
+
+  sprite = &(*sprites)[*count];
+  memset(sprite, 0, sizeof(Sprite));
+  sprite->fgFile = strdup(fgFile);
+  sprite->maskFile = strdup(maskFile);
+  sprite->scaleFactor = scaleFactor;
+  sprite->orientation = orientation;
+  if (!sprite->fgFile || !sprite->maskFile) {
+    fprintf(stderr, "Unable to allocate memory for the sprites\n");
+    exit(-1);
+  }
+
+  return (*count)++;
+}
+
+void prepareSprite(Sprite *sprite, ImageArena *arena, ImageCache *cache,
+                   ThreadPool *pool) {
+  const AlphaPlane *plane;
+  const Pixel *image;
+  int rows, cols, maskRows, maskCols, colors;
+
+  image = cacheImage(cache, sprite->fgFile, &rows, &cols, &colors);
+  plane = cacheMask(cache, sprite->maskFile);
+  if (!image || !plane) {
+    fprintf(stderr, "Unable to read %s or %s\n", sprite->fgFile,
+            sprite->maskFile);
+    exit(-1);
+  }
+  if (plane->rows != rows || plane->cols != cols) {
+    fprintf(stderr, "%s and %s differ in size\n", sprite->fgFile,
+            sprite->maskFile);
+    exit(-1);
+  }
+  sprite->foreground = image;
+  sprite->mask = plane->alpha;
+  sprite->channels = plane->channels;
+  maskRows = rows;
+  maskCols = cols;
+
+  /* the cached images are shared, so changes go into new ones */
+  if (sprite->orientation != ORIENT_NORMAL) {
+    sprite->foreground = (const Pixel *)orientedCopy(
+        arena, pool, (const unsigned char *)sprite->foreground, rows, cols, 3,
+        sprite->orientation, &rows, &cols);
+    sprite->mask =
+        orientedCopy(arena, pool, sprite->mask, maskRows, maskCols,
+                     sprite->channels, sprite->orientation, &maskRows,
+                     &maskCols);
+    if (!sprite->foreground || !sprite->mask) {
+      fprintf(stderr, "Unable to allocate memory for oriented image\n");
+      exit(-1);
+    }
+  }
+  if (sprite->scaleFactor != 1.0f) {
+    sprite->foreground = (const Pixel *)scaleImage(
+        arena, pool, (const unsigned char *)sprite->foreground, 3, rows, cols,
+        sprite->scaleFactor, &rows, &cols);
+    sprite->mask = scaleImage(arena, pool, sprite->mask, sprite->channels,
+                              maskRows, maskCols, sprite->scaleFactor,
+                              &maskRows, &maskCols);
+  }
+
+  /* copies no longer need the cached files, which stay cached unpinned for
+   * later sprites made from them */
+  if (sprite->foreground == image)
+    sprite->pinnedImage = image;
+  else
+    releaseCached(cache, image);
+  if (sprite->mask == plane->alpha)
+    sprite->pinnedMask = plane;
+  else
+    releaseCached(cache, plane);
+
+  sprite->rows = rows;
+  sprite->cols = cols;
+  sprite->spans = buildMaskSpans(sprite->mask, rows, cols, sprite->channels);
+  if (!sprite->spans) {
+    fprintf(stderr, "Unable to allocate memory for the mask spans\n");
+    exit(-1);
+  }
+}
+
+int compareZ(const void *a, const void *b) {
+  const Placement *p = (const Placement *)a, *q = (const Placement *)b;
+
+  if (p->z != q->z)
+    return p->z < q->z ? -1 : 1;
+  return p->order - q->order;
+}
+
+void compositeBin(void *arg, long index) {
+  Frame *frame = (Frame *)arg;
+  int y0 = (int)(index / frame->binsAcross) * BIN_SIZE;
+  int x0 = (int)(index % frame->binsAcross) * BIN_SIZE;
+  int y1 = y0 + BIN_SIZE < frame->rows ? y0 + BIN_SIZE : frame->rows;
+  int x1 = x0 + BIN_SIZE < frame->cols ? x0 + BIN_SIZE : frame->cols;
+  long e;
+  int y;
+
+  for (y = y0; y < y1; y++)
+    memcpy(frame->output + (long)y * frame->cols + x0,
+           frame->background + (long)y * frame->cols + x0,
+           (x1 - x0) * sizeof(Pixel));
+
+  /* the bin's sprites, lowest first, each clipped to the bin */
+  for (e = frame->binStart[index]; e < frame->binStart[index + 1]; e++) {
+    const Placement *place = &frame->placements[frame->binEntries[e]];
+    const Sprite *sprite = &frame->sprites[place->sprite];
+    const MaskSpans *spans = sprite->spans;
+    int top = place->dy + spans->top, bottom = place->dy + spans->bottom;
+    int a = x0 > place->dx ? x0 : place->dx;
+    int b = x1 < place->dx + sprite->cols ? x1 : place->dx + sprite->cols;
+
+    for (y = top > y0 ? top : y0; y < bottom && y < y1; y++) {
+      int fy = y - place->dy;
+      long f = (long)fy * sprite->cols;
+      Pixel *out = frame->output + (long)y * frame->cols + place->dx;
+
+      blendSpanRow(spans, fy, a - place->dx, b - place->dx, out,
+                   sprite->foreground + f, NULL,
+                   sprite->mask + f * sprite->channels);
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  const Pixel *background;
+  Pixel *output;
+  Sprite *sprites = NULL;
+  Placement *placements = NULL;
+  Frame frame;
+  ImageArena *arena;
+  ImageCache *cache;
+  ThreadPool *pool;
+  WriteStats stats;
+  FILE *fp;
+  char *line = NULL;
+  size_t size = 0;
+  long *binStart;
+  int *binEntries = NULL;
+  long bins, entries, covered = 0, b;
+  int nsprites = 0, spriteCapacity = 0;
+  int nplacements = 0, placementCapacity = 0;
+  int bgRows, bgCols, colors;
+  int threads = 1;
+  int bad = 0;
+  int opt, i, lineNumber = 0;
+  double start;
+
+  while ((opt = getopt(argc, argv, "j:")) != -1) {
+    switch (opt) {
+    case 'j': // threads to composite with, 0 for one per processor
+      threads = atoi(optarg);
+      break;
+    default:
+      bad = 1;
+    }
+  }
+
+  if (bad || argc - optind != 3) {
+    printf("Usage: %s [-j threads] <background file> <placement list> "
+           "<output file>\n",
+           argv[0]);
+    printf("  each line: <foreground> <mask> <dx> <dy> <scaleFactor> "
+           "<orientation> <z>\n");
+    printf("  orientation: 0 or none, 1 or 90, 180, 270, fliph, flipv, "
+           "transpose or transverse\n");
+    exit(-1);
+  }
+  argv += optind - 1;
+
+  /* read the placements */
+  fp = strcmp(argv[2], "-") == 0 ? stdin : fopen(argv[2], "r");
+  if (!fp) {
+    fprintf(stderr, "Unable to open %s\n", argv[2]);
+    exit(-1);
+  }
+  while (getline(&line, &size, fp) != -1) {
+    char *field[7], *save = NULL, *token;
+    Placement *place;
+    float scaleFactor;
+    int orientation;
+    int n = 0;
+
+    lineNumber++;
+    for (token = strtok_r(line, " \t\r\n", &save); token && n < 7;
+         token = strtok_r(NULL, " \t\r\n", &save))
+      field[n++] = token;
+    if (n == 0 || field[0][0] == '#')
+      continue;
+    scaleFactor = n == 7 ? atof(field[4]) : 0;
+    orientation = n == 7 ? orientationFor(field[5]) : -1;
+    if (n != 7 || token || scaleFactor <= 0 || orientation < 0) {
+      fprintf(stderr,
+              "line %d: expected 7 fields, a positive scale and an "
+              "orientation\n",
+              lineNumber);
+      exit(-1);
+    }
+
+    if (nplacements == placementCapacity) {
+      placementCapacity = placementCapacity ? 2 * placementCapacity : 256;
+      placements = realloc(placements, placementCapacity * sizeof(Placement));
+      if (!placements) {
+        fprintf(stderr, "Unable to allocate memory for the placements\n");
+        exit(-1);
+      }
+    }
+    place = &placements[nplacements];
+    place->sprite = findSprite(&sprites, &nsprites, &spriteCapacity, field[0],
+                               field[1], scaleFactor, orientation);
+    place->dx = atoi(field[2]);
+    place->dy = atoi(field[3]);
+    place->z = atoi(field[6]);
+    place->order = lineNumber;
+    nplacements++;
+  }
+  free(line);
+  if (fp != stdin)
+    fclose(fp);
+
+  /* read background image */
+  background = mapPPM(&bgRows, &bgCols, &colors, argv[1]);
+  if (!background) {
+    fprintf(stderr, "Unable to read %s\n", argv[1]);
+    exit(-1);
+  }
+
+  arena = createArena(0, ARENA_HUGE_PAGES);
+  cache = createImageCache(0);
+  pool = createThreadPool(threads);
+  if (!arena || !cache || !pool) {
+    fprintf(stderr, "Unable to allocate memory for the images\n");
+    exit(-1);
+  }
+
+  start = wallSeconds();
+
+  /* each distinct sprite is read, oriented and scaled once */
+  for (i = 0; i < nsprites; i++)
+    prepareSprite(&sprites[i], arena, cache, pool);
+
+  /* every sprite must lie inside the background */
+  for (i = 0; i < nplacements; i++) {
+    const Placement *place = &placements[i];
+    const Sprite *sprite = &sprites[place->sprite];
+
+    if (place->dx < 0 || place->dy < 0 ||
+        place->dx + sprite->cols > bgCols ||
+        place->dy + sprite->rows > bgRows) {
+      fprintf(stderr, "line %d: invalid offsets or sprite too large for %s\n",
+              place->order, argv[1]);
+      exit(-1);
+    }
+  }
+  qsort(placements, nplacements, sizeof(Placement), compareZ);
+
+  /* count the placements touching each bin, then list them in z order */
+  frame.binsAcross = (bgCols + BIN_SIZE - 1) / BIN_SIZE;
+  frame.binsDown = (bgRows + BIN_SIZE - 1) / BIN_SIZE;
+  bins = (long)frame.binsAcross * frame.binsDown;
+  binStart = calloc(bins + 1, sizeof(long));
+  if (!binStart) {
+    fprintf(stderr, "Unable to allocate memory for the bins\n");
+    exit(-1);
+  }
+  for (int pass = 0; pass < 2; pass++) {
+    long *next = NULL;
+
+    if (pass == 1) {
+      for (b = 0; b < bins; b++)
+        binStart[b + 1] += binStart[b];
+      next = malloc(bins * sizeof(long));
+      binEntries = malloc((binStart[bins] > 0 ? binStart[bins] : 1) *
+                          sizeof(int));
+      if (!next || !binEntries) {
+        fprintf(stderr, "Unable to allocate memory for the bins\n");
+        exit(-1);
+      }
+      memcpy(next, binStart, bins * sizeof(long));
+    }
+
+    for (i = 0; i < nplacements; i++) {
+      const Placement *place = &placements[i];
+      const MaskSpans *spans = sprites[place->sprite].spans;
+      int bx, by;
+
+      if (spans->count == 0)
+        continue;
+      if (pass == 0)
+        covered += (long)(spans->right - spans->left) *
+                   (spans->bottom - spans->top);
+
+      /* the bins under the mask's bounding box */
+      for (by = (place->dy + spans->top) / BIN_SIZE;
+           by <= (place->dy + spans->bottom - 1) / BIN_SIZE; by++)
+        for (bx = (place->dx + spans->left) / BIN_SIZE;
+             bx <= (place->dx + spans->right - 1) / BIN_SIZE; bx++) {
+          b = (long)by * frame.binsAcross + bx;
+          if (pass == 0)
+            binStart[b + 1]++;
+          else
+            binEntries[next[b]++] = i;
+        }
+    }
+    free(next);
+  }
+  entries = binStart[bins];
+
+  /* allocate memory for the output image */
+  output = arenaPixels(arena, bgRows, bgCols);
+  if (!output) {
+    fprintf(stderr, "Unable to allocate memory for output image\n");
+    exit(-1);
+  }
+
+  frame.output = output;
+  frame.background = background;
+  frame.rows = bgRows;
+  frame.cols = bgCols;
+  frame.sprites = sprites;
+  frame.placements = placements;
+  frame.binStart = binStart;
+  frame.binEntries = binEntries;
+  poolFor(pool, bins, compositeBin, &frame);
+
+  fprintf(stderr, "%d placements of %d sprites, %ld bin entries in %ld bins\n",
+          nplacements, nsprites, entries, bins);
+  fprintf(stderr, "sprite boxes cover %ld of %ld pixels, %.3f s\n", covered,
+          (long)bgRows * bgCols, wallSeconds() - start);
+
+  /* output the composited image */
+  if (writePPMParallel(output, bgRows, bgCols, colors, argv[3], 0, &stats) !=
+      0) {
+    fprintf(stderr, "Unable to write %s\n", argv[3]);
+    exit(-1);
+  }
+  fprintf(stderr, "wrote %ld bytes in %.3f s (%.1f MB/s)\n", stats.bytes,
+          stats.seconds, writeBandwidth(&stats));
+
+  for (i = 0; i < nsprites; i++) {
+    free(sprites[i].fgFile);
+    free(sprites[i].maskFile);
+    freeMaskSpans(sprites[i].spans);
+    releaseCached(cache, sprites[i].pinnedImage);
+    releaseCached(cache, sprites[i].pinnedMask);
+  }
+  free(sprites);
+  free(placements);
+  free(binStart);
+  free(binEntries);
+  unmapPPM(background);
+  destroyImageCache(cache);
+  destroyThreadPool(pool);
+  destroyArena(arena);
+
+  return 0;
+}
@@ -0,0 +1,178 @@
+/*
+  Check and time the colour operations over every one of the 2^24 colours.
+  Each isolateRed kernel the processor supports is run at a range of
+  thresholds and checked to be identical to the loop ppmmain used to run,
+  and lab1's compiled range adjustments are checked against its old loop.
+  Each is then timed on the same colours; every timed pass first copies the
+  colours back, so the rates include that copy.  Exits nonzero on any
+  mismatch.
+*/
+
+#include "colorOps.h"
+#include "ppmIO.h"
+#include "wallClock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define COLORS (1L << 24)
+
+/* ppmmain's original red isolation loop, kept as the reference */
+static void branchyIsolate(Pixel *image, long n, int threshold);
+
+/* lab1's original red and green range adjustments, kept as the reference */
+static void branchyAdjust(Pixel *image, long n, int redDecrease,
+                          int greenIncrease);
+
+void branchyIsolate(Pixel *image, long n, int threshold) {
+  long i, j;
+  int min;
+
+  for (i = 0; i < n; i++) {
+    j = (int)image[i].r - ((int)image[i].g + (int)image[i].b) / 2;
+    min = image[i].g < image[i].b ? image[i].g : image[i].b;
+    min = image[i].r < min ? image[i].r : min;
+    min = min < 128 ? min : min / 2;
+    if (j > threshold) {
+      image[i].r = image[i].r < 128 ? image[i].r * 2 : image[i].r;
+    } else {
+      image[i].r = min;
+    }
+    image[i].g = image[i].b = min;
+  }
+}
+
+void branchyAdjust(Pixel *image, long n, int redDecrease, int greenIncrease) {
+  long i;
+
+  for (i = 0; i < n; i++) {
+    if (image[i].r > 100 && image[i].r < 200) {
+      image[i].r =
+          image[i].r - redDecrease > 0 ? image[i].r - redDecrease : 0;
+    }
+    if (image[i].g > 50 && image[i].g < 150) {
+      image[i].g =
+          image[i].g + greenIncrease < 255 ? image[i].g + greenIncrease : 255;
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  static const char *kernels[] = {"ssse3", "scalar"};
+  static const int thresholds[] = {-300, -1, 0, 10, 127, 200, 255, 300};
+  ColorOp ops[] = {
+      {COLOR_OP_ADD, COLOR_RED, 100, 200, -50},
+      {COLOR_OP_ADD, COLOR_GREEN, 50, 150, 30},
+  };
+  Pixel *colors, *output, *reference;
+  ColorLUT lut;
+  int iterations = 5;
+  double start, seconds;
+  long i;
+  int failed = 0;
+  int it, k, t;
+
+  if (argc > 2) {
+    printf("Usage: %s [iterations]\n", argv[0]);
+    exit(-1);
+  }
+  if (argc > 1)
+    iterations = atoi(argv[1]);
+  if (iterations <= 0) {
+    fprintf(stderr, "Iterations must be positive\n");
+    exit(-1);
+  }
+
+  colors = malloc(COLORS * sizeof(Pixel));
+  output = malloc(COLORS * sizeof(Pixel));
+  reference = malloc(COLORS * sizeof(Pixel));
+  if (!colors || !output || !reference) {
+    fprintf(stderr, "Unable to allocate memory for the colours\n");
+    exit(-1);
+  }
+  for (i = 0; i < COLORS; i++) {
+    colors[i].r = (unsigned char)(i >> 16);
+    colors[i].g = (unsigned char)(i >> 8);
+    colors[i].b = (unsigned char)i;
+  }
+
+  printf("%ld colours, default isolateRed kernel %s\n", COLORS,
+         colorOpsKernel());
+
+  /* every kernel against the old loop, on every colour */
+  for (t = 0; t < (int)(sizeof(thresholds) / sizeof(thresholds[0])); t++) {
+    memcpy(reference, colors, COLORS * sizeof(Pixel));
+    branchyIsolate(reference, COLORS, thresholds[t]);
+
+    for (k = 0; k < (int)(sizeof(kernels) / sizeof(kernels[0])); k++) {
+      if (useColorOpsKernel(kernels[k]) != 0)
+        continue;
+
+      memset(output, 1, COLORS * sizeof(Pixel));
+      isolateRed(output, colors, COLORS, thresholds[t]);
+      if (memcmp(output, reference, COLORS * sizeof(Pixel)) != 0) {
+        printf("isolateRed %-6s threshold %4d  MISMATCH\n", kernels[k],
+               thresholds[t]);
+        failed = 1;
+      }
+    }
+  }
+  printf("isolateRed checked at %d thresholds%s\n",
+         (int)(sizeof(thresholds) / sizeof(thresholds[0])),
+         failed ? "" : ", all identical");
+
+  /* the branchy loop it replaced */
+  start = wallSeconds();
+  for (it = 0; it < iterations; it++) {
+    memcpy(output, colors, COLORS * sizeof(Pixel));
+    branchyIsolate(output, COLORS, 10);
+  }
+  seconds = (wallSeconds() - start) / iterations;
+  printf("isolateRed  %-8s  %8.1f MP/s\n", "loop", COLORS / 1e6 / seconds);
+
+  for (k = 0; k < (int)(sizeof(kernels) / sizeof(kernels[0])); k++) {
+    if (useColorOpsKernel(kernels[k]) != 0)
+      continue;
+
+    start = wallSeconds();
+    for (it = 0; it < iterations; it++) {
+      memcpy(output, colors, COLORS * sizeof(Pixel));
+      isolateRed(output, output, COLORS, 10);
+    }
+    seconds = (wallSeconds() - start) / iterations;
+    printf("isolateRed  %-8s  %8.1f MP/s\n", kernels[k],
+           COLORS / 1e6 / seconds);
+  }
+
+  /* lab1's adjustments, compiled and as they were */
+  memcpy(reference, colors, COLORS * sizeof(Pixel));
+  branchyAdjust(reference, COLORS, 50, 30);
+  compileColorOps(&lut, ops, sizeof(ops) / sizeof(ops[0]));
+  applyColorLUT(&lut, output, colors, COLORS);
+  if (memcmp(output, reference, COLORS * sizeof(Pixel)) != 0) {
+    printf("applyColorLUT  MISMATCH\n");
+    failed = 1;
+  }
+
+  start = wallSeconds();
+  for (it = 0; it < iterations; it++) {
+    memcpy(output, colors, COLORS * sizeof(Pixel));
+    branchyAdjust(output, COLORS, 50, 30);
+  }
+  seconds = (wallSeconds() - start) / iterations;
+  printf("adjust      %-8s  %8.1f MP/s\n", "loop", COLORS / 1e6 / seconds);
+
+  start = wallSeconds();
+  for (it = 0; it < iterations; it++) {
+    memcpy(output, colors, COLORS * sizeof(Pixel));
+    applyColorLUT(&lut, output, output, COLORS);
+  }
+  seconds = (wallSeconds() - start) / iterations;
+  printf("adjust      %-8s  %8.1f MP/s\n", "table", COLORS / 1e6 / seconds);
+
+  free(colors);
+  free(output);
+  free(reference);
+
+  return failed ? -1 : 0;
+}
@@ -0,0 +1,150 @@
+/*
+  Measure how the tiled compositor scales with threads.  The foreground is
+  composited onto the background at (dx, dy) with pools of 1, 2, 4, ... up
+  to the thread limit (one per processor by default), and every result is
+  checked to be identical to the single threaded one.  Each pool is timed
+  blending every pixel and again using the mask's spans, which skip the
+  clear pixels and copy the solid ones.  Exits nonzero if any result
+  differs.
+*/
+
+#include "alphaPlane.h"
+#include "composite.h"
+#include "ppmIO.h"
+#include "threadPool.h"
+#include "wallClock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static double timeComposite(ThreadPool *pool, Pixel *output,
+                            const Pixel *background, int bgRows, int bgCols,
+                            const Pixel *foreground, const AlphaPlane *mask,
+                            int dx, int dy, const MaskSpans *spans,
+                            int iterations);
+
+/* seconds per composite, after one untimed warm up */
+double timeComposite(ThreadPool *pool, Pixel *output, const Pixel *background,
+                     int bgRows, int bgCols, const Pixel *foreground,
+                     const AlphaPlane *mask, int dx, int dy,
+                     const MaskSpans *spans, int iterations) {
+  double seconds;
+  int it;
+
+  memset(output, 1, (long)bgRows * bgCols * sizeof(Pixel));
+  compositeOffset(pool, output, background, bgRows, bgCols, foreground,
+                  mask->alpha, mask->channels, mask->rows, mask->cols, dx, dy,
+                  spans);
+  seconds = wallSeconds();
+  for (it = 0; it < iterations; it++)
+    compositeOffset(pool, output, background, bgRows, bgCols, foreground,
+                    mask->alpha, mask->channels, mask->rows, mask->cols, dx,
+                    dy, spans);
+  return (wallSeconds() - seconds) / iterations;
+}
+
+int main(int argc, char *argv[]) {
+  const Pixel *foreground, *background;
+  Pixel *output, *reference;
+  AlphaPlane *mask;
+  MaskSpans *spans;
+  ThreadPool *pool;
+  int fgRows, fgCols, bgRows, bgCols, colors;
+  int tileRows, tileCols;
+  int dx, dy;
+  int iterations = 20;
+  int maxThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  double seconds, spanSeconds, single = 0;
+  int threads, same;
+  int failed = 0;
+
+  if (argc < 6) {
+    printf("Usage: %s <foreground> <background> <mask> <dx> <dy> "
+           "[iterations] [max threads]\n",
+           argv[0]);
+    exit(-1);
+  }
+
+  dx = atoi(argv[4]);
+  dy = atoi(argv[5]);
+  if (argc > 6)
+    iterations = atoi(argv[6]);
+  if (argc > 7)
+    maxThreads = atoi(argv[7]);
+  if (iterations <= 0 || maxThreads <= 0) {
+    fprintf(stderr, "Iterations and threads must be positive\n");
+    exit(-1);
+  }
+
+  foreground = mapPPM(&fgRows, &fgCols, &colors, argv[1]);
+  background = mapPPM(&bgRows, &bgCols, &colors, argv[2]);
+  mask = readAlphaPlane(argv[3]);
+  if (!foreground || !background || !mask) {
+    fprintf(stderr, "Unable to read the images\n");
+    exit(-1);
+  }
+  if (mask->rows != fgRows || mask->cols != fgCols || dx < 0 || dy < 0 ||
+      dx + fgCols > bgCols || dy + fgRows > bgRows) {
+    fprintf(stderr, "Dimension mismatch or invalid offsets\n");
+    exit(-1);
+  }
+
+  output = malloc((long)bgRows * bgCols * sizeof(Pixel));
+  reference = malloc((long)bgRows * bgCols * sizeof(Pixel));
+  spans = buildMaskSpans(mask->alpha, fgRows, fgCols, mask->channels);
+  if (!output || !reference || !spans) {
+    fprintf(stderr, "Unable to allocate memory for the output\n");
+    exit(-1);
+  }
+
+  compositeTileSize(bgCols, mask->channels, &tileRows, &tileCols);
+  printf("%d x %d onto %d x %d, tiles %d x %d\n", fgCols, fgRows, bgCols,
+         bgRows, tileCols, tileRows);
+  printf("mask %.1f%% solid, %.1f%% edge\n",
+         100.0 * spans->solid / ((double)fgRows * fgCols),
+         100.0 * spans->edge / ((double)fgRows * fgCols));
+  printf("threads   MP/s   speedup   spans MP/s\n");
+
+  /* 1, 2, 4, ... and then the limit itself */
+  for (threads = 1;;
+       threads = threads * 2 < maxThreads ? threads * 2 : maxThreads) {
+    pool = createThreadPool(threads);
+    if (!pool) {
+      fprintf(stderr, "Unable to start %d threads\n", threads);
+      exit(-1);
+    }
+
+    seconds = timeComposite(pool, output, background, bgRows, bgCols,
+                            foreground, mask, dx, dy, NULL, iterations);
+    if (threads == 1) {
+      single = seconds;
+      memcpy(reference, output, (long)bgRows * bgCols * sizeof(Pixel));
+    }
+    same = memcmp(output, reference, (long)bgRows * bgCols * sizeof(Pixel)) == 0;
+
+    spanSeconds = timeComposite(pool, output, background, bgRows, bgCols,
+                                foreground, mask, dx, dy, spans, iterations);
+    same &= memcmp(output, reference, (long)bgRows * bgCols * sizeof(Pixel)) == 0;
+
+    printf("%7d %7.1f %8.2fx %10.1f  %s\n", poolThreads(pool),
+           (double)bgRows * bgCols / 1e6 / seconds, single / seconds,
+           (double)bgRows * bgCols / 1e6 / spanSeconds,
+           same ? "identical" : "MISMATCH");
+    if (!same)
+      failed = 1;
+    destroyThreadPool(pool);
+
+    if (threads == maxThreads)
+      break;
+  }
+
+  free(output);
+  free(reference);
+  freeAlphaPlane(mask);
+  freeMaskSpans(spans);
+  unmapPPM(foreground);
+  unmapPPM(background);
+
+  return failed ? -1 : 0;
+}
@@ -0,0 +1,146 @@
+/*
+  Measure chroma key mask throughput.  The floating point loop that
+  1_generate_mask used to run is timed against every chromaKeyMask kernel
+  the processor supports, writing both RGB masks and alpha planes, and each
+  kernel's mask is checked to be identical to the loop's.  The fused key and
+  composite pass is timed as well, against the image blended through the
+  loop's mask.
+*/
+
+#include "chromaKey.h"
+#include "ppmIO.h"
+#include "wallClock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* the original per pixel loop, kept as the reference */
+static void floatMask(const Pixel *image, Pixel *mask, long n, char maskColor);
+
+void floatMask(const Pixel *image, Pixel *mask, long n, char maskColor) {
+  long i;
+
+  for (i = 0; i < n; i++) {
+    float r, g, b;
+    r = image[i].r;
+    g = image[i].g;
+    b = image[i].b;
+
+    if ((maskColor == 'b' && (b > (4.0 / 3.0) * g) && (b > (4.0 / 3.0) * r) &&
+         (b > 50)) ||
+        (maskColor == 'g' && (g > (4.0 / 3.0) * b) && (g > (4.0 / 3.0) * r) &&
+         (g > 50))) {
+      mask[i].r = 0;
+      mask[i].g = 0;
+      mask[i].b = 0;
+    } else {
+      mask[i].r = 255;
+      mask[i].g = 255;
+      mask[i].b = 255;
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  static const char *kernels[] = {"avx512", "avx2", "ssse3", "neon", "scalar"};
+  Pixel *image, *reference, *background, *composite, *referenceComposite;
+  unsigned char *mask, *plane, *referencePlane;
+  int rows, cols, colors;
+  int iterations = 50;
+  long n, i;
+  double start, seconds, planeSeconds, compositeSeconds;
+  char maskColor;
+  int it, k;
+
+  if (argc < 3) {
+    printf("Usage: %s <input file> <mask color (b/g)> [iterations]\n", argv[0]);
+    exit(-1);
+  }
+
+  maskColor = argv[2][0];
+  if (argc > 3)
+    iterations = atoi(argv[3]);
+  if (iterations <= 0) {
+    fprintf(stderr, "Iterations must be positive\n");
+    exit(-1);
+  }
+
+  image = readPPM(&rows, &cols, &colors, argv[1]);
+  if (!image) {
+    fprintf(stderr, "Unable to read %s\n", argv[1]);
+    exit(-1);
+  }
+
+  n = (long)rows * cols;
+  reference = malloc(n * sizeof(Pixel));
+  mask = malloc(n * sizeof(Pixel));
+  plane = malloc(n);
+  referencePlane = malloc(n);
+  background = malloc(n * sizeof(Pixel));
+  composite = malloc(n * sizeof(Pixel));
+  referenceComposite = malloc(n * sizeof(Pixel));
+  if (!reference || !mask || !plane || !referencePlane || !background ||
+      !composite || !referenceComposite) {
+    fprintf(stderr, "Unable to allocate memory for the masks\n");
+    exit(-1);
+  }
+
+  printf("%d x %d, key '%c', default kernel %s\n", cols, rows, maskColor,
+         chromaKeyKernel());
+
+  start = wallSeconds();
+  for (it = 0; it < iterations; it++)
+    floatMask(image, reference, n, maskColor);
+  seconds = (wallSeconds() - start) / iterations;
+  printf("float loop: %8.1f MP/s\n", n / 1e6 / seconds);
+  for (i = 0; i < n; i++) {
+    referencePlane[i] = reference[i].g;
+    background[i] = image[n - 1 - i];
+    referenceComposite[i] = reference[i].g ? image[i] : background[i];
+  }
+  printf("            %8s   %8s   %8s\n", "rgb", "plane", "composite");
+
+  for (k = 0; k < (int)(sizeof(kernels) / sizeof(kernels[0])); k++) {
+    if (useChromaKeyKernel(kernels[k]) != 0)
+      continue;
+
+    memset(mask, 1, n * sizeof(Pixel));
+    start = wallSeconds();
+    for (it = 0; it < iterations; it++)
+      chromaKeyMask(image, mask, n, maskColor, 3);
+    seconds = (wallSeconds() - start) / iterations;
+
+    memset(plane, 1, n);
+    start = wallSeconds();
+    for (it = 0; it < iterations; it++)
+      chromaKeyMask(image, plane, n, maskColor, 1);
+    planeSeconds = (wallSeconds() - start) / iterations;
+
+    memset(composite, 1, n * sizeof(Pixel));
+    start = wallSeconds();
+    for (it = 0; it < iterations; it++)
+      chromaKeyComposite(image, background, composite, n, maskColor);
+    compositeSeconds = (wallSeconds() - start) / iterations;
+
+    printf("%-10s  %8.1f   %8.1f   %8.1f MP/s  %s\n", kernels[k],
+           n / 1e6 / seconds, n / 1e6 / planeSeconds,
+           n / 1e6 / compositeSeconds,
+           memcmp(mask, reference, n * sizeof(Pixel)) == 0 &&
+                   memcmp(plane, referencePlane, n) == 0 &&
+                   memcmp(composite, referenceComposite,
+                          n * sizeof(Pixel)) == 0
+               ? "identical"
+               : "MISMATCH");
+  }
+
+  free(image);
+  free(reference);
+  free(mask);
+  free(plane);
+  free(referencePlane);
+  free(background);
+  free(composite);
+  free(referenceComposite);
+
+  return 0;
+}
@@ -5,6 +5,7 @@
   Bruce A. Maxwell updated 2021-09-05
 */
 
+#include "colorOps.h"
 #include "ppmIO.h"
 #include <math.h>
 #include <stdio.h>
@@ -25,6 +26,14 @@ int main(int argc, char *argv[]) {
   float frequency = 2.0;        // Frequency of the sine wave
   float phaseShift = 0;         // Phase shift of the sine wave
   float waveValue;              // Value from the sine wave
+  ColorOp ops[] = {
+      // Decrease redness in specific red range
+      {COLOR_OP_ADD, COLOR_RED, 100, 200, -redDecreaseFactor},
+      // Increase greenness in specific green range, assuming leaves are in
+      // this green range
+      {COLOR_OP_ADD, COLOR_GREEN, 50, 150, greenIncreaseFactor},
+  };
+  ColorLUT lut; // The adjustments, as a table per channel
 
   if (argc < 3) {
     printf("Usage: ppmtest <input file> <output file>\n");
@@ -43,22 +52,8 @@ int main(int argc, char *argv[]) {
 
   /* mess with the image here  */
   /* Adjust colors in the image: make red flower more red and leaves more green */
-  for (i = 0; i < imagesize; i++) {
-    // Decrease redness in specific red range
-    if (image[i].r > 100 && image[i].r < 200) {
-      image[i].r = image[i].r - redDecreaseFactor > 0
-                       ? image[i].r - redDecreaseFactor
-                       : 0;
-    }
-
-    // Increase greenness in specific green range
-    if (image[i].g > 50 &&
-        image[i].g < 150) { // Assuming leaves are in this green range
-      image[i].g = image[i].g + greenIncreaseFactor < 255
-                       ? image[i].g + greenIncreaseFactor
-                       : 255;
-    }
-  }
+  compileColorOps(&lut, ops, sizeof(ops) / sizeof(ops[0]));
+  applyColorLUT(&lut, image, image, imagesize);
 
   /* Apply a horizontal square root ramp */
   for (int y = 0; y < rows; y++) {
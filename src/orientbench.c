@@ -0,0 +1,192 @@
+/*
+  Measure orientation throughput on synthetic 4K and 8K frames.  The per
+  pixel loop 5_image_blend_rotate used to rotate with is timed against
+  orientImage with every kernel the processor supports, and each of the
+  eight orientations is timed as well, on RGB frames and on grey planes.
+  Every result is checked to be identical to a per pixel reference.
+*/
+
+#include "orient.h"
+#include "threadPool.h"
+#include "wallClock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* the original per pixel rotation, kept as the reference for 90 degrees */
+static void rotateImage90(unsigned char *output, const unsigned char *input,
+                          int channels, int oldRows, int oldCols);
+
+/* the reference for any orientation, one pixel at a time */
+static void referenceOrient(unsigned char *output, const unsigned char *input,
+                            int rows, int cols, int channels, int orientation);
+
+/* seconds per orientImage, averaged over the iterations */
+static double timeOrient(ThreadPool *pool, unsigned char *output,
+                         const unsigned char *input, int rows, int cols,
+                         int channels, int orientation, int iterations);
+
+void rotateImage90(unsigned char *output, const unsigned char *input,
+                   int channels, int oldRows, int oldCols) {
+  int newCols = oldRows;
+
+  for (int y = 0; y < oldRows; ++y) {
+    for (int x = 0; x < oldCols; ++x) {
+      for (int c = 0; c < channels; ++c)
+        output[(x * newCols + (oldRows - y - 1)) * channels + c] =
+            input[(y * oldCols + x) * channels + c];
+    }
+  }
+}
+
+void referenceOrient(unsigned char *output, const unsigned char *input,
+                     int rows, int cols, int channels, int orientation) {
+  int newRows, newCols, y, x, outY, outX;
+
+  orientedSize(rows, cols, orientation, &newRows, &newCols);
+  for (y = 0; y < rows; y++) {
+    for (x = 0; x < cols; x++) {
+      int flipX = cols - 1 - x, flipY = rows - 1 - y;
+
+      switch (orientation) {
+      case ORIENT_FLIP_HORIZONTAL:
+        outY = y, outX = flipX;
+        break;
+      case ORIENT_ROTATE_180:
+        outY = flipY, outX = flipX;
+        break;
+      case ORIENT_FLIP_VERTICAL:
+        outY = flipY, outX = x;
+        break;
+      case ORIENT_TRANSPOSE:
+        outY = x, outX = y;
+        break;
+      case ORIENT_ROTATE_90:
+        outY = x, outX = flipY;
+        break;
+      case ORIENT_TRANSVERSE:
+        outY = flipX, outX = flipY;
+        break;
+      case ORIENT_ROTATE_270:
+        outY = flipX, outX = y;
+        break;
+      default:
+        outY = y, outX = x;
+      }
+      memcpy(output + ((long)outY * newCols + outX) * channels,
+             input + ((long)y * cols + x) * channels, channels);
+    }
+  }
+}
+
+double timeOrient(ThreadPool *pool, unsigned char *output,
+                  const unsigned char *input, int rows, int cols, int channels,
+                  int orientation, int iterations) {
+  double start = wallSeconds();
+  int it;
+
+  for (it = 0; it < iterations; it++)
+    orientImage(pool, output, input, rows, cols, channels, orientation);
+
+  return (wallSeconds() - start) / iterations;
+}
+
+int main(int argc, char *argv[]) {
+  static const char *kernels[] = {"ssse3", "scalar"};
+  static const int sizes[][2] = {{2160, 3840}, {4320, 7680}};
+  unsigned char *input, *output, *reference;
+  ThreadPool *pool;
+  int iterations = 5;
+  int threads = 1;
+  int bad = 0;
+  int opt, s, k, o, channels;
+
+  while ((opt = getopt(argc, argv, "j:")) != -1) {
+    switch (opt) {
+    case 'j': // threads to orient with, 0 for one per processor
+      threads = atoi(optarg);
+      break;
+    default:
+      bad = 1;
+    }
+  }
+
+  if (bad || argc - optind > 1) {
+    printf("Usage: %s [-j threads] [iterations]\n", argv[0]);
+    exit(-1);
+  }
+  argv += optind - 1;
+  argc -= optind - 1;
+
+  if (argc > 1)
+    iterations = atoi(argv[1]);
+  if (iterations <= 0) {
+    fprintf(stderr, "Iterations must be positive\n");
+    exit(-1);
+  }
+
+  pool = createThreadPool(threads);
+  if (!pool) {
+    fprintf(stderr, "Unable to create the thread pool\n");
+    exit(-1);
+  }
+  printf("%d threads, default kernel %s\n", poolThreads(pool), orientKernel());
+
+  for (s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+    int rows = sizes[s][0], cols = sizes[s][1];
+    long n = (long)rows * cols, i;
+
+    input = malloc(n * 3);
+    output = malloc(n * 3);
+    reference = malloc(n * 3);
+    if (!input || !output || !reference) {
+      fprintf(stderr, "Unable to allocate memory for the frames\n");
+      exit(-1);
+    }
+    for (i = 0; i < n * 3; i++)
+      input[i] = (unsigned char)(i * 2654435761u >> 24);
+
+    for (channels = 3; channels >= 1; channels -= 2) {
+      double start, seconds;
+      int it;
+
+      printf("\n%d x %d %s\n", cols, rows, channels == 3 ? "rgb" : "grey");
+
+      start = wallSeconds();
+      for (it = 0; it < iterations; it++)
+        rotateImage90(output, input, channels, rows, cols);
+      seconds = (wallSeconds() - start) / iterations;
+      referenceOrient(reference, input, rows, cols, channels,
+                      ORIENT_ROTATE_90);
+      printf("%-10s  %-8s  %8.1f MP/s  %s\n", "90", "loop", n / 1e6 / seconds,
+             memcmp(output, reference, n * channels) == 0 ? "identical"
+                                                         : "MISMATCH");
+
+      for (o = ORIENT_NORMAL; o <= ORIENT_ROTATE_270; o++) {
+        referenceOrient(reference, input, rows, cols, channels, o);
+
+        for (k = 0; k < (int)(sizeof(kernels) / sizeof(kernels[0])); k++) {
+          if (useOrientKernel(kernels[k]) != 0)
+            continue;
+
+          memset(output, 1, n * channels);
+          seconds = timeOrient(pool, output, input, rows, cols, channels, o,
+                               iterations);
+          printf("%-10s  %-8s  %8.1f MP/s  %s\n", orientationName(o),
+                 kernels[k], n / 1e6 / seconds,
+                 memcmp(output, reference, n * channels) == 0 ? "identical"
+                                                             : "MISMATCH");
+        }
+      }
+    }
+
+    free(input);
+    free(output);
+    free(reference);
+  }
+
+  destroyThreadPool(pool);
+
+  return 0;
+}
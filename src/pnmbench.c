@@ -0,0 +1,90 @@
+/*
+  Measure how fast the netpbm decoder parses ASCII (P3) images.  A random
+  image is written as P3 text into memory and decoded repeatedly, both with
+  decodeNetpbm and with a plain strtol loop for comparison.
+*/
+
+#include "ppmIO.h"
+#include "wallClock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, char *argv[]) {
+  unsigned char *text, *image;
+  unsigned char *samples;
+  int rows, cols, colors, channels;
+  int outRows, outCols;
+  int iterations = 10;
+  long count, len, i;
+  double start, decodeTime, strtolTime;
+  int it;
+
+  if (argc < 3) {
+    printf("Usage: %s <rows> <cols> [iterations]\n", argv[0]);
+    exit(-1);
+  }
+
+  rows = atoi(argv[1]);
+  cols = atoi(argv[2]);
+  if (argc > 3)
+    iterations = atoi(argv[3]);
+  if (rows <= 0 || cols <= 0 || iterations <= 0) {
+    fprintf(stderr, "Image size and iterations must be positive\n");
+    exit(-1);
+  }
+
+  /* write a random image as P3 text, 15 samples per line */
+  count = (long)rows * cols * 3;
+  text = malloc(count * 4 + 64);
+  samples = malloc(count);
+  if (!text || !samples) {
+    fprintf(stderr, "Unable to allocate memory for the test image\n");
+    exit(-1);
+  }
+  len = sprintf((char *)text, "P3\n%d %d\n255\n", cols, rows);
+  srand(1);
+  for (i = 0; i < count; i++) {
+    samples[i] = rand() & 255;
+    len += sprintf((char *)text + len, "%d%c", samples[i],
+                   i % 15 == 14 ? '\n' : ' ');
+  }
+
+  /* the decoder under test */
+  start = wallSeconds();
+  for (it = 0; it < iterations; it++) {
+    image = decodeNetpbm(text, len, &outRows, &outCols, &colors, &channels);
+    if (!image || memcmp(image, samples, count) != 0) {
+      fprintf(stderr, "Decoded image does not match\n");
+      exit(-1);
+    }
+    free(image);
+  }
+  decodeTime = (wallSeconds() - start) / iterations;
+
+  /* a straightforward strtol loop over the same text */
+  start = wallSeconds();
+  for (it = 0; it < iterations; it++) {
+    char *p = strchr((char *)text + 3, '\n');
+
+    p = strchr(p + 1, '\n') + 1;
+    image = malloc(count);
+    for (i = 0; i < count; i++)
+      image[i] = (unsigned char)strtol(p, &p, 10);
+    if (memcmp(image, samples, count) != 0) {
+      fprintf(stderr, "strtol image does not match\n");
+      exit(-1);
+    }
+    free(image);
+  }
+  strtolTime = (wallSeconds() - start) / iterations;
+
+  printf("%d x %d P3, %.1f MB of text\n", cols, rows, len / 1e6);
+  printf("decodeNetpbm: %8.1f MB/s\n", len / 1e6 / decodeTime);
+  printf("strtol loop:  %8.1f MB/s\n", len / 1e6 / strtolTime);
+
+  free(text);
+  free(samples);
+
+  return 0;
+}
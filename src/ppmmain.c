@@ -7,6 +7,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include "colorOps.h"
 #include "ppmIO.h"
 
 #define USECPP 0
@@ -15,8 +16,6 @@ int main(int argc, char *argv[]) {
   Pixel *image;
   int rows, cols, colors;
   long imagesize;
-  long i, j;
-  int min;
 
   if(argc < 3) {
     printf("Usage: ppmtest <input file> <output file>\n");
@@ -34,23 +33,10 @@ int main(int argc, char *argv[]) {
   imagesize = (long)rows * (long)cols;
 
   /* mess with the image here  */
-  for(i=0;i<imagesize;i++) {
-
-    // this little piece of code thresholds out very red pixels
-    // the resulting image will be very red where there is red stuff
-    // and greyscale elsewhere
-    j = (int)image[i].r - ((int)image[i].g + (int)image[i].b) / 2;
-    min = image[i].g < image[i].b ? image[i].g : image[i].b;
-    min = image[i].r < min ? image[i].r : min;
-    min = min < 128 ? min : min/2;
-    if(j > 10) {
-      image[i].r = image[i].r < 128 ? image[i].r*2 : image[i].r;
-    }
-    else {
-      image[i].r = min;
-    }
-    image[i].g = image[i].b = min;
-  }
+  // this little piece of code thresholds out very red pixels
+  // the resulting image will be very red where there is red stuff
+  // and greyscale elsewhere
+  isolateRed(image, image, imagesize, 10);
 
   /* write out the resulting image */
   writePPM(image, rows, cols, colors /* s/b 255 */, argv[2]);
@@ -0,0 +1,152 @@
+/*
+  Measure resampling throughput.  Every filter is timed with every kernel
+  the processor supports, on the image and on a grey plane taken from its
+  green samples, and each kernel's result is checked to be identical to the
+  scalar kernel's.  Throughput counts output pixels.
+*/
+
+#include "ppmIO.h"
+#include "resample.h"
+#include "threadPool.h"
+#include "wallClock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* seconds per resample, averaged over the iterations */
+static double timeResample(ThreadPool *pool, unsigned char *output, int newRows,
+                           int newCols, const unsigned char *input, int rows,
+                           int cols, int channels, int filter,
+                           int iterations);
+
+double timeResample(ThreadPool *pool, unsigned char *output, int newRows,
+                    int newCols, const unsigned char *input, int rows,
+                    int cols, int channels, int filter, int iterations) {
+  double start = wallSeconds();
+  int it;
+
+  for (it = 0; it < iterations; it++) {
+    if (resampleImage(pool, output, newRows, newCols, input, rows, cols,
+                      channels, filter) != 0) {
+      fprintf(stderr, "Unable to resample\n");
+      exit(-1);
+    }
+  }
+
+  return (wallSeconds() - start) / iterations;
+}
+
+int main(int argc, char *argv[]) {
+  static const char *kernels[] = {"avx2", "sse2", "scalar"};
+  Pixel *image;
+  unsigned char *plane, *output, *planeOutput, *reference, *planeReference;
+  ThreadPool *pool;
+  int rows, cols, colors, newRows, newCols;
+  int iterations = 20;
+  int threads = 1;
+  float scaleFactor;
+  long n, outputPixels, i;
+  int bad = 0;
+  int opt, f, k;
+
+  while ((opt = getopt(argc, argv, "j:")) != -1) {
+    switch (opt) {
+    case 'j': // threads to resample with, 0 for one per processor
+      threads = atoi(optarg);
+      break;
+    default:
+      bad = 1;
+    }
+  }
+
+  if (bad || argc - optind < 2) {
+    printf("Usage: %s [-j threads] <input file> <scaleFactor> [iterations]\n",
+           argv[0]);
+    exit(-1);
+  }
+  argv += optind - 1;
+  argc -= optind - 1;
+
+  scaleFactor = atof(argv[2]);
+  if (argc > 3)
+    iterations = atoi(argv[3]);
+  if (scaleFactor <= 0 || iterations <= 0) {
+    fprintf(stderr, "Scale and iterations must be positive\n");
+    exit(-1);
+  }
+
+  image = readPPM(&rows, &cols, &colors, argv[1]);
+  if (!image) {
+    fprintf(stderr, "Unable to read %s\n", argv[1]);
+    exit(-1);
+  }
+  newRows = (int)(rows * scaleFactor);
+  newCols = (int)(cols * scaleFactor);
+  if (newRows <= 0 || newCols <= 0) {
+    fprintf(stderr, "Scale too small for a %d x %d image\n", cols, rows);
+    exit(-1);
+  }
+
+  n = (long)rows * cols;
+  outputPixels = (long)newRows * newCols;
+  plane = malloc(n);
+  output = malloc(outputPixels * sizeof(Pixel));
+  reference = malloc(outputPixels * sizeof(Pixel));
+  planeOutput = malloc(outputPixels);
+  planeReference = malloc(outputPixels);
+  pool = createThreadPool(threads);
+  if (!plane || !output || !reference || !planeOutput || !planeReference ||
+      !pool) {
+    fprintf(stderr, "Unable to allocate memory for the images\n");
+    exit(-1);
+  }
+  for (i = 0; i < n; i++)
+    plane[i] = image[i].g;
+
+  printf("%d x %d to %d x %d, %d threads, default kernel %s\n", cols, rows,
+         newCols, newRows, poolThreads(pool), resampleKernel());
+  printf("                    %8s   %8s\n", "rgb", "grey");
+
+  for (f = RESAMPLE_NEAREST; f <= RESAMPLE_LANCZOS3; f++) {
+    /* the scalar kernel gives the reference */
+    useResampleKernel("scalar");
+    resampleImage(pool, reference, newRows, newCols,
+                  (const unsigned char *)image, rows, cols, 3, f);
+    resampleImage(pool, planeReference, newRows, newCols, plane, rows, cols, 1,
+                  f);
+
+    for (k = 0; k < (int)(sizeof(kernels) / sizeof(kernels[0])); k++) {
+      double seconds, planeSeconds;
+
+      if (useResampleKernel(kernels[k]) != 0)
+        continue;
+
+      memset(output, 1, outputPixels * sizeof(Pixel));
+      seconds = timeResample(pool, output, newRows, newCols,
+                             (const unsigned char *)image, rows, cols, 3, f,
+                             iterations);
+      memset(planeOutput, 1, outputPixels);
+      planeSeconds = timeResample(pool, planeOutput, newRows, newCols, plane,
+                                  rows, cols, 1, f, iterations);
+
+      printf("%-8s  %-8s  %8.1f   %8.1f MP/s  %s\n", resampleFilterName(f),
+             kernels[k], outputPixels / 1e6 / seconds,
+             outputPixels / 1e6 / planeSeconds,
+             memcmp(output, reference, outputPixels * sizeof(Pixel)) == 0 &&
+                     memcmp(planeOutput, planeReference, outputPixels) == 0
+                 ? "identical"
+                 : "MISMATCH");
+    }
+  }
+
+  destroyThreadPool(pool);
+  free(image);
+  free(plane);
+  free(output);
+  free(reference);
+  free(planeOutput);
+  free(planeReference);
+
+  return 0;
+}
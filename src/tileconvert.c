@@ -0,0 +1,33 @@
+/*
+  Convert between ppm images and tiled (.tpm) images.  The direction is
+  picked from the extension of the input file.
+*/
+
+#include "ppmIO.h"
+#include "tileIO.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char *argv[]) {
+  int tileSize = TILE_SIZE;
+
+  if (argc < 3 || argc > 4) {
+    printf("Usage: %s <input file> <output file> [tile size]\n", argv[0]);
+    exit(-1);
+  }
+
+  if (argc == 4)
+    tileSize = atoi(argv[3]);
+
+  if (isTiledFile(argv[1])) {
+    if (tiledToPPM(argv[1], argv[2]) != 0) {
+      fprintf(stderr, "Unable to convert %s\n", argv[1]);
+      exit(-1);
+    }
+  } else if (ppmToTiled(argv[1], argv[2], tileSize) != 0) {
+    fprintf(stderr, "Unable to convert %s\n", argv[1]);
+    exit(-1);
+  }
+
+  return 0;
+}